@@ -44,6 +44,7 @@
 #include "build/version.h"
 
 DECLARE_bool(debug);
+DECLARE_uint32(snapshot_interval);
 
 DEFINE_bool(fullscreen, false, "Whether to launch the emulator in fullscreen.",
             "Display");
@@ -559,6 +560,15 @@ bool EmulatorWindow::Initialize() {
         "Ctrl+Pause/Break",
         std::bind(&EmulatorWindow::CpuBreakIntoHostDebugger, this)));
   }
+  cpu_menu->AddChild(MenuItem::Create(MenuItem::Type::kSeparator));
+  {
+    cpu_menu->AddChild(MenuItem::Create(
+        MenuItem::Type::kString, "Rewind to &Latest Snapshot", "F9",
+        std::bind(&EmulatorWindow::CpuRewind, this, 0)));
+    cpu_menu->AddChild(MenuItem::Create(
+        MenuItem::Type::kString, "Rewind to P&revious Snapshot", "Shift+F9",
+        std::bind(&EmulatorWindow::CpuRewind, this, 1)));
+  }
   main_menu->AddChild(std::move(cpu_menu));
 
   // GPU menu.
@@ -789,6 +799,9 @@ void EmulatorWindow::OnKeyDown(ui::KeyEvent& e) {
     case ui::VirtualKey::kCancel: {
       CpuBreakIntoHostDebugger();
     } break;
+    case ui::VirtualKey::kF9: {
+      CpuRewind(e.is_shift_pressed() ? 1 : 0);
+    } break;
 
     case ui::VirtualKey::kF1: {
       ShowFAQ();
@@ -911,6 +924,23 @@ void EmulatorWindow::CpuBreakIntoDebugger() {
 
 void EmulatorWindow::CpuBreakIntoHostDebugger() { xe::debugging::Break(); }
 
+void EmulatorWindow::CpuRewind(size_t snapshots_back) {
+  if (!emulator()->is_title_open()) {
+    return;
+  }
+  if (!cvars::snapshot_interval) {
+    xe::ui::ImGuiDialog::ShowMessageBox(
+        imgui_drawer_.get(), "Rewind",
+        "Xenia must be launched with a non-zero --snapshot_interval in order "
+        "to rewind.");
+    return;
+  }
+  if (!emulator()->RestoreSnapshot(snapshots_back)) {
+    XELOGW("No snapshot to rewind to, {} available",
+           emulator()->snapshot_count());
+  }
+}
+
 void EmulatorWindow::GpuTraceFrame() {
   emulator()->graphics_system()->RequestFrameTrace();
 }
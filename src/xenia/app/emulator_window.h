@@ -136,6 +136,7 @@ class EmulatorWindow {
   void CpuTimeScalarSetDouble();
   void CpuBreakIntoDebugger();
   void CpuBreakIntoHostDebugger();
+  void CpuRewind(size_t snapshots_back);
   void GpuTraceFrame();
   void GpuClearCaches();
   void ToggleDisplayConfigDialog();
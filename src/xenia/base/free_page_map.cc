@@ -0,0 +1,203 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/base/free_page_map.h"
+
+#include <algorithm>
+
+#include "xenia/base/assert.h"
+#include "xenia/base/math.h"
+
+namespace xe {
+
+void FreePageMap::Resize(uint32_t page_count) {
+  page_count_ = page_count;
+  free_page_count_ = page_count;
+  uint32_t word_count = (page_count + 63) / 64;
+  pages_.assign(word_count, ~uint64_t(0));
+  if (page_count & 63) {
+    pages_.back() = (uint64_t(1) << (page_count & 63)) - 1;
+  }
+  words_with_free_.assign((word_count + 63) / 64, 0);
+  words_with_used_.assign((word_count + 63) / 64, 0);
+  for (uint32_t i = 0; i < word_count; ++i) {
+    UpdateSummary(i);
+  }
+}
+
+void FreePageMap::Reset() { Resize(page_count_); }
+
+void FreePageMap::Mark(uint32_t first_page, uint32_t count, bool free) {
+  assert_true(first_page + count <= page_count_);
+  uint32_t page = first_page;
+  uint32_t end = first_page + count;
+  while (page < end) {
+    uint32_t word_index = page >> 6;
+    uint32_t bit = page & 63;
+    uint32_t bit_count = std::min(end - page, 64 - bit);
+    uint64_t mask =
+        (bit_count == 64 ? ~uint64_t(0) : (uint64_t(1) << bit_count) - 1)
+        << bit;
+    uint64_t& word = pages_[word_index];
+    if (free) {
+      free_page_count_ += xe::bit_count(mask & ~word);
+      word |= mask;
+    } else {
+      free_page_count_ -= xe::bit_count(mask & word);
+      word &= ~mask;
+    }
+    UpdateSummary(word_index);
+    page += bit_count;
+  }
+}
+
+void FreePageMap::UpdateSummary(uint32_t word_index) {
+  uint64_t word = pages_[word_index];
+  uint64_t summary_bit = uint64_t(1) << (word_index & 63);
+  if (word) {
+    words_with_free_[word_index >> 6] |= summary_bit;
+  } else {
+    words_with_free_[word_index >> 6] &= ~summary_bit;
+  }
+  if (word != ~uint64_t(0)) {
+    words_with_used_[word_index >> 6] |= summary_bit;
+  } else {
+    words_with_used_[word_index >> 6] &= ~summary_bit;
+  }
+}
+
+uint32_t FreePageMap::FindNext(bool free, uint32_t begin, uint32_t end) const {
+  const std::vector<uint64_t>& summary =
+      free ? words_with_free_ : words_with_used_;
+  uint32_t word_count = uint32_t(pages_.size());
+  uint32_t page = begin;
+  while (page < end) {
+    uint32_t word_index = page >> 6;
+    uint64_t word = free ? pages_[word_index] : ~pages_[word_index];
+    word &= ~uint64_t(0) << (page & 63);
+    if (word) {
+      return std::min((word_index << 6) + xe::tzcnt(word), end);
+    }
+    // Skip the words without a match.
+    uint32_t next_word_index = word_index + 1;
+    while (true) {
+      if (next_word_index >= word_count || (next_word_index << 6) >= end) {
+        return end;
+      }
+      uint64_t summary_word = summary[next_word_index >> 6] &
+                              (~uint64_t(0) << (next_word_index & 63));
+      if (summary_word) {
+        next_word_index = (next_word_index & ~uint32_t(63)) +
+                          xe::tzcnt(summary_word);
+        break;
+      }
+      next_word_index = (next_word_index & ~uint32_t(63)) + 64;
+    }
+    page = next_word_index << 6;
+  }
+  return end;
+}
+
+uint32_t FreePageMap::FindPrevious(bool free, uint32_t begin,
+                                   uint32_t end) const {
+  const std::vector<uint64_t>& summary =
+      free ? words_with_free_ : words_with_used_;
+  if (begin >= end) {
+    return kInvalidPage;
+  }
+  uint32_t page = end - 1;
+  while (true) {
+    uint32_t word_index = page >> 6;
+    uint64_t word = free ? pages_[word_index] : ~pages_[word_index];
+    word &= ~uint64_t(0) >> (63 - (page & 63));
+    if (word) {
+      uint32_t found = (word_index << 6) + 63 - xe::lzcnt(word);
+      return found >= begin ? found : kInvalidPage;
+    }
+    // Skip the words without a match.
+    int64_t previous_word_index = int64_t(word_index) - 1;
+    while (true) {
+      if (previous_word_index < 0 ||
+          uint64_t(previous_word_index) * 64 + 63 < begin) {
+        return kInvalidPage;
+      }
+      uint64_t summary_word =
+          summary[previous_word_index >> 6] &
+          (~uint64_t(0) >> (63 - (previous_word_index & 63)));
+      if (summary_word) {
+        previous_word_index = (previous_word_index & ~int64_t(63)) + 63 -
+                              xe::lzcnt(summary_word);
+        break;
+      }
+      previous_word_index = (previous_word_index & ~int64_t(63)) - 1;
+    }
+    page = uint32_t(previous_word_index) * 64 + 63;
+    if (page < begin) {
+      return kInvalidPage;
+    }
+  }
+}
+
+uint32_t FreePageMap::FindFreeRange(uint32_t low_page, uint32_t end_page,
+                                    uint32_t count, uint32_t alignment,
+                                    bool top_down) const {
+  end_page = std::min(end_page, page_count_);
+  alignment = std::max(alignment, uint32_t(1));
+  if (!count || low_page >= end_page || count > end_page - low_page) {
+    return kInvalidPage;
+  }
+  auto align_up = [alignment](uint64_t page) {
+    return (page + alignment - 1) / alignment * alignment;
+  };
+
+  if (!top_down) {
+    // Pages after this can't be the base of a run.
+    uint32_t base_end = end_page - count + 1;
+    uint64_t base = align_up(low_page);
+    while (base < base_end) {
+      uint32_t free_page = FindNext(true, uint32_t(base), base_end);
+      if (free_page == base_end) {
+        break;
+      }
+      base = align_up(free_page);
+      if (base >= base_end) {
+        break;
+      }
+      uint32_t used_page =
+          FindNext(false, uint32_t(base), uint32_t(base) + count);
+      if (used_page == base + count) {
+        return uint32_t(base);
+      }
+      base = align_up(used_page + 1);
+    }
+    return kInvalidPage;
+  }
+
+  // Runs must end at or before this.
+  uint32_t run_end = end_page;
+  while (run_end >= count && run_end - count >= low_page) {
+    uint32_t base = (run_end - count) / alignment * alignment;
+    if (base < low_page) {
+      break;
+    }
+    uint32_t used_page = FindPrevious(false, base, base + count);
+    if (used_page == kInvalidPage) {
+      return base;
+    }
+    // The run must end before the used page, at a free page.
+    uint32_t free_page = FindPrevious(true, low_page, used_page);
+    if (free_page == kInvalidPage) {
+      break;
+    }
+    run_end = free_page + 1;
+  }
+  return kInvalidPage;
+}
+
+}  // namespace xe
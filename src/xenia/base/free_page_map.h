@@ -0,0 +1,69 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_BASE_FREE_PAGE_MAP_H_
+#define XENIA_BASE_FREE_PAGE_MAP_H_
+
+#include <cstdint>
+#include <vector>
+
+namespace xe {
+
+// Free page tracking for heap allocation: a bit per page set when the page is
+// free, and summaries with a bit per 64-page word set when the word has any
+// free or any used pages, so runs of free or used pages are skipped a word or
+// 4096 pages at a time with bit scans rather than looked at page by page.
+// Not thread safe.
+class FreePageMap {
+ public:
+  static constexpr uint32_t kInvalidPage = UINT32_MAX;
+
+  // Sets the number of pages, all free.
+  void Resize(uint32_t page_count);
+  // Marks all pages as free.
+  void Reset();
+
+  uint32_t page_count() const { return page_count_; }
+  uint32_t free_page_count() const { return free_page_count_; }
+  bool IsFree(uint32_t page) const {
+    return (pages_[page >> 6] >> (page & 63)) & 1;
+  }
+
+  void MarkUsed(uint32_t first_page, uint32_t count) {
+    Mark(first_page, count, false);
+  }
+  void MarkFree(uint32_t first_page, uint32_t count) {
+    Mark(first_page, count, true);
+  }
+
+  // Finds the lowest (or the highest if top_down) run of count free pages
+  // starting at a multiple of alignment pages within [low_page, end_page).
+  // Returns kInvalidPage if there's none.
+  uint32_t FindFreeRange(uint32_t low_page, uint32_t end_page, uint32_t count,
+                         uint32_t alignment, bool top_down) const;
+
+ private:
+  void Mark(uint32_t first_page, uint32_t count, bool free);
+  void UpdateSummary(uint32_t word_index);
+  // First page in [begin, end) that is free (or used), end if none.
+  uint32_t FindNext(bool free, uint32_t begin, uint32_t end) const;
+  // Last page in [begin, end) that is free (or used), kInvalidPage if none.
+  uint32_t FindPrevious(bool free, uint32_t begin, uint32_t end) const;
+
+  uint32_t page_count_ = 0;
+  uint32_t free_page_count_ = 0;
+  // Pages past page_count_ in the last word are used.
+  std::vector<uint64_t> pages_;
+  std::vector<uint64_t> words_with_free_;
+  std::vector<uint64_t> words_with_used_;
+};
+
+}  // namespace xe
+
+#endif  // XENIA_BASE_FREE_PAGE_MAP_H_
@@ -114,6 +114,33 @@ bool Protect(void* base_address, size_t length, PageAccess access,
 // the region.
 bool QueryProtect(void* base_address, size_t& length, PageAccess& access_out);
 
+// Whether the pages written since ResetDirtyPageTracking can be queried. This
+// uses the soft-dirty page table bits on Linux, which are independent from
+// page protection.
+bool IsDirtyPageTrackingSupported();
+
+// Starts tracking the pages written anew, for all memory of the process.
+bool ResetDirtyPageTracking();
+
+// Sets the bits in dirty_bits, one for each page_size() page starting from the
+// page-aligned base_address, of the pages written since the last
+// ResetDirtyPageTracking. Other bits are left unchanged.
+bool QueryDirtyPages(const void* base_address, size_t length,
+                     uint64_t* dirty_bits);
+
+// Whether AdviseHugePages can have an effect. This uses transparent huge pages
+// on Linux.
+bool IsHugePageAdviceSupported();
+
+// Asks for the memory in the range to be backed by huge pages where it's
+// possible. Needs to be done again after AllocFixed, which may replace the
+// mapping. Protecting a part of a huge page splits it into normal pages.
+bool AdviseHugePages(void* base_address, size_t length);
+
+// Returns the number of bytes backed by huge pages in the mappings overlapping
+// the range.
+size_t QueryHugePageBackedSize(const void* base_address, size_t length);
+
 // Allocates a block of memory for a type with the given alignment.
 // The memory must be freed with AlignedFree.
 template <typename T>
@@ -12,7 +12,10 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cstddef>
+#include <cstdio>
+#include <cstring>
 
 #include "xenia/base/math.h"
 #include "xenia/base/platform.h"
@@ -112,6 +115,141 @@ bool QueryProtect(void* base_address, size_t& length, PageAccess& access_out) {
   return false;
 }
 
+#if XE_PLATFORM_LINUX
+// Bit 55 of /proc/self/pagemap entries, set by the kernel on writes after
+// writing 4 to /proc/self/clear_refs (CONFIG_MEM_SOFT_DIRTY). The bit may be
+// lost for pages of shared mappings that are evicted and faulted back in.
+constexpr uint64_t kPagemapSoftDirty = uint64_t(1) << 55;
+
+bool ResetDirtyPageTracking() {
+  int fd = open("/proc/self/clear_refs", O_WRONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool result = write(fd, "4", 1) == 1;
+  close(fd);
+  return result;
+}
+
+bool QueryDirtyPages(const void* base_address, size_t length,
+                     uint64_t* dirty_bits) {
+  int fd = open("/proc/self/pagemap", O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  size_t host_page_size = page_size();
+  size_t first_page = reinterpret_cast<size_t>(base_address) / host_page_size;
+  size_t page_count = (length + host_page_size - 1) / host_page_size;
+  uint64_t entries[512];
+  for (size_t i = 0; i < page_count;) {
+    size_t entry_count = std::min(page_count - i, xe::countof(entries));
+    ssize_t read_size = pread(fd, entries, entry_count * sizeof(uint64_t),
+                              off_t((first_page + i) * sizeof(uint64_t)));
+    if (read_size != ssize_t(entry_count * sizeof(uint64_t))) {
+      close(fd);
+      return false;
+    }
+    for (size_t j = 0; j < entry_count; ++j, ++i) {
+      if (entries[j] & kPagemapSoftDirty) {
+        dirty_bits[i >> 6] |= uint64_t(1) << (i & 63);
+      }
+    }
+  }
+  close(fd);
+  return true;
+}
+
+bool IsDirtyPageTrackingSupported() {
+  // The kernel may be built without soft-dirty bits, check if a write is seen.
+  static const bool supported = []() {
+    size_t host_page_size = page_size();
+    void* page = mmap(nullptr, host_page_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED) {
+      return false;
+    }
+    *static_cast<volatile uint8_t*>(page) = 1;
+    uint64_t dirty_bits = 0;
+    bool result = ResetDirtyPageTracking() &&
+                  QueryDirtyPages(page, host_page_size, &dirty_bits) &&
+                  !dirty_bits;
+    if (result) {
+      *static_cast<volatile uint8_t*>(page) = 2;
+      result = QueryDirtyPages(page, host_page_size, &dirty_bits) &&
+               dirty_bits == 1;
+    }
+    munmap(page, host_page_size);
+    return result;
+  }();
+  return supported;
+}
+#else
+bool IsDirtyPageTrackingSupported() { return false; }
+
+bool ResetDirtyPageTracking() { return false; }
+
+bool QueryDirtyPages(const void* base_address, size_t length,
+                     uint64_t* dirty_bits) {
+  return false;
+}
+#endif  // XE_PLATFORM_LINUX
+
+#if XE_PLATFORM_LINUX
+bool IsHugePageAdviceSupported() {
+  // "always [madvise] never", with the current mode in brackets.
+  static const bool supported = []() {
+    FILE* file = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!file) {
+      return false;
+    }
+    char modes[64] = {};
+    bool mode_read = fgets(modes, sizeof(modes), file) != nullptr;
+    fclose(file);
+    return mode_read &&
+           (strstr(modes, "[always]") || strstr(modes, "[madvise]"));
+  }();
+  return supported;
+}
+
+bool AdviseHugePages(void* base_address, size_t length) {
+  return madvise(base_address, length, MADV_HUGEPAGE) == 0;
+}
+
+size_t QueryHugePageBackedSize(const void* base_address, size_t length) {
+  FILE* smaps = fopen("/proc/self/smaps", "r");
+  if (!smaps) {
+    return 0;
+  }
+  uintptr_t begin = reinterpret_cast<uintptr_t>(base_address);
+  uintptr_t end = begin + length;
+  bool mapping_in_range = false;
+  size_t huge_size = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), smaps)) {
+    // Each mapping starts with a "begin-end" line, followed by "Field: value"
+    // lines, the names of which aren't valid "begin-end" lines.
+    unsigned long long mapping_begin, mapping_end, huge_kb;
+    if (sscanf(line, "%llx-%llx", &mapping_begin, &mapping_end) == 2) {
+      mapping_in_range = mapping_begin < end && mapping_end > begin;
+    } else if (mapping_in_range &&
+               (sscanf(line, "AnonHugePages: %llu kB", &huge_kb) == 1 ||
+                sscanf(line, "ShmemPmdMapped: %llu kB", &huge_kb) == 1)) {
+      huge_size += size_t(huge_kb) * 1024;
+    }
+  }
+  fclose(smaps);
+  return huge_size;
+}
+#else
+bool IsHugePageAdviceSupported() { return false; }
+
+bool AdviseHugePages(void* base_address, size_t length) { return false; }
+
+size_t QueryHugePageBackedSize(const void* base_address, size_t length) {
+  return 0;
+}
+#endif  // XE_PLATFORM_LINUX
+
 FileMappingHandle CreateFileMappingHandle(const std::filesystem::path& path,
                                           size_t length, PageAccess access,
                                           bool commit) {
@@ -172,6 +172,27 @@ bool QueryProtect(void* base_address, size_t& length, PageAccess& access_out) {
   return true;
 }
 
+// GetWriteWatch is only available for VirtualAlloc allocations, not for file
+// mappings.
+bool IsDirtyPageTrackingSupported() { return false; }
+
+bool ResetDirtyPageTracking() { return false; }
+
+bool QueryDirtyPages(const void* base_address, size_t length,
+                     uint64_t* dirty_bits) {
+  return false;
+}
+
+// Large pages need SeLockMemoryPrivilege and must be committed in whole when
+// the mapping is created, with no protection granularity below them.
+bool IsHugePageAdviceSupported() { return false; }
+
+bool AdviseHugePages(void* base_address, size_t length) { return false; }
+
+size_t QueryHugePageBackedSize(const void* base_address, size_t length) {
+  return 0;
+}
+
 FileMappingHandle CreateFileMappingHandle(const std::filesystem::path& path,
                                           size_t length, PageAccess access,
                                           bool commit) {
@@ -13,8 +13,12 @@
 #include "third_party/fmt/include/fmt/format.h"
 
 #include "xenia/base/clock.h"
+#include "xenia/base/free_page_map.h"
 
 #include <array>
+#include <chrono>
+#include <random>
+#include <vector>
 
 namespace xe {
 namespace base {
@@ -592,6 +596,157 @@ TEST_CASE("make_fourcc", "[fourcc]") {
   }
 }
 
+
+// Page by page scan like BaseHeap::AllocRange did before FreePageMap.
+static uint32_t FindFreeRangeReference(const std::vector<bool>& used,
+                                       uint32_t low_page, uint32_t end_page,
+                                       uint32_t count, uint32_t alignment,
+                                       bool top_down) {
+  uint32_t first_base = xe::round_up(low_page, alignment, false);
+  if (end_page < count) {
+    return FreePageMap::kInvalidPage;
+  }
+  uint32_t last_base = (end_page - count) / alignment * alignment;
+  if (first_base > last_base || last_base < low_page) {
+    return FreePageMap::kInvalidPage;
+  }
+  auto is_free = [&](uint32_t base) {
+    for (uint32_t i = base; i < base + count; ++i) {
+      if (used[i]) {
+        return false;
+      }
+    }
+    return true;
+  };
+  if (top_down) {
+    for (int64_t base = last_base; base >= int64_t(first_base);
+         base -= alignment) {
+      if (is_free(uint32_t(base))) {
+        return uint32_t(base);
+      }
+    }
+  } else {
+    for (uint32_t base = first_base; base <= last_base; base += alignment) {
+      if (is_free(base)) {
+        return base;
+      }
+    }
+  }
+  return FreePageMap::kInvalidPage;
+}
+
+TEST_CASE("free_page_map_find_free_range", "[free_page_map]") {
+  std::mt19937 random(1234);
+  for (uint32_t page_count : {1u, 63u, 64u, 65u, 1000u, 4096u, 9000u}) {
+    FreePageMap map;
+    map.Resize(page_count);
+    std::vector<bool> used(page_count, false);
+    REQUIRE(map.free_page_count() == page_count);
+    for (uint32_t iteration = 0; iteration < 2000; ++iteration) {
+      // Mark random ranges, mostly small, sometimes spanning many words.
+      uint32_t first = random() % page_count;
+      uint32_t max_count = page_count - first;
+      uint32_t count =
+          1 + random() % std::min(max_count, (random() & 7) ? 16u : 512u);
+      bool free = (random() & 1) != 0;
+      if (free) {
+        map.MarkFree(first, count);
+      } else {
+        map.MarkUsed(first, count);
+      }
+      for (uint32_t i = first; i < first + count; ++i) {
+        used[i] = !free;
+      }
+
+      uint32_t low_page = random() % page_count;
+      uint32_t end_page = low_page + 1 + random() % (page_count - low_page);
+      uint32_t range_count = 1 + random() % std::min(page_count, 70u);
+      uint32_t alignment = 1u << (random() % 5);
+      for (bool top_down : {false, true}) {
+        REQUIRE(map.FindFreeRange(low_page, end_page, range_count, alignment,
+                                  top_down) ==
+                FindFreeRangeReference(used, low_page, end_page, range_count,
+                                       alignment, top_down));
+      }
+    }
+    uint32_t free_page_count = 0;
+    for (uint32_t i = 0; i < page_count; ++i) {
+      REQUIRE(map.IsFree(i) == !used[i]);
+      free_page_count += used[i] ? 0 : 1;
+    }
+    REQUIRE(map.free_page_count() == free_page_count);
+    map.Reset();
+    REQUIRE(map.free_page_count() == page_count);
+    REQUIRE(map.FindFreeRange(0, page_count, page_count, 1, true) == 0);
+  }
+}
+
+// Not run by default: xenia-base-tests "[benchmark]"
+TEST_CASE("free_page_map_benchmark", "[.][benchmark][free_page_map]") {
+  // A 512 MB heap of 4 KB pages fragmented by many small allocations with
+  // random ones freed, like titles churning NtAllocateVirtualMemory, with
+  // large 64 KB aligned allocations made and freed in between.
+  const uint32_t page_count = 512 * 1024 / 4;
+  std::mt19937 random(5678);
+  std::vector<bool> used(page_count, false);
+  std::vector<std::pair<uint32_t, uint32_t>> allocations;
+  FreePageMap map;
+  map.Resize(page_count);
+
+  uint64_t map_nanoseconds = 0, reference_nanoseconds = 0;
+  uint32_t allocation_count = 0;
+  for (uint32_t iteration = 0; iteration < 12000; ++iteration) {
+    bool large = (iteration % 16) == 0;
+    uint32_t count = large ? 16 + random() % 256 : 1 + random() % 8;
+    uint32_t alignment = large ? 16 : 1;
+    bool top_down = (random() & 3) == 0;
+
+    auto map_start = std::chrono::steady_clock::now();
+    uint32_t base =
+        map.FindFreeRange(0, page_count, count, alignment, top_down);
+    auto map_end = std::chrono::steady_clock::now();
+    uint32_t reference_base = FindFreeRangeReference(
+        used, 0, page_count, count, alignment, top_down);
+    auto reference_end = std::chrono::steady_clock::now();
+    map_nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           map_end - map_start)
+                           .count();
+    reference_nanoseconds +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(reference_end -
+                                                             map_end)
+            .count();
+    REQUIRE(base == reference_base);
+    if (base == FreePageMap::kInvalidPage) {
+      break;
+    }
+    ++allocation_count;
+    map.MarkUsed(base, count);
+    for (uint32_t i = base; i < base + count; ++i) {
+      used[i] = true;
+    }
+    allocations.emplace_back(base, count);
+
+    // Free about a third of the allocations, leaving holes.
+    if (random() % 3 == 0) {
+      size_t index = random() % allocations.size();
+      auto allocation = allocations[index];
+      allocations[index] = allocations.back();
+      allocations.pop_back();
+      map.MarkFree(allocation.first, allocation.second);
+      for (uint32_t i = allocation.first;
+           i < allocation.first + allocation.second; ++i) {
+        used[i] = false;
+      }
+    }
+  }
+  fmt::print(
+      "FreePageMap: {} allocations, {} free pages left, {} ns per search, "
+      "{} ns per page scan search\n",
+      allocation_count, map.free_page_count(),
+      map_nanoseconds / std::max(allocation_count, 1u),
+      reference_nanoseconds / std::max(allocation_count, 1u));
+}
+
 }  // namespace test
 }  // namespace base
 }  // namespace xe
@@ -12,10 +12,10 @@
 
 #include <memory>
 
+#include "xenia/cpu/function.h"
+
 namespace xe {
 namespace cpu {
-class FunctionDebugInfo;
-class GuestFunction;
 namespace hir {
 class HIRBuilder;
 }  // namespace hir
@@ -37,8 +37,11 @@ class Assembler {
 
   virtual void Reset();
 
-  virtual bool Assemble(GuestFunction* function, hir::HIRBuilder* builder,
-                        uint32_t debug_info_flags,
+  // Makes code translated for the tier the current code of the function, then
+  // sets the tier of the function. The previous code stays usable until then,
+  // as other threads may be running it.
+  virtual bool Assemble(GuestFunction* function, GuestFunction::Tier tier,
+                        hir::HIRBuilder* builder, uint32_t debug_info_flags,
                         std::unique_ptr<FunctionDebugInfo> debug_info) = 0;
 
  protected:
@@ -10,6 +10,7 @@
 #ifndef XENIA_CPU_BACKEND_BACKEND_H_
 #define XENIA_CPU_BACKEND_BACKEND_H_
 
+#include <filesystem>
 #include <memory>
 
 #include "xenia/cpu/backend/machine_info.h"
@@ -60,6 +61,26 @@ class Backend {
   virtual uint64_t CalculateNextHostInstruction(ThreadDebugInfo* thread_info,
                                                 uint64_t current_pc) = 0;
 
+  // Opens the persistent code storage for the given module, keyed by the
+  // module image hash and a hash of the frontend settings that affect
+  // codegen. Previously stored translations that are still valid become
+  // available to RestoreGuestFunction and new ones are appended.
+  // Returns false if the backend does not support code storage.
+  virtual bool InitializeCodeStorage(Module* module,
+                                     const std::filesystem::path& storage_root,
+                                     uint64_t module_hash,
+                                     uint64_t frontend_key) {
+    return false;
+  }
+  // Flushes and closes the code storage of the given module, if any.
+  virtual void ShutdownCodeStorage(Module* module) {}
+  // Attempts to define the function from persistent code storage instead of
+  // translating it. Returns true if the function is now ready to execute.
+  virtual bool RestoreGuestFunction(GuestFunction* function) { return false; }
+  // Frees the code of the functions of a module that is being unloaded once no
+  // thread is running it, if calls to them can be redirected.
+  virtual void ReleaseModuleCode(Module* module) {}
+
   virtual void InstallBreakpoint(Breakpoint* breakpoint) {}
   virtual void InstallBreakpoint(Breakpoint* breakpoint, Function* fn) {}
   virtual void UninstallBreakpoint(Breakpoint* breakpoint) {}
@@ -13,6 +13,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <string>
+#include <vector>
 
 #include "xenia/cpu/function.h"
 
@@ -35,6 +36,30 @@ class CodeCache {
 
   // Finds platform-specific function unwind info for the given host PC.
   virtual void* LookupUnwindInfo(uint64_t host_pc) = 0;
+
+  // Code a thread that may run guest code can still be running, gathered by
+  // the processor for ReclaimRetiredCode.
+  struct ThreadCodeReferences {
+    uint32_t thread_id;
+    // Whether host_pcs covers all guest frames on the stack of the thread. This
+    // is only known when it's not running guest code, or while it's calling
+    // host code from guest code.
+    bool scanned;
+    // Sorted values from the guest frames pointing into generated code, which
+    // include the return addresses into the code the thread is running.
+    std::vector<uint64_t> host_pcs;
+  };
+
+  // Whether code replaced by retranslation or of unloaded modules is waiting
+  // to be freed by ReclaimRetiredCode.
+  virtual bool has_retired_code() const { return false; }
+  // Frees retired code once every thread that was alive when it was retired
+  // has either exited or been scanned not referencing it. A thread is only
+  // scanned after it has left guest code, so it will load the new code from
+  // the indirection table the next time it calls the function. threads must
+  // be sorted by thread ID.
+  virtual void ReclaimRetiredCode(
+      const std::vector<ThreadCodeReferences>& threads) {}
 };
 
 }  // namespace backend
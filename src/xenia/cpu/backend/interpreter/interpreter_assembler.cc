@@ -0,0 +1,51 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/backend/interpreter/interpreter_assembler.h"
+
+#include "xenia/base/logging.h"
+#include "xenia/base/profiling.h"
+#include "xenia/cpu/backend/interpreter/interpreter_backend.h"
+#include "xenia/cpu/backend/interpreter/interpreter_code.h"
+#include "xenia/cpu/backend/interpreter/interpreter_function.h"
+#include "xenia/cpu/hir/hir_builder.h"
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace interpreter {
+
+InterpreterAssembler::InterpreterAssembler(InterpreterBackend* backend)
+    : Assembler(backend) {}
+
+InterpreterAssembler::~InterpreterAssembler() = default;
+
+bool InterpreterAssembler::Assemble(
+    GuestFunction* function, GuestFunction::Tier tier,
+    hir::HIRBuilder* builder, uint32_t debug_info_flags,
+    std::unique_ptr<FunctionDebugInfo> debug_info) {
+  SCOPE_profile_cpu_f("cpu");
+
+  auto code = InterpreterCode::Create(builder);
+  if (!code) {
+    XELOGE("Function {:08X} uses operations the interpreter doesn't implement",
+           function->address());
+    return false;
+  }
+
+  function->set_debug_info(std::move(debug_info));
+  static_cast<InterpreterFunction*>(function)->Setup(std::move(code));
+  function->set_tier(tier);
+  return true;
+}
+
+}  // namespace interpreter
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
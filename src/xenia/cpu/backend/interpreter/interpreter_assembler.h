@@ -0,0 +1,40 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_ASSEMBLER_H_
+#define XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_ASSEMBLER_H_
+
+#include <memory>
+
+#include "xenia/cpu/backend/assembler.h"
+#include "xenia/cpu/function.h"
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace interpreter {
+
+class InterpreterBackend;
+
+class InterpreterAssembler : public Assembler {
+ public:
+  explicit InterpreterAssembler(InterpreterBackend* backend);
+  ~InterpreterAssembler() override;
+
+  bool Assemble(GuestFunction* function, GuestFunction::Tier tier,
+                hir::HIRBuilder* builder, uint32_t debug_info_flags,
+                std::unique_ptr<FunctionDebugInfo> debug_info) override;
+};
+
+}  // namespace interpreter
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
+
+#endif  // XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_ASSEMBLER_H_
@@ -0,0 +1,76 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/backend/interpreter/interpreter_backend.h"
+
+#include <cstring>
+
+#include "xenia/cpu/backend/interpreter/interpreter_assembler.h"
+#include "xenia/cpu/backend/interpreter/interpreter_function.h"
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace interpreter {
+
+InterpreterBackend::InterpreterBackend() = default;
+
+InterpreterBackend::~InterpreterBackend() = default;
+
+bool InterpreterBackend::Initialize(Processor* processor) {
+  if (!Backend::Initialize(processor)) {
+    return false;
+  }
+
+  // Loads and stores can be byte-swapping.
+  machine_info_.supports_extended_load_store = true;
+
+  // Values are stored in registers indexed by their ordinals.
+  machine_info_.uses_value_ordinals = true;
+
+  // Every value has its own register in the interpreter, the register sets
+  // only limit how much the register allocator has to spill.
+  auto& gprs = machine_info_.register_sets[0];
+  gprs.id = 0;
+  std::strcpy(gprs.name, "gpr");
+  gprs.types = MachineInfo::RegisterSet::INT_TYPES;
+  gprs.count = 32;
+
+  auto& vecs = machine_info_.register_sets[1];
+  vecs.id = 1;
+  std::strcpy(vecs.name, "vec");
+  vecs.types = MachineInfo::RegisterSet::FLOAT_TYPES |
+               MachineInfo::RegisterSet::VEC_TYPES;
+  vecs.count = 32;
+
+  return true;
+}
+
+void InterpreterBackend::CommitExecutableRange(uint32_t guest_low,
+                                               uint32_t guest_high) {}
+
+std::unique_ptr<Assembler> InterpreterBackend::CreateAssembler() {
+  return std::make_unique<InterpreterAssembler>(this);
+}
+
+std::unique_ptr<GuestFunction> InterpreterBackend::CreateGuestFunction(
+    Module* module, uint32_t address) {
+  return std::make_unique<InterpreterFunction>(module, address);
+}
+
+uint64_t InterpreterBackend::CalculateNextHostInstruction(
+    ThreadDebugInfo* thread_info, uint64_t current_pc) {
+  // There is no host code to step through.
+  return 0;
+}
+
+}  // namespace interpreter
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
@@ -0,0 +1,48 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_BACKEND_H_
+#define XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_BACKEND_H_
+
+#include <memory>
+
+#include "xenia/cpu/backend/backend.h"
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace interpreter {
+
+// Executes HIR directly instead of generating machine code. Much slower than
+// the native backends, but portable, and useful as a reference when checking
+// their output.
+class InterpreterBackend : public Backend {
+ public:
+  InterpreterBackend();
+  ~InterpreterBackend() override;
+
+  bool Initialize(Processor* processor) override;
+
+  void CommitExecutableRange(uint32_t guest_low, uint32_t guest_high) override;
+
+  std::unique_ptr<Assembler> CreateAssembler() override;
+
+  std::unique_ptr<GuestFunction> CreateGuestFunction(Module* module,
+                                                     uint32_t address) override;
+
+  uint64_t CalculateNextHostInstruction(ThreadDebugInfo* thread_info,
+                                        uint64_t current_pc) override;
+};
+
+}  // namespace interpreter
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
+
+#endif  // XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_BACKEND_H_
@@ -0,0 +1,1524 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/backend/interpreter/interpreter_code.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cfenv>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+#include <unordered_map>
+
+#include "xenia/base/assert.h"
+#include "xenia/base/atomic.h"
+#include "xenia/base/byte_order.h"
+#include "xenia/base/clock.h"
+#include "xenia/base/debugging.h"
+#include "xenia/base/logging.h"
+#include "xenia/base/math.h"
+#include "xenia/base/memory.h"
+#include "xenia/base/platform.h"
+#include "xenia/cpu/cpu_flags.h"
+#include "xenia/cpu/function.h"
+#include "xenia/cpu/hir/block.h"
+#include "xenia/cpu/hir/hir_builder.h"
+#include "xenia/cpu/hir/instr.h"
+#include "xenia/cpu/hir/label.h"
+#include "xenia/cpu/mmio_handler.h"
+#include "xenia/cpu/ppc/ppc_context.h"
+#include "xenia/cpu/ppc/ppc_frontend.h"
+#include "xenia/cpu/processor.h"
+#include "xenia/cpu/thread_state.h"
+#include "xenia/memory.h"
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace interpreter {
+
+using namespace xe::cpu::hir;
+
+namespace {
+
+typedef Value::ConstantValue Register;
+
+template <typename T>
+T& As(Register& reg) {
+  return *reinterpret_cast<T*>(&reg);
+}
+template <typename T>
+const T& As(const Register& reg) {
+  return *reinterpret_cast<const T*>(&reg);
+}
+
+template <typename T>
+T* Lanes(vec128_t& value) {
+  return reinterpret_cast<T*>(&value);
+}
+template <typename T>
+const T* Lanes(const vec128_t& value) {
+  return reinterpret_cast<const T*>(&value);
+}
+
+// Calls f with a value of the unsigned integer type of the HIR type.
+template <typename F>
+void DispatchInt(TypeName type, F&& f) {
+  switch (type) {
+    case INT8_TYPE:
+      f(uint8_t());
+      break;
+    case INT16_TYPE:
+      f(uint16_t());
+      break;
+    case INT32_TYPE:
+      f(uint32_t());
+      break;
+    case INT64_TYPE:
+      f(uint64_t());
+      break;
+    default:
+      assert_unhandled_case(type);
+      break;
+  }
+}
+
+template <typename F>
+void DispatchFloat(TypeName type, F&& f) {
+  switch (type) {
+    case FLOAT32_TYPE:
+      f(float());
+      break;
+    case FLOAT64_TYPE:
+      f(double());
+      break;
+    default:
+      assert_unhandled_case(type);
+      break;
+  }
+}
+
+// Calls f with a value of the lane type of a vector operation.
+template <typename F>
+void DispatchLane(TypeName type, bool is_unsigned, F&& f) {
+  switch (type) {
+    case INT8_TYPE:
+      if (is_unsigned) {
+        f(uint8_t());
+      } else {
+        f(int8_t());
+      }
+      break;
+    case INT16_TYPE:
+      if (is_unsigned) {
+        f(uint16_t());
+      } else {
+        f(int16_t());
+      }
+      break;
+    case INT32_TYPE:
+      if (is_unsigned) {
+        f(uint32_t());
+      } else {
+        f(int32_t());
+      }
+      break;
+    case FLOAT32_TYPE:
+      f(float());
+      break;
+    default:
+      assert_unhandled_case(type);
+      break;
+  }
+}
+
+bool IsFloatType(TypeName type) {
+  return type == FLOAT32_TYPE || type == FLOAT64_TYPE;
+}
+
+bool IsVectorLaneType(TypeName type, bool allow_float) {
+  return type == INT8_TYPE || type == INT16_TYPE || type == INT32_TYPE ||
+         (allow_float && type == FLOAT32_TYPE);
+}
+
+bool IsTrue(const Register& reg, TypeName type) {
+  switch (type) {
+    case INT8_TYPE:
+      return reg.u8 != 0;
+    case INT16_TYPE:
+      return reg.u16 != 0;
+    case INT32_TYPE:
+    case FLOAT32_TYPE:
+      return reg.u32 != 0;
+    case INT64_TYPE:
+    case FLOAT64_TYPE:
+      return reg.u64 != 0;
+    case VEC128_TYPE:
+      return (reg.v128.low | reg.v128.high) != 0;
+    default:
+      assert_unhandled_case(type);
+      return false;
+  }
+}
+
+template <typename F>
+void ForEachF32(vec128_t& dest, const vec128_t& src, F&& f) {
+  for (size_t n = 0; n < 4; ++n) {
+    dest.f32[n] = f(src.f32[n]);
+  }
+}
+template <typename F>
+void ForEachF32(vec128_t& dest, const vec128_t& src1, const vec128_t& src2,
+                F&& f) {
+  for (size_t n = 0; n < 4; ++n) {
+    dest.f32[n] = f(src1.f32[n], src2.f32[n]);
+  }
+}
+
+template <typename T, typename F>
+void ForEachLane(vec128_t& dest, const vec128_t& src1, const vec128_t& src2,
+                 F&& f) {
+  for (size_t n = 0; n < sizeof(vec128_t) / sizeof(T); ++n) {
+    Lanes<T>(dest)[n] = f(Lanes<T>(src1)[n], Lanes<T>(src2)[n]);
+  }
+}
+
+// Sets all bits of the lanes where f is true.
+template <typename T, typename F>
+void CompareLanes(vec128_t& dest, const vec128_t& src1, const vec128_t& src2,
+                  F&& f) {
+  vec128_t result;
+  for (size_t n = 0; n < sizeof(vec128_t) / sizeof(T); ++n) {
+    bool lane_result = f(Lanes<T>(src1)[n], Lanes<T>(src2)[n]);
+    std::memset(reinterpret_cast<uint8_t*>(&result) + n * sizeof(T),
+                lane_result ? 0xFF : 0x00, sizeof(T));
+  }
+  dest = result;
+}
+
+// Runs the constant folding implementation of a vector operation on two
+// vectors.
+template <typename F>
+vec128_t FoldVector(const vec128_t& src1, const vec128_t& src2, F&& f) {
+  Value value1, value2;
+  value1.set_constant(src1);
+  value2.set_constant(src2);
+  f(value1, value2);
+  return value1.constant.v128;
+}
+
+template <typename T>
+T Round(T value, uint16_t round_mode) {
+  switch (round_mode) {
+    case ROUND_TO_ZERO:
+      return std::trunc(value);
+    case ROUND_TO_NEAREST:
+      // Ties to even regardless of the current rounding mode.
+      if (!std::isfinite(value)) {
+        return value;
+      }
+      return value - std::remainder(value, T(1));
+    case ROUND_TO_MINUS_INFINITY:
+      return std::floor(value);
+    case ROUND_TO_POSITIVE_INFINITY:
+      return std::ceil(value);
+    default:
+      return std::nearbyint(value);
+  }
+}
+
+// Like the x86 conversions, returns the minimum integer if the value doesn't
+// fit.
+template <typename I, typename F>
+I ConvertToInt(F value, bool truncate) {
+  if (std::isnan(value)) {
+    return std::numeric_limits<I>::min();
+  }
+  F rounded = truncate ? std::trunc(value) : std::nearbyint(value);
+  F limit = -F(std::numeric_limits<I>::min());
+  if (rounded < -limit || rounded >= limit) {
+    return std::numeric_limits<I>::min();
+  }
+  return I(rounded);
+}
+
+// Saturating like vctsxs and vctuxs.
+int32_t ConvertLaneToInt(float value, bool is_unsigned) {
+  if (std::isnan(value)) {
+    return 0;
+  }
+  if (is_unsigned) {
+    if (value <= 0.0f) {
+      return 0;
+    }
+    if (value >= 4294967296.0f) {
+      return int32_t(UINT32_MAX);
+    }
+    return int32_t(uint32_t(value));
+  }
+  if (value >= 2147483648.0f) {
+    return INT32_MAX;
+  }
+  if (value <= -2147483648.0f) {
+    return INT32_MIN;
+  }
+  return int32_t(value);
+}
+
+template <typename T>
+T MulHi(T a, T b, bool is_unsigned) {
+  if constexpr (sizeof(T) < sizeof(uint64_t)) {
+    if (is_unsigned) {
+      return T((uint64_t(a) * uint64_t(b)) >> (sizeof(T) * 8));
+    }
+    typedef std::make_signed_t<T> S;
+    return T((int64_t(S(a)) * int64_t(S(b))) >> (sizeof(T) * 8));
+  } else {
+#if XE_COMPILER_MSVC
+    if (is_unsigned) {
+      return __umulh(a, b);
+    }
+    return uint64_t(__mulh(int64_t(a), int64_t(b)));
+#else
+    if (is_unsigned) {
+      return uint64_t((static_cast<unsigned __int128>(a) *
+                       static_cast<unsigned __int128>(b)) >>
+                      64);
+    }
+    return uint64_t((static_cast<__int128>(int64_t(a)) *
+                     static_cast<__int128>(int64_t(b))) >>
+                    64);
+#endif  // XE_COMPILER_MSVC
+  }
+}
+
+// Shift counts are masked like in x86 shifts.
+template <typename T>
+uint32_t ShiftCount(uint8_t count) {
+  return count & (sizeof(T) == sizeof(uint64_t) ? 0x3F : 0x1F);
+}
+
+float DotProduct(const vec128_t& src1, const vec128_t& src2, size_t count) {
+  float result = 0.0f;
+  bool finite = true;
+  for (size_t n = 0; n < count; ++n) {
+    finite &= std::isfinite(src1.f32[n]) && std::isfinite(src2.f32[n]);
+    result += src1.f32[n] * src2.f32[n];
+  }
+  // Overflow gives a NaN, like in the x64 backend.
+  if (finite && std::isinf(result)) {
+    return std::numeric_limits<float>::quiet_NaN();
+  }
+  return result;
+}
+
+uint8_t* TranslateAddress(uint8_t* membase, uint32_t address) {
+  // Emulate the 4 KB physical address offset in 0xE0000000+ when can't do it
+  // via memory mapping.
+  static const bool physical_offset =
+      xe::memory::allocation_granularity() > 0x1000;
+  if (physical_offset && address >= 0xE0000000) {
+    address += 0x1000;
+  }
+  return membase + address;
+}
+
+void LoadValue(const uint8_t* host_address, TypeName type, bool byte_swap,
+               Register& dest) {
+  switch (type) {
+    case INT8_TYPE:
+      dest.u8 = xe::load<uint8_t>(host_address);
+      break;
+    case INT16_TYPE:
+      dest.u16 = xe::load<uint16_t>(host_address);
+      if (byte_swap) {
+        dest.u16 = xe::byte_swap(dest.u16);
+      }
+      break;
+    case INT32_TYPE:
+    case FLOAT32_TYPE:
+      dest.u32 = xe::load<uint32_t>(host_address);
+      if (byte_swap) {
+        dest.u32 = xe::byte_swap(dest.u32);
+      }
+      break;
+    case INT64_TYPE:
+    case FLOAT64_TYPE:
+      dest.u64 = xe::load<uint64_t>(host_address);
+      if (byte_swap) {
+        dest.u64 = xe::byte_swap(dest.u64);
+      }
+      break;
+    case VEC128_TYPE:
+      std::memcpy(&dest.v128, host_address, sizeof(vec128_t));
+      if (byte_swap) {
+        for (size_t n = 0; n < 4; ++n) {
+          dest.v128.u32[n] = xe::byte_swap(dest.v128.u32[n]);
+        }
+      }
+      break;
+    default:
+      assert_unhandled_case(type);
+      break;
+  }
+}
+
+void StoreValue(uint8_t* host_address, TypeName type, bool byte_swap,
+                const Register& value) {
+  switch (type) {
+    case INT8_TYPE:
+      xe::store<uint8_t>(host_address, value.u8);
+      break;
+    case INT16_TYPE:
+      xe::store<uint16_t>(host_address,
+                          byte_swap ? xe::byte_swap(value.u16) : value.u16);
+      break;
+    case INT32_TYPE:
+    case FLOAT32_TYPE:
+      xe::store<uint32_t>(host_address,
+                          byte_swap ? xe::byte_swap(value.u32) : value.u32);
+      break;
+    case INT64_TYPE:
+    case FLOAT64_TYPE:
+      xe::store<uint64_t>(host_address,
+                          byte_swap ? xe::byte_swap(value.u64) : value.u64);
+      break;
+    case VEC128_TYPE: {
+      vec128_t data = value.v128;
+      if (byte_swap) {
+        for (size_t n = 0; n < 4; ++n) {
+          data.u32[n] = xe::byte_swap(data.u32[n]);
+        }
+      }
+      std::memcpy(host_address, &data, sizeof(vec128_t));
+    } break;
+    default:
+      assert_unhandled_case(type);
+      break;
+  }
+}
+
+// Guest memory accesses. 32-bit ones may be to MMIO, which can't be caught
+// through access violations in host code that isn't generated.
+bool MayBeMmio(TypeName type, uint32_t address, uint16_t flags) {
+  return type == INT32_TYPE &&
+         ((flags & LoadStoreFlags::LOAD_STORE_MMIO_CHECK) ||
+          (address & 0xFF000000) == 0x7F000000);
+}
+
+void LoadGuest(ThreadState* thread_state, uint8_t* membase, uint32_t address,
+               TypeName type, uint16_t flags, Register& dest) {
+  bool byte_swap = (flags & LoadStoreFlags::LOAD_STORE_BYTE_SWAP) != 0;
+  if (MayBeMmio(type, address, flags)) {
+    MMIORange* mmio_range =
+        thread_state->memory()->LookupVirtualMappedRange(address);
+    if (mmio_range) {
+      // Values are in memory byte order.
+      dest.u32 = xe::byte_swap(mmio_range->read(
+          thread_state->context(), mmio_range->callback_context, address));
+      if (byte_swap) {
+        dest.u32 = xe::byte_swap(dest.u32);
+      }
+      return;
+    }
+  }
+  LoadValue(TranslateAddress(membase, address), type, byte_swap, dest);
+}
+
+void StoreGuest(ThreadState* thread_state, uint8_t* membase, uint32_t address,
+                TypeName type, uint16_t flags, const Register& value) {
+  bool byte_swap = (flags & LoadStoreFlags::LOAD_STORE_BYTE_SWAP) != 0;
+  if (MayBeMmio(type, address, flags)) {
+    MMIORange* mmio_range =
+        thread_state->memory()->LookupVirtualMappedRange(address);
+    if (mmio_range) {
+      uint32_t data = byte_swap ? xe::byte_swap(value.u32) : value.u32;
+      mmio_range->write(thread_state->context(), mmio_range->callback_context,
+                        address, xe::byte_swap(data));
+      return;
+    }
+  }
+  StoreValue(TranslateAddress(membase, address), type, byte_swap, value);
+}
+
+void Trap(ThreadState* thread_state, uint16_t trap_type) {
+  switch (trap_type) {
+    case 20:
+    case 26: {
+      // 0x0FE00014 is a 'debug print' where r3 = buffer r4 = length
+      uint32_t str_ptr = uint32_t(thread_state->context()->r[3]);
+      auto str = thread_state->memory()->TranslateVirtual<const char*>(str_ptr);
+      XELOGD("(DebugPrint) {}", str);
+      if (cvars::debugprint_trap_log) {
+        debugging::DebugPrint("(DebugPrint) {}", str);
+      }
+    } break;
+    case 0:
+    case 22:
+      XELOGE("tw/td forced trap hit! This should be a crash!");
+      if (cvars::break_on_debugbreak) {
+        xe::debugging::Break();
+      }
+      break;
+    case 25:
+      // ?
+      break;
+    default:
+      XELOGW("Unknown trap type {}", trap_type);
+      xe::debugging::Break();
+      break;
+  }
+}
+
+void CallGuest(ThreadState* thread_state, Function* function,
+               uint32_t return_address) {
+  if (function->status() != Symbol::Status::kDefined) {
+    function =
+        thread_state->processor()->ResolveFunction(function->address());
+    assert_not_null(function);
+    if (!function) {
+      return;
+    }
+  }
+  function->Call(thread_state, return_address);
+}
+
+void CallIndirect(ThreadState* thread_state, uint32_t target_address,
+                  uint32_t return_address) {
+  assert_not_zero(target_address);
+  auto function = thread_state->processor()->ResolveFunction(target_address);
+  assert_not_null(function);
+  if (!function) {
+    XELOGE("Interpreter failed to resolve indirect call target {:08X}",
+           target_address);
+    return;
+  }
+  function->Call(thread_state, return_address);
+}
+
+void CallExtern(ThreadState* thread_state, Function* function) {
+  auto context = thread_state->context();
+  if (function->behavior() == Function::Behavior::kBuiltin) {
+    auto builtin_function = static_cast<BuiltinFunction*>(function);
+    if (builtin_function->handler()) {
+      builtin_function->handler()(context, builtin_function->arg0(),
+                                  builtin_function->arg1());
+      return;
+    }
+  } else if (function->behavior() == Function::Behavior::kExtern) {
+    auto extern_function = static_cast<GuestFunction*>(function);
+    if (extern_function->extern_handler()) {
+      extern_function->extern_handler()(context, context->kernel_state);
+      return;
+    }
+  }
+  if (!cvars::ignore_undefined_externs) {
+    xe::FatalError(fmt::format("undefined extern call to {:08X} {}",
+                               function->address(), function->name().c_str()));
+  } else {
+    XELOGE("undefined extern call to {:08X} {}", function->address(),
+           function->name());
+  }
+}
+
+void SetRoundingMode(uint32_t fpscr) {
+#if XE_ARCH_AMD64
+  // Same as in the x64 backend, so code can switch between tiers.
+  static const uint32_t mxcsr_table[] = {
+      0x1F80, 0x7F80, 0x5F80, 0x3F80, 0x9F80, 0xFF80, 0xDF80, 0xBF80,
+  };
+  _mm_setcsr(mxcsr_table[fpscr & 0x7]);
+#else
+  static const int round_table[] = {
+      FE_TONEAREST,
+      FE_TOWARDZERO,
+      FE_UPWARD,
+      FE_DOWNWARD,
+  };
+  std::fesetround(round_table[fpscr & 0x3]);
+#endif  // XE_ARCH_AMD64
+}
+
+// Registers of the functions being interpreted on a thread, allocated in call
+// order as guest calls nest, so calls don't allocate memory. Registers are
+// taken from chunks that are kept for the lifetime of the thread.
+class RegisterStack {
+ public:
+  Register* Push(size_t count) {
+    if (chunk_index_ < chunks_.size()) {
+      const Chunk& chunk = chunks_[chunk_index_];
+      if (chunk.used && chunk.used + count > chunk.size) {
+        ++chunk_index_;
+      }
+    }
+    if (chunk_index_ >= chunks_.size()) {
+      chunks_.emplace_back();
+    }
+    Chunk& chunk = chunks_[chunk_index_];
+    if (chunk.used + count > chunk.size) {
+      // Only an empty chunk can be too small here.
+      chunk.size = std::max(count, kMinChunkSize);
+      chunk.registers.reset(new Register[chunk.size]);
+    }
+    Register* registers = chunk.registers.get() + chunk.used;
+    chunk.used += count;
+    return registers;
+  }
+
+  // Frees the registers of the last Push.
+  void Pop(size_t count) {
+    Chunk& chunk = chunks_[chunk_index_];
+    chunk.used -= count;
+    if (!chunk.used && chunk_index_) {
+      --chunk_index_;
+    }
+  }
+
+ private:
+  static constexpr size_t kMinChunkSize = 16384;
+
+  struct Chunk {
+    std::unique_ptr<Register[]> registers;
+    size_t size = 0;
+    size_t used = 0;
+  };
+  std::vector<Chunk> chunks_;
+  size_t chunk_index_ = 0;
+};
+
+thread_local RegisterStack register_stack;
+
+// Registers of one call, freed when it returns.
+class RegisterFrame {
+ public:
+  explicit RegisterFrame(size_t count)
+      : registers_(register_stack.Push(count)), count_(count) {}
+  ~RegisterFrame() { register_stack.Pop(count_); }
+  RegisterFrame(const RegisterFrame&) = delete;
+  RegisterFrame& operator=(const RegisterFrame&) = delete;
+
+  Register* registers() const { return registers_; }
+
+ private:
+  Register* registers_;
+  size_t count_;
+};
+
+}  // namespace
+
+InterpreterCode::~InterpreterCode() = default;
+
+bool InterpreterCode::IsSupported(const hir::Instr* instr) {
+  switch (instr->opcode->num) {
+    case OPCODE_DID_SATURATE:
+    case OPCODE_PACK:
+    case OPCODE_UNPACK:
+      return false;
+    case OPCODE_SHL:
+    case OPCODE_SHR:
+    case OPCODE_SHA:
+      // Whole vector shifts.
+      return instr->dest->type != VEC128_TYPE;
+    case OPCODE_ATOMIC_EXCHANGE:
+      return instr->dest->type == INT32_TYPE ||
+             instr->dest->type == INT64_TYPE;
+    case OPCODE_PERMUTE:
+      return instr->flags == INT32_TYPE || instr->flags == INT8_TYPE;
+    case OPCODE_SWIZZLE:
+      return instr->flags == INT32_TYPE || instr->flags == FLOAT32_TYPE;
+    case OPCODE_VECTOR_SHL:
+    case OPCODE_VECTOR_SHR:
+    case OPCODE_VECTOR_SHA:
+    case OPCODE_VECTOR_ROTATE_LEFT:
+      return IsVectorLaneType(TypeName(instr->flags), false);
+    case OPCODE_VECTOR_AVERAGE:
+      return IsVectorLaneType(TypeName(instr->flags & 0xFF), false);
+    case OPCODE_VECTOR_ADD:
+    case OPCODE_VECTOR_SUB:
+      return IsVectorLaneType(TypeName(instr->flags & 0xFF), true);
+    case OPCODE_VECTOR_MAX:
+    case OPCODE_VECTOR_MIN:
+      return IsVectorLaneType(TypeName(instr->flags >> 8), false);
+    case OPCODE_VECTOR_COMPARE_EQ:
+    case OPCODE_VECTOR_COMPARE_SGT:
+    case OPCODE_VECTOR_COMPARE_SGE:
+    case OPCODE_VECTOR_COMPARE_UGT:
+    case OPCODE_VECTOR_COMPARE_UGE:
+      return IsVectorLaneType(TypeName(instr->flags), true);
+    default:
+      return instr->opcode->num < __OPCODE_MAX_VALUE;
+  }
+}
+
+std::unique_ptr<InterpreterCode> InterpreterCode::Create(
+    HIRBuilder* builder) {
+  // Find where the blocks start to resolve branches, and check if everything
+  // can be interpreted.
+  auto is_skipped = [](const hir::Instr* instr) {
+    switch (instr->opcode->num) {
+      case OPCODE_COMMENT:
+      case OPCODE_NOP:
+      case OPCODE_SOURCE_OFFSET:
+      case OPCODE_CONTEXT_BARRIER:
+        return true;
+      default:
+        return false;
+    }
+  };
+  std::unordered_map<const Block*, uint32_t> block_starts;
+  uint32_t instr_count = 0;
+  for (auto block = builder->first_block(); block; block = block->next) {
+    block_starts.emplace(block, instr_count);
+    for (auto instr = block->instr_head; instr; instr = instr->next) {
+      if (is_skipped(instr)) {
+        continue;
+      }
+      if (!IsSupported(instr)) {
+        return nullptr;
+      }
+      ++instr_count;
+    }
+  }
+
+  auto code = std::unique_ptr<InterpreterCode>(new InterpreterCode());
+  code->instrs_.reserve(instr_count + 1);
+  code->registers_.resize(std::max(builder->max_value_ordinal(), uint32_t(1)));
+  for (auto block = builder->first_block(); block; block = block->next) {
+    for (auto instr = block->instr_head; instr; instr = instr->next) {
+      if (is_skipped(instr)) {
+        continue;
+      }
+      Instr lowered = {};
+      lowered.opcode = instr->opcode->num;
+      lowered.flags = instr->flags;
+      if (instr->dest) {
+        lowered.dest_type = instr->dest->type;
+        lowered.dest = instr->dest->ordinal;
+      }
+      uint32_t signature = instr->opcode->signature;
+      const hir::Instr::Op* ops[] = {&instr->src1, &instr->src2,
+                                     &instr->src3};
+      OpcodeSignatureType op_types[] = {GET_OPCODE_SIG_TYPE_SRC1(signature),
+                                        GET_OPCODE_SIG_TYPE_SRC2(signature),
+                                        GET_OPCODE_SIG_TYPE_SRC3(signature)};
+      for (size_t n = 0; n < 3; ++n) {
+        switch (op_types[n]) {
+          case OPCODE_SIG_TYPE_L:
+            lowered.src[n].target = block_starts[ops[n]->label->block];
+            break;
+          case OPCODE_SIG_TYPE_O:
+            lowered.src[n].offset = ops[n]->offset;
+            break;
+          case OPCODE_SIG_TYPE_S:
+            lowered.src[n].symbol = ops[n]->symbol;
+            break;
+          case OPCODE_SIG_TYPE_V: {
+            const Value* value = ops[n]->value;
+            if (value->IsConstant()) {
+              code->registers_[value->ordinal] = value->constant;
+            }
+            lowered.src[n].reg = value->ordinal;
+            lowered.src_types[n] = value->type;
+          } break;
+          default:
+            break;
+        }
+      }
+      code->instrs_.push_back(lowered);
+    }
+  }
+  // Falling through the last block returns.
+  Instr return_instr = {};
+  return_instr.opcode = OPCODE_RETURN;
+  code->instrs_.push_back(return_instr);
+  return code;
+}
+
+void InterpreterCode::Execute(GuestFunction* function,
+                              ThreadState* thread_state,
+                              uint32_t return_address) const {
+  if (function->tier() == GuestFunction::Tier::kInterpreted &&
+      !--*function->tier_up_counter()) {
+    thread_state->processor()->frontend()->QueueTierUp(function);
+  }
+
+  auto context = thread_state->context();
+  uint8_t* membase = context->virtual_membase;
+  auto context_address = reinterpret_cast<uint8_t*>(context);
+  RegisterFrame register_frame(registers_.size());
+  Register* registers = register_frame.registers();
+  std::memcpy(registers, registers_.data(),
+              sizeof(Register) * registers_.size());
+  uint32_t call_return_address = 0;
+  const Instr* instrs = instrs_.data();
+  size_t index = 0;
+  while (true) {
+    const Instr& i = instrs[index++];
+    Register& dest = registers[i.dest];
+    auto src = [registers, &i](size_t n) -> const Register& {
+      return registers[i.src[n].reg];
+    };
+    switch (i.opcode) {
+      case OPCODE_DEBUG_BREAK:
+        xe::debugging::Break();
+        break;
+      case OPCODE_DEBUG_BREAK_TRUE:
+        if (IsTrue(src(0), i.src_types[0])) {
+          xe::debugging::Break();
+        }
+        break;
+      case OPCODE_TRAP:
+        Trap(thread_state, i.flags);
+        break;
+      case OPCODE_TRAP_TRUE:
+        if (IsTrue(src(0), i.src_types[0])) {
+          Trap(thread_state, i.flags);
+        }
+        break;
+
+      case OPCODE_CALL:
+        if (i.flags & CALL_TAIL) {
+          CallGuest(thread_state, i.src[0].symbol, return_address);
+          return;
+        }
+        CallGuest(thread_state, i.src[0].symbol, call_return_address);
+        break;
+      case OPCODE_CALL_TRUE:
+        if (IsTrue(src(0), i.src_types[0])) {
+          if (i.flags & CALL_TAIL) {
+            CallGuest(thread_state, i.src[1].symbol, return_address);
+            return;
+          }
+          CallGuest(thread_state, i.src[1].symbol, call_return_address);
+        }
+        break;
+      case OPCODE_CALL_INDIRECT:
+      case OPCODE_CALL_INDIRECT_TRUE: {
+        size_t target_index = 0;
+        if (i.opcode == OPCODE_CALL_INDIRECT_TRUE) {
+          if (!IsTrue(src(0), i.src_types[0])) {
+            break;
+          }
+          target_index = 1;
+        }
+        uint32_t target_address = src(target_index).u32;
+        if ((i.flags & CALL_POSSIBLE_RETURN) &&
+            target_address == return_address) {
+          return;
+        }
+        if (i.flags & CALL_TAIL) {
+          CallIndirect(thread_state, target_address, return_address);
+          return;
+        }
+        CallIndirect(thread_state, target_address, call_return_address);
+      } break;
+      case OPCODE_CALL_EXTERN:
+        CallExtern(thread_state, i.src[0].symbol);
+        break;
+      case OPCODE_RETURN:
+        return;
+      case OPCODE_RETURN_TRUE:
+        if (IsTrue(src(0), i.src_types[0])) {
+          return;
+        }
+        break;
+      case OPCODE_SET_RETURN_ADDRESS:
+        call_return_address = src(0).u32;
+        break;
+
+      case OPCODE_BRANCH:
+        index = i.src[0].target;
+        break;
+      case OPCODE_BRANCH_TRUE:
+        if (IsTrue(src(0), i.src_types[0])) {
+          index = i.src[1].target;
+        }
+        break;
+      case OPCODE_BRANCH_FALSE:
+        if (!IsTrue(src(0), i.src_types[0])) {
+          index = i.src[1].target;
+        }
+        break;
+
+      case OPCODE_ASSIGN:
+      case OPCODE_CAST:
+        dest = src(0);
+        break;
+      case OPCODE_ZERO_EXTEND: {
+        uint64_t value = 0;
+        DispatchInt(i.src_types[0],
+                    [&](auto t) { value = As<decltype(t)>(src(0)); });
+        dest.u64 = value;
+      } break;
+      case OPCODE_SIGN_EXTEND: {
+        int64_t value = 0;
+        DispatchInt(i.src_types[0], [&](auto t) {
+          value = std::make_signed_t<decltype(t)>(As<decltype(t)>(src(0)));
+        });
+        dest.i64 = value;
+      } break;
+      case OPCODE_TRUNCATE:
+        dest.u64 = src(0).u64;
+        break;
+      case OPCODE_CONVERT: {
+        bool truncate = i.flags == ROUND_TO_ZERO;
+        const Register& value = src(0);
+        switch (i.dest_type) {
+          case INT32_TYPE:
+            if (i.src_types[0] == FLOAT32_TYPE) {
+              dest.i32 = ConvertToInt<int32_t>(value.f32, truncate);
+            } else {
+              // PPC saturates, clamp like the x64 backend.
+              double clamped = value.f64 < 2147483647.0 ? value.f64
+                                                          : 2147483647.0;
+              dest.i32 = ConvertToInt<int32_t>(clamped, truncate);
+            }
+            break;
+          case INT64_TYPE:
+            dest.i64 = ConvertToInt<int64_t>(value.f64, truncate);
+            if (dest.i64 == INT64_MIN && !std::signbit(value.f64)) {
+              dest.i64 = INT64_MAX;
+            }
+            break;
+          case FLOAT32_TYPE:
+            if (i.src_types[0] == INT32_TYPE) {
+              dest.f32 = float(value.i32);
+            } else {
+              dest.f32 = float(value.f64);
+            }
+            break;
+          case FLOAT64_TYPE:
+            if (i.src_types[0] == INT64_TYPE) {
+              dest.f64 = double(value.i64);
+            } else {
+              dest.f64 = double(value.f32);
+            }
+            break;
+          default:
+            assert_unhandled_case(i.dest_type);
+            break;
+        }
+      } break;
+      case OPCODE_ROUND:
+        if (i.dest_type == VEC128_TYPE) {
+          ForEachF32(dest.v128, src(0).v128,
+                     [&i](float a) { return Round(a, i.flags); });
+        } else {
+          DispatchFloat(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            As<T>(dest) = Round(As<T>(src(0)), i.flags);
+          });
+        }
+        break;
+      case OPCODE_VECTOR_CONVERT_I2F:
+        dest.v128 =
+            FoldVector(src(0).v128, src(0).v128, [&i](Value& a, Value& b) {
+              a.VectorConvertI2F(&b, (i.flags & ARITHMETIC_UNSIGNED) != 0);
+            });
+        break;
+      case OPCODE_VECTOR_CONVERT_F2I: {
+        bool is_unsigned = (i.flags & ARITHMETIC_UNSIGNED) != 0;
+        vec128_t value = src(0).v128;
+        for (size_t n = 0; n < 4; ++n) {
+          dest.v128.i32[n] = ConvertLaneToInt(value.f32[n], is_unsigned);
+        }
+      } break;
+      case OPCODE_LOAD_VECTOR_SHL:
+      case OPCODE_LOAD_VECTOR_SHR: {
+        uint8_t sh = src(0).u8 & 0xF;
+        uint8_t base = i.opcode == OPCODE_LOAD_VECTOR_SHL ? sh : 16 - sh;
+        vec128_t value;
+        for (uint8_t n = 0; n < 16; ++n) {
+          value.u8[n ^ 0x3] = base + n;
+        }
+        dest.v128 = value;
+      } break;
+      case OPCODE_LOAD_CLOCK:
+        dest.u64 = Clock::QueryGuestTickCount();
+        break;
+
+      case OPCODE_LOAD_LOCAL:
+        dest = src(0);
+        break;
+      case OPCODE_STORE_LOCAL:
+        registers[i.src[0].reg] = src(1);
+        break;
+      case OPCODE_LOAD_CONTEXT:
+        LoadValue(context_address + i.src[0].offset, i.dest_type, false,
+                  dest);
+        break;
+      case OPCODE_STORE_CONTEXT:
+        StoreValue(context_address + i.src[0].offset, i.src_types[1], false,
+                   src(1));
+        break;
+      case OPCODE_LOAD_MMIO: {
+        auto mmio_range = reinterpret_cast<MMIORange*>(i.src[0].offset);
+        auto read_address = uint32_t(i.src[1].offset);
+        dest.u32 = xe::byte_swap(mmio_range->read(
+            context, mmio_range->callback_context, read_address));
+      } break;
+      case OPCODE_STORE_MMIO: {
+        auto mmio_range = reinterpret_cast<MMIORange*>(i.src[0].offset);
+        auto write_address = uint32_t(i.src[1].offset);
+        mmio_range->write(context, mmio_range->callback_context, write_address,
+                          xe::byte_swap(src(2).u32));
+      } break;
+      case OPCODE_LOAD_OFFSET:
+        LoadGuest(thread_state, membase, src(0).u32 + src(1).u32, i.dest_type,
+                  i.flags, dest);
+        break;
+      case OPCODE_STORE_OFFSET:
+        StoreGuest(thread_state, membase, src(0).u32 + src(1).u32,
+                   i.src_types[2], i.flags, src(2));
+        break;
+      case OPCODE_LOAD:
+        LoadGuest(thread_state, membase, src(0).u32, i.dest_type, i.flags,
+                  dest);
+        break;
+      case OPCODE_STORE:
+        StoreGuest(thread_state, membase, src(0).u32, i.src_types[1], i.flags,
+                   src(1));
+        break;
+      case OPCODE_MEMSET:
+        std::memset(TranslateAddress(membase, src(0).u32), src(1).u8,
+                    size_t(src(2).u64));
+        break;
+      case OPCODE_CACHE_CONTROL:
+        break;
+      case OPCODE_MEMORY_BARRIER:
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        break;
+
+      case OPCODE_MAX:
+      case OPCODE_MIN: {
+        bool is_max = i.opcode == OPCODE_MAX;
+        // Like maxss and minss, the second operand is the result if either is
+        // NaN.
+        auto select = [is_max](auto a, auto b) {
+          return (is_max ? a > b : a < b) ? a : b;
+        };
+        if (i.dest_type == VEC128_TYPE) {
+          ForEachF32(dest.v128, src(0).v128, src(1).v128, select);
+        } else if (IsFloatType(i.dest_type)) {
+          DispatchFloat(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            As<T>(dest) = select(As<T>(src(0)), As<T>(src(1)));
+          });
+        } else {
+          DispatchInt(i.dest_type, [&](auto t) {
+            typedef std::make_signed_t<decltype(t)> S;
+            As<S>(dest) = select(As<S>(src(0)), As<S>(src(1)));
+          });
+        }
+      } break;
+      case OPCODE_VECTOR_MAX:
+      case OPCODE_VECTOR_MIN: {
+        bool is_max = i.opcode == OPCODE_VECTOR_MAX;
+        vec128_t a = src(0).v128, b = src(1).v128;
+        DispatchLane(TypeName(i.flags >> 8),
+                     (i.flags & ARITHMETIC_UNSIGNED) != 0, [&](auto t) {
+                       typedef decltype(t) T;
+                       ForEachLane<T>(dest.v128, a, b, [is_max](T x, T y) {
+                         return is_max ? std::max(x, y) : std::min(x, y);
+                       });
+                     });
+      } break;
+      case OPCODE_SELECT:
+        if (i.src_types[0] == VEC128_TYPE) {
+          const vec128_t& mask = src(0).v128;
+          const vec128_t& a = src(1).v128;
+          const vec128_t& b = src(2).v128;
+          vec128_t value;
+          value.low = (~mask.low & a.low) | (mask.low & b.low);
+          value.high = (~mask.high & a.high) | (mask.high & b.high);
+          dest.v128 = value;
+        } else {
+          dest = src(0).u8 ? src(1) : src(2);
+        }
+        break;
+      case OPCODE_IS_TRUE:
+        dest.u8 = IsTrue(src(0), i.src_types[0]) ? 1 : 0;
+        break;
+      case OPCODE_IS_FALSE:
+        dest.u8 = IsTrue(src(0), i.src_types[0]) ? 0 : 1;
+        break;
+      case OPCODE_IS_NAN:
+        if (i.src_types[0] == FLOAT32_TYPE) {
+          dest.u8 = std::isnan(src(0).f32) ? 1 : 0;
+        } else {
+          dest.u8 = std::isnan(src(0).f64) ? 1 : 0;
+        }
+        break;
+      case OPCODE_COMPARE_EQ:
+      case OPCODE_COMPARE_NE:
+      case OPCODE_COMPARE_SLT:
+      case OPCODE_COMPARE_SLE:
+      case OPCODE_COMPARE_SGT:
+      case OPCODE_COMPARE_SGE:
+      case OPCODE_COMPARE_ULT:
+      case OPCODE_COMPARE_ULE:
+      case OPCODE_COMPARE_UGT:
+      case OPCODE_COMPARE_UGE: {
+        bool result = false;
+        auto compare = [&i, &result](auto a, auto b) {
+          switch (i.opcode) {
+            case OPCODE_COMPARE_EQ:
+              result = a == b;
+              break;
+            case OPCODE_COMPARE_NE:
+              result = a != b;
+              break;
+            case OPCODE_COMPARE_SLT:
+            case OPCODE_COMPARE_ULT:
+              result = a < b;
+              break;
+            case OPCODE_COMPARE_SLE:
+            case OPCODE_COMPARE_ULE:
+              result = a <= b;
+              break;
+            case OPCODE_COMPARE_SGT:
+            case OPCODE_COMPARE_UGT:
+              result = a > b;
+              break;
+            default:
+              result = a >= b;
+              break;
+          }
+        };
+        if (IsFloatType(i.src_types[0])) {
+          DispatchFloat(i.src_types[0], [&](auto t) {
+            typedef decltype(t) T;
+            compare(As<T>(src(0)), As<T>(src(1)));
+          });
+        } else {
+          bool is_signed = i.opcode >= OPCODE_COMPARE_SLT &&
+                           i.opcode <= OPCODE_COMPARE_SGE;
+          DispatchInt(i.src_types[0], [&](auto t) {
+            typedef decltype(t) T;
+            typedef std::make_signed_t<T> S;
+            if (is_signed) {
+              compare(As<S>(src(0)), As<S>(src(1)));
+            } else {
+              compare(As<T>(src(0)), As<T>(src(1)));
+            }
+          });
+        }
+        dest.u8 = result ? 1 : 0;
+      } break;
+      case OPCODE_VECTOR_COMPARE_EQ:
+      case OPCODE_VECTOR_COMPARE_SGT:
+      case OPCODE_VECTOR_COMPARE_SGE:
+      case OPCODE_VECTOR_COMPARE_UGT:
+      case OPCODE_VECTOR_COMPARE_UGE: {
+        bool is_unsigned = i.opcode == OPCODE_VECTOR_COMPARE_UGT ||
+                           i.opcode == OPCODE_VECTOR_COMPARE_UGE;
+        vec128_t a = src(0).v128, b = src(1).v128;
+        DispatchLane(TypeName(i.flags), is_unsigned, [&](auto t) {
+          typedef decltype(t) T;
+          CompareLanes<T>(dest.v128, a, b, [&i](T x, T y) {
+            switch (i.opcode) {
+              case OPCODE_VECTOR_COMPARE_EQ:
+                return x == y;
+              case OPCODE_VECTOR_COMPARE_SGT:
+              case OPCODE_VECTOR_COMPARE_UGT:
+                return x > y;
+              default:
+                return x >= y;
+            }
+          });
+        });
+      } break;
+
+      case OPCODE_ADD:
+      case OPCODE_SUB:
+      case OPCODE_MUL:
+      case OPCODE_DIV: {
+        auto op = [&i](auto a, auto b) -> decltype(a) {
+          switch (i.opcode) {
+            case OPCODE_ADD:
+              return a + b;
+            case OPCODE_SUB:
+              return a - b;
+            case OPCODE_MUL:
+              return a * b;
+            default:
+              return a / b;
+          }
+        };
+        if (i.dest_type == VEC128_TYPE) {
+          ForEachF32(dest.v128, src(0).v128, src(1).v128, op);
+        } else if (IsFloatType(i.dest_type)) {
+          DispatchFloat(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            As<T>(dest) = op(As<T>(src(0)), As<T>(src(1)));
+          });
+        } else if (i.opcode == OPCODE_DIV) {
+          bool is_unsigned = (i.flags & ARITHMETIC_UNSIGNED) != 0;
+          DispatchInt(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            typedef std::make_signed_t<T> S;
+            T a = As<T>(src(0)), b = As<T>(src(1));
+            // Undefined in PPC, skipped by the x64 backend.
+            if (!b) {
+              As<T>(dest) = 0;
+            } else if (is_unsigned) {
+              As<T>(dest) = T(a / b);
+            } else if (S(a) == std::numeric_limits<S>::min() && S(b) == -1) {
+              As<T>(dest) = a;
+            } else {
+              As<T>(dest) = T(S(a) / S(b));
+            }
+          });
+        } else {
+          // Wrapping in unsigned types.
+          DispatchInt(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            As<T>(dest) = T(op(uint64_t(As<T>(src(0))),
+                               uint64_t(As<T>(src(1)))));
+          });
+        }
+      } break;
+      case OPCODE_ADD_CARRY:
+        DispatchInt(i.dest_type, [&](auto t) {
+          typedef decltype(t) T;
+          As<T>(dest) = T(uint64_t(As<T>(src(0))) + uint64_t(As<T>(src(1))) +
+                          (src(2).u8 & 1));
+        });
+        break;
+      case OPCODE_VECTOR_ADD:
+      case OPCODE_VECTOR_SUB: {
+        auto type = TypeName(i.flags & 0xFF);
+        uint32_t arithmetic_flags = i.flags >> 8;
+        bool is_unsigned = (arithmetic_flags & ARITHMETIC_UNSIGNED) != 0;
+        bool saturate = (arithmetic_flags & ARITHMETIC_SATURATE) != 0;
+        bool is_add = i.opcode == OPCODE_VECTOR_ADD;
+        dest.v128 = FoldVector(src(0).v128, src(1).v128,
+                               [&](Value& a, Value& b) {
+                                 if (is_add) {
+                                   a.VectorAdd(&b, type, is_unsigned, saturate);
+                                 } else {
+                                   a.VectorSub(&b, type, is_unsigned, saturate);
+                                 }
+                               });
+      } break;
+      case OPCODE_MUL_HI: {
+        bool is_unsigned = (i.flags & ARITHMETIC_UNSIGNED) != 0;
+        DispatchInt(i.dest_type, [&](auto t) {
+          typedef decltype(t) T;
+          As<T>(dest) = MulHi(As<T>(src(0)), As<T>(src(1)), is_unsigned);
+        });
+      } break;
+      case OPCODE_MUL_ADD:
+      case OPCODE_MUL_SUB: {
+        bool is_sub = i.opcode == OPCODE_MUL_SUB;
+        auto op = [is_sub](auto a, auto b, auto c) {
+          return std::fma(a, b, is_sub ? -c : c);
+        };
+        if (i.dest_type == VEC128_TYPE) {
+          vec128_t a = src(0).v128, b = src(1).v128, c = src(2).v128;
+          for (size_t n = 0; n < 4; ++n) {
+            dest.v128.f32[n] = op(a.f32[n], b.f32[n], c.f32[n]);
+          }
+        } else {
+          DispatchFloat(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            As<T>(dest) = op(As<T>(src(0)), As<T>(src(1)), As<T>(src(2)));
+          });
+        }
+      } break;
+      case OPCODE_NEG:
+      case OPCODE_ABS:
+      case OPCODE_SQRT:
+      case OPCODE_RSQRT:
+      case OPCODE_RECIP:
+      case OPCODE_POW2:
+      case OPCODE_LOG2: {
+        auto op = [&i](auto a) -> decltype(a) {
+          typedef decltype(a) T;
+          switch (i.opcode) {
+            case OPCODE_NEG:
+              return -a;
+            case OPCODE_ABS:
+              return std::abs(a);
+            case OPCODE_SQRT:
+              return std::sqrt(a);
+            case OPCODE_RSQRT:
+              return T(1) / std::sqrt(a);
+            case OPCODE_RECIP:
+              return T(1) / a;
+            case OPCODE_POW2:
+              return std::exp2(a);
+            default:
+              return std::log2(a);
+          }
+        };
+        if (i.dest_type == VEC128_TYPE) {
+          ForEachF32(dest.v128, src(0).v128, op);
+        } else if (IsFloatType(i.dest_type)) {
+          DispatchFloat(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            As<T>(dest) = op(As<T>(src(0)));
+          });
+        } else {
+          DispatchInt(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            typedef std::make_signed_t<T> S;
+            S value = As<S>(src(0));
+            if (i.opcode == OPCODE_NEG || value < 0) {
+              As<T>(dest) = T(T(0) - T(value));
+            } else {
+              As<T>(dest) = T(value);
+            }
+          });
+        }
+      } break;
+      case OPCODE_DOT_PRODUCT_3:
+      case OPCODE_DOT_PRODUCT_4:
+        dest.f32 = DotProduct(src(0).v128, src(1).v128,
+                                     i.opcode == OPCODE_DOT_PRODUCT_3 ? 3 : 4);
+        break;
+
+      case OPCODE_AND:
+      case OPCODE_AND_NOT:
+      case OPCODE_OR:
+      case OPCODE_XOR: {
+        // Types are at most 128 bits, whole registers can be used.
+        const Register& a = src(0);
+        const Register& b = src(1);
+        vec128_t value;
+        switch (i.opcode) {
+          case OPCODE_AND:
+            value.low = a.v128.low & b.v128.low;
+            value.high = a.v128.high & b.v128.high;
+            break;
+          case OPCODE_AND_NOT:
+            value.low = a.v128.low & ~b.v128.low;
+            value.high = a.v128.high & ~b.v128.high;
+            break;
+          case OPCODE_OR:
+            value.low = a.v128.low | b.v128.low;
+            value.high = a.v128.high | b.v128.high;
+            break;
+          default:
+            value.low = a.v128.low ^ b.v128.low;
+            value.high = a.v128.high ^ b.v128.high;
+            break;
+        }
+        dest.v128 = value;
+      } break;
+      case OPCODE_NOT: {
+        vec128_t value = src(0).v128;
+        value.low = ~value.low;
+        value.high = ~value.high;
+        dest.v128 = value;
+      } break;
+      case OPCODE_SHL:
+      case OPCODE_SHR:
+      case OPCODE_SHA:
+      case OPCODE_ROTATE_LEFT:
+        DispatchInt(i.dest_type, [&](auto t) {
+          typedef decltype(t) T;
+          typedef std::make_signed_t<T> S;
+          T value = As<T>(src(0));
+          switch (i.opcode) {
+            case OPCODE_SHL:
+              As<T>(dest) = T(uint64_t(value) << ShiftCount<T>(src(1).u8));
+              break;
+            case OPCODE_SHR:
+              As<T>(dest) = T(uint64_t(value) >> ShiftCount<T>(src(1).u8));
+              break;
+            case OPCODE_SHA:
+              As<T>(dest) = T(int64_t(S(value)) >> ShiftCount<T>(src(1).u8));
+              break;
+            default:
+              As<T>(dest) = xe::rotate_left(
+                  value, uint8_t(src(1).u8 & (sizeof(T) * 8 - 1)));
+              break;
+          }
+        });
+        break;
+      case OPCODE_VECTOR_SHL:
+      case OPCODE_VECTOR_SHR:
+      case OPCODE_VECTOR_ROTATE_LEFT: {
+        auto type = TypeName(i.flags);
+        dest.v128 = FoldVector(src(0).v128, src(1).v128,
+                               [&i, type](Value& a, Value& b) {
+                                 if (i.opcode == OPCODE_VECTOR_SHL) {
+                                   a.VectorShl(&b, type);
+                                 } else if (i.opcode == OPCODE_VECTOR_SHR) {
+                                   a.VectorShr(&b, type);
+                                 } else {
+                                   a.VectorRol(&b, type);
+                                 }
+                               });
+      } break;
+      case OPCODE_VECTOR_SHA: {
+        vec128_t a = src(0).v128, b = src(1).v128;
+        DispatchLane(TypeName(i.flags), false, [&](auto t) {
+          typedef decltype(t) T;
+          if constexpr (std::is_integral_v<T>) {
+            ForEachLane<T>(dest.v128, a, b, [](T x, T y) {
+              return T(x >> (y & (sizeof(T) * 8 - 1)));
+            });
+          }
+        });
+      } break;
+      case OPCODE_VECTOR_AVERAGE: {
+        auto type = TypeName(i.flags & 0xFF);
+        uint32_t arithmetic_flags = i.flags >> 8;
+        dest.v128 = FoldVector(
+            src(0).v128, src(1).v128, [&](Value& a, Value& b) {
+              a.VectorAverage(&b, type,
+                              (arithmetic_flags & ARITHMETIC_UNSIGNED) != 0,
+                              (arithmetic_flags & ARITHMETIC_SATURATE) != 0);
+            });
+      } break;
+      case OPCODE_BYTE_SWAP:
+        if (i.dest_type == VEC128_TYPE) {
+          vec128_t value = src(0).v128;
+          for (size_t n = 0; n < 4; ++n) {
+            value.u32[n] = xe::byte_swap(value.u32[n]);
+          }
+          dest.v128 = value;
+        } else {
+          DispatchInt(i.dest_type, [&](auto t) {
+            typedef decltype(t) T;
+            As<T>(dest) = xe::byte_swap(As<T>(src(0)));
+          });
+        }
+        break;
+      case OPCODE_CNTLZ: {
+        uint8_t count = 0;
+        DispatchInt(i.src_types[0], [&](auto t) {
+          count = xe::lzcnt(As<decltype(t)>(src(0)));
+        });
+        dest.u8 = count;
+      } break;
+      case OPCODE_INSERT: {
+        vec128_t value = src(0).v128;
+        uint8_t lane = src(1).u8;
+        switch (i.src_types[2]) {
+          case INT8_TYPE:
+            value.u8[(lane ^ 0x3) & 0xF] = src(2).u8;
+            break;
+          case INT16_TYPE:
+            value.u16[(lane ^ 0x1) & 0x7] = src(2).u16;
+            break;
+          default:
+            value.u32[lane & 0x3] = src(2).u32;
+            break;
+        }
+        dest.v128 = value;
+      } break;
+      case OPCODE_EXTRACT: {
+        const vec128_t& value = src(0).v128;
+        uint8_t lane = src(1).u8;
+        switch (i.dest_type) {
+          case INT8_TYPE:
+            dest.u8 = value.u8[(lane ^ 0x3) & 0xF];
+            break;
+          case INT16_TYPE:
+            dest.u16 = value.u16[(lane ^ 0x1) & 0x7];
+            break;
+          default:
+            dest.u32 = value.u32[lane & 0x3];
+            break;
+        }
+      } break;
+      case OPCODE_SPLAT: {
+        vec128_t value;
+        switch (i.src_types[0]) {
+          case INT8_TYPE:
+            std::memset(&value, src(0).u8, sizeof(value));
+            break;
+          case INT16_TYPE:
+            for (size_t n = 0; n < 8; ++n) {
+              value.u16[n] = src(0).u16;
+            }
+            break;
+          default:
+            for (size_t n = 0; n < 4; ++n) {
+              value.u32[n] = src(0).u32;
+            }
+            break;
+        }
+        dest.v128 = value;
+      } break;
+      case OPCODE_PERMUTE: {
+        const vec128_t& a = src(1).v128;
+        const vec128_t& b = src(2).v128;
+        vec128_t value;
+        if (i.flags == INT32_TYPE) {
+          uint32_t control = src(0).u32;
+          for (size_t n = 0; n < 4; ++n) {
+            uint32_t lane_control = control >> (n * 8);
+            value.u32[n] =
+                ((lane_control >> 2) & 0x1 ? b : a).u32[lane_control & 0x3];
+          }
+        } else {
+          // Bytes in guest order, like vperm.
+          const vec128_t& control = src(0).v128;
+          for (size_t n = 0; n < 16; ++n) {
+            uint8_t byte_control = control.u8[n ^ 0x3] & 0x1F;
+            value.u8[n ^ 0x3] =
+                (byte_control & 0x10 ? b : a).u8[(byte_control & 0xF) ^ 0x3];
+          }
+        }
+        dest.v128 = value;
+      } break;
+      case OPCODE_SWIZZLE: {
+        vec128_t value = src(0).v128;
+        uint32_t mask = uint32_t(i.src[1].offset);
+        for (size_t n = 0; n < 4; ++n) {
+          dest.v128.u32[n] = value.u32[(mask >> (n * 2)) & 0x3];
+        }
+      } break;
+
+      case OPCODE_ATOMIC_EXCHANGE: {
+        // The address is a host one.
+        void* host_address = reinterpret_cast<void*>(src(0).u64);
+        if (i.dest_type == INT32_TYPE) {
+          dest.u32 = xe::atomic_exchange(
+              src(1).u32, reinterpret_cast<volatile uint32_t*>(host_address));
+        } else {
+          dest.u64 = xe::atomic_exchange(
+              src(1).u64, reinterpret_cast<volatile uint64_t*>(host_address));
+        }
+      } break;
+      case OPCODE_ATOMIC_COMPARE_EXCHANGE: {
+        uint8_t* host_address = TranslateAddress(membase, src(0).u32);
+        bool result;
+        if (i.src_types[1] == INT32_TYPE) {
+          result = xe::atomic_cas(
+              src(1).u32, src(2).u32,
+              reinterpret_cast<volatile uint32_t*>(host_address));
+        } else {
+          result = xe::atomic_cas(
+              src(1).u64, src(2).u64,
+              reinterpret_cast<volatile uint64_t*>(host_address));
+        }
+        dest.u8 = result ? 1 : 0;
+      } break;
+      case OPCODE_SET_ROUNDING_MODE:
+        SetRoundingMode(src(0).u32);
+        break;
+
+      default:
+        assert_unhandled_case(i.opcode);
+        break;
+    }
+  }
+}
+
+}  // namespace interpreter
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
@@ -0,0 +1,91 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_CODE_H_
+#define XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_CODE_H_
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "xenia/cpu/hir/opcodes.h"
+#include "xenia/cpu/hir/value.h"
+
+namespace xe {
+namespace cpu {
+class Function;
+class GuestFunction;
+class ThreadState;
+namespace hir {
+class HIRBuilder;
+class Instr;
+}  // namespace hir
+}  // namespace cpu
+}  // namespace xe
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace interpreter {
+
+// Finalized HIR of a function lowered to a flat instruction list that can be
+// executed directly, without generating machine code.
+// Every value gets its own register, indexed by the value ordinal, with
+// constants preloaded. Locals are registers too.
+class InterpreterCode {
+ public:
+  ~InterpreterCode();
+
+  // Returns nullptr if the function uses an operation or a type the
+  // interpreter doesn't implement, it must be compiled to machine code then.
+  static std::unique_ptr<InterpreterCode> Create(hir::HIRBuilder* builder);
+
+  size_t instr_count() const { return instrs_.size(); }
+
+  // Executes the function on the calling thread, which must have thread_state
+  // bound. return_address is the guest address the function returns to, for
+  // indirect calls that may actually be returns.
+  void Execute(GuestFunction* function, ThreadState* thread_state,
+               uint32_t return_address) const;
+
+ private:
+  typedef hir::Value::ConstantValue Register;
+
+  union Operand {
+    // Register of a value or a local.
+    uint32_t reg;
+    // Instruction index of a label.
+    uint32_t target;
+    uint64_t offset;
+    Function* symbol;
+  };
+
+  struct Instr {
+    hir::Opcode opcode;
+    uint16_t flags;
+    hir::TypeName dest_type;
+    hir::TypeName src_types[3];
+    uint32_t dest;
+    Operand src[3];
+  };
+
+  InterpreterCode() = default;
+
+  static bool IsSupported(const hir::Instr* instr);
+
+  std::vector<Instr> instrs_;
+  std::vector<Register> registers_;
+};
+
+}  // namespace interpreter
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
+
+#endif  // XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_CODE_H_
@@ -0,0 +1,44 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/backend/interpreter/interpreter_function.h"
+
+#include "xenia/base/assert.h"
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace interpreter {
+
+InterpreterFunction::InterpreterFunction(Module* module, uint32_t address)
+    : GuestFunction(module, address) {}
+
+InterpreterFunction::~InterpreterFunction() = default;
+
+void InterpreterFunction::Setup(std::unique_ptr<InterpreterCode> code) {
+  std::lock_guard<std::mutex> lock(code_versions_mutex_);
+  code_.store(code.get());
+  code_versions_.push_back(std::move(code));
+}
+
+bool InterpreterFunction::CallImpl(ThreadState* thread_state,
+                                   uint32_t return_address) {
+  const InterpreterCode* code = code_.load();
+  assert_not_null(code);
+  if (!code) {
+    return false;
+  }
+  code->Execute(this, thread_state, return_address);
+  return true;
+}
+
+}  // namespace interpreter
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
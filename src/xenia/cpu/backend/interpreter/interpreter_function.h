@@ -0,0 +1,52 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_FUNCTION_H_
+#define XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_FUNCTION_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "xenia/cpu/backend/interpreter/interpreter_code.h"
+#include "xenia/cpu/function.h"
+#include "xenia/cpu/thread_state.h"
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace interpreter {
+
+class InterpreterFunction : public GuestFunction {
+ public:
+  InterpreterFunction(Module* module, uint32_t address);
+  ~InterpreterFunction() override;
+
+  const InterpreterCode* code() const { return code_.load(); }
+
+  // Makes the function execute the given code. Previous code is kept, as it
+  // may still be running on other threads.
+  void Setup(std::unique_ptr<InterpreterCode> code);
+
+ protected:
+  bool CallImpl(ThreadState* thread_state, uint32_t return_address) override;
+
+ private:
+  std::atomic<const InterpreterCode*> code_{nullptr};
+  std::mutex code_versions_mutex_;
+  std::vector<std::unique_ptr<InterpreterCode>> code_versions_;
+};
+
+}  // namespace interpreter
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
+
+#endif  // XENIA_CPU_BACKEND_INTERPRETER_INTERPRETER_FUNCTION_H_
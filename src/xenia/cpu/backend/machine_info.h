@@ -18,6 +18,9 @@ namespace backend {
 
 struct MachineInfo {
   bool supports_extended_load_store;
+  // Whether the generated code stores values by their ordinals, so reducing
+  // the number of ordinals saves space.
+  bool uses_value_ordinals;
 
   struct RegisterSet {
     enum Types {
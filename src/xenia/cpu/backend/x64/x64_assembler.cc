@@ -9,6 +9,7 @@
 
 #include "xenia/cpu/backend/x64/x64_assembler.h"
 
+#include <algorithm>
 #include <climits>
 
 #include "third_party/capstone/include/capstone/capstone.h"
@@ -16,6 +17,7 @@
 #include "xenia/base/profiling.h"
 #include "xenia/base/reset_scope.h"
 #include "xenia/base/string.h"
+#include "xenia/cpu/backend/interpreter/interpreter_code.h"
 #include "xenia/cpu/backend/x64/x64_backend.h"
 #include "xenia/cpu/backend/x64/x64_code_cache.h"
 #include "xenia/cpu/backend/x64/x64_emitter.h"
@@ -67,33 +69,50 @@ void X64Assembler::Reset() {
   Assembler::Reset();
 }
 
-bool X64Assembler::Assemble(GuestFunction* function, HIRBuilder* builder,
-                            uint32_t debug_info_flags,
+bool X64Assembler::Assemble(GuestFunction* function, GuestFunction::Tier tier,
+                            HIRBuilder* builder, uint32_t debug_info_flags,
                             std::unique_ptr<FunctionDebugInfo> debug_info) {
   SCOPE_profile_cpu_f("cpu");
 
   // Reset when we leave.
   xe::make_reset_scope(this);
 
-  // Lower HIR -> x64.
+  // Interpreted functions only get an entry calling the interpreter. If the
+  // interpreter can't execute the function, emit baseline code instead.
+  if (tier == GuestFunction::Tier::kInterpreted) {
+    auto interpreter_code = interpreter::InterpreterCode::Create(builder);
+    if (interpreter_code) {
+      return AssembleInterpreterEntry(function, builder,
+                                      std::move(interpreter_code),
+                                      std::move(debug_info));
+    }
+    tier = GuestFunction::Tier::kBaseline;
+    *function->tier_up_counter() = std::max(cvars::tier_up_call_count, 1);
+  }
+
+  // Lower HIR -> x64. The function may be running its current code on other
+  // threads, so the new code and source map are only published once placed.
   void* machine_code = nullptr;
   size_t code_size = 0;
-  if (!emitter_->Emit(function, builder, debug_info_flags, debug_info.get(),
-                      &machine_code, &code_size, &function->source_map())) {
+  std::vector<SourceMapEntry> source_map;
+  if (!emitter_->Emit(function, tier, builder, debug_info_flags,
+                      debug_info.get(), &machine_code, &code_size,
+                      &source_map)) {
     return false;
   }
 
   // Stash generated machine code.
   if (debug_info_flags & DebugInfoFlags::kDebugInfoDisasmMachineCode) {
-    DumpMachineCode(machine_code, code_size, function->source_map(),
-                    &string_buffer_);
+    DumpMachineCode(machine_code, code_size, source_map, &string_buffer_);
     debug_info->set_machine_code_disasm(xe_strdup(string_buffer_.buffer()));
     string_buffer_.Reset();
   }
 
   function->set_debug_info(std::move(debug_info));
+  uint8_t* old_machine_code = function->machine_code();
   static_cast<X64Function*>(function)->Setup(
-      reinterpret_cast<uint8_t*>(machine_code), code_size);
+      reinterpret_cast<uint8_t*>(machine_code), code_size,
+      std::move(source_map), tier);
 
   // Install into indirection table.
   uint64_t host_address = reinterpret_cast<uint64_t>(machine_code);
@@ -101,10 +120,53 @@ bool X64Assembler::Assemble(GuestFunction* function, HIRBuilder* builder,
   reinterpret_cast<X64CodeCache*>(backend_->code_cache())
       ->AddIndirection(function->address(),
                        static_cast<uint32_t>(host_address));
+  RetireCode(function, old_machine_code);
+
+  return true;
+}
+
+bool X64Assembler::AssembleInterpreterEntry(
+    GuestFunction* function, HIRBuilder* builder,
+    std::unique_ptr<interpreter::InterpreterCode> interpreter_code,
+    std::unique_ptr<FunctionDebugInfo> debug_info) {
+  void* machine_code = nullptr;
+  size_t code_size = 0;
+  if (!emitter_->EmitInterpreterEntry(function, builder,
+                                      interpreter_code.get(), &machine_code,
+                                      &code_size)) {
+    return false;
+  }
+
+  function->set_debug_info(std::move(debug_info));
+  auto x64_function = static_cast<X64Function*>(function);
+  x64_function->AddInterpreterCode(std::move(interpreter_code));
+  uint8_t* old_machine_code = x64_function->machine_code();
+  x64_function->Setup(reinterpret_cast<uint8_t*>(machine_code), code_size, {},
+                      GuestFunction::Tier::kInterpreted);
+
+  uint64_t host_address = reinterpret_cast<uint64_t>(machine_code);
+  assert_true((host_address >> 32) == 0);
+  reinterpret_cast<X64CodeCache*>(backend_->code_cache())
+      ->AddIndirection(function->address(),
+                       static_cast<uint32_t>(host_address));
+  RetireCode(function, old_machine_code);
 
   return true;
 }
 
+void X64Assembler::RetireCode(GuestFunction* function,
+                              uint8_t* old_machine_code) {
+  // Code replaced by retranslation may still be running on other threads, so
+  // it's only freed once the stacks of the threads show it isn't. Checked
+  // after the new code is published (see X64Function::is_called_directly), so
+  // a caller embedding the old code has marked the function by now.
+  if (old_machine_code && x64_backend_->may_free_code() &&
+      !static_cast<X64Function*>(function)->is_called_directly()) {
+    x64_backend_->code_cache()->RetireCode(old_machine_code);
+    x64_backend_->processor()->RequestCodeReclamation();
+  }
+}
+
 void X64Assembler::DumpMachineCode(
     void* machine_code, size_t code_size,
     const std::vector<SourceMapEntry>& source_map, StringBuffer* str) {
@@ -20,6 +20,9 @@
 namespace xe {
 namespace cpu {
 namespace backend {
+namespace interpreter {
+class InterpreterCode;
+}  // namespace interpreter
 namespace x64 {
 
 class X64Backend;
@@ -35,11 +38,16 @@ class X64Assembler : public Assembler {
 
   void Reset() override;
 
-  bool Assemble(GuestFunction* function, hir::HIRBuilder* builder,
-                uint32_t debug_info_flags,
+  bool Assemble(GuestFunction* function, GuestFunction::Tier tier,
+                hir::HIRBuilder* builder, uint32_t debug_info_flags,
                 std::unique_ptr<FunctionDebugInfo> debug_info) override;
 
  private:
+  bool AssembleInterpreterEntry(
+      GuestFunction* function, hir::HIRBuilder* builder,
+      std::unique_ptr<interpreter::InterpreterCode> interpreter_code,
+      std::unique_ptr<FunctionDebugInfo> debug_info);
+  void RetireCode(GuestFunction* function, uint8_t* old_machine_code);
   void DumpMachineCode(void* machine_code, size_t code_size,
                        const std::vector<SourceMapEntry>& source_map,
                        StringBuffer* str);
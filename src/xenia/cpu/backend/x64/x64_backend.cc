@@ -10,19 +10,25 @@
 #include "xenia/cpu/backend/x64/x64_backend.h"
 
 #include <stddef.h>
+#include <cstring>
+#include <vector>
 
 #include "third_party/capstone/include/capstone/capstone.h"
 #include "third_party/capstone/include/capstone/x86.h"
 
 #include "xenia/base/exception_handler.h"
 #include "xenia/base/logging.h"
+#include "xenia/base/xxhash.h"
 #include "xenia/cpu/backend/x64/x64_assembler.h"
 #include "xenia/cpu/backend/x64/x64_code_cache.h"
+#include "xenia/cpu/backend/x64/x64_code_storage.h"
 #include "xenia/cpu/backend/x64/x64_emitter.h"
 #include "xenia/cpu/backend/x64/x64_function.h"
 #include "xenia/cpu/backend/x64/x64_sequences.h"
 #include "xenia/cpu/backend/x64/x64_stack_layout.h"
 #include "xenia/cpu/breakpoint.h"
+#include "xenia/cpu/module.h"
+#include "xenia/cpu/ppc/ppc_frontend.h"
 #include "xenia/cpu/processor.h"
 #include "xenia/cpu/stack_walker.h"
 
@@ -58,6 +64,8 @@ class X64ThunkEmitter : public X64Emitter {
   HostToGuestThunk EmitHostToGuestThunk();
   GuestToHostThunk EmitGuestToHostThunk();
   ResolveFunctionThunk EmitResolveFunctionThunk();
+  ResolveFunctionThunk EmitCallSiteResolveThunk();
+  ResolveFunctionThunk EmitIndirectCallThunk();
 
  private:
   // The following four functions provide save/load functionality for registers.
@@ -79,6 +87,9 @@ X64Backend::X64Backend() : Backend(), code_cache_(nullptr) {
 }
 
 X64Backend::~X64Backend() {
+  // Flush stored code before the code cache goes away.
+  code_storage_.reset();
+
   if (capstone_handle_) {
     cs_close(&capstone_handle_);
   }
@@ -106,6 +117,9 @@ bool X64Backend::Initialize(Processor* processor) {
     machine_info_.supports_extended_load_store = false;
   }
 
+  // Values only live in host registers and spill slots.
+  machine_info_.uses_value_ordinals = false;
+
   auto& gprs = machine_info_.register_sets[0];
   gprs.id = 0;
   std::strcpy(gprs.name, "gpr");
@@ -131,12 +145,18 @@ bool X64Backend::Initialize(Processor* processor) {
   host_to_guest_thunk_ = thunk_emitter.EmitHostToGuestThunk();
   guest_to_host_thunk_ = thunk_emitter.EmitGuestToHostThunk();
   resolve_function_thunk_ = thunk_emitter.EmitResolveFunctionThunk();
+  call_site_resolve_thunk_ = thunk_emitter.EmitCallSiteResolveThunk();
+  indirect_call_thunk_ = thunk_emitter.EmitIndirectCallThunk();
+  emitter_feature_flags_ = thunk_emitter.feature_flags();
 
   // Set the code cache to use the ResolveFunction thunk for default
   // indirections.
   assert_zero(uint64_t(resolve_function_thunk_) & 0xFFFFFFFF00000000ull);
   code_cache_->set_indirection_default(
       uint32_t(uint64_t(resolve_function_thunk_)));
+  assert_zero(uint64_t(indirect_call_thunk_) & 0xFFFFFFFF00000000ull);
+  code_cache_->set_indirect_call_thunk(
+      uint32_t(uint64_t(indirect_call_thunk_)));
 
   // Allocate some special indirections.
   code_cache_->CommitExecutableRange(0x9FFF0000, 0x9FFFFFFF);
@@ -164,6 +184,74 @@ std::unique_ptr<GuestFunction> X64Backend::CreateGuestFunction(
   return std::make_unique<X64Function>(module, address);
 }
 
+bool X64Backend::InitializeCodeStorage(
+    Module* module, const std::filesystem::path& storage_root,
+    uint64_t module_hash, uint64_t frontend_key) {
+  if (!code_storage_) {
+    // Everything baked into the emitted code that may differ between runs.
+    // Host functions are relocated when the code is restored, but offsets
+    // between functions in this binary change when it's rebuilt. The emitter
+    // data and the thunks are at fixed addresses unless those are taken.
+    struct {
+      uint32_t version;
+      uint32_t feature_flags;
+      uint64_t frontend_key;
+      int64_t host_image_layout[2];
+      uint64_t emitter_data;
+      uint64_t guest_to_host_thunk;
+      uint64_t resolve_function_thunk;
+    } codegen_key_data;
+    std::memset(&codegen_key_data, 0, sizeof(codegen_key_data));
+    codegen_key_data.version = X64CodeStorage::kVersion;
+    codegen_key_data.feature_flags = emitter_feature_flags_;
+    codegen_key_data.frontend_key = frontend_key;
+    codegen_key_data.host_image_layout[0] = X64CodeStorage::ToImageOffset(
+        reinterpret_cast<const void*>(&X64Backend::ExceptionCallbackThunk));
+    codegen_key_data.host_image_layout[1] = X64CodeStorage::ToImageOffset(
+        reinterpret_cast<const void*>(&X64Emitter::PlaceConstData));
+    codegen_key_data.emitter_data = uint64_t(emitter_data_);
+    codegen_key_data.guest_to_host_thunk =
+        uint64_t(reinterpret_cast<uintptr_t>(guest_to_host_thunk_));
+    codegen_key_data.resolve_function_thunk =
+        uint64_t(reinterpret_cast<uintptr_t>(resolve_function_thunk_));
+    code_storage_ = std::make_unique<X64CodeStorage>(
+        code_cache_.get(),
+        XXH3_64bits(&codegen_key_data, sizeof(codegen_key_data)));
+  }
+  return code_storage_->OpenModule(module, storage_root, module_hash);
+}
+
+void X64Backend::ShutdownCodeStorage(Module* module) {
+  if (code_storage_) {
+    code_storage_->CloseModule(module);
+  }
+}
+
+bool X64Backend::RestoreGuestFunction(GuestFunction* function) {
+  if (!code_storage_) {
+    return false;
+  }
+  return code_storage_->RestoreFunction(static_cast<X64Function*>(function));
+}
+
+bool X64Backend::may_free_code() const {
+  // Otherwise X64Emitter::Call embeds the address of the callee's code.
+  return code_cache_->has_indirection_table();
+}
+
+void X64Backend::ReleaseModuleCode(Module* module) {
+  if (!may_free_code()) {
+    return;
+  }
+  std::vector<GuestFunction*> functions;
+  module->ForEachFunction([&functions](Function* function) {
+    if (function->is_guest()) {
+      functions.push_back(static_cast<GuestFunction*>(function));
+    }
+  });
+  code_cache_->ReleaseGuestFunctions(functions);
+}
+
 uint64_t ReadCapstoneReg(HostThreadContext* context, x86_reg reg) {
   switch (reg) {
     case X86_REG_RAX:
@@ -286,6 +374,11 @@ uint64_t X64Backend::CalculateNextHostInstruction(ThreadDebugInfo* thread_info,
       return current_pc + insn.size;
     case X86_INS_CALL: {
       assert_true(detail.op_count == 1);
+      if (detail.operands[0].type == X86_OP_IMM) {
+        // Patched call site.
+        uint64_t target_pc = static_cast<uint64_t>(detail.operands[0].imm);
+        return target_pc;
+      }
       assert_true(detail.operands[0].type == X86_OP_REG);
       uint64_t target_pc =
           ReadCapstoneReg(&thread_info->host_context, detail.operands[0].reg);
@@ -349,6 +442,7 @@ uint64_t X64Backend::CalculateNextHostInstruction(ThreadDebugInfo* thread_info,
 }
 
 void X64Backend::InstallBreakpoint(Breakpoint* breakpoint) {
+  InvalidateCallSites();
   breakpoint->ForEachHostAddress([breakpoint](uint64_t host_address) {
     auto ptr = reinterpret_cast<void*>(host_address);
     auto original_bytes = xe::load_and_swap<uint16_t>(ptr);
@@ -361,6 +455,7 @@ void X64Backend::InstallBreakpoint(Breakpoint* breakpoint) {
 void X64Backend::InstallBreakpoint(Breakpoint* breakpoint, Function* fn) {
   assert_true(breakpoint->address_type() == Breakpoint::AddressType::kGuest);
   assert_true(fn->is_guest());
+  InvalidateCallSites();
   auto guest_function = reinterpret_cast<cpu::GuestFunction*>(fn);
   auto host_address =
       guest_function->MapGuestAddressToMachineCode(breakpoint->guest_address());
@@ -377,6 +472,13 @@ void X64Backend::InstallBreakpoint(Breakpoint* breakpoint, Function* fn) {
   breakpoint->backend_data().emplace_back(host_address, original_bytes);
 }
 
+void X64Backend::InvalidateCallSites() {
+  // Call sites patched by X64Emitter jump straight into the code of their
+  // targets. Send them back through the resolve path so that nothing keeps
+  // calling code the debugger may be replacing.
+  code_cache_->ResetCallSites();
+}
+
 void X64Backend::UninstallBreakpoint(Breakpoint* breakpoint) {
   for (auto& pair : breakpoint->backend_data()) {
     auto ptr = reinterpret_cast<uint8_t*>(pair.first);
@@ -505,10 +607,29 @@ GuestToHostThunk X64ThunkEmitter::EmitGuestToHostThunk() {
   // Save off volatile registers.
   EmitSaveVolatileRegs();
 
+  // Guest frames are below the return address into guest code until the call
+  // returns, so they can be scanned for references to retired code.
+  inc(qword[GetContextReg() + offsetof(ppc::PPCContext, host_call_count)]);
+  mov(qword[GetContextReg() +
+            offsetof(ppc::PPCContext, host_call_stack_pointer)],
+      rsp);
+
   mov(rax, rcx);              // function
   mov(rcx, GetContextReg());  // context
   call(rax);
 
+  // Back in guest code. xchg is a full barrier, so the indirection table is
+  // only read after this is visible to Processor::ReclaimRetiredCode. rax
+  // holds the result, rcx and rdx are restored below.
+#if XE_PLATFORM_LINUX
+  mov(rdx, qword[rsp + offsetof(StackLayout::Thunk, r[3])]);
+#else
+  mov(rdx, GetContextReg());
+#endif
+  inc(qword[rdx + offsetof(ppc::PPCContext, host_call_count)]);
+  xor_(ecx, ecx);
+  xchg(qword[rdx + offsetof(ppc::PPCContext, host_call_stack_pointer)], rcx);
+
   EmitLoadVolatileRegs();
 
   code_offsets.epilog = getSize();
@@ -590,6 +711,81 @@ ResolveFunctionThunk X64ThunkEmitter::EmitResolveFunctionThunk() {
   return (ResolveFunctionThunk)fn;
 }
 
+// Used by the X64ThunkEmitter's CallSiteResolveThunk.
+uint64_t ResolveCallSite(void* raw_context, uint64_t target_address,
+                         uint64_t site_end_address);
+
+ResolveFunctionThunk X64ThunkEmitter::EmitCallSiteResolveThunk() {
+  // ebx = target PPC address
+  // rax = end of the call site to patch
+  // rcx = context
+
+  struct _code_offsets {
+    size_t prolog;
+    size_t prolog_stack_alloc;
+    size_t body;
+    size_t epilog;
+    size_t tail;
+  } code_offsets = {};
+
+  const size_t stack_size = StackLayout::THUNK_STACK_SIZE;
+
+  code_offsets.prolog = getSize();
+
+  // rsp + 0 = return address
+  sub(rsp, stack_size);
+
+  code_offsets.prolog_stack_alloc = getSize();
+  code_offsets.body = getSize();
+
+  // Save volatile registers
+  EmitSaveVolatileRegs();
+
+  mov(r8, rax);
+  mov(rcx, rsi);  // context
+  mov(rdx, rbx);
+  mov(rax, reinterpret_cast<uint64_t>(&ResolveCallSite));
+  call(rax);
+
+  EmitLoadVolatileRegs();
+
+  code_offsets.epilog = getSize();
+
+  add(rsp, stack_size);
+  jmp(rax);
+
+  code_offsets.tail = getSize();
+
+  assert_zero(code_offsets.prolog);
+  EmitFunctionInfo func_info = {};
+  func_info.code_size.total = getSize();
+  func_info.code_size.prolog = code_offsets.body - code_offsets.prolog;
+  func_info.code_size.body = code_offsets.epilog - code_offsets.body;
+  func_info.code_size.epilog = code_offsets.tail - code_offsets.epilog;
+  func_info.code_size.tail = getSize() - code_offsets.tail;
+  func_info.prolog_stack_alloc_offset =
+      code_offsets.prolog_stack_alloc - code_offsets.prolog;
+  func_info.stack_size = stack_size;
+
+  void* fn = Emplace(func_info);
+  return (ResolveFunctionThunk)fn;
+}
+
+ResolveFunctionThunk X64ThunkEmitter::EmitIndirectCallThunk() {
+  // ebx = target PPC address
+  // Taken by inline cache misses once the cache has been filled.
+
+  mov(eax, dword[ebx]);
+  jmp(rax);
+
+  EmitFunctionInfo func_info = {};
+  func_info.code_size.total = getSize();
+  func_info.code_size.tail = getSize();
+
+  void* fn = Emplace(func_info);
+  return (ResolveFunctionThunk)fn;
+}
+
 void X64ThunkEmitter::EmitSaveVolatileRegs() {
   // Save off volatile registers.
   // mov(qword[rsp + offsetof(StackLayout::Thunk, r[0])], rax);
@@ -26,6 +26,7 @@ namespace backend {
 namespace x64 {
 
 class X64CodeCache;
+class X64CodeStorage;
 
 typedef void* (*HostToGuestThunk)(void* target, void* arg0, void* arg1);
 typedef void* (*GuestToHostThunk)(void* target, void* arg0, void* arg1);
@@ -39,6 +40,13 @@ class X64Backend : public Backend {
   ~X64Backend() override;
 
   X64CodeCache* code_cache() const { return code_cache_.get(); }
+  // Whether calls go through the indirection table or patched call sites, which
+  // are updated when a function gets new code, so the old code can be freed.
+  // Code of functions called directly (X64Function::is_called_directly) is
+  // kept.
+  bool may_free_code() const;
+  // Persistent code storage, if enabled for any module.
+  X64CodeStorage* code_storage() const { return code_storage_.get(); }
   uintptr_t emitter_data() const { return emitter_data_; }
 
   // Call a generated function, saving all stack parameters.
@@ -49,6 +57,11 @@ class X64Backend : public Backend {
   ResolveFunctionThunk resolve_function_thunk() const {
     return resolve_function_thunk_;
   }
+  // Function that thunks to ResolveCallSite in X64Emitter, patching the call
+  // site it was reached from.
+  ResolveFunctionThunk call_site_resolve_thunk() const {
+    return call_site_resolve_thunk_;
+  }
 
   bool Initialize(Processor* processor) override;
 
@@ -62,6 +75,14 @@ class X64Backend : public Backend {
   uint64_t CalculateNextHostInstruction(ThreadDebugInfo* thread_info,
                                         uint64_t current_pc) override;
 
+  bool InitializeCodeStorage(Module* module,
+                             const std::filesystem::path& storage_root,
+                             uint64_t module_hash,
+                             uint64_t frontend_key) override;
+  void ShutdownCodeStorage(Module* module) override;
+  bool RestoreGuestFunction(GuestFunction* function) override;
+  void ReleaseModuleCode(Module* module) override;
+
   void InstallBreakpoint(Breakpoint* breakpoint) override;
   void InstallBreakpoint(Breakpoint* breakpoint, Function* fn) override;
   void UninstallBreakpoint(Breakpoint* breakpoint) override;
@@ -70,14 +91,20 @@ class X64Backend : public Backend {
   static bool ExceptionCallbackThunk(Exception* ex, void* data);
   bool ExceptionCallback(Exception* ex);
 
+  void InvalidateCallSites();
+
   uintptr_t capstone_handle_ = 0;
 
   std::unique_ptr<X64CodeCache> code_cache_;
+  std::unique_ptr<X64CodeStorage> code_storage_;
   uintptr_t emitter_data_ = 0;
+  uint32_t emitter_feature_flags_ = 0;
 
   HostToGuestThunk host_to_guest_thunk_;
   GuestToHostThunk guest_to_host_thunk_;
   ResolveFunctionThunk resolve_function_thunk_;
+  ResolveFunctionThunk call_site_resolve_thunk_;
+  ResolveFunctionThunk indirect_call_thunk_;
 };
 
 }  // namespace x64
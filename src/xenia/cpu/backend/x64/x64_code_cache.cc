@@ -9,8 +9,11 @@
 
 #include "xenia/cpu/backend/x64/x64_code_cache.h"
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
+#include <iterator>
+#include <unordered_set>
 
 #if ENABLE_VTUNE
 #include "third_party/vtune/include/jitprofiling.h"
@@ -24,6 +27,7 @@
 #include "xenia/base/logging.h"
 #include "xenia/base/math.h"
 #include "xenia/base/memory.h"
+#include "xenia/cpu/backend/x64/x64_function.h"
 #include "xenia/cpu/function.h"
 #include "xenia/cpu/module.h"
 
@@ -37,6 +41,22 @@ using namespace xe::literals;
 X64CodeCache::X64CodeCache() = default;
 
 X64CodeCache::~X64CodeCache() {
+  if (generated_code_execute_base_) {
+    auto stats = QueryStatistics();
+    XELOGI(
+        "Code cache: {} KiB committed, {} KiB used, {} KiB free in {} ranges "
+        "(largest {} KiB), {} KiB retired, {} functions ({} KiB) reclaimed",
+        stats.committed_size / 1024, stats.used_size / 1024,
+        stats.free_size / 1024, stats.free_range_count,
+        stats.largest_free_range / 1024, stats.retired_size / 1024,
+        stats.reclaimed_function_count, stats.reclaimed_size / 1024);
+  }
+
+  for (const CodeMap* code_map : retired_code_maps_) {
+    delete code_map;
+  }
+  delete code_map_.load();
+
   if (indirection_table_base_) {
     xe::memory::DeallocFixed(indirection_table_base_, 0,
                              xe::memory::DeallocationType::kRelease);
@@ -120,9 +140,6 @@ bool X64CodeCache::Initialize() {
     }
   }
 
-  // Preallocate the function map to a large, reasonable size.
-  generated_code_map_.reserve(kMaximumFunctionCount);
-
   return true;
 }
 
@@ -136,9 +153,21 @@ void X64CodeCache::AddIndirection(uint32_t guest_address,
     return;
   }
 
+  SetIndirection(guest_address, host_address);
+}
+
+void X64CodeCache::SetIndirection(uint32_t guest_address,
+                                  uint32_t host_address) {
   uint32_t* indirection_slot = reinterpret_cast<uint32_t*>(
       indirection_table_base_ + (guest_address - kIndirectionTableBase));
   *indirection_slot = host_address;
+
+  // Move call sites patched to call the old code of a recompiled function.
+  std::lock_guard<std::mutex> lock(call_sites_mutex_);
+  auto patched_range = patched_call_sites_.equal_range(guest_address);
+  for (auto it = patched_range.first; it != patched_range.second; ++it) {
+    WriteCallSiteField(it->second, host_address - (it->second + 4));
+  }
 }
 
 void X64CodeCache::CommitExecutableRange(uint32_t guest_low,
@@ -167,16 +196,19 @@ void X64CodeCache::PlaceHostCode(uint32_t guest_address, void* machine_code,
   // Same for now. We may use different pools or whatnot later on, like when
   // we only want to place guest code in a serialized cache on disk.
   PlaceGuestCode(guest_address, machine_code, func_info, nullptr,
+                 GuestFunction::Tier::kOptimized, nullptr,
                  code_execute_address_out, code_write_address_out);
 }
 
 void X64CodeCache::PlaceGuestCode(uint32_t guest_address, void* machine_code,
                                   const EmitFunctionInfo& func_info,
                                   GuestFunction* function_info,
+                                  GuestFunction::Tier tier,
+                                  const std::vector<SourceMapEntry>* source_map,
                                   void*& code_execute_address_out,
                                   void*& code_write_address_out) {
-  // Hold a lock while we bump the pointers up. This is important as the
-  // unwind table requires entries AND code to be sorted in order.
+  // Hold a lock while we allocate. This is important as the unwind table
+  // requires entries AND code to be sorted in order.
   size_t low_mark;
   size_t high_mark;
   uint8_t* code_execute_address;
@@ -184,39 +216,37 @@ void X64CodeCache::PlaceGuestCode(uint32_t guest_address, void* machine_code,
   {
     auto global_lock = global_critical_region_.Acquire();
 
-    low_mark = generated_code_offset_;
-
-    // Reserve code.
+    // Reserve code and unwind info.
+    // We go on the high size of the unwind info as we don't know how big we
+    // need it, and a few extra bytes of padding isn't the worst thing.
     // Always move the code to land on 16b alignment.
-    code_execute_address =
-        generated_code_execute_base_ + generated_code_offset_;
+    unwind_reservation = RequestUnwindReservation();
+    size_t code_offset =
+        AllocateCode(xe::round_up(func_info.code_size.total, 16) +
+                     xe::round_up(unwind_reservation.data_size, 16));
+    low_mark = code_offset;
+    code_execute_address = generated_code_execute_base_ + code_offset;
     code_execute_address_out = code_execute_address;
-    uint8_t* code_write_address =
-        generated_code_write_base_ + generated_code_offset_;
+    uint8_t* code_write_address = generated_code_write_base_ + code_offset;
     code_write_address_out = code_write_address;
-    generated_code_offset_ += xe::round_up(func_info.code_size.total, 16);
+    code_offset += xe::round_up(func_info.code_size.total, 16);
 
-    auto tail_write_address =
-        generated_code_write_base_ + generated_code_offset_;
+    auto tail_write_address = generated_code_write_base_ + code_offset;
 
-    // Reserve unwind info.
-    // We go on the high size of the unwind info as we don't know how big we
-    // need it, and a few extra bytes of padding isn't the worst thing.
-    unwind_reservation = RequestUnwindReservation(generated_code_write_base_ +
-                                                  generated_code_offset_);
-    generated_code_offset_ += xe::round_up(unwind_reservation.data_size, 16);
+    unwind_reservation.entry_address = tail_write_address;
+    code_offset += xe::round_up(unwind_reservation.data_size, 16);
 
-    auto end_write_address =
-        generated_code_write_base_ + generated_code_offset_;
+    auto end_write_address = generated_code_write_base_ + code_offset;
 
-    high_mark = generated_code_offset_;
+    high_mark = code_offset;
 
-    // Store in map. It is maintained in sorted order of host PC dependent on
-    // us also being append-only.
-    generated_code_map_.emplace_back(
-        (uint64_t(code_execute_address - generated_code_execute_base_) << 32) |
-            generated_code_offset_,
-        function_info);
+    // Store in map, maintained in sorted order of host PC. Freed code may be
+    // reused, so new code isn't necessarily placed after everything else.
+    CodeMapEntry map_entry;
+    map_entry.start_offset = uint32_t(low_mark);
+    map_entry.end_offset = uint32_t(high_mark);
+    map_entry.function = function_info;
+    AddCodeMapEntry(map_entry);
 
     // TODO(DrChat): The following code doesn't really need to be under the
     // global lock except for PlaceCode (but it depends on the previous code
@@ -279,15 +309,443 @@ void X64CodeCache::PlaceGuestCode(uint32_t guest_address, void* machine_code,
   }
 #endif
 
-  // Now that everything is ready, fix up the indirection table.
+  OnCodePlaced(guest_address, function_info, tier, source_map,
+               code_execute_address, func_info.code_size.total);
+
+  // Now that everything is ready, fix up the indirection table for host code
+  // at guest addresses. Guest functions update it once they refer to the code.
   // Note that we do support code that doesn't have an indirection fixup, so
   // ignore those when we see them.
-  if (guest_address && indirection_table_base_) {
-    uint32_t* indirection_slot = reinterpret_cast<uint32_t*>(
-        indirection_table_base_ + (guest_address - kIndirectionTableBase));
-    *indirection_slot =
-        uint32_t(reinterpret_cast<uint64_t>(code_execute_address));
+  if (!function_info && guest_address && indirection_table_base_) {
+    SetIndirection(guest_address,
+                   uint32_t(reinterpret_cast<uint64_t>(code_execute_address)));
+  }
+}
+
+void X64CodeCache::AddCallSites(const void* code_execute_address,
+                                const std::vector<CallSite>& call_sites) {
+  uint32_t code_address =
+      uint32_t(reinterpret_cast<uintptr_t>(code_execute_address));
+  std::lock_guard<std::mutex> lock(call_sites_mutex_);
+  for (const CallSite& call_site : call_sites) {
+    CallSiteInfo& info = call_sites_[code_address + call_site.end_offset];
+    info.stub_address = code_address + call_site.stub_offset;
+    info.guest_target_address =
+        call_site.guest_target_offset
+            ? code_address + call_site.guest_target_offset
+            : 0;
+    info.hit_address =
+        call_site.hit_offset ? code_address + call_site.hit_offset : 0;
+  }
+}
+
+void X64CodeCache::PatchCallSite(uint32_t site_end_address,
+                                 uint32_t guest_address) {
+  if (!indirection_table_base_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(call_sites_mutex_);
+  auto it = call_sites_.find(site_end_address);
+  if (it == call_sites_.end()) {
+    // Called before the function's call sites were added.
+    return;
+  }
+  const CallSiteInfo& info = it->second;
+
+  // Read under the lock so that a concurrent recompilation either sees the
+  // patch or is picked up here.
+  uint32_t host_address = *reinterpret_cast<uint32_t*>(
+      indirection_table_base_ + (guest_address - kIndirectionTableBase));
+  if (host_address == indirection_default_value_) {
+    return;
+  }
+
+  // Fields are aligned so these stores are atomic, and the code executing
+  // concurrently sees either the old or the new target.
+  uint32_t rel32_address = site_end_address - 4;
+  auto read_field = [](uint32_t address) {
+    return *reinterpret_cast<volatile uint32_t*>(uintptr_t(address));
+  };
+  if (!info.guest_target_address) {
+    if (read_field(rel32_address) !=
+        info.stub_address - site_end_address) {
+      // Already patched by another thread.
+      return;
+    }
+    WriteCallSiteField(rel32_address, host_address - site_end_address);
+    patched_call_sites_.emplace(guest_address, rel32_address);
+    return;
+  }
+
+  // Inline cache miss. The first target seen is cached, the call must be
+  // patched before the guest target for hits to be valid.
+  if (read_field(info.guest_target_address) == kEmptyInlineCacheTarget) {
+    WriteCallSiteField(info.hit_address,
+                       host_address - (info.hit_address + 4));
+    WriteCallSiteField(info.guest_target_address, guest_address);
+    patched_call_sites_.emplace(guest_address, info.hit_address);
+  }
+  // Other targets go through the indirection table from now on.
+  WriteCallSiteField(rel32_address, indirect_call_thunk_ - site_end_address);
+}
+
+void X64CodeCache::ResetCallSites() {
+  std::lock_guard<std::mutex> lock(call_sites_mutex_);
+  for (auto& it : call_sites_) {
+    uint32_t site_end_address = it.first;
+    const CallSiteInfo& info = it.second;
+    if (info.guest_target_address) {
+      // The hit call is left as is, threads that have just compared may still
+      // take it, and it's rewritten before the cache is filled again.
+      WriteCallSiteField(info.guest_target_address, kEmptyInlineCacheTarget);
+    }
+    WriteCallSiteField(site_end_address - 4,
+                       info.stub_address - site_end_address);
+  }
+  patched_call_sites_.clear();
+}
+
+void X64CodeCache::RetireCode(const void* code_execute_address) {
+  uint32_t start_offset = uint32_t(
+      reinterpret_cast<const uint8_t*>(code_execute_address) -
+      generated_code_execute_base_);
+  auto global_lock = global_critical_region_.Acquire();
+  const CodeMap* code_map = code_map_.load(std::memory_order_relaxed);
+  const CodeMapEntry* map_entry =
+      code_map ? FindCodeMapEntry(*code_map, start_offset) : nullptr;
+  if (!map_entry || map_entry->start_offset != start_offset) {
+    assert_always();
+    return;
+  }
+  // The code stays in the map until it's freed, so threads still running it
+  // can be symbolized and unwound.
+  RetiredCode retired;
+  retired.start_offset = start_offset;
+  retired.end_offset = map_entry->end_offset;
+  retired.has_thread_ids = false;
+  retired_size_ += retired.end_offset - retired.start_offset;
+  retired_code_.push_back(std::move(retired));
+}
+
+void X64CodeCache::ReleaseGuestFunctions(
+    const std::vector<GuestFunction*>& functions) {
+  std::unordered_set<uint32_t> guest_addresses;
+  for (GuestFunction* function : functions) {
+    if (function->machine_code()) {
+      guest_addresses.insert(function->address());
+    }
+  }
+  if (guest_addresses.empty()) {
+    return;
+  }
+
+  if (indirection_table_base_) {
+    for (uint32_t guest_address : guest_addresses) {
+      *reinterpret_cast<uint32_t*>(indirection_table_base_ +
+                                   (guest_address - kIndirectionTableBase)) =
+          indirection_default_value_;
+    }
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(call_sites_mutex_);
+    std::unordered_set<uint32_t> patched_fields;
+    for (auto it = patched_call_sites_.begin();
+         it != patched_call_sites_.end();) {
+      if (guest_addresses.count(it->first)) {
+        patched_fields.insert(it->second);
+        it = patched_call_sites_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (!patched_fields.empty()) {
+      for (const auto& it : call_sites_) {
+        uint32_t site_end_address = it.first;
+        const CallSiteInfo& info = it.second;
+        if (patched_fields.count(site_end_address - 4)) {
+          WriteCallSiteField(site_end_address - 4,
+                             info.stub_address - site_end_address);
+        } else if (info.hit_address && patched_fields.count(info.hit_address)) {
+          // Like in ResetCallSites, the hit call is left as is.
+          WriteCallSiteField(info.guest_target_address,
+                             kEmptyInlineCacheTarget);
+        }
+      }
+    }
+  }
+
+  // Code embedded in other callers must be kept.
+  for (GuestFunction* function : functions) {
+    if (function->machine_code() &&
+        !static_cast<X64Function*>(function)->is_called_directly()) {
+      RetireCode(function->machine_code());
+    }
+  }
+}
+
+void X64CodeCache::ReclaimRetiredCode(
+    const std::vector<ThreadCodeReferences>& threads) {
+  auto global_lock = global_critical_region_.Acquire();
+  std::vector<std::pair<uint32_t, uint32_t>> freed_ranges;
+  auto retired_end = std::remove_if(
+      retired_code_.begin(), retired_code_.end(),
+      [&threads, &freed_ranges](RetiredCode& retired) {
+        // Threads created later load the current code from the indirection
+        // table.
+        if (!retired.has_thread_ids) {
+          retired.has_thread_ids = true;
+          retired.thread_ids.reserve(threads.size());
+          for (const ThreadCodeReferences& thread : threads) {
+            retired.thread_ids.push_back(thread.thread_id);
+          }
+        }
+        uint64_t start = kGeneratedCodeExecuteBase + retired.start_offset;
+        uint64_t end = kGeneratedCodeExecuteBase + retired.end_offset;
+        retired.thread_ids.erase(
+            std::remove_if(
+                retired.thread_ids.begin(), retired.thread_ids.end(),
+                [&threads, start, end](uint32_t thread_id) {
+                  auto thread = std::lower_bound(
+                      threads.cbegin(), threads.cend(), thread_id,
+                      [](const ThreadCodeReferences& thread, uint32_t id) {
+                        return thread.thread_id < id;
+                      });
+                  if (thread == threads.cend() ||
+                      thread->thread_id != thread_id) {
+                    // Exited.
+                    return true;
+                  }
+                  if (!thread->scanned) {
+                    return false;
+                  }
+                  auto pc = std::lower_bound(thread->host_pcs.cbegin(),
+                                             thread->host_pcs.cend(), start);
+                  return pc == thread->host_pcs.cend() || *pc >= end;
+                }),
+            retired.thread_ids.end());
+        if (!retired.thread_ids.empty()) {
+          return false;
+        }
+        freed_ranges.emplace_back(retired.start_offset, retired.end_offset);
+        return true;
+      });
+  retired_code_.erase(retired_end, retired_code_.end());
+  if (freed_ranges.empty()) {
+    return;
+  }
+  std::sort(freed_ranges.begin(), freed_ranges.end());
+  FreeCode(freed_ranges);
+}
+
+void X64CodeCache::FreeCode(
+    const std::vector<std::pair<uint32_t, uint32_t>>& ranges) {
+  size_t freed_size = 0;
+  for (const auto& range : ranges) {
+    freed_size += range.second - range.first;
+  }
+  retired_size_ -= freed_size;
+  reclaimed_function_count_ += ranges.size();
+  reclaimed_size_ += freed_size;
+
+  auto range_containing = [&ranges](uint32_t offset) {
+    auto it = std::upper_bound(
+        ranges.cbegin(), ranges.cend(), offset,
+        [](uint32_t value, const std::pair<uint32_t, uint32_t>& range) {
+          return value < range.first;
+        });
+    return it != ranges.cbegin() && offset < (--it)->second;
+  };
+  const CodeMap* code_map = code_map_.load(std::memory_order_relaxed);
+  if (code_map) {
+    auto base = std::make_shared<std::vector<CodeMapEntry>>();
+    auto keep_entry = [&range_containing](const CodeMapEntry& entry) {
+      return !range_containing(entry.start_offset);
+    };
+    if (code_map->base) {
+      std::copy_if(code_map->base->cbegin(), code_map->base->cend(),
+                   std::back_inserter(*base), keep_entry);
+    }
+    size_t base_size = base->size();
+    std::copy_if(code_map->recent.cbegin(), code_map->recent.cend(),
+                 std::back_inserter(*base), keep_entry);
+    std::inplace_merge(base->begin(), base->begin() + base_size, base->end(),
+                       [](const CodeMapEntry& a, const CodeMapEntry& b) {
+                         return a.start_offset < b.start_offset;
+                       });
+    auto new_code_map = new CodeMap;
+    new_code_map->base = std::move(base);
+    PublishCodeMap(new_code_map);
+  }
+
+  // Nothing may be patched in the memory once it's reused.
+  {
+    uint32_t execute_base = uint32_t(kGeneratedCodeExecuteBase);
+    std::lock_guard<std::mutex> lock(call_sites_mutex_);
+    for (auto it = call_sites_.begin(); it != call_sites_.end();) {
+      if (range_containing(it->first - execute_base)) {
+        it = call_sites_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    for (auto it = patched_call_sites_.begin();
+         it != patched_call_sites_.end();) {
+      if (range_containing(it->second - execute_base)) {
+        it = patched_call_sites_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  for (const auto& range : ranges) {
+    std::memset(generated_code_write_base_ + range.first, 0xCC,
+                range.second - range.first);
+
+    // Coalesce with the adjacent free ranges.
+    size_t offset = range.first;
+    size_t size = range.second - range.first;
+    auto next = free_ranges_.lower_bound(offset);
+    if (next != free_ranges_.begin()) {
+      auto previous = std::prev(next);
+      if (previous->first + previous->second == offset) {
+        offset = previous->first;
+        size += previous->second;
+        EraseFreeRange(previous);
+      }
+    }
+    if (next != free_ranges_.end() && offset + size == next->first) {
+      size += next->second;
+      EraseFreeRange(next);
+    }
+    if (offset + size == generated_code_offset_) {
+      generated_code_offset_ = offset;
+    } else {
+      free_ranges_.emplace(offset, size);
+      free_ranges_by_size_.emplace(size, offset);
+      free_size_ += size;
+    }
+  }
+}
+
+const X64CodeCache::CodeMapEntry* X64CodeCache::FindCodeMapEntry(
+    const std::vector<CodeMapEntry>& entries, uint32_t offset) {
+  auto it = std::upper_bound(entries.cbegin(), entries.cend(), offset,
+                             [](uint32_t value, const CodeMapEntry& entry) {
+                               return value < entry.start_offset;
+                             });
+  if (it == entries.cbegin() || offset >= (--it)->end_offset) {
+    return nullptr;
+  }
+  return &*it;
+}
+
+const X64CodeCache::CodeMapEntry* X64CodeCache::FindCodeMapEntry(
+    const CodeMap& code_map, uint32_t offset) {
+  const CodeMapEntry* entry = FindCodeMapEntry(code_map.recent, offset);
+  if (!entry && code_map.base) {
+    entry = FindCodeMapEntry(*code_map.base, offset);
+  }
+  return entry;
+}
+
+void X64CodeCache::AddCodeMapEntry(const CodeMapEntry& entry) {
+  const CodeMap* code_map = code_map_.load(std::memory_order_relaxed);
+  auto new_code_map = code_map ? new CodeMap(*code_map) : new CodeMap;
+  auto by_start_offset = [](const CodeMapEntry& a, const CodeMapEntry& b) {
+    return a.start_offset < b.start_offset;
+  };
+  std::vector<CodeMapEntry>& recent = new_code_map->recent;
+  recent.insert(std::upper_bound(recent.cbegin(), recent.cend(), entry,
+                                 by_start_offset),
+                entry);
+  if (recent.size() > kCodeMapMaxRecentEntries) {
+    auto base = std::make_shared<std::vector<CodeMapEntry>>();
+    size_t base_size =
+        new_code_map->base ? new_code_map->base->size() : size_t(0);
+    base->reserve(base_size + recent.size());
+    if (new_code_map->base) {
+      std::merge(new_code_map->base->cbegin(), new_code_map->base->cend(),
+                 recent.cbegin(), recent.cend(), std::back_inserter(*base),
+                 by_start_offset);
+    } else {
+      base->assign(recent.cbegin(), recent.cend());
+    }
+    new_code_map->base = std::move(base);
+    recent.clear();
+  }
+  PublishCodeMap(new_code_map);
+}
+
+void X64CodeCache::PublishCodeMap(const CodeMap* code_map) {
+  retired_code_maps_.push_back(code_map_.exchange(code_map));
+  // A lookup that starts after this sees no readers can only load the new map.
+  if (!code_map_readers_.load()) {
+    for (const CodeMap* retired_code_map : retired_code_maps_) {
+      delete retired_code_map;
+    }
+    retired_code_maps_.clear();
+  }
+}
+
+void X64CodeCache::EraseFreeRange(std::map<size_t, size_t>::iterator it) {
+  auto by_size = free_ranges_by_size_.equal_range(it->second);
+  for (auto by_size_it = by_size.first; by_size_it != by_size.second;
+       ++by_size_it) {
+    if (by_size_it->second == it->first) {
+      free_ranges_by_size_.erase(by_size_it);
+      break;
+    }
   }
+  free_size_ -= it->second;
+  free_ranges_.erase(it);
+}
+
+size_t X64CodeCache::AllocateCode(size_t size) {
+  // Best fit, to keep large ranges for large functions.
+  auto by_size = free_ranges_by_size_.lower_bound(size);
+  if (by_size == free_ranges_by_size_.end()) {
+    size_t offset = generated_code_offset_;
+    generated_code_offset_ += size;
+    return offset;
+  }
+  auto it = free_ranges_.find(by_size->second);
+  size_t offset = it->first;
+  size_t remaining_size = it->second - size;
+  EraseFreeRange(it);
+  if (remaining_size) {
+    free_ranges_.emplace(offset + size, remaining_size);
+    free_ranges_by_size_.emplace(remaining_size, offset + size);
+    free_size_ += remaining_size;
+  }
+  return offset;
+}
+
+X64CodeCache::Statistics X64CodeCache::QueryStatistics() {
+  auto global_lock = global_critical_region_.Acquire();
+  Statistics stats;
+  stats.committed_size = generated_code_commit_mark_;
+  stats.used_size = generated_code_offset_ - free_size_;
+  stats.free_size = free_size_;
+  stats.free_range_count = free_ranges_.size();
+  stats.largest_free_range = free_ranges_by_size_.empty()
+                                 ? 0
+                                 : free_ranges_by_size_.crbegin()->first;
+  stats.retired_size = retired_size_;
+  stats.reclaimed_function_count = reclaimed_function_count_;
+  stats.reclaimed_size = reclaimed_size_;
+  return stats;
+}
+
+void X64CodeCache::WriteCallSiteField(uint32_t execute_address,
+                                      uint32_t value) {
+  assert_zero(execute_address & 3);
+  auto field = reinterpret_cast<volatile uint32_t*>(
+      generated_code_write_base_ +
+      (uintptr_t(execute_address) -
+       reinterpret_cast<uintptr_t>(generated_code_execute_base_)));
+  *field = value;
 }
 
 uint32_t X64CodeCache::PlaceData(const void* data, size_t length) {
@@ -335,31 +793,23 @@ uint32_t X64CodeCache::PlaceData(const void* data, size_t length) {
   return uint32_t(uintptr_t(data_address));
 }
 
-GuestFunction* X64CodeCache::LookupFunction(uint64_t host_pc) {
+bool X64CodeCache::LookupCodeMapEntry(uint64_t host_pc,
+                                      CodeMapEntry& entry_out) {
   uint32_t key = uint32_t(host_pc - kGeneratedCodeExecuteBase);
-  void* fn_entry = std::bsearch(
-      &key, generated_code_map_.data(), generated_code_map_.size() + 1,
-      sizeof(std::pair<uint32_t, Function*>),
-      [](const void* key_ptr, const void* element_ptr) {
-        auto key = *reinterpret_cast<const uint32_t*>(key_ptr);
-        auto element =
-            reinterpret_cast<const std::pair<uint64_t, GuestFunction*>*>(
-                element_ptr);
-        if (key < (element->first >> 32)) {
-          return -1;
-        } else if (key > uint32_t(element->first)) {
-          return 1;
-        } else {
-          return 0;
-        }
-      });
-  if (fn_entry) {
-    return reinterpret_cast<const std::pair<uint64_t, GuestFunction*>*>(
-               fn_entry)
-        ->second;
-  } else {
-    return nullptr;
+  code_map_readers_.fetch_add(1);
+  const CodeMap* code_map = code_map_.load();
+  const CodeMapEntry* entry =
+      code_map ? FindCodeMapEntry(*code_map, key) : nullptr;
+  if (entry) {
+    entry_out = *entry;
   }
+  code_map_readers_.fetch_sub(1);
+  return entry != nullptr;
+}
+
+GuestFunction* X64CodeCache::LookupFunction(uint64_t host_pc) {
+  CodeMapEntry entry;
+  return LookupCodeMapEntry(host_pc, entry) ? entry.function : nullptr;
 }
 
 }  // namespace x64
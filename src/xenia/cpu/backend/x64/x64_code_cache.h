@@ -13,8 +13,11 @@
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -41,6 +44,24 @@ struct EmitFunctionInfo {
 
 class X64CodeCache : public CodeCache {
  public:
+  struct Statistics {
+    // Bytes of generated code memory committed.
+    size_t committed_size;
+    // Bytes of code, unwind info and data placed and not freed, including
+    // retired code.
+    size_t used_size;
+    // Bytes of freed code below the end of the used memory, reused by new code
+    // before the used memory is extended.
+    size_t free_size;
+    size_t free_range_count;
+    size_t largest_free_range;
+    // Bytes of code replaced by retranslation or of unloaded modules waiting
+    // until no thread is running it to be freed.
+    size_t retired_size;
+    uint64_t reclaimed_function_count;
+    uint64_t reclaimed_size;
+  };
+
   ~X64CodeCache() override;
 
   static std::unique_ptr<X64CodeCache> Create();
@@ -67,13 +88,61 @@ class X64CodeCache : public CodeCache {
                      const EmitFunctionInfo& func_info,
                      void*& code_execute_address_out,
                      void*& code_write_address_out);
+  // Places the code of a translation of the guest function for the tier, with
+  // an optional source map for profilers. The indirection table entry of the
+  // function isn't changed, the caller must publish the code as the current
+  // version of the function first.
   void PlaceGuestCode(uint32_t guest_address, void* machine_code,
                       const EmitFunctionInfo& func_info,
-                      GuestFunction* function_info,
+                      GuestFunction* function_info, GuestFunction::Tier tier,
+                      const std::vector<SourceMapEntry>* source_map,
                       void*& code_execute_address_out,
                       void*& code_write_address_out);
   uint32_t PlaceData(const void* data, size_t length);
 
+  // A guest call site emitted by X64Emitter to be patched into a direct call
+  // once its target is compiled. Offsets are from the start of the function.
+  struct CallSite {
+    // End of the patchable call or jump, with its rel32 right before it. This
+    // identifies the site for the call site resolve thunk.
+    uint32_t end_offset;
+    // Local stub unpatched sites call, going to the call site resolve thunk.
+    uint32_t stub_offset;
+    // For inline caches of indirect calls, the guest target imm32 compared
+    // against and the rel32 of the call or jump taken if it matches, 0 for
+    // direct calls.
+    uint32_t guest_target_offset;
+    uint32_t hit_offset;
+  };
+  // Inline cache guest target value that never matches (misaligned).
+  static const uint32_t kEmptyInlineCacheTarget = 0xFFFFFFFF;
+
+  void set_indirect_call_thunk(uint32_t indirect_call_thunk) {
+    indirect_call_thunk_ = indirect_call_thunk;
+  }
+  void AddCallSites(const void* code_execute_address,
+                    const std::vector<CallSite>& call_sites);
+  // Points the call site ending at the execute address directly to the current
+  // code of the guest function, if the site is known and not patched yet.
+  void PatchCallSite(uint32_t site_end_address, uint32_t guest_address);
+  // Returns all call sites to their unpatched state.
+  void ResetCallSites();
+
+  // Marks code that is no longer the current code of its function, to be
+  // freed by ReclaimRetiredCode once no thread can be running it. Callers must
+  // reach the functions only through the indirection table or patched call
+  // sites, which are updated when the function gets new code.
+  void RetireCode(const void* code_execute_address);
+  // Sends calls to the functions of an unloaded module back to the resolve
+  // thunk and retires their code.
+  void ReleaseGuestFunctions(const std::vector<GuestFunction*>& functions);
+
+  bool has_retired_code() const override { return retired_size_ != 0; }
+  void ReclaimRetiredCode(
+      const std::vector<ThreadCodeReferences>& threads) override;
+
+  Statistics QueryStatistics();
+
   GuestFunction* LookupFunction(uint64_t host_pc) override;
 
  protected:
@@ -90,26 +159,63 @@ class X64CodeCache : public CodeCache {
   static const uintptr_t kGeneratedCodeWriteBase =
       kGeneratedCodeExecuteBase + kGeneratedCodeSize + 1;
 
-  // This is picked to be high enough to cover whatever we can reasonably
-  // expect. If we hit issues with this it probably means some corner case
-  // in analysis triggering.
-  static const size_t kMaximumFunctionCount = 100000;
-
   struct UnwindReservation {
     size_t data_size = 0;
-    size_t table_slot = 0;
     uint8_t* entry_address = 0;
   };
 
   X64CodeCache();
 
-  virtual UnwindReservation RequestUnwindReservation(uint8_t* entry_address) {
+  // Returns the size of the unwind info to place after the code, the entry
+  // address is set once the code is placed.
+  virtual UnwindReservation RequestUnwindReservation() {
     return UnwindReservation();
   }
   virtual void PlaceCode(uint32_t guest_address, void* machine_code,
                          const EmitFunctionInfo& func_info,
                          void* code_execute_address,
                          UnwindReservation unwind_reservation) {}
+  // Called once placed code is ready to be executed, outside the global
+  // critical region, so external profilers can symbolize it. function_info
+  // and source_map are null for host code.
+  virtual void OnCodePlaced(uint32_t guest_address,
+                            GuestFunction* function_info,
+                            GuestFunction::Tier tier,
+                            const std::vector<SourceMapEntry>* source_map,
+                            const void* code_execute_address,
+                            size_t code_size) {}
+  // Snapshot of the placed code, sorted by offset. LookupFunction and unwind
+  // info lookups may be called from exception handlers and profilers
+  // interrupting or suspending a thread that holds the global critical region,
+  // so they read the current snapshot without locking, and writers replace it
+  // as a whole. New entries are only copied
+  // with the recent ones, which are merged into a new shared base once there
+  // are many of them.
+  struct CodeMapEntry {
+    uint32_t start_offset;
+    uint32_t end_offset;
+    GuestFunction* function;
+  };
+  struct CodeMap {
+    std::shared_ptr<const std::vector<CodeMapEntry>> base;
+    std::vector<CodeMapEntry> recent;
+  };
+  static const size_t kCodeMapMaxRecentEntries = 512;
+  static const CodeMapEntry* FindCodeMapEntry(
+      const std::vector<CodeMapEntry>& entries, uint32_t offset);
+  static const CodeMapEntry* FindCodeMapEntry(const CodeMap& code_map,
+                                              uint32_t offset);
+  // Finds the placed code containing the host PC without locking.
+  bool LookupCodeMapEntry(uint64_t host_pc, CodeMapEntry& entry_out);
+
+  // The global critical region must be held.
+  void AddCodeMapEntry(const CodeMapEntry& entry);
+  void PublishCodeMap(const CodeMap* code_map);
+  size_t AllocateCode(size_t size);
+  void FreeCode(const std::vector<std::pair<uint32_t, uint32_t>>& ranges);
+  void EraseFreeRange(std::map<size_t, size_t>::iterator it);
+  void SetIndirection(uint32_t guest_address, uint32_t host_address);
+  void WriteCallSiteField(uint32_t execute_address, uint32_t value);
 
   std::filesystem::path file_name_;
   xe::memory::FileMappingHandle mapping_ =
@@ -135,12 +241,47 @@ class X64CodeCache : public CodeCache {
   uint8_t* generated_code_write_base_ = nullptr;
   // Current offset to empty space in generated code.
   size_t generated_code_offset_ = 0;
+  // Freed ranges below generated_code_offset_, coalesced, by offset and by
+  // size for best fit allocation.
+  std::map<size_t, size_t> free_ranges_;
+  std::multimap<size_t, size_t> free_ranges_by_size_;
+  size_t free_size_ = 0;
   // Current high water mark of COMMITTED code.
   std::atomic<size_t> generated_code_commit_mark_ = {0};
-  // Sorted map by host PC base offsets to source function info.
-  // This can be used to bsearch on host PC to find the guest function.
-  // The key is [start address | end address].
-  std::vector<std::pair<uint64_t, GuestFunction*>> generated_code_map_;
+  // Current snapshot of the placed code, to bsearch on host PC to find the
+  // guest function.
+  std::atomic<const CodeMap*> code_map_ = {nullptr};
+  // LookupFunction calls that may be reading any snapshot. Replaced snapshots
+  // are deleted once none are seen after a new one is published.
+  std::atomic<uint32_t> code_map_readers_ = {0};
+  std::vector<const CodeMap*> retired_code_maps_;
+
+  struct RetiredCode {
+    uint32_t start_offset;
+    uint32_t end_offset;
+    // Sorted IDs of the threads that may still be running the code, taken on
+    // the first ReclaimRetiredCode after the code was retired.
+    bool has_thread_ids;
+    std::vector<uint32_t> thread_ids;
+  };
+  std::vector<RetiredCode> retired_code_;
+  std::atomic<size_t> retired_size_ = {0};
+  uint64_t reclaimed_function_count_ = 0;
+  uint64_t reclaimed_size_ = 0;
+
+  // Execute address of the call site, as taken by PatchCallSite, and its
+  // fields.
+  struct CallSiteInfo {
+    uint32_t stub_address;
+    uint32_t guest_target_address;
+    uint32_t hit_address;
+  };
+  std::mutex call_sites_mutex_;
+  std::unordered_map<uint32_t, CallSiteInfo> call_sites_;
+  // rel32 fields of call sites patched to call guest functions directly, by
+  // guest address, to be updated when the function is recompiled.
+  std::unordered_multimap<uint32_t, uint32_t> patched_call_sites_;
+  uint32_t indirect_call_thunk_ = 0;
 };
 
 }  // namespace x64
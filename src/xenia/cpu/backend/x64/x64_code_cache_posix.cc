@@ -9,6 +9,33 @@
 
 #include "xenia/cpu/backend/x64/x64_code_cache.h"
 
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "third_party/fmt/include/fmt/format.h"
+#include "xenia/base/cvar.h"
+#include "xenia/base/filesystem.h"
+#include "xenia/base/logging.h"
+#include "xenia/cpu/function.h"
+
+DEFINE_bool(perf_map, false,
+            "Write /tmp/perf-<pid>.map with the symbols of generated code, for "
+            "Linux perf to attribute samples to guest functions.",
+            "CPU");
+DEFINE_path(perf_jitdump_path, "",
+            "Directory to write jit-<pid>.dump to, with the symbols, code and "
+            "guest source lines of generated code, for perf inject --jit. "
+            "Requires perf record -k mono.",
+            "CPU");
+
 namespace xe {
 namespace cpu {
 namespace backend {
@@ -25,7 +52,7 @@ class PosixX64CodeCache : public X64CodeCache {
 
  private:
   /*
-  UnwindReservation RequestUnwindReservation(uint8_t* entry_address) override;
+  UnwindReservation RequestUnwindReservation() override;
   void PlaceCode(uint32_t guest_address, void* machine_code, size_t code_size,
                  size_t stack_size, void* code_execute_address,
                  UnwindReservation unwind_reservation) override;
@@ -34,6 +61,73 @@ class PosixX64CodeCache : public X64CodeCache {
                              size_t unwind_table_slot, void* code_address,
                              size_t code_size, size_t stack_size);
   */
+
+  void OnCodePlaced(uint32_t guest_address, GuestFunction* function_info,
+                    GuestFunction::Tier tier,
+                    const std::vector<SourceMapEntry>* source_map,
+                    const void* code_execute_address,
+                    size_t code_size) override;
+
+  bool OpenJitDump();
+  void WriteJitDumpRecords(const std::string& name,
+                           const std::vector<SourceMapEntry>* source_map,
+                           const void* code_execute_address, size_t code_size);
+
+  // https://github.com/torvalds/linux/blob/master/tools/perf/Documentation/jitdump-specification.txt
+  struct JitDumpHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t total_size;
+    uint32_t elf_mach;
+    uint32_t pad1;
+    uint32_t pid;
+    uint64_t timestamp;
+    uint64_t flags;
+  };
+  enum JitDumpRecordType : uint32_t {
+    kJitCodeLoad = 0,
+    kJitCodeDebugInfo = 2,
+  };
+  struct JitDumpRecordHeader {
+    uint32_t id;
+    uint32_t total_size;
+    uint64_t timestamp;
+  };
+  struct JitDumpCodeLoad {
+    JitDumpRecordHeader header;
+    uint32_t pid;
+    uint32_t tid;
+    uint64_t vma;
+    uint64_t code_addr;
+    uint64_t code_size;
+    uint64_t code_index;
+    // Followed by the null-terminated name and the code.
+  };
+  struct JitDumpDebugInfo {
+    JitDumpRecordHeader header;
+    uint64_t code_addr;
+    uint64_t nr_entry;
+    // Followed by the entries.
+  };
+  struct JitDumpDebugEntry {
+    uint64_t code_addr;
+    int32_t line;
+    int32_t discrim;
+    // Followed by the null-terminated file name.
+  };
+
+  static uint64_t JitDumpTimestamp();
+
+  // Entries are appended as code is placed. Code is never moved, entries of
+  // recompiled functions stay valid for their old code until it's freed, and
+  // code later placed in the freed memory gets newer entries at the same
+  // address.
+  std::mutex profiler_mutex_;
+  FILE* perf_map_file_ = nullptr;
+  FILE* jitdump_file_ = nullptr;
+  // perf finds the dump by the executable mapping of it.
+  void* jitdump_marker_ = nullptr;
+  uint64_t jitdump_code_index_ = 0;
 };
 
 std::unique_ptr<X64CodeCache> X64CodeCache::Create() {
@@ -41,11 +135,163 @@ std::unique_ptr<X64CodeCache> X64CodeCache::Create() {
 }
 
 PosixX64CodeCache::PosixX64CodeCache() = default;
-PosixX64CodeCache::~PosixX64CodeCache() = default;
 
-bool PosixX64CodeCache::Initialize() { return X64CodeCache::Initialize(); }
+PosixX64CodeCache::~PosixX64CodeCache() {
+  if (perf_map_file_) {
+    fclose(perf_map_file_);
+  }
+  if (jitdump_marker_) {
+    munmap(jitdump_marker_, sysconf(_SC_PAGESIZE));
+  }
+  if (jitdump_file_) {
+    fclose(jitdump_file_);
+  }
+}
+
+bool PosixX64CodeCache::Initialize() {
+  if (!X64CodeCache::Initialize()) {
+    return false;
+  }
+
+  // Truncate files left by an earlier process with the same ID.
+  if (cvars::perf_map) {
+    auto perf_map_path = fmt::format("/tmp/perf-{}.map", getpid());
+    perf_map_file_ = xe::filesystem::OpenFile(perf_map_path, "w");
+    if (!perf_map_file_) {
+      XELOGE("Unable to create {}", perf_map_path);
+    }
+  }
+  if (!cvars::perf_jitdump_path.empty() && !OpenJitDump()) {
+    XELOGE("Unable to create a jitdump file in {}",
+           xe::path_to_utf8(cvars::perf_jitdump_path));
+  }
+
+  return true;
+}
+
+bool PosixX64CodeCache::OpenJitDump() {
+  auto jitdump_path = cvars::perf_jitdump_path /
+                      fmt::format("jit-{}.dump", getpid());
+  jitdump_file_ = xe::filesystem::OpenFile(jitdump_path, "w+b");
+  if (!jitdump_file_) {
+    return false;
+  }
+  jitdump_marker_ = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+                         MAP_PRIVATE, fileno(jitdump_file_), 0);
+  if (jitdump_marker_ == MAP_FAILED) {
+    jitdump_marker_ = nullptr;
+    fclose(jitdump_file_);
+    jitdump_file_ = nullptr;
+    return false;
+  }
+
+  JitDumpHeader header = {};
+  header.magic = 0x4A695444;
+  header.version = 1;
+  header.total_size = sizeof(header);
+  header.elf_mach = EM_X86_64;
+  header.pid = uint32_t(getpid());
+  header.timestamp = JitDumpTimestamp();
+  fwrite(&header, sizeof(header), 1, jitdump_file_);
+  fflush(jitdump_file_);
+  return true;
+}
+
+uint64_t PosixX64CodeCache::JitDumpTimestamp() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec);
+}
+
+void PosixX64CodeCache::OnCodePlaced(
+    uint32_t guest_address, GuestFunction* function_info,
+    GuestFunction::Tier tier, const std::vector<SourceMapEntry>* source_map,
+    const void* code_execute_address, size_t code_size) {
+  if (!perf_map_file_ && !jitdump_file_) {
+    return;
+  }
+
+  std::string name;
+  if (function_info) {
+    if (!function_info->name().empty()) {
+      name = function_info->name();
+    } else {
+      name = fmt::format("sub_{:08X}", guest_address);
+    }
+    switch (tier) {
+      case GuestFunction::Tier::kBaseline:
+        name += " [baseline]";
+        break;
+      case GuestFunction::Tier::kInterpreted:
+        name += " [interpreted]";
+        break;
+      default:
+        break;
+    }
+  } else {
+    name = "xenia_host_code";
+  }
+
+  std::lock_guard<std::mutex> lock(profiler_mutex_);
+  if (perf_map_file_) {
+    fmt::print(perf_map_file_, "{:x} {:x} {}\n",
+               reinterpret_cast<uintptr_t>(code_execute_address), code_size,
+               name);
+    fflush(perf_map_file_);
+  }
+  if (jitdump_file_) {
+    WriteJitDumpRecords(name, source_map, code_execute_address, code_size);
+  }
+}
+
+void PosixX64CodeCache::WriteJitDumpRecords(
+    const std::string& name, const std::vector<SourceMapEntry>* source_map,
+    const void* code_execute_address, size_t code_size) {
+  uint64_t code_address = reinterpret_cast<uintptr_t>(code_execute_address);
+  uint64_t timestamp = JitDumpTimestamp();
+
+  // Debug info must precede the code it describes. The guest address of each
+  // instruction is reported as the file name, as inlined code may come from
+  // other functions.
+  if (source_map && !source_map->empty()) {
+    JitDumpDebugInfo debug_info = {};
+    debug_info.header.id = kJitCodeDebugInfo;
+    // 8 hex digits and the terminator.
+    debug_info.header.total_size =
+        uint32_t(sizeof(debug_info) +
+                 (sizeof(JitDumpDebugEntry) + 9) * source_map->size());
+    debug_info.header.timestamp = timestamp;
+    debug_info.code_addr = code_address;
+    debug_info.nr_entry = source_map->size();
+    fwrite(&debug_info, sizeof(debug_info), 1, jitdump_file_);
+    for (const SourceMapEntry& source_map_entry : *source_map) {
+      JitDumpDebugEntry entry = {};
+      entry.code_addr = code_address + source_map_entry.code_offset;
+      entry.line = 1;
+      fwrite(&entry, sizeof(entry), 1, jitdump_file_);
+      auto file_name = fmt::format("{:08X}", source_map_entry.guest_address);
+      fwrite(file_name.c_str(), file_name.size() + 1, 1, jitdump_file_);
+    }
+  }
+
+  JitDumpCodeLoad code_load = {};
+  code_load.header.id = kJitCodeLoad;
+  code_load.header.total_size =
+      uint32_t(sizeof(code_load) + name.size() + 1 + code_size);
+  code_load.header.timestamp = timestamp;
+  code_load.pid = uint32_t(getpid());
+  code_load.tid = uint32_t(syscall(SYS_gettid));
+  code_load.vma = code_address;
+  code_load.code_addr = code_address;
+  code_load.code_size = code_size;
+  code_load.code_index = jitdump_code_index_++;
+  fwrite(&code_load, sizeof(code_load), 1, jitdump_file_);
+  fwrite(name.c_str(), name.size() + 1, 1, jitdump_file_);
+  fwrite(code_execute_address, code_size, 1, jitdump_file_);
+  fflush(jitdump_file_);
+}
 
 }  // namespace x64
 }  // namespace backend
 }  // namespace cpu
-}  // namespace xe
\ No newline at end of file
+}  // namespace xe
@@ -0,0 +1,370 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/backend/x64/x64_code_storage.h"
+
+#include <cstring>
+
+#include "third_party/fmt/include/fmt/format.h"
+#include "xenia/base/assert.h"
+#include "xenia/base/filesystem.h"
+#include "xenia/base/logging.h"
+#include "xenia/base/xxhash.h"
+#include "xenia/cpu/backend/x64/x64_function.h"
+#include "xenia/cpu/module.h"
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace x64 {
+
+// 'XJIT'.
+static const uint32_t kStorageMagic = 0x54494A58;
+// Of the machine code and the tables of a function, far more than any emitted
+// function, to reject corrupted records before allocating them.
+static const uint64_t kMaxRecordDataSize = 64 * 1024 * 1024;
+
+struct StorageFileHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t codegen_key;
+  uint64_t module_hash;
+};
+
+struct StorageRecordHeader {
+  uint32_t address;
+  uint32_t end_address;
+  uint64_t guest_code_hash;
+  // Hash of the machine code and the source map, for integrity checking.
+  uint64_t record_hash;
+  uint32_t machine_code_size;
+  uint32_t source_map_count;
+  uint32_t host_relocation_count;
+  uint32_t code_size_prolog;
+  uint32_t code_size_body;
+  uint32_t code_size_epilog;
+  uint32_t code_size_tail;
+  uint32_t prolog_stack_alloc_offset;
+  uint32_t stack_size;
+};
+static_assert_size(SourceMapEntry, 12);
+static_assert_size(X64CodeStorage::HostRelocation, 16);
+
+int64_t X64CodeStorage::ToImageOffset(const void* host_address) {
+  return int64_t(reinterpret_cast<uintptr_t>(host_address) -
+                 reinterpret_cast<uintptr_t>(&X64CodeStorage::ToImageOffset));
+}
+
+uint64_t X64CodeStorage::FromImageOffset(int64_t image_offset) {
+  return uint64_t(reinterpret_cast<uintptr_t>(&X64CodeStorage::ToImageOffset) +
+                  image_offset);
+}
+
+X64CodeStorage::X64CodeStorage(X64CodeCache* code_cache, uint64_t codegen_key)
+    : code_cache_(code_cache), codegen_key_(codegen_key) {}
+
+X64CodeStorage::~X64CodeStorage() {
+  CloseAllModules();
+
+  auto stats = QueryStatistics();
+  XELOGI(
+      "Code storage: {} hits, {} misses, {} invalidations, {} functions "
+      "stored",
+      stats.hits, stats.misses, stats.invalidations, stats.stores);
+}
+
+bool X64CodeStorage::OpenModule(Module* module,
+                                const std::filesystem::path& storage_root,
+                                uint64_t module_hash) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (modules_.count(module)) {
+    return true;
+  }
+
+  if (!std::filesystem::exists(storage_root)) {
+    if (!std::filesystem::create_directories(storage_root)) {
+      XELOGE(
+          "Failed to create the code storage directory, persistent code "
+          "storage will be disabled: {}",
+          xe::path_to_utf8(storage_root));
+      return false;
+    }
+  }
+
+  auto file_path = storage_root / fmt::format("{:016X}.x64.xjit", module_hash);
+  // Records are read from the start before appending.
+  FILE* file = xe::filesystem::OpenFile(file_path, "r+b");
+  if (!file && !std::filesystem::exists(file_path)) {
+    file = xe::filesystem::OpenFile(file_path, "w+b");
+  }
+  if (!file) {
+    XELOGE(
+        "Failed to open the code storage file for writing, persistent code "
+        "storage will be disabled: {}",
+        xe::path_to_utf8(file_path));
+    return false;
+  }
+
+  ModuleStorage storage;
+  storage.file = file;
+
+  StorageFileHeader header;
+  if (fread(&header, sizeof(header), 1, file) &&
+      header.magic == kStorageMagic && header.version == kVersion &&
+      header.codegen_key == codegen_key_ && header.module_hash == module_hash) {
+    ReadRecords(file, storage);
+    xe::filesystem::Seek(file, 0, SEEK_END);
+  } else {
+    xe::filesystem::Seek(file, 0, SEEK_END);
+    if (xe::filesystem::Tell(file) > 0) {
+      // Written by a different build or with different settings.
+      XELOGI("Discarding stale code storage for module {}", module->name());
+      ++invalidations_;
+    }
+    xe::filesystem::TruncateStdioFile(file, 0);
+    header.magic = kStorageMagic;
+    header.version = kVersion;
+    header.codegen_key = codegen_key_;
+    header.module_hash = module_hash;
+    fwrite(&header, sizeof(header), 1, file);
+  }
+
+  XELOGI("Loaded {} stored functions for module {} from {}",
+         storage.functions.size(), module->name(), xe::path_to_utf8(file_path));
+  modules_.emplace(module, std::move(storage));
+  return true;
+}
+
+bool X64CodeStorage::ReadRecords(FILE* file, ModuleStorage& storage) {
+  uint64_t valid_bytes = sizeof(StorageFileHeader);
+  if (!xe::filesystem::Seek(file, 0, SEEK_END)) {
+    return false;
+  }
+  int64_t file_size = xe::filesystem::Tell(file);
+  if (file_size < int64_t(valid_bytes) ||
+      !xe::filesystem::Seek(file, int64_t(valid_bytes), SEEK_SET)) {
+    return false;
+  }
+  while (true) {
+    StorageRecordHeader record;
+    if (!fread(&record, sizeof(record), 1, file)) {
+      break;
+    }
+    uint64_t record_data_size =
+        uint64_t(record.machine_code_size) +
+        uint64_t(record.source_map_count) * sizeof(SourceMapEntry) +
+        uint64_t(record.host_relocation_count) * sizeof(HostRelocation);
+    if (record_data_size > kMaxRecordDataSize ||
+        record_data_size >
+            uint64_t(file_size) - (valid_bytes + sizeof(record))) {
+      break;
+    }
+    StoredFunction function;
+    function.end_address = record.end_address;
+    function.guest_code_hash = record.guest_code_hash;
+    function.func_info = {};
+    function.func_info.code_size.prolog = record.code_size_prolog;
+    function.func_info.code_size.body = record.code_size_body;
+    function.func_info.code_size.epilog = record.code_size_epilog;
+    function.func_info.code_size.tail = record.code_size_tail;
+    function.func_info.code_size.total = record.machine_code_size;
+    function.func_info.prolog_stack_alloc_offset =
+        record.prolog_stack_alloc_offset;
+    function.func_info.stack_size = record.stack_size;
+    function.machine_code.resize(record.machine_code_size);
+    function.source_map.resize(record.source_map_count);
+    function.host_relocations.resize(record.host_relocation_count);
+    if (fread(function.machine_code.data(), 1, function.machine_code.size(),
+              file) != function.machine_code.size() ||
+        fread(function.source_map.data(), sizeof(SourceMapEntry),
+              function.source_map.size(),
+              file) != function.source_map.size() ||
+        fread(function.host_relocations.data(), sizeof(HostRelocation),
+              function.host_relocations.size(),
+              file) != function.host_relocations.size()) {
+      break;
+    }
+    XXH3_state_t hash_state;
+    XXH3_64bits_reset(&hash_state);
+    XXH3_64bits_update(&hash_state, function.machine_code.data(),
+                       function.machine_code.size());
+    XXH3_64bits_update(&hash_state, function.source_map.data(),
+                       function.source_map.size() * sizeof(SourceMapEntry));
+    XXH3_64bits_update(&hash_state, function.host_relocations.data(),
+                       function.host_relocations.size() *
+                           sizeof(HostRelocation));
+    if (XXH3_64bits_digest(&hash_state) != record.record_hash) {
+      break;
+    }
+    bool relocations_valid = true;
+    for (const HostRelocation& relocation : function.host_relocations) {
+      if (relocation.code_offset > function.machine_code.size() ||
+          function.machine_code.size() - relocation.code_offset <
+              sizeof(uint64_t)) {
+        relocations_valid = false;
+        break;
+      }
+    }
+    if (!relocations_valid) {
+      break;
+    }
+    valid_bytes += sizeof(record) + function.machine_code.size() +
+                   function.source_map.size() * sizeof(SourceMapEntry) +
+                   function.host_relocations.size() * sizeof(HostRelocation);
+    // Later records supersede earlier ones (the guest code was modified and
+    // the function retranslated).
+    storage.functions[record.address] = std::move(function);
+  }
+  // Drop anything after the last intact record.
+  return xe::filesystem::TruncateStdioFile(file, valid_bytes);
+}
+
+void X64CodeStorage::CloseModule(Module* module) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = modules_.find(module);
+  if (it == modules_.end()) {
+    return;
+  }
+  if (it->second.file) {
+    fclose(it->second.file);
+  }
+  modules_.erase(it);
+}
+
+void X64CodeStorage::CloseAllModules() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto& it : modules_) {
+    if (it.second.file) {
+      fclose(it.second.file);
+    }
+  }
+  modules_.clear();
+}
+
+uint64_t X64CodeStorage::HashGuestCode(Module* module, uint32_t address,
+                                       uint32_t end_address) const {
+  // end_address is the address of the last instruction.
+  return XXH3_64bits(module->memory()->TranslateVirtual(address),
+                     end_address + 4 - address);
+}
+
+bool X64CodeStorage::RestoreFunction(X64Function* function) {
+  Module* module = function->module();
+  StoredFunction stored;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto module_it = modules_.find(module);
+    if (module_it == modules_.end()) {
+      return false;
+    }
+    auto& functions = module_it->second.functions;
+    auto it = functions.find(function->address());
+    if (it == functions.end()) {
+      ++misses_;
+      return false;
+    }
+    if (it->second.end_address < function->address() ||
+        HashGuestCode(module, function->address(), it->second.end_address) !=
+            it->second.guest_code_hash) {
+      // Self-modifying or patched code - translate and store again.
+      functions.erase(it);
+      ++invalidations_;
+      ++misses_;
+      return false;
+    }
+    // Records are only consumed once; keep the lock short while placing.
+    stored = std::move(it->second);
+    functions.erase(it);
+  }
+
+  for (const HostRelocation& relocation : stored.host_relocations) {
+    uint64_t host_address = FromImageOffset(relocation.image_offset);
+    std::memcpy(stored.machine_code.data() + relocation.code_offset,
+                &host_address, sizeof(host_address));
+  }
+
+  void* code_execute_address;
+  void* code_write_address;
+  function->set_end_address(stored.end_address);
+  code_cache_->PlaceGuestCode(function->address(), stored.machine_code.data(),
+                              stored.func_info, function,
+                              GuestFunction::Tier::kOptimized,
+                              &stored.source_map, code_execute_address,
+                              code_write_address);
+  function->Setup(reinterpret_cast<uint8_t*>(code_execute_address),
+                  stored.machine_code.size(), std::move(stored.source_map),
+                  GuestFunction::Tier::kOptimized);
+  code_cache_->AddIndirection(
+      function->address(),
+      uint32_t(reinterpret_cast<uintptr_t>(code_execute_address)));
+
+  ++hits_;
+  return true;
+}
+
+void X64CodeStorage::StoreFunction(
+    GuestFunction* function, const EmitFunctionInfo& func_info,
+    const void* machine_code, const std::vector<SourceMapEntry>& source_map,
+    const std::vector<HostRelocation>& host_relocations) {
+  Module* module = function->module();
+  if (!function->has_end_address()) {
+    return;
+  }
+
+  StorageRecordHeader record;
+  record.address = function->address();
+  record.end_address = function->end_address();
+  record.guest_code_hash =
+      HashGuestCode(module, function->address(), function->end_address());
+  record.machine_code_size = uint32_t(func_info.code_size.total);
+  record.source_map_count = uint32_t(source_map.size());
+  record.host_relocation_count = uint32_t(host_relocations.size());
+  record.code_size_prolog = uint32_t(func_info.code_size.prolog);
+  record.code_size_body = uint32_t(func_info.code_size.body);
+  record.code_size_epilog = uint32_t(func_info.code_size.epilog);
+  record.code_size_tail = uint32_t(func_info.code_size.tail);
+  record.prolog_stack_alloc_offset =
+      uint32_t(func_info.prolog_stack_alloc_offset);
+  record.stack_size = uint32_t(func_info.stack_size);
+  XXH3_state_t hash_state;
+  XXH3_64bits_reset(&hash_state);
+  XXH3_64bits_update(&hash_state, machine_code, func_info.code_size.total);
+  XXH3_64bits_update(&hash_state, source_map.data(),
+                     source_map.size() * sizeof(SourceMapEntry));
+  XXH3_64bits_update(&hash_state, host_relocations.data(),
+                     host_relocations.size() * sizeof(HostRelocation));
+  record.record_hash = XXH3_64bits_digest(&hash_state);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto module_it = modules_.find(module);
+  if (module_it == modules_.end() || !module_it->second.file) {
+    return;
+  }
+  FILE* file = module_it->second.file;
+  fwrite(&record, sizeof(record), 1, file);
+  fwrite(machine_code, 1, func_info.code_size.total, file);
+  fwrite(source_map.data(), sizeof(SourceMapEntry), source_map.size(), file);
+  fwrite(host_relocations.data(), sizeof(HostRelocation),
+         host_relocations.size(), file);
+  ++stores_;
+}
+
+X64CodeStorage::Statistics X64CodeStorage::QueryStatistics() const {
+  Statistics stats;
+  stats.hits = hits_;
+  stats.misses = misses_;
+  stats.invalidations = invalidations_;
+  stats.stores = stores_;
+  return stats;
+}
+
+}  // namespace x64
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
@@ -0,0 +1,144 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_CPU_BACKEND_X64_X64_CODE_STORAGE_H_
+#define XENIA_CPU_BACKEND_X64_X64_CODE_STORAGE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "xenia/cpu/backend/x64/x64_code_cache.h"
+#include "xenia/cpu/function.h"
+
+namespace xe {
+namespace cpu {
+class Module;
+}  // namespace cpu
+}  // namespace xe
+
+namespace xe {
+namespace cpu {
+namespace backend {
+namespace x64 {
+
+class X64Function;
+
+// Persists finalized guest function machine code on disk so that subsequent
+// launches of the same module can skip translation entirely.
+//
+// Each module gets its own file named after the image hash. The file header
+// carries a key made of everything that changes codegen (frontend cvars,
+// emitter feature flags, the layout of the host image and the fixed host
+// addresses baked into the code); a mismatch discards the whole file. Records
+// are appended as functions are translated and the last record for a guest
+// address wins on load.
+//
+// Only code that doesn't reference host heap objects is stored - the emitter
+// flags anything else (builtins, MMIO callbacks, trace strings) as not
+// storable. Guest-to-guest calls go through the indirection table, which is
+// at a fixed host address, and host calls go through thunks placed at the
+// start of the code cache, so restored code is valid at any placement. The
+// host functions called through the thunks move with the host image (ASLR),
+// so their addresses are stored relative to the image and relocated on load.
+class X64CodeStorage {
+ public:
+  // Increment when the record layout or the emitted code conventions change.
+  static constexpr uint32_t kVersion = 2;
+
+  // A 64-bit immediate in the machine code holding the address of something
+  // in the host image.
+  struct HostRelocation {
+    uint32_t code_offset;
+    uint32_t reserved;
+    int64_t image_offset;
+  };
+
+  // Converts between host image addresses and offsets that are the same in
+  // every launch of the same build.
+  static int64_t ToImageOffset(const void* host_address);
+  static uint64_t FromImageOffset(int64_t image_offset);
+
+  struct Statistics {
+    // Functions defined from storage instead of being translated.
+    uint64_t hits;
+    // Functions that had to be translated as they weren't stored.
+    uint64_t misses;
+    // Stored functions (or whole module files) discarded because the guest
+    // code or the codegen key no longer matched.
+    uint64_t invalidations;
+    // Functions written to storage this session.
+    uint64_t stores;
+  };
+
+  X64CodeStorage(X64CodeCache* code_cache, uint64_t codegen_key);
+  ~X64CodeStorage();
+
+  uint64_t codegen_key() const { return codegen_key_; }
+
+  bool OpenModule(Module* module, const std::filesystem::path& storage_root,
+                  uint64_t module_hash);
+  void CloseModule(Module* module);
+  void CloseAllModules();
+
+  // Places the stored code for the function in the code cache and sets the
+  // function up, if a valid record exists.
+  bool RestoreFunction(X64Function* function);
+
+  // Appends freshly emitted code to the storage of the function's module.
+  // machine_code must point to the relocated code as placed in the cache.
+  void StoreFunction(GuestFunction* function,
+                     const EmitFunctionInfo& func_info,
+                     const void* machine_code,
+                     const std::vector<SourceMapEntry>& source_map,
+                     const std::vector<HostRelocation>& host_relocations);
+
+  Statistics QueryStatistics() const;
+
+ private:
+  struct StoredFunction {
+    uint32_t end_address;
+    uint64_t guest_code_hash;
+    EmitFunctionInfo func_info;
+    std::vector<uint8_t> machine_code;
+    std::vector<SourceMapEntry> source_map;
+    std::vector<HostRelocation> host_relocations;
+  };
+
+  struct ModuleStorage {
+    FILE* file = nullptr;
+    std::unordered_map<uint32_t, StoredFunction> functions;
+  };
+
+  uint64_t HashGuestCode(Module* module, uint32_t address,
+                         uint32_t end_address) const;
+  bool ReadRecords(FILE* file, ModuleStorage& storage);
+
+  X64CodeCache* code_cache_;
+  uint64_t codegen_key_;
+
+  std::mutex mutex_;
+  std::unordered_map<Module*, ModuleStorage> modules_;
+
+  std::atomic<uint64_t> hits_ = {0};
+  std::atomic<uint64_t> misses_ = {0};
+  std::atomic<uint64_t> invalidations_ = {0};
+  std::atomic<uint64_t> stores_ = {0};
+};
+
+}  // namespace x64
+}  // namespace backend
+}  // namespace cpu
+}  // namespace xe
+
+#endif  // XENIA_CPU_BACKEND_X64_X64_CODE_STORAGE_H_
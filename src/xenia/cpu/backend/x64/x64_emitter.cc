@@ -11,8 +11,10 @@
 
 #include <stddef.h>
 
+#include <algorithm>
 #include <climits>
 #include <cstring>
+#include <vector>
 
 #include "third_party/fmt/include/fmt/format.h"
 #include "xenia/base/assert.h"
@@ -24,8 +26,10 @@
 #include "xenia/base/memory.h"
 #include "xenia/base/profiling.h"
 #include "xenia/base/vec128.h"
+#include "xenia/cpu/backend/interpreter/interpreter_code.h"
 #include "xenia/cpu/backend/x64/x64_backend.h"
 #include "xenia/cpu/backend/x64/x64_code_cache.h"
+#include "xenia/cpu/backend/x64/x64_code_storage.h"
 #include "xenia/cpu/backend/x64/x64_function.h"
 #include "xenia/cpu/backend/x64/x64_sequences.h"
 #include "xenia/cpu/backend/x64/x64_stack_layout.h"
@@ -36,19 +40,25 @@
 #include "xenia/cpu/symbol.h"
 #include "xenia/cpu/thread_state.h"
 
-DEFINE_bool(debugprint_trap_log, false,
-            "Log debugprint traps to the active debugger", "CPU");
-DEFINE_bool(ignore_undefined_externs, true,
-            "Don't exit when an undefined extern is called.", "CPU");
 DEFINE_bool(emit_source_annotations, false,
             "Add extra movs and nops to make disassembly easier to read.",
             "CPU");
+DEFINE_bool(patch_call_sites, false,
+            "Patch guest calls to call their targets directly once they have "
+            "been compiled, and cache the last target of indirect calls. Not "
+            "used with store_translated_code.",
+            "CPU");
+DEFINE_bool(move_cold_blocks, true,
+            "Emit blocks that only trap or break into the debugger after the "
+            "function epilog, so the rest of the code is contiguous.",
+            "CPU");
 
 namespace xe {
 namespace cpu {
 namespace backend {
 namespace x64 {
 
+using xe::cpu::hir::Block;
 using xe::cpu::hir::HIRBuilder;
 using xe::cpu::hir::Instr;
 using namespace xe::literals;
@@ -105,8 +115,9 @@ X64Emitter::X64Emitter(X64Backend* backend, XbyakAllocator* allocator)
 
 X64Emitter::~X64Emitter() = default;
 
-bool X64Emitter::Emit(GuestFunction* function, HIRBuilder* builder,
-                      uint32_t debug_info_flags, FunctionDebugInfo* debug_info,
+bool X64Emitter::Emit(GuestFunction* function, GuestFunction::Tier tier,
+                      HIRBuilder* builder, uint32_t debug_info_flags,
+                      FunctionDebugInfo* debug_info,
                       void** out_code_address, size_t* out_code_size,
                       std::vector<SourceMapEntry>* out_source_map) {
   SCOPE_profile_cpu_f("cpu");
@@ -116,6 +127,23 @@ bool X64Emitter::Emit(GuestFunction* function, HIRBuilder* builder,
   debug_info_flags_ = debug_info_flags;
   trace_data_ = &function->trace_data();
   source_map_arena_.Reset();
+  host_relocations_.clear();
+  // Trace data lives in host memory allocated for this run only, and baseline
+  // code is temporary. Stored code is only checked against the guest code of
+  // the function itself, so inlined callees could be stale when restored.
+  code_storable_ =
+      !debug_info_flags && tier == GuestFunction::Tier::kOptimized &&
+      !(builder->attributes() & hir::FUNCTION_ATTRIB_INLINED_CALLS);
+  tier_up_function_ =
+      tier == GuestFunction::Tier::kBaseline ? function : nullptr;
+  interpreted_function_ = nullptr;
+  interpreter_code_ = nullptr;
+  // Patches are relative to where the code is placed, and the call sites are
+  // only known while emitting.
+  patch_call_sites_ = cvars::patch_call_sites &&
+                      code_cache_->has_indirection_table() &&
+                      !backend_->code_storage();
+  call_sites_.clear();
 
   // Fill the generator with code.
   EmitFunctionInfo func_info = {};
@@ -123,18 +151,64 @@ bool X64Emitter::Emit(GuestFunction* function, HIRBuilder* builder,
     return false;
   }
 
+  // Stash source map. Offsets are relative to the code start, and the code
+  // cache passes them to profilers when placing the code.
+  source_map_arena_.CloneContents(out_source_map);
+
   // Copy the final code to the cache and relocate it.
   *out_code_size = getSize();
-  *out_code_address = Emplace(func_info, function);
+  *out_code_address = Emplace(func_info, function, tier, out_source_map);
 
-  // Stash source map.
-  source_map_arena_.CloneContents(out_source_map);
+  if (!call_sites_.empty()) {
+    code_cache_->AddCallSites(*out_code_address, call_sites_);
+  }
+
+  // Keep the placed code for subsequent launches, if possible.
+  auto code_storage = backend_->code_storage();
+  if (code_storage && code_storable_) {
+    code_storage->StoreFunction(function, func_info, *out_code_address,
+                                *out_source_map, host_relocations_);
+  }
 
   return true;
 }
 
+bool X64Emitter::EmitInterpreterEntry(
+    GuestFunction* function, HIRBuilder* builder,
+    const interpreter::InterpreterCode* interpreter_code,
+    void** out_code_address, size_t* out_code_size) {
+  SCOPE_profile_cpu_f("cpu");
+
+  debug_info_ = nullptr;
+  debug_info_flags_ = 0;
+  trace_data_ = &function->trace_data();
+  // The entry references the interpreter code in host memory, and the
+  // interpreter counts the calls itself.
+  code_storable_ = false;
+  host_relocations_.clear();
+  tier_up_function_ = nullptr;
+  interpreted_function_ = function;
+  interpreter_code_ = interpreter_code;
+  patch_call_sites_ = false;
+  call_sites_.clear();
+
+  EmitFunctionInfo func_info = {};
+  bool emitted = Emit(builder, func_info);
+  interpreted_function_ = nullptr;
+  interpreter_code_ = nullptr;
+  if (!emitted) {
+    return false;
+  }
+
+  *out_code_size = getSize();
+  *out_code_address =
+      Emplace(func_info, function, GuestFunction::Tier::kInterpreted);
+  return true;
+}
+
 void* X64Emitter::Emplace(const EmitFunctionInfo& func_info,
-                          GuestFunction* function) {
+                          GuestFunction* function, GuestFunction::Tier tier,
+                          const std::vector<SourceMapEntry>* source_map) {
   // To avoid changing xbyak, we do a switcharoo here.
   // top_ points to the Xbyak buffer, and since we are in AutoGrow mode
   // it has pending relocations. We copy the top_ to our buffer, swap the
@@ -149,7 +223,8 @@ void* X64Emitter::Emplace(const EmitFunctionInfo& func_info,
   assert_true(func_info.code_size.total == size_);
   if (function) {
     code_cache_->PlaceGuestCode(function->address(), top_, func_info, function,
-                                new_execute_address, new_write_address);
+                                tier, source_map, new_execute_address,
+                                new_write_address);
   } else {
     code_cache_->PlaceHostCode(0, top_, func_info, new_execute_address,
                                new_write_address);
@@ -161,9 +236,59 @@ void* X64Emitter::Emplace(const EmitFunctionInfo& func_info,
   return new_execute_address;
 }
 
+// Called by baseline code once it's hot.
+uint64_t RequestTierUp(void* raw_context, uint64_t function_ptr) {
+  auto thread_state = *reinterpret_cast<ThreadState**>(raw_context);
+  thread_state->processor()->frontend()->QueueTierUp(
+      reinterpret_cast<GuestFunction*>(function_ptr));
+  return 0;
+}
+
+// Called by the entry code of interpreted functions.
+uint64_t ExecuteInterpreterCode(void* raw_context, uint64_t code_ptr,
+                                uint64_t function_ptr,
+                                uint64_t return_address) {
+  auto thread_state = *reinterpret_cast<ThreadState**>(raw_context);
+  reinterpret_cast<const interpreter::InterpreterCode*>(code_ptr)->Execute(
+      reinterpret_cast<GuestFunction*>(function_ptr), thread_state,
+      uint32_t(return_address));
+  return 0;
+}
+
+// Blocks reached only on error paths, such as failed assertions in the guest
+// code.
+static bool IsColdBlock(const Block* block) {
+  for (auto instr = block->instr_head; instr; instr = instr->next) {
+    if (instr->opcode == &hir::OPCODE_TRAP_info ||
+        instr->opcode == &hir::OPCODE_DEBUG_BREAK_info) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Whether execution may continue from the end of the block to the block after
+// it in HIR order, or to the epilog after the last block.
+static bool FallsThrough(const Block* block) {
+  const Instr* tail = block->instr_tail;
+  if (!tail) {
+    return true;
+  }
+  if (tail->opcode == &hir::OPCODE_BRANCH_info) {
+    return false;
+  }
+  // Returns jump to the epilog unless they're at the end of the last block.
+  if (tail->opcode == &hir::OPCODE_RETURN_info) {
+    return !block->next;
+  }
+  return true;
+}
+
 bool X64Emitter::Emit(HIRBuilder* builder, EmitFunctionInfo& func_info) {
   Xbyak::Label epilog_label;
   epilog_label_ = &epilog_label;
+  Xbyak::Label call_site_stub_label;
+  call_site_stub_label_ = &call_site_stub_label;
 
   // Calculate stack size. We need to align things to their natural sizes.
   // This could be much better (sort by type/etc).
@@ -246,37 +371,69 @@ bool X64Emitter::Emit(HIRBuilder* builder, EmitFunctionInfo& func_info) {
   mov(GetMembaseReg(),
       qword[GetContextReg() + offsetof(ppc::PPCContext, virtual_membase)]);
 
+  // Count calls to baseline code and request optimization once it's hot. The
+  // counter only reaches zero once, further calls take it negative.
+  if (tier_up_function_) {
+    Xbyak::Label tier_up_skip;
+    mov(rax, reinterpret_cast<uint64_t>(tier_up_function_->tier_up_counter()));
+    sub(dword[rax], 1);
+    jnz(tier_up_skip);
+    CallNative(&RequestTierUp, reinterpret_cast<uint64_t>(tier_up_function_));
+    L(tier_up_skip);
+  }
+
   // Body.
-  auto block = builder->first_block();
-  while (block) {
-    // Mark block labels.
-    auto label = block->label_head;
-    while (label) {
-      L(label->name);
-      label = label->next;
+  if (interpreter_code_) {
+    mov(GetNativeParam(0), reinterpret_cast<uint64_t>(interpreter_code_));
+    mov(GetNativeParam(1), reinterpret_cast<uint64_t>(interpreted_function_));
+    mov(GetNativeParam(2), qword[rsp + StackLayout::GUEST_RET_ADDR]);
+    CallNativeSafe(reinterpret_cast<void*>(&ExecuteInterpreterCode));
+  }
+  // Cold blocks are emitted after the epilog, so the hot blocks are packed
+  // into fewer cache lines and fall through into each other. The entry block
+  // stays in place. Blocks falling through into a block emitted elsewhere jump
+  // to it instead, through labels indexed by the block ordinals.
+  auto first_block = interpreter_code_ ? nullptr : builder->first_block();
+  size_t block_count = 0;
+  std::vector<bool> cold_blocks;
+  for (auto block = first_block; block; block = block->next) {
+    assert_true(block->ordinal == block_count);
+    ++block_count;
+    cold_blocks.push_back(cvars::move_cold_blocks && block != first_block &&
+                          IsColdBlock(block));
+  }
+  std::vector<Xbyak::Label> block_labels;
+  if (std::find(cold_blocks.cbegin(), cold_blocks.cend(), true) !=
+      cold_blocks.cend()) {
+    block_labels.resize(block_count);
+  }
+  auto emit_block = [&](const Block* block) {
+    if (!block_labels.empty()) {
+      L(block_labels[block->ordinal]);
     }
-
-    // Process instructions.
-    const Instr* instr = block->instr_head;
-    while (instr) {
-      const Instr* new_tail = instr;
-      if (!SelectSequence(this, instr, &new_tail)) {
-        // No sequence found!
-        // NOTE: If you encounter this after adding a new instruction, do a full
-        // rebuild!
-        assert_always();
-        XELOGE("Unable to process HIR opcode {}", instr->opcode->name);
-        break;
+    EmitBlock(block);
+    // The next block is emitted right after this one if both are on the same
+    // side of the epilog.
+    if (block_labels.empty() || !FallsThrough(block)) {
+      return;
+    }
+    bool is_cold = cold_blocks[block->ordinal];
+    if (!block->next) {
+      if (is_cold) {
+        jmp(epilog_label, T_NEAR);
       }
-      instr = new_tail;
+    } else if (is_cold != cold_blocks[block->next->ordinal]) {
+      jmp(block_labels[block->next->ordinal], T_NEAR);
+    }
+  };
+  for (auto block = first_block; block; block = block->next) {
+    if (!cold_blocks[block->ordinal]) {
+      emit_block(block);
     }
-
-    block = block->next;
   }
 
   // Function epilog.
   L(epilog_label);
-  epilog_label_ = nullptr;
   EmitTraceUserCallReturn();
   mov(GetContextReg(), qword[rsp + StackLayout::GUEST_CTX_HOME]);
 
@@ -287,6 +444,30 @@ bool X64Emitter::Emit(HIRBuilder* builder, EmitFunctionInfo& func_info) {
 
   code_offsets.tail = getSize();
 
+  if (!block_labels.empty()) {
+    for (auto block = first_block; block; block = block->next) {
+      if (cold_blocks[block->ordinal]) {
+        emit_block(block);
+      }
+    }
+  }
+  epilog_label_ = nullptr;
+
+  // Unpatched call sites go to the thunk through here, as it may be out of
+  // rel32 range of the code being emitted.
+  call_site_stub_label_ = nullptr;
+  if (!call_sites_.empty()) {
+    Xbyak::Label thunk_address_label;
+    uint32_t stub_offset = uint32_t(getSize());
+    L(call_site_stub_label);
+    jmp(qword[rip + thunk_address_label]);
+    L(thunk_address_label);
+    dq(reinterpret_cast<uint64_t>(backend_->call_site_resolve_thunk()));
+    for (auto& call_site : call_sites_) {
+      call_site.stub_offset = stub_offset;
+    }
+  }
+
   if (cvars::emit_source_annotations) {
     nop();
     nop();
@@ -307,6 +488,30 @@ bool X64Emitter::Emit(HIRBuilder* builder, EmitFunctionInfo& func_info) {
   return true;
 }
 
+void X64Emitter::EmitBlock(const Block* block) {
+  // Mark block labels.
+  auto label = block->label_head;
+  while (label) {
+    L(label->name);
+    label = label->next;
+  }
+
+  // Process instructions.
+  const Instr* instr = block->instr_head;
+  while (instr) {
+    const Instr* new_tail = instr;
+    if (!SelectSequence(this, instr, &new_tail)) {
+      // No sequence found!
+      // NOTE: If you encounter this after adding a new instruction, do a full
+      // rebuild!
+      assert_always();
+      XELOGE("Unable to process HIR opcode {}", instr->opcode->name);
+      break;
+    }
+    instr = new_tail;
+  }
+}
+
 void X64Emitter::MarkSourceOffset(const Instr* i) {
   auto entry = source_map_arena_.Alloc<SourceMapEntry>();
   entry->guest_address = static_cast<uint32_t>(i->src1.offset);
@@ -411,15 +616,71 @@ uint64_t ResolveFunction(void* raw_context, uint64_t target_address) {
   return addr;
 }
 
+// This is used by the X64ThunkEmitter's CallSiteResolveThunk.
+uint64_t ResolveCallSite(void* raw_context, uint64_t target_address,
+                         uint64_t site_end_address) {
+  uint64_t addr = ResolveFunction(raw_context, target_address);
+
+  auto thread_state = *reinterpret_cast<ThreadState**>(raw_context);
+  auto backend =
+      static_cast<X64Backend*>(thread_state->processor()->backend());
+  backend->code_cache()->PatchCallSite(uint32_t(site_end_address),
+                                       uint32_t(target_address));
+
+  return addr;
+}
+
+uint32_t X64Emitter::EmitCallSiteBranch(bool is_tail) {
+  // Code is placed at 16b alignment, so aligning the offset is enough.
+  while ((getSize() + 1) & 3) {
+    nop();
+  }
+  if (is_tail) {
+    jmp(*call_site_stub_label_, CodeGenerator::T_NEAR);
+  } else {
+    call(*call_site_stub_label_);
+  }
+  return uint32_t(getSize());
+}
+
 void X64Emitter::Call(const hir::Instr* instr, GuestFunction* function) {
   assert_not_null(function);
   auto fn = static_cast<X64Function*>(function);
   // Resolve address to the function to call and store in rax.
-  if (fn->machine_code()) {
+  // The callee's code is only embedded if it's never replaced, as callers
+  // would keep running the old code otherwise. Stored code must not embed the
+  // placement of other functions either.
+  if (fn->machine_code() &&
+      !processor()->frontend()->may_retranslate_functions() &&
+      (!backend_->code_storage() || !code_cache_->has_indirection_table())) {
+    // Marked before taking the code so that it's not freed if the module is
+    // unloaded now.
+    fn->MarkCalledDirectly();
+    uint8_t* machine_code = fn->machine_code();
     // TODO(benvanik): is it worth it to do this? It removes the need for
     // a ResolveFunction call, but makes the table less useful.
-    assert_zero(uint64_t(fn->machine_code()) & 0xFFFFFFFF00000000);
-    mov(eax, uint32_t(uint64_t(fn->machine_code())));
+    assert_zero(uint64_t(machine_code) & 0xFFFFFFFF00000000);
+    mov(eax, uint32_t(uint64_t(machine_code)));
+    DisableCodeStorage();
+  } else if (patch_call_sites_) {
+    // Goes to the call site resolve thunk until the first call patches the
+    // rel32 to the target's code.
+    mov(ebx, function->address());
+    bool is_tail = (instr->flags & hir::CALL_TAIL) != 0;
+    if (is_tail) {
+      EmitTraceUserCallReturn();
+      mov(rcx, qword[rsp + StackLayout::GUEST_RET_ADDR]);
+      add(rsp, static_cast<uint32_t>(stack_size()));
+    } else {
+      mov(rcx, qword[rsp + StackLayout::GUEST_CALL_RET_ADDR]);
+    }
+    Xbyak::Label site_end;
+    lea(rax, ptr[rip + site_end]);
+    X64CodeCache::CallSite call_site = {};
+    call_site.end_offset = EmitCallSiteBranch(is_tail);
+    L(site_end);
+    call_sites_.push_back(call_site);
+    return;
   } else if (code_cache_->has_indirection_table()) {
     // Load the pointer to the indirection table maintained in X64CodeCache.
     // The target dword will either contain the address of the generated code
@@ -459,6 +720,44 @@ void X64Emitter::CallIndirect(const hir::Instr* instr,
     je(epilog_label(), CodeGenerator::T_NEAR);
   }
 
+  if (patch_call_sites_) {
+    // Monomorphic inline cache: the first target is called directly, others
+    // go through the indirection table.
+    if (reg.cvt32() != ebx) {
+      mov(ebx, reg.cvt32());
+    }
+    bool is_tail = (instr->flags & hir::CALL_TAIL) != 0;
+    if (is_tail) {
+      EmitTraceUserCallReturn();
+      mov(rcx, qword[rsp + StackLayout::GUEST_RET_ADDR]);
+      add(rsp, static_cast<uint32_t>(stack_size()));
+    } else {
+      mov(rcx, qword[rsp + StackLayout::GUEST_CALL_RET_ADDR]);
+    }
+    X64CodeCache::CallSite call_site = {};
+    Xbyak::Label miss, site_end;
+    // cmp ebx, imm32, with the imm32 aligned for patching. Xbyak would pick
+    // the imm8 form for the empty value.
+    while ((getSize() + 2) & 3) {
+      nop();
+    }
+    db(0x81);
+    db(0xFB);
+    call_site.guest_target_offset = uint32_t(getSize());
+    dd(X64CodeCache::kEmptyInlineCacheTarget);
+    jne(miss, CodeGenerator::T_NEAR);
+    call_site.hit_offset = EmitCallSiteBranch(is_tail) - 4;
+    if (!is_tail) {
+      jmp(site_end, CodeGenerator::T_NEAR);
+    }
+    L(miss);
+    lea(rax, ptr[rip + site_end]);
+    call_site.end_offset = EmitCallSiteBranch(is_tail);
+    L(site_end);
+    call_sites_.push_back(call_site);
+    return;
+  }
+
   // Load the pointer to the indirection table maintained in X64CodeCache.
   // The target dword will either contain the address of the generated code
   // or a thunk to ResolveAddress.
@@ -471,7 +770,7 @@ void X64Emitter::CallIndirect(const hir::Instr* instr,
     // Old-style resolve.
     // Not too important because indirection table is almost always available.
     mov(edx, reg.cvt32());
-    mov(rax, reinterpret_cast<uint64_t>(ResolveFunction));
+    MovHostImageAddress(rax, reinterpret_cast<void*>(ResolveFunction));
     mov(rcx, GetContextReg());
     call(rax);
   }
@@ -508,6 +807,8 @@ uint64_t UndefinedCallExtern(void* raw_context, uint64_t function_ptr) {
 void X64Emitter::CallExtern(const hir::Instr* instr, const Function* function) {
   bool undefined = true;
   if (function->behavior() == Function::Behavior::kBuiltin) {
+    // Builtin arguments point into host objects.
+    DisableCodeStorage();
     auto builtin_function = static_cast<const BuiltinFunction*>(function);
     if (builtin_function->handler()) {
       undefined = false;
@@ -533,7 +834,8 @@ void X64Emitter::CallExtern(const hir::Instr* instr, const Function* function) {
       // r9  = arg2
       auto thunk = backend()->guest_to_host_thunk();
       mov(rax, reinterpret_cast<uint64_t>(thunk));
-      mov(rcx, reinterpret_cast<uint64_t>(extern_function->extern_handler()));
+      MovHostImageAddress(
+          rcx, reinterpret_cast<void*>(extern_function->extern_handler()));
       mov(rdx,
           qword[GetContextReg() + offsetof(ppc::PPCContext, kernel_state)]);
       call(rax);
@@ -541,6 +843,7 @@ void X64Emitter::CallExtern(const hir::Instr* instr, const Function* function) {
     }
   }
   if (undefined) {
+    DisableCodeStorage();
     CallNative(UndefinedCallExtern, reinterpret_cast<uint64_t>(function));
   }
 }
@@ -568,11 +871,24 @@ void X64Emitter::CallNativeSafe(void* fn) {
   // r9  = arg2
   auto thunk = backend()->guest_to_host_thunk();
   mov(rax, reinterpret_cast<uint64_t>(thunk));
-  mov(rcx, reinterpret_cast<uint64_t>(fn));
+  MovHostImageAddress(rcx, fn);
   call(rax);
   // rax = host return
 }
 
+void X64Emitter::MovHostImageAddress(const Xbyak::Reg64& reg,
+                                     const void* address) {
+  // mov r64, imm64 - always with the full immediate so it can be relocated.
+  db(0x48 | (reg.getIdx() >> 3));
+  db(0xB8 | (reg.getIdx() & 7));
+  X64CodeStorage::HostRelocation relocation;
+  relocation.code_offset = uint32_t(getSize());
+  relocation.reserved = 0;
+  relocation.image_offset = X64CodeStorage::ToImageOffset(address);
+  host_relocations_.push_back(relocation);
+  dq(reinterpret_cast<uint64_t>(address));
+}
+
 void X64Emitter::SetReturnAddress(uint64_t value) {
   mov(rax, value);
   mov(qword[rsp + StackLayout::GUEST_CALL_RET_ADDR], rax);
@@ -13,6 +13,8 @@
 #include <vector>
 
 #include "xenia/base/arena.h"
+#include "xenia/cpu/backend/x64/x64_code_cache.h"
+#include "xenia/cpu/backend/x64/x64_code_storage.h"
 #include "xenia/cpu/function.h"
 #include "xenia/cpu/function_trace_data.h"
 #include "xenia/cpu/hir/hir_builder.h"
@@ -27,6 +29,11 @@
 namespace xe {
 namespace cpu {
 class Processor;
+namespace backend {
+namespace interpreter {
+class InterpreterCode;
+}  // namespace interpreter
+}  // namespace backend
 }  // namespace cpu
 }  // namespace xe
 
@@ -157,10 +164,17 @@ class X64Emitter : public Xbyak::CodeGenerator {
   static uintptr_t PlaceConstData();
   static void FreeConstData(uintptr_t data);
 
-  bool Emit(GuestFunction* function, hir::HIRBuilder* builder,
-            uint32_t debug_info_flags, FunctionDebugInfo* debug_info,
+  bool Emit(GuestFunction* function, GuestFunction::Tier tier,
+            hir::HIRBuilder* builder, uint32_t debug_info_flags,
+            FunctionDebugInfo* debug_info,
             void** out_code_address, size_t* out_code_size,
             std::vector<SourceMapEntry>* out_source_map);
+  // Emits code entering the HIR interpreter with interpreter_code instead of
+  // translating the function body.
+  bool EmitInterpreterEntry(
+      GuestFunction* function, hir::HIRBuilder* builder,
+      const interpreter::InterpreterCode* interpreter_code,
+      void** out_code_address, size_t* out_code_size);
 
  public:
   // Reserved:  rsp, rsi, rdi
@@ -223,6 +237,9 @@ class X64Emitter : public Xbyak::CodeGenerator {
   // Moves a 64bit immediate into memory.
   bool ConstantFitsIn32Reg(uint64_t v);
   void MovMem64(const Xbyak::RegExp& addr, uint64_t v);
+  // Moves the address of a function or data in the host image into a
+  // register, relocated when the code is restored from storage.
+  void MovHostImageAddress(const Xbyak::Reg64& reg, const void* address);
 
   Xbyak::Address GetXmmConstPtr(XmmConst id);
   void LoadConstantXmm(Xbyak::Xmm dest, float v);
@@ -233,20 +250,32 @@ class X64Emitter : public Xbyak::CodeGenerator {
   Xbyak::Address StashConstantXmm(int index, double v);
   Xbyak::Address StashConstantXmm(int index, const vec128_t& v);
 
+  uint32_t feature_flags() const { return feature_flags_; }
   bool IsFeatureEnabled(uint32_t feature_flag) const {
     return (feature_flags_ & feature_flag) == feature_flag;
   }
 
+  // Marks the function being emitted as referencing host objects whose
+  // addresses aren't stable across launches, so it must not be written to
+  // persistent code storage.
+  void DisableCodeStorage() { code_storable_ = false; }
+
   FunctionDebugInfo* debug_info() const { return debug_info_; }
 
   size_t stack_size() const { return stack_size_; }
 
  protected:
   void* Emplace(const EmitFunctionInfo& func_info,
-                GuestFunction* function = nullptr);
+                GuestFunction* function = nullptr,
+                GuestFunction::Tier tier = GuestFunction::Tier::kOptimized,
+                const std::vector<SourceMapEntry>* source_map = nullptr);
   bool Emit(hir::HIRBuilder* builder, EmitFunctionInfo& func_info);
+  void EmitBlock(const hir::Block* block);
   void EmitGetCurrentThreadId();
   void EmitTraceUserCallReturn();
+  // Emits a call or jump to the call site stub, with its rel32 aligned for
+  // patching, and returns the offset of its end.
+  uint32_t EmitCallSiteBranch(bool is_tail);
 
  protected:
   Processor* processor_ = nullptr;
@@ -266,6 +295,17 @@ class X64Emitter : public Xbyak::CodeGenerator {
   Arena source_map_arena_;
 
   size_t stack_size_ = 0;
+  bool code_storable_ = true;
+  std::vector<X64CodeStorage::HostRelocation> host_relocations_;
+  // Set when emitting GuestFunction::Tier::kBaseline code.
+  GuestFunction* tier_up_function_ = nullptr;
+  // Set when emitting an entry to GuestFunction::Tier::kInterpreted code.
+  GuestFunction* interpreted_function_ = nullptr;
+  const interpreter::InterpreterCode* interpreter_code_ = nullptr;
+  // Guest calls are emitted as call sites patched at runtime.
+  bool patch_call_sites_ = false;
+  Xbyak::Label* call_site_stub_label_ = nullptr;
+  std::vector<X64CodeCache::CallSite> call_sites_;
 
   static const uint32_t gpr_reg_map_[GPR_COUNT];
   static const uint32_t xmm_reg_map_[XMM_COUNT];
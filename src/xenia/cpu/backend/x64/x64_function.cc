@@ -9,6 +9,7 @@
 
 #include "xenia/cpu/backend/x64/x64_function.h"
 
+#include "xenia/base/atomic.h"
 #include "xenia/cpu/backend/x64/x64_backend.h"
 #include "xenia/cpu/processor.h"
 #include "xenia/cpu/thread_state.h"
@@ -18,23 +19,64 @@ namespace cpu {
 namespace backend {
 namespace x64 {
 
+namespace {
+
+// Marks the thread as running guest code for Processor::ReclaimRetiredCode,
+// the reverse of what the guest to host thunk does. Nested in the host code
+// called from guest code, the previous guest frames are scannable again once
+// the inner guest code returns or unwinds.
+class GuestCodeScope {
+ public:
+  explicit GuestCodeScope(ppc::PPCContext* context) : context_(context) {
+    outermost_ = !context_->guest_stack_top;
+    if (outermost_) {
+      context_->guest_stack_top = reinterpret_cast<uintptr_t>(this);
+    }
+    context_->host_call_count = context_->host_call_count + 1;
+    // A full barrier, so the code to run is only read after this is visible.
+    host_call_stack_pointer_ =
+        xe::atomic_exchange(uint64_t(0), &context_->host_call_stack_pointer);
+  }
+  ~GuestCodeScope() {
+    context_->host_call_count = context_->host_call_count + 1;
+    if (outermost_) {
+      context_->guest_stack_top = 0;
+    }
+    context_->host_call_stack_pointer = host_call_stack_pointer_;
+  }
+
+ private:
+  ppc::PPCContext* context_;
+  bool outermost_;
+  uint64_t host_call_stack_pointer_;
+};
+
+}  // namespace
+
 X64Function::X64Function(Module* module, uint32_t address)
     : GuestFunction(module, address) {}
 
 X64Function::~X64Function() {
-  // machine_code_ is freed by code cache.
+  // Machine code is freed by the code cache.
+}
+
+void X64Function::Setup(uint8_t* machine_code, size_t machine_code_length,
+                        std::vector<SourceMapEntry> source_map, Tier tier) {
+  PublishCodeVersion(machine_code, machine_code_length, std::move(source_map),
+                     tier);
 }
 
-void X64Function::Setup(uint8_t* machine_code, size_t machine_code_length) {
-  machine_code_ = machine_code;
-  machine_code_length_ = machine_code_length;
+void X64Function::AddInterpreterCode(
+    std::unique_ptr<interpreter::InterpreterCode> interpreter_code) {
+  interpreter_code_.push_back(std::move(interpreter_code));
 }
 
 bool X64Function::CallImpl(ThreadState* thread_state, uint32_t return_address) {
   auto backend =
       reinterpret_cast<X64Backend*>(thread_state->processor()->backend());
   auto thunk = backend->host_to_guest_thunk();
-  thunk(machine_code_, thread_state->context(),
+  GuestCodeScope guest_code_scope(thread_state->context());
+  thunk(machine_code(), thread_state->context(),
         reinterpret_cast<void*>(uintptr_t(return_address)));
   return true;
 }
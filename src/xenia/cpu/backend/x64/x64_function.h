@@ -10,6 +10,11 @@
 #ifndef XENIA_CPU_BACKEND_X64_X64_FUNCTION_H_
 #define XENIA_CPU_BACKEND_X64_X64_FUNCTION_H_
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "xenia/cpu/backend/interpreter/interpreter_code.h"
 #include "xenia/cpu/function.h"
 #include "xenia/cpu/thread_state.h"
 
@@ -23,17 +28,34 @@ class X64Function : public GuestFunction {
   X64Function(Module* module, uint32_t address);
   ~X64Function() override;
 
-  uint8_t* machine_code() const override { return machine_code_; }
-  size_t machine_code_length() const override { return machine_code_length_; }
+  // Publishes placed code as the current version. The indirection table must
+  // be updated only afterwards.
+  void Setup(uint8_t* machine_code, size_t machine_code_length,
+             std::vector<SourceMapEntry> source_map, Tier tier);
+  // Takes ownership of the code executed by the interpreter entry of a
+  // GuestFunction::Tier::kInterpreted function. Previous code is kept, as it
+  // may still be running on other threads.
+  void AddInterpreterCode(
+      std::unique_ptr<interpreter::InterpreterCode> interpreter_code);
 
-  void Setup(uint8_t* machine_code, size_t machine_code_length);
+  // Whether other code calls the current or older machine code directly rather
+  // than through the indirection table, so replaced code must not be freed.
+  // Both sequentially consistent, pairing with the machine code being
+  // published and read: either the caller reads the new code, or the function
+  // is seen marked once the new code is published.
+  bool is_called_directly() const {
+    return called_directly_.load(std::memory_order_seq_cst);
+  }
+  void MarkCalledDirectly() {
+    called_directly_.store(true, std::memory_order_seq_cst);
+  }
 
  protected:
   bool CallImpl(ThreadState* thread_state, uint32_t return_address) override;
 
  private:
-  uint8_t* machine_code_ = nullptr;
-  size_t machine_code_length_ = 0;
+  std::atomic<bool> called_directly_ = {false};
+  std::vector<std::unique_ptr<interpreter::InterpreterCode>> interpreter_code_;
 };
 
 }  // namespace x64
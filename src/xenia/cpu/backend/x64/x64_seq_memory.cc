@@ -15,6 +15,8 @@
 #include "xenia/base/memory.h"
 #include "xenia/cpu/backend/x64/x64_op.h"
 #include "xenia/cpu/backend/x64/x64_tracers.h"
+#include "xenia/cpu/thread_state.h"
+#include "xenia/memory.h"
 
 namespace xe {
 namespace cpu {
@@ -103,6 +105,81 @@ RegExp ComputeMemoryAddress(X64Emitter& e, const T& guest) {
   }
 }
 
+// Guest loads and stores that have accessed MMIO through an access violation
+// are retranslated to go through these, calling the MMIO callbacks directly if
+// the address is in a range. Values are in memory byte order, like in loads and
+// stores.
+uint64_t LoadMmioCheckedI32(void* raw_context, uint64_t address) {
+  auto thread_state = *reinterpret_cast<ThreadState**>(raw_context);
+  Memory* memory = thread_state->memory();
+  auto guest_address = uint32_t(address);
+  MMIORange* mmio_range = memory->LookupVirtualMappedRange(guest_address);
+  if (mmio_range) {
+    return xe::byte_swap(mmio_range->read(
+        raw_context, mmio_range->callback_context, guest_address));
+  }
+  return xe::load<uint32_t>(memory->TranslateVirtual(guest_address));
+}
+uint64_t StoreMmioCheckedI32(void* raw_context, uint64_t address,
+                             uint64_t value) {
+  auto thread_state = *reinterpret_cast<ThreadState**>(raw_context);
+  Memory* memory = thread_state->memory();
+  auto guest_address = uint32_t(address);
+  MMIORange* mmio_range = memory->LookupVirtualMappedRange(guest_address);
+  if (mmio_range) {
+    mmio_range->write(raw_context, mmio_range->callback_context, guest_address,
+                      xe::byte_swap(uint32_t(value)));
+  } else {
+    xe::store<uint32_t>(memory->TranslateVirtual(guest_address),
+                        uint32_t(value));
+  }
+  return 0;
+}
+
+template <typename T>
+void EmitMmioCheckedAddress(X64Emitter& e, const T& guest, int32_t offset) {
+  if (guest.is_constant) {
+    e.mov(e.GetNativeParam(0).cvt32(), uint32_t(guest.constant()) + offset);
+  } else {
+    e.mov(e.GetNativeParam(0).cvt32(), guest.reg().cvt32());
+    if (offset) {
+      e.add(e.GetNativeParam(0).cvt32(), offset);
+    }
+  }
+}
+
+template <typename T>
+void EmitLoadMmioCheckedI32(X64Emitter& e, const I32Op& dest, const T& guest,
+                            int32_t offset, uint16_t flags) {
+  // The helper is a host function.
+  e.DisableCodeStorage();
+  EmitMmioCheckedAddress(e, guest, offset);
+  e.CallNativeSafe(reinterpret_cast<void*>(LoadMmioCheckedI32));
+  if (flags & LoadStoreFlags::LOAD_STORE_BYTE_SWAP) {
+    e.bswap(e.eax);
+  }
+  e.mov(dest, e.eax);
+}
+
+template <typename T>
+void EmitStoreMmioCheckedI32(X64Emitter& e, const T& guest, int32_t offset,
+                             const I32Op& value, uint16_t flags) {
+  // The helper is a host function.
+  e.DisableCodeStorage();
+  EmitMmioCheckedAddress(e, guest, offset);
+  bool byte_swap = (flags & LoadStoreFlags::LOAD_STORE_BYTE_SWAP) != 0;
+  if (value.is_constant) {
+    e.mov(e.GetNativeParam(1).cvt32(),
+          byte_swap ? xe::byte_swap(value.constant()) : value.constant());
+  } else {
+    e.mov(e.GetNativeParam(1).cvt32(), value);
+    if (byte_swap) {
+      e.bswap(e.GetNativeParam(1).cvt32());
+    }
+  }
+  e.CallNativeSafe(reinterpret_cast<void*>(StoreMmioCheckedI32));
+}
+
 // ============================================================================
 // OPCODE_ATOMIC_EXCHANGE
 // ============================================================================
@@ -556,6 +633,8 @@ struct LOAD_MMIO_I32
     // uint64_t (context, addr)
     auto mmio_range = reinterpret_cast<MMIORange*>(i.src1.value);
     auto read_address = uint32_t(i.src2.value);
+    // The callback context is a host object.
+    e.DisableCodeStorage();
     e.mov(e.GetNativeParam(0), uint64_t(mmio_range->callback_context));
     e.mov(e.GetNativeParam(1).cvt32(), read_address);
     e.CallNativeSafe(reinterpret_cast<void*>(mmio_range->read));
@@ -581,6 +660,8 @@ struct STORE_MMIO_I32
     // void (context, addr, value)
     auto mmio_range = reinterpret_cast<MMIORange*>(i.src1.value);
     auto write_address = uint32_t(i.src2.value);
+    // The callback context is a host object.
+    e.DisableCodeStorage();
     e.mov(e.GetNativeParam(0), uint64_t(mmio_range->callback_context));
     e.mov(e.GetNativeParam(1).cvt32(), write_address);
     if (i.src3.is_constant) {
@@ -634,6 +715,11 @@ struct LOAD_OFFSET_I16
 struct LOAD_OFFSET_I32
     : Sequence<LOAD_OFFSET_I32, I<OPCODE_LOAD_OFFSET, I32Op, I64Op, I64Op>> {
   static void Emit(X64Emitter& e, const EmitArgType& i) {
+    if (i.instr->flags & LoadStoreFlags::LOAD_STORE_MMIO_CHECK) {
+      EmitLoadMmioCheckedI32(e, i.dest, i.src1, int32_t(i.src2.constant()),
+                             i.instr->flags);
+      return;
+    }
     auto addr = ComputeMemoryAddressOffset(e, i.src1, i.src2);
     if (i.instr->flags & LoadStoreFlags::LOAD_STORE_BYTE_SWAP) {
       if (e.IsFeatureEnabled(kX64EmitMovbe)) {
@@ -709,6 +795,11 @@ struct STORE_OFFSET_I32
     : Sequence<STORE_OFFSET_I32,
                I<OPCODE_STORE_OFFSET, VoidOp, I64Op, I64Op, I32Op>> {
   static void Emit(X64Emitter& e, const EmitArgType& i) {
+    if (i.instr->flags & LoadStoreFlags::LOAD_STORE_MMIO_CHECK) {
+      EmitStoreMmioCheckedI32(e, i.src1, int32_t(i.src2.constant()), i.src3,
+                              i.instr->flags);
+      return;
+    }
     auto addr = ComputeMemoryAddressOffset(e, i.src1, i.src2);
     if (i.instr->flags & LoadStoreFlags::LOAD_STORE_BYTE_SWAP) {
       assert_false(i.src3.is_constant);
@@ -787,6 +878,10 @@ struct LOAD_I16 : Sequence<LOAD_I16, I<OPCODE_LOAD, I16Op, I64Op>> {
 };
 struct LOAD_I32 : Sequence<LOAD_I32, I<OPCODE_LOAD, I32Op, I64Op>> {
   static void Emit(X64Emitter& e, const EmitArgType& i) {
+    if (i.instr->flags & LoadStoreFlags::LOAD_STORE_MMIO_CHECK) {
+      EmitLoadMmioCheckedI32(e, i.dest, i.src1, 0, i.instr->flags);
+      return;
+    }
     auto addr = ComputeMemoryAddress(e, i.src1);
     if (i.instr->flags & LoadStoreFlags::LOAD_STORE_BYTE_SWAP) {
       if (e.IsFeatureEnabled(kX64EmitMovbe)) {
@@ -919,6 +1014,10 @@ struct STORE_I16 : Sequence<STORE_I16, I<OPCODE_STORE, VoidOp, I64Op, I16Op>> {
 };
 struct STORE_I32 : Sequence<STORE_I32, I<OPCODE_STORE, VoidOp, I64Op, I32Op>> {
   static void Emit(X64Emitter& e, const EmitArgType& i) {
+    if (i.instr->flags & LoadStoreFlags::LOAD_STORE_MMIO_CHECK) {
+      EmitStoreMmioCheckedI32(e, i.src1, 0, i.src2, i.instr->flags);
+      return;
+    }
     auto addr = ComputeMemoryAddress(e, i.src1);
     if (i.instr->flags & LoadStoreFlags::LOAD_STORE_BYTE_SWAP) {
       assert_false(i.src2.is_constant);
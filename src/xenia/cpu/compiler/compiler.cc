@@ -9,8 +9,10 @@
 
 #include "xenia/cpu/compiler/compiler.h"
 
+#include "xenia/base/clock.h"
 #include "xenia/base/profiling.h"
 #include "xenia/cpu/compiler/compiler_pass.h"
+#include "xenia/cpu/cpu_flags.h"
 
 namespace xe {
 namespace cpu {
@@ -27,15 +29,54 @@ void Compiler::AddPass(std::unique_ptr<CompilerPass> pass) {
 
 void Compiler::Reset() {}
 
+// Counts the instructions that will be emitted.
+static void CountInstrs(hir::HIRBuilder* builder, uint32_t* instr_count,
+                        uint32_t* store_context_count) {
+  *instr_count = 0;
+  *store_context_count = 0;
+  for (auto block = builder->first_block(); block; block = block->next) {
+    for (auto instr = block->instr_head; instr; instr = instr->next) {
+      if (!(instr->opcode->flags & hir::OPCODE_FLAG_IGNORE)) {
+        ++*instr_count;
+        if (instr->opcode == &hir::OPCODE_STORE_CONTEXT_info) {
+          ++*store_context_count;
+        }
+      }
+    }
+  }
+}
+
 bool Compiler::Compile(xe::cpu::hir::HIRBuilder* builder) {
+  bool collect_statistics = cvars::translation_statistics;
+  pass_statistics_.clear();
+  loop_statistics_ = {};
+  uint32_t instr_count = 0;
+  uint32_t store_context_count = 0;
+  if (collect_statistics) {
+    CountInstrs(builder, &instr_count, &store_context_count);
+  }
+
   // TODO(benvanik): sophisticated stuff. Run passes in parallel, run until they
   //                 stop changing things, etc.
   for (size_t i = 0; i < passes_.size(); ++i) {
     auto& pass = passes_[i];
     scratch_arena_.Reset();
+    uint64_t start_ticks =
+        collect_statistics ? Clock::QueryHostTickCount() : 0;
     if (!pass->Run(builder)) {
       return false;
     }
+    if (collect_statistics) {
+      PassStatistics stats;
+      stats.name = pass->name();
+      stats.ticks = Clock::QueryHostTickCount() - start_ticks;
+      stats.instr_count_before = instr_count;
+      stats.store_context_count_before = store_context_count;
+      CountInstrs(builder, &instr_count, &store_context_count);
+      stats.instr_count_after = instr_count;
+      stats.store_context_count_after = store_context_count;
+      pass_statistics_.push_back(stats);
+    }
   }
 
   return true;
@@ -10,6 +10,7 @@
 #ifndef XENIA_CPU_COMPILER_COMPILER_H_
 #define XENIA_CPU_COMPILER_COMPILER_H_
 
+#include <cstdint>
 #include <memory>
 #include <vector>
 
@@ -42,9 +43,36 @@ class Compiler {
 
   bool Compile(hir::HIRBuilder* builder);
 
+  // Measurements of the passes in the last Compile, in the order they were
+  // added, if enabled with --translation_statistics. Passes in a group are
+  // measured together. Instructions are counted if they will be emitted.
+  struct PassStatistics {
+    const char* name;
+    uint64_t ticks;
+    uint32_t instr_count_before;
+    uint32_t instr_count_after;
+    uint32_t store_context_count_before;
+    uint32_t store_context_count_after;
+  };
+  const std::vector<PassStatistics>& pass_statistics() const {
+    return pass_statistics_;
+  }
+
+  // Loops found in the function in the last Compile, filled in by
+  // LoopInvariantCodeMotionPass.
+  struct LoopStatistics {
+    uint32_t loop_count;
+    uint32_t max_loop_depth;
+    uint32_t hoisted_loop_count;
+    uint32_t hoisted_instr_count;
+  };
+  LoopStatistics& loop_statistics() { return loop_statistics_; }
+
  private:
   Processor* processor_;
   Arena scratch_arena_;
+  std::vector<PassStatistics> pass_statistics_;
+  LoopStatistics loop_statistics_ = {};
 
   std::vector<std::unique_ptr<CompilerPass>> passes_;
 };
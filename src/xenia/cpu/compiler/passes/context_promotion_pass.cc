@@ -16,11 +16,6 @@
 #include "xenia/cpu/ppc/ppc_context.h"
 #include "xenia/cpu/processor.h"
 
-DECLARE_bool(debug);
-
-DEFINE_bool(store_all_context_values, false,
-            "Don't strip dead context stores to aid in debugging.", "CPU");
-
 namespace xe {
 namespace cpu {
 namespace compiler {
@@ -58,13 +53,6 @@ bool ContextPromotionPass::Run(HIRBuilder* builder) {
   //   store_context +200, v0
   //   v1 = load_context +100  <-- replace with v1 = v0
   //   store_context +200, v1
-  //
-  // It'd be possible in this stage to also remove redundant context stores:
-  // Example of dead store elimination:
-  //   store_context +100, v0  <-- removed due to following store
-  //   store_context +100, v1
-  // This is more generally done by DSE, however if it could be done here
-  // instead as it may be faster (at least on the block-level).
 
   // Promote loads to values.
   // Process each block independently, for now.
@@ -74,16 +62,7 @@ bool ContextPromotionPass::Run(HIRBuilder* builder) {
     block = block->next;
   }
 
-  // Remove all dead stores.
-  // This will break debugging as we can't recover this information when
-  // trying to extract stack traces/register values, so we don't do that.
-  if (!cvars::debug && !cvars::store_all_context_values) {
-    block = builder->first_block();
-    while (block) {
-      RemoveDeadStoresBlock(block);
-      block = block->next;
-    }
-  }
+  // Dead stores are removed by DeadStoreEliminationPass.
 
   return true;
 }
@@ -121,32 +100,6 @@ void ContextPromotionPass::PromoteBlock(Block* block) {
   }
 }
 
-void ContextPromotionPass::RemoveDeadStoresBlock(Block* block) {
-  auto& validity = context_validity_;
-  validity.reset();
-
-  // Walk backwards and mark offsets that are written to.
-  // If the offset was written to earlier, ignore the store.
-  Instr* i = block->instr_tail;
-  while (i) {
-    Instr* prev = i->prev;
-    if (i->opcode->flags & (OPCODE_FLAG_VOLATILE | OPCODE_FLAG_BRANCH)) {
-      // Volatile instruction - requires all context values be flushed.
-      validity.reset();
-    } else if (i->opcode == &OPCODE_STORE_CONTEXT_info) {
-      size_t offset = i->src1.offset;
-      if (!validity.test(static_cast<uint32_t>(offset))) {
-        // Offset not yet written, mark and continue.
-        validity.set(static_cast<uint32_t>(offset));
-      } else {
-        // Already written to. Remove this store.
-        i->Remove();
-      }
-    }
-    i = prev;
-  }
-}
-
 }  // namespace passes
 }  // namespace compiler
 }  // namespace cpu
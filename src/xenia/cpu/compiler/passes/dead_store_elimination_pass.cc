@@ -0,0 +1,168 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/compiler/passes/dead_store_elimination_pass.h"
+
+#include "xenia/base/cvar.h"
+#include "xenia/base/profiling.h"
+#include "xenia/cpu/compiler/compiler.h"
+#include "xenia/cpu/ppc/ppc_context.h"
+#include "xenia/cpu/processor.h"
+
+DECLARE_bool(debug);
+
+DEFINE_bool(store_all_context_values, false,
+            "Don't strip dead context stores to aid in debugging.", "CPU");
+
+namespace xe {
+namespace cpu {
+namespace compiler {
+namespace passes {
+
+// TODO(benvanik): remove when enums redefined.
+using namespace xe::cpu::hir;
+
+using xe::cpu::hir::Block;
+using xe::cpu::hir::Edge;
+using xe::cpu::hir::HIRBuilder;
+using xe::cpu::hir::Instr;
+
+DeadStoreEliminationPass::DeadStoreEliminationPass() : CompilerPass() {}
+
+DeadStoreEliminationPass::~DeadStoreEliminationPass() {}
+
+bool DeadStoreEliminationPass::Initialize(Compiler* compiler) {
+  if (!CompilerPass::Initialize(compiler)) {
+    return false;
+  }
+
+  live_.resize(static_cast<uint32_t>(sizeof(ppc::PPCContext)));
+
+  return true;
+}
+
+bool DeadStoreEliminationPass::Run(HIRBuilder* builder) {
+  // Stores are only needed where something may read them: a later load in
+  // this or another block, or anything leaving the function (calls, returns,
+  // traps and other volatile instructions, which may observe the whole
+  // context). Example:
+  //   store_context +100, v0  <-- removed, overwritten on all paths
+  //   branch_true v1, label0
+  //   store_context +100, v2
+  //   branch label1
+  // label0:
+  //   store_context +100, v3
+  //
+  // This will break debugging as we can't recover this information when
+  // trying to extract stack traces/register values, so we don't do that.
+  if (cvars::debug || cvars::store_all_context_values) {
+    return true;
+  }
+
+  uint16_t block_count = 0;
+  auto block = builder->first_block();
+  while (block) {
+    block->ordinal = block_count++;
+    block = block->next;
+  }
+  if (block_live_in_.size() < block_count) {
+    block_live_in_.resize(block_count);
+  }
+  for (uint16_t n = 0; n < block_count; ++n) {
+    block_live_in_[n].resize(live_.size());
+    block_live_in_[n].reset();
+  }
+
+  // Iterate backwards until the live sets settle. They only grow, so this
+  // terminates, and in practice takes one more pass than the deepest loop
+  // nesting.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    block = builder->last_block();
+    while (block) {
+      ComputeLiveness(builder, block, false);
+      if (live_ != block_live_in_[block->ordinal]) {
+        block_live_in_[block->ordinal] = live_;
+        changed = true;
+      }
+      block = block->prev;
+    }
+  }
+
+  block = builder->first_block();
+  while (block) {
+    ComputeLiveness(builder, block, true);
+    block = block->next;
+  }
+
+  return true;
+}
+
+void DeadStoreEliminationPass::ComputeLiveness(HIRBuilder* builder,
+                                               Block* block,
+                                               bool remove_dead_stores) {
+  // Start with what's live where the block ends: the successors, and the next
+  // block if it falls through.
+  Instr* i = block->instr_tail;
+  if (!i || !builder->IsUnconditionalJump(i)) {
+    if (block->next) {
+      live_ = block_live_in_[block->next->ordinal];
+    } else {
+      // Falls off the end of the function.
+      live_.set();
+    }
+  } else {
+    live_.reset();
+  }
+  auto edge = block->outgoing_edge_head;
+  while (edge) {
+    live_ |= block_live_in_[edge->dest->ordinal];
+    edge = edge->outgoing_next;
+  }
+
+  // Walk backwards, tracking the bytes read before being written.
+  while (i) {
+    Instr* prev = i->prev;
+    if (i->opcode == &OPCODE_BRANCH_info ||
+        i->opcode == &OPCODE_BRANCH_TRUE_info ||
+        i->opcode == &OPCODE_BRANCH_FALSE_info) {
+      // Covered by the edges.
+    } else if (i->opcode->flags & (OPCODE_FLAG_VOLATILE | OPCODE_FLAG_BRANCH) ||
+               i->opcode == &OPCODE_CONTEXT_BARRIER_info) {
+      // Everything must be in the context.
+      live_.set();
+    } else if (i->opcode == &OPCODE_STORE_CONTEXT_info) {
+      uint32_t offset = static_cast<uint32_t>(i->src1.offset);
+      uint32_t size = static_cast<uint32_t>(GetTypeSize(i->src2.value->type));
+      bool is_live = false;
+      for (uint32_t n = offset; n < offset + size; ++n) {
+        if (live_.test(n)) {
+          is_live = true;
+          break;
+        }
+      }
+      if (is_live) {
+        live_.reset(offset, offset + size);
+      } else if (remove_dead_stores) {
+        i->Remove();
+      }
+    } else if (i->opcode == &OPCODE_LOAD_CONTEXT_info) {
+      uint32_t offset = static_cast<uint32_t>(i->src1.offset);
+      uint32_t size = static_cast<uint32_t>(GetTypeSize(i->dest->type));
+      live_.set(offset, offset + size);
+    }
+    i = prev;
+  }
+}
+
+}  // namespace passes
+}  // namespace compiler
+}  // namespace cpu
+}  // namespace xe
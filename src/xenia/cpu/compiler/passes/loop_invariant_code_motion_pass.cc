@@ -0,0 +1,622 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/compiler/passes/loop_invariant_code_motion_pass.h"
+
+#include <algorithm>
+
+#include "xenia/cpu/compiler/compiler.h"
+
+namespace xe {
+namespace cpu {
+namespace compiler {
+namespace passes {
+
+// TODO(benvanik): remove when enums redefined.
+using namespace xe::cpu::hir;
+
+using xe::cpu::hir::Block;
+using xe::cpu::hir::HIRBuilder;
+using xe::cpu::hir::Instr;
+using xe::cpu::hir::Label;
+using xe::cpu::hir::Value;
+
+// Hoisting must save more than the loads of the hoisted values in the loop.
+static constexpr int32_t kMinHoistBenefit = 2;
+
+// Approximate cost of an instruction on x64, or 0 if it may not be hoisted.
+// Instructions that can fault, have side effects or depend on anything but
+// their operands may not be.
+static int32_t GetHoistCost(const Instr* instr) {
+  switch (instr->opcode->num) {
+    case OPCODE_CONVERT:
+    case OPCODE_VECTOR_CONVERT_I2F:
+    case OPCODE_VECTOR_CONVERT_F2I:
+    case OPCODE_SQRT:
+    case OPCODE_RSQRT:
+    case OPCODE_RECIP:
+    case OPCODE_POW2:
+    case OPCODE_LOG2:
+    case OPCODE_DOT_PRODUCT_3:
+    case OPCODE_DOT_PRODUCT_4:
+      return 10;
+    case OPCODE_DIV:
+      // Integer division traps on zero.
+      return instr->dest->type >= FLOAT32_TYPE ? 10 : 0;
+    case OPCODE_ROUND:
+    case OPCODE_LOAD_VECTOR_SHL:
+    case OPCODE_LOAD_VECTOR_SHR:
+    case OPCODE_MUL:
+    case OPCODE_MUL_HI:
+    case OPCODE_MUL_ADD:
+    case OPCODE_MUL_SUB:
+    case OPCODE_VECTOR_SHL:
+    case OPCODE_VECTOR_SHR:
+    case OPCODE_VECTOR_SHA:
+    case OPCODE_VECTOR_ROTATE_LEFT:
+    case OPCODE_PERMUTE:
+    case OPCODE_PACK:
+    case OPCODE_UNPACK:
+      return 4;
+    case OPCODE_ASSIGN:
+    case OPCODE_CAST:
+    case OPCODE_ZERO_EXTEND:
+    case OPCODE_SIGN_EXTEND:
+    case OPCODE_TRUNCATE:
+    case OPCODE_MAX:
+    case OPCODE_VECTOR_MAX:
+    case OPCODE_MIN:
+    case OPCODE_VECTOR_MIN:
+    case OPCODE_SELECT:
+    case OPCODE_IS_TRUE:
+    case OPCODE_IS_FALSE:
+    case OPCODE_IS_NAN:
+    case OPCODE_COMPARE_EQ:
+    case OPCODE_COMPARE_NE:
+    case OPCODE_COMPARE_SLT:
+    case OPCODE_COMPARE_SLE:
+    case OPCODE_COMPARE_SGT:
+    case OPCODE_COMPARE_SGE:
+    case OPCODE_COMPARE_ULT:
+    case OPCODE_COMPARE_ULE:
+    case OPCODE_COMPARE_UGT:
+    case OPCODE_COMPARE_UGE:
+    case OPCODE_VECTOR_COMPARE_EQ:
+    case OPCODE_VECTOR_COMPARE_SGT:
+    case OPCODE_VECTOR_COMPARE_SGE:
+    case OPCODE_VECTOR_COMPARE_UGT:
+    case OPCODE_VECTOR_COMPARE_UGE:
+    case OPCODE_ADD:
+    case OPCODE_ADD_CARRY:
+    case OPCODE_VECTOR_ADD:
+    case OPCODE_SUB:
+    case OPCODE_VECTOR_SUB:
+    case OPCODE_NEG:
+    case OPCODE_ABS:
+    case OPCODE_AND:
+    case OPCODE_AND_NOT:
+    case OPCODE_OR:
+    case OPCODE_XOR:
+    case OPCODE_NOT:
+    case OPCODE_SHL:
+    case OPCODE_SHR:
+    case OPCODE_SHA:
+    case OPCODE_ROTATE_LEFT:
+    case OPCODE_VECTOR_AVERAGE:
+    case OPCODE_BYTE_SWAP:
+    case OPCODE_CNTLZ:
+    case OPCODE_INSERT:
+    case OPCODE_EXTRACT:
+    case OPCODE_SPLAT:
+    case OPCODE_SWIZZLE:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static bool UsesValue(const Instr* instr, const Value* value) {
+  auto sig = instr->opcode->signature;
+  return (GET_OPCODE_SIG_TYPE_SRC1(sig) == OPCODE_SIG_TYPE_V &&
+          instr->src1.value == value) ||
+         (GET_OPCODE_SIG_TYPE_SRC2(sig) == OPCODE_SIG_TYPE_V &&
+          instr->src2.value == value) ||
+         (GET_OPCODE_SIG_TYPE_SRC3(sig) == OPCODE_SIG_TYPE_V &&
+          instr->src3.value == value);
+}
+
+static void ReplaceOperand(Instr* instr, const Value* value,
+                           Value* replacement) {
+  auto sig = instr->opcode->signature;
+  if (GET_OPCODE_SIG_TYPE_SRC1(sig) == OPCODE_SIG_TYPE_V &&
+      instr->src1.value == value) {
+    instr->set_src1(replacement);
+  }
+  if (GET_OPCODE_SIG_TYPE_SRC2(sig) == OPCODE_SIG_TYPE_V &&
+      instr->src2.value == value) {
+    instr->set_src2(replacement);
+  }
+  if (GET_OPCODE_SIG_TYPE_SRC3(sig) == OPCODE_SIG_TYPE_V &&
+      instr->src3.value == value) {
+    instr->set_src3(replacement);
+  }
+}
+
+LoopInvariantCodeMotionPass::LoopInvariantCodeMotionPass() : CompilerPass() {}
+
+LoopInvariantCodeMotionPass::~LoopInvariantCodeMotionPass() {}
+
+bool LoopInvariantCodeMotionPass::Run(HIRBuilder* builder) {
+  // Loops are found as back edges to blocks dominating their source:
+  //   b0: ...
+  //   b1: v0 = load_context +100      <-- header, dominates b2
+  //       v1 = convert v0
+  //       ...
+  //   b2: branch_true v2, b1          <-- latch, back edge
+  // Invariant instructions are moved to a preheader inserted before b1 that
+  // all branches to b1 from outside of the loop are redirected to:
+  //   bp: v3 = load_context +100
+  //       v1 = convert v3
+  //       store_local l0, v1
+  //       branch b1
+  //   b1: v4 = load_local l0
+  //       ...
+  if (!FindBlocks(builder)) {
+    return true;
+  }
+  ComputeDominators();
+  FindLoops();
+
+  auto& stats = compiler_->loop_statistics();
+  stats.loop_count = uint32_t(loops_.size());
+  for (const Loop& loop : loops_) {
+    stats.max_loop_depth = std::max(stats.max_loop_depth, loop.depth);
+  }
+
+  // Outer loops would have to be found again after inserting the preheaders
+  // of the inner ones, and most of the time is spent in innermost loops.
+  for (const Loop& loop : loops_) {
+    if (!loop.innermost || !CanHoist(builder, loop)) {
+      continue;
+    }
+    uint32_t hoisted_instr_count = HoistInvariants(builder, loop);
+    if (hoisted_instr_count) {
+      ++stats.hoisted_loop_count;
+      stats.hoisted_instr_count += hoisted_instr_count;
+    }
+  }
+
+  return true;
+}
+
+bool LoopInvariantCodeMotionPass::FindBlocks(HIRBuilder* builder) {
+  blocks_.clear();
+  for (auto block = builder->first_block(); block; block = block->next) {
+    if (blocks_.size() >= UINT16_MAX) {
+      return false;
+    }
+    block->ordinal = uint16_t(blocks_.size());
+    blocks_.push_back(block);
+  }
+  if (blocks_.empty()) {
+    return false;
+  }
+
+  uint32_t block_count = uint32_t(blocks_.size());
+  successors_.assign(block_count, {});
+  predecessors_.assign(block_count, {});
+  for (uint32_t i = 0; i < block_count; ++i) {
+    auto block = blocks_[i];
+    auto& successors = successors_[i];
+    // Conditional branches may be followed by more instructions.
+    for (auto instr = block->instr_head; instr; instr = instr->next) {
+      Label* label = nullptr;
+      if (instr->opcode == &OPCODE_BRANCH_info) {
+        label = instr->src1.label;
+      } else if (instr->opcode == &OPCODE_BRANCH_TRUE_info ||
+                 instr->opcode == &OPCODE_BRANCH_FALSE_info) {
+        label = instr->src2.label;
+      } else {
+        continue;
+      }
+      auto target = label->block;
+      if (target->ordinal >= block_count ||
+          blocks_[target->ordinal] != target) {
+        // Not a block of this function, the graph can't be trusted.
+        return false;
+      }
+      successors.push_back(target->ordinal);
+    }
+    if (block->next && (!block->instr_tail ||
+                        !builder->IsUnconditionalJump(block->instr_tail))) {
+      successors.push_back(i + 1);
+    }
+    for (uint32_t successor : successors) {
+      predecessors_[successor].push_back(i);
+    }
+  }
+  return true;
+}
+
+void LoopInvariantCodeMotionPass::ComputeDominators() {
+  // Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm".
+  uint32_t block_count = uint32_t(blocks_.size());
+
+  // Reverse postorder of the blocks reachable from the entry.
+  std::vector<uint32_t> postorder;
+  postorder.reserve(block_count);
+  std::vector<bool> visited(block_count);
+  std::vector<std::pair<uint32_t, size_t>> stack;
+  stack.emplace_back(0, 0);
+  visited[0] = true;
+  while (!stack.empty()) {
+    uint32_t block = stack.back().first;
+    size_t successor_index = stack.back().second++;
+    if (successor_index < successors_[block].size()) {
+      uint32_t successor = successors_[block][successor_index];
+      if (!visited[successor]) {
+        visited[successor] = true;
+        stack.emplace_back(successor, 0);
+      }
+    } else {
+      postorder.push_back(block);
+      stack.pop_back();
+    }
+  }
+  std::vector<uint32_t> rpo(postorder.rbegin(), postorder.rend());
+  rpo_numbers_.assign(block_count, kNoBlock);
+  for (uint32_t i = 0; i < uint32_t(rpo.size()); ++i) {
+    rpo_numbers_[rpo[i]] = i;
+  }
+
+  // Unreachable blocks are left without a dominator.
+  idoms_.assign(block_count, kNoBlock);
+  idoms_[0] = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t i = 1; i < rpo.size(); ++i) {
+      uint32_t block = rpo[i];
+      uint32_t idom = kNoBlock;
+      for (uint32_t predecessor : predecessors_[block]) {
+        if (idoms_[predecessor] == kNoBlock) {
+          continue;
+        }
+        if (idom == kNoBlock) {
+          idom = predecessor;
+          continue;
+        }
+        uint32_t finger1 = predecessor;
+        uint32_t finger2 = idom;
+        while (finger1 != finger2) {
+          while (rpo_numbers_[finger1] > rpo_numbers_[finger2]) {
+            finger1 = idoms_[finger1];
+          }
+          while (rpo_numbers_[finger2] > rpo_numbers_[finger1]) {
+            finger2 = idoms_[finger2];
+          }
+        }
+        idom = finger1;
+      }
+      if (idoms_[block] != idom) {
+        idoms_[block] = idom;
+        changed = true;
+      }
+    }
+  }
+}
+
+bool LoopInvariantCodeMotionPass::Dominates(uint32_t dominator,
+                                            uint32_t block) const {
+  if (idoms_[block] == kNoBlock) {
+    return false;
+  }
+  while (block != dominator) {
+    if (!block) {
+      return false;
+    }
+    block = idoms_[block];
+  }
+  return true;
+}
+
+void LoopInvariantCodeMotionPass::FindLoops() {
+  uint32_t block_count = uint32_t(blocks_.size());
+  loops_.clear();
+  std::vector<uint32_t> worklist;
+  for (uint32_t latch = 0; latch < block_count; ++latch) {
+    for (uint32_t header : successors_[latch]) {
+      if (!Dominates(header, latch)) {
+        continue;
+      }
+      // Back edges to the same header form one loop.
+      auto it = std::find_if(
+          loops_.begin(), loops_.end(),
+          [&](const Loop& loop) { return loop.header == blocks_[header]; });
+      if (it == loops_.end()) {
+        Loop loop;
+        loop.header = blocks_[header];
+        loop.body.assign(block_count, false);
+        loop.body[header] = true;
+        loop.depth = 0;
+        loop.innermost = true;
+        loops_.push_back(std::move(loop));
+        it = loops_.end() - 1;
+      }
+      // The body is everything reaching the latch without passing through
+      // the header.
+      auto& body = it->body;
+      if (!body[latch]) {
+        body[latch] = true;
+        worklist.push_back(latch);
+      }
+      while (!worklist.empty()) {
+        uint32_t block = worklist.back();
+        worklist.pop_back();
+        for (uint32_t predecessor : predecessors_[block]) {
+          if (idoms_[predecessor] != kNoBlock && !body[predecessor]) {
+            body[predecessor] = true;
+            worklist.push_back(predecessor);
+          }
+        }
+      }
+    }
+  }
+
+  for (Loop& loop : loops_) {
+    for (const Loop& other_loop : loops_) {
+      if (other_loop.body[loop.header->ordinal]) {
+        ++loop.depth;
+      }
+      if (&other_loop != &loop && loop.body[other_loop.header->ordinal]) {
+        loop.innermost = false;
+      }
+    }
+  }
+}
+
+bool LoopInvariantCodeMotionPass::CanHoist(HIRBuilder* builder,
+                                           const Loop& loop) const {
+  // The preheader is inserted right before the header, so the block before
+  // the header must not be a part of the loop falling through into it.
+  auto prev = loop.header->prev;
+  if (prev && loop.body[prev->ordinal] &&
+      (!prev->instr_tail || !builder->IsUnconditionalJump(prev->instr_tail))) {
+    return false;
+  }
+
+  // Calls and traps may change anything, including the context.
+  for (uint32_t i = 0; i < uint32_t(blocks_.size()); ++i) {
+    if (!loop.body[i]) {
+      continue;
+    }
+    for (auto instr = blocks_[i]->instr_head; instr; instr = instr->next) {
+      if (instr->opcode == &OPCODE_BRANCH_TRUE_info ||
+          instr->opcode == &OPCODE_BRANCH_FALSE_info ||
+          instr->opcode == &OPCODE_RETURN_TRUE_info) {
+        continue;
+      }
+      if (instr->opcode->flags & OPCODE_FLAG_VOLATILE ||
+          instr->opcode == &OPCODE_CONTEXT_BARRIER_info ||
+          instr->opcode == &OPCODE_SET_ROUNDING_MODE_info) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+uint32_t LoopInvariantCodeMotionPass::HoistInvariants(HIRBuilder* builder,
+                                                      const Loop& loop) {
+  stored_context_ranges_.clear();
+  stored_locals_.clear();
+  for (uint32_t i = 0; i < uint32_t(blocks_.size()); ++i) {
+    if (!loop.body[i]) {
+      continue;
+    }
+    for (auto instr = blocks_[i]->instr_head; instr; instr = instr->next) {
+      if (instr->opcode == &OPCODE_STORE_CONTEXT_info) {
+        size_t offset = instr->src1.offset;
+        stored_context_ranges_.emplace_back(
+            offset, offset + GetTypeSize(instr->src2.value->type));
+      } else if (instr->opcode == &OPCODE_STORE_LOCAL_info) {
+        stored_locals_.insert(instr->src1.value);
+      }
+    }
+  }
+
+  preheader_anchor_ = nullptr;
+  uint32_t hoisted_instr_count = 0;
+  for (uint32_t i = 0; i < uint32_t(blocks_.size()); ++i) {
+    if (loop.body[i]) {
+      hoisted_instr_count += HoistBlockInvariants(builder, loop, blocks_[i]);
+    }
+  }
+  return hoisted_instr_count;
+}
+
+uint32_t LoopInvariantCodeMotionPass::HoistBlockInvariants(HIRBuilder* builder,
+                                                           const Loop& loop,
+                                                           Block* block) {
+  // Values can't be used in other blocks, so the operands of invariant
+  // instructions are either constants or defined earlier in the block.
+  invariant_instrs_.clear();
+  std::vector<Instr*> hoisted_instrs;
+  int32_t benefit = 0;
+  for (auto instr = block->instr_head; instr; instr = instr->next) {
+    if (IsInvariantLeaf(instr)) {
+      invariant_instrs_.insert(instr);
+      continue;
+    }
+    int32_t cost = GetHoistCost(instr);
+    if (!cost || (instr->next && instr->next->opcode->flags &
+                                     OPCODE_FLAG_PAIRED_PREV)) {
+      continue;
+    }
+    auto sig = instr->opcode->signature;
+    const Value* srcs[] = {
+        GET_OPCODE_SIG_TYPE_SRC1(sig) == OPCODE_SIG_TYPE_V ? instr->src1.value
+                                                           : nullptr,
+        GET_OPCODE_SIG_TYPE_SRC2(sig) == OPCODE_SIG_TYPE_V ? instr->src2.value
+                                                           : nullptr,
+        GET_OPCODE_SIG_TYPE_SRC3(sig) == OPCODE_SIG_TYPE_V ? instr->src3.value
+                                                           : nullptr,
+    };
+    bool is_invariant = true;
+    for (const Value* src : srcs) {
+      if (src && !src->IsConstant() &&
+          (!src->def || !invariant_instrs_.count(src->def))) {
+        is_invariant = false;
+        break;
+      }
+    }
+    if (is_invariant) {
+      invariant_instrs_.insert(instr);
+      hoisted_instrs.push_back(instr);
+      benefit += cost;
+    }
+  }
+
+  // Values still used in the loop must be passed through locals.
+  std::vector<Instr*> roots;
+  for (Instr* instr : hoisted_instrs) {
+    for (auto use = instr->dest->use_head; use; use = use->next) {
+      if (!invariant_instrs_.count(use->instr)) {
+        roots.push_back(instr);
+        break;
+      }
+    }
+  }
+  benefit -= int32_t(roots.size());
+  if (hoisted_instrs.empty() || benefit < kMinHoistBenefit) {
+    return 0;
+  }
+
+  if (!preheader_anchor_) {
+    preheader_anchor_ = CreatePreheader(builder, loop);
+  }
+  auto anchor = preheader_anchor_;
+
+  // Leaves are copied, they may have other uses in the loop.
+  leaf_clones_.clear();
+  for (Instr* instr : hoisted_instrs) {
+    auto sig = instr->opcode->signature;
+    const OpcodeSignatureType src_types[] = {
+        GET_OPCODE_SIG_TYPE_SRC1(sig),
+        GET_OPCODE_SIG_TYPE_SRC2(sig),
+        GET_OPCODE_SIG_TYPE_SRC3(sig),
+    };
+    Instr::Op* srcs[] = {&instr->src1, &instr->src2, &instr->src3};
+    for (size_t i = 0; i < 3; ++i) {
+      if (src_types[i] != OPCODE_SIG_TYPE_V) {
+        continue;
+      }
+      Value* src = srcs[i]->value;
+      // Hoisted operands are already in the preheader.
+      if (src->IsConstant() || src->def->block != block) {
+        continue;
+      }
+      auto& clone = leaf_clones_[src];
+      if (!clone) {
+        auto leaf = src->def;
+        if (leaf->opcode == &OPCODE_LOAD_CONTEXT_info) {
+          clone = builder->LoadContext(leaf->src1.offset, src->type);
+        } else {
+          clone = builder->LoadLocal(leaf->src1.value);
+        }
+        builder->last_instr()->MoveBefore(anchor);
+      }
+      ReplaceOperand(instr, src, clone);
+    }
+    instr->MoveBefore(anchor);
+  }
+
+  for (Instr* root : roots) {
+    Value* value = root->dest;
+    Value* slot = builder->AllocLocal(value->type);
+    builder->StoreLocal(slot, value);
+    builder->last_instr()->MoveBefore(anchor);
+
+    // Reload before the first remaining use, keeping paired instructions
+    // together.
+    Instr* first_use = block->instr_head;
+    while (!UsesValue(first_use, value)) {
+      first_use = first_use->next;
+    }
+    while (first_use->prev &&
+           first_use->opcode->flags & OPCODE_FLAG_PAIRED_PREV) {
+      first_use = first_use->prev;
+    }
+    Value* reload = builder->LoadLocal(slot);
+    builder->last_instr()->MoveBefore(first_use);
+
+    std::vector<Instr*> users;
+    for (auto use = value->use_head; use; use = use->next) {
+      if (use->instr->block == block) {
+        users.push_back(use->instr);
+      }
+    }
+    for (Instr* user : users) {
+      ReplaceOperand(user, value, reload);
+    }
+  }
+
+  return uint32_t(hoisted_instrs.size());
+}
+
+Instr* LoopInvariantCodeMotionPass::CreatePreheader(HIRBuilder* builder,
+                                                   const Loop& loop) {
+  auto header = loop.header;
+  auto preheader = builder->InsertBlock(header);
+  auto label = builder->NewLabel();
+  builder->MarkLabel(label, preheader);
+  builder->Branch(header);
+
+  // Enter the loop through the preheader.
+  for (uint32_t i = 0; i < uint32_t(blocks_.size()); ++i) {
+    if (loop.body[i]) {
+      continue;
+    }
+    for (auto instr = blocks_[i]->instr_head; instr; instr = instr->next) {
+      if (instr->opcode == &OPCODE_BRANCH_info) {
+        if (instr->src1.label->block == header) {
+          instr->src1.label = label;
+        }
+      } else if (instr->opcode == &OPCODE_BRANCH_TRUE_info ||
+                 instr->opcode == &OPCODE_BRANCH_FALSE_info) {
+        if (instr->src2.label->block == header) {
+          instr->src2.label = label;
+        }
+      }
+    }
+  }
+
+  return preheader->instr_tail;
+}
+
+bool LoopInvariantCodeMotionPass::IsInvariantLeaf(const Instr* instr) const {
+  if (instr->opcode == &OPCODE_LOAD_CONTEXT_info) {
+    size_t offset = instr->src1.offset;
+    size_t end = offset + GetTypeSize(instr->dest->type);
+    for (const auto& range : stored_context_ranges_) {
+      if (offset < range.second && range.first < end) {
+        return false;
+      }
+    }
+    return true;
+  } else if (instr->opcode == &OPCODE_LOAD_LOCAL_info) {
+    return !stored_locals_.count(instr->src1.value);
+  }
+  return false;
+}
+
+}  // namespace passes
+}  // namespace compiler
+}  // namespace cpu
+}  // namespace xe
@@ -0,0 +1,88 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_CPU_COMPILER_PASSES_LOOP_INVARIANT_CODE_MOTION_PASS_H_
+#define XENIA_CPU_COMPILER_PASSES_LOOP_INVARIANT_CODE_MOTION_PASS_H_
+
+#include <cstdint>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "xenia/cpu/compiler/compiler_pass.h"
+
+namespace xe {
+namespace cpu {
+namespace compiler {
+namespace passes {
+
+// Finds the natural loops of the function and moves computations that produce
+// the same value on every iteration into a new block executed once before the
+// loop.
+// Values can't live across blocks, so each hoisted value that is still used
+// in the loop is passed through a local, which costs a load per iteration.
+// Only trees of instructions that are more expensive than that are hoisted.
+class LoopInvariantCodeMotionPass : public CompilerPass {
+ public:
+  LoopInvariantCodeMotionPass();
+  ~LoopInvariantCodeMotionPass() override;
+
+  const char* name() const override { return "LoopInvariantCodeMotion"; }
+
+  bool Run(hir::HIRBuilder* builder) override;
+
+ private:
+  static constexpr uint32_t kNoBlock = UINT32_MAX;
+
+  struct Loop {
+    hir::Block* header;
+    // Indexed by block ordinal.
+    std::vector<bool> body;
+    uint32_t depth;
+    bool innermost;
+  };
+
+  bool FindBlocks(hir::HIRBuilder* builder);
+  void ComputeDominators();
+  bool Dominates(uint32_t dominator, uint32_t block) const;
+  void FindLoops();
+  bool CanHoist(hir::HIRBuilder* builder, const Loop& loop) const;
+  uint32_t HoistInvariants(hir::HIRBuilder* builder, const Loop& loop);
+  uint32_t HoistBlockInvariants(hir::HIRBuilder* builder, const Loop& loop,
+                                hir::Block* block);
+  hir::Instr* CreatePreheader(hir::HIRBuilder* builder, const Loop& loop);
+  bool IsInvariantLeaf(const hir::Instr* instr) const;
+
+  // Indexed by block ordinal.
+  std::vector<hir::Block*> blocks_;
+  std::vector<std::vector<uint32_t>> successors_;
+  std::vector<std::vector<uint32_t>> predecessors_;
+  std::vector<uint32_t> rpo_numbers_;
+  std::vector<uint32_t> idoms_;
+
+  std::vector<Loop> loops_;
+
+  // Context and locals written anywhere in the loop being processed.
+  std::vector<std::pair<size_t, size_t>> stored_context_ranges_;
+  std::unordered_set<const hir::Value*> stored_locals_;
+
+  std::unordered_set<const hir::Instr*> invariant_instrs_;
+  std::unordered_map<const hir::Value*, hir::Value*> leaf_clones_;
+  // Hoisted instructions are inserted before the branch ending the
+  // preheader, created when the first one is found.
+  hir::Instr* preheader_anchor_ = nullptr;
+};
+
+}  // namespace passes
+}  // namespace compiler
+}  // namespace cpu
+}  // namespace xe
+
+#endif  // XENIA_CPU_COMPILER_PASSES_LOOP_INVARIANT_CODE_MOTION_PASS_H_
@@ -9,6 +9,11 @@
 
 #include "xenia/cpu/compiler/passes/value_reduction_pass.h"
 
+#include <functional>
+#include <queue>
+#include <vector>
+
+#include "xenia/base/math.h"
 #include "xenia/base/platform.h"
 #include "xenia/base/profiling.h"
 #include "xenia/cpu/backend/backend.h"
@@ -42,15 +47,16 @@ ValueReductionPass::ValueReductionPass() : CompilerPass() {}
 
 ValueReductionPass::~ValueReductionPass() {}
 
-void ValueReductionPass::ComputeLastUse(Value* value) {
+void ValueReductionPass::ComputeLastUse(Value* value, const Block* block) {
   // TODO(benvanik): compute during construction?
   // Note that this list isn't sorted (unfortunately), so we have to scan
-  // them all.
+  // them all. Instruction ordinals are only comparable within the block.
   uint32_t max_ordinal = 0;
   Value::Use* last_use = nullptr;
   auto use = value->use_head;
   while (use) {
-    if (!last_use || use->instr->ordinal >= max_ordinal) {
+    if (use->instr->block == block &&
+        (!last_use || use->instr->ordinal >= max_ordinal)) {
       last_use = use;
       max_ordinal = use->instr->ordinal;
     }
@@ -62,74 +68,116 @@ void ValueReductionPass::ComputeLastUse(Value* value) {
 bool ValueReductionPass::Run(HIRBuilder* builder) {
   // Walk each block and reuse variable ordinals as much as possible.
 
-  llvm::BitVector ordinals(builder->max_value_ordinal());
-
+  // Values used outside of the block defining them keep their ordinals, so
+  // that they can't collide with values of the other blocks. This includes
+  // locals and constants, which have no defining instruction - the interpreter
+  // keeps constants in the registers of their ordinals for the whole function.
+  llvm::BitVector reserved_ordinals(builder->max_value_ordinal());
+  for (Value* local : builder->locals()) {
+    reserved_ordinals.set(local->ordinal);
+  }
   auto block = builder->first_block();
+  while (block) {
+    auto instr = block->instr_head;
+    while (instr) {
+      const OpcodeInfo* info = instr->opcode;
+      Value* sources[] = {
+          GET_OPCODE_SIG_TYPE_SRC1(info->signature) == OPCODE_SIG_TYPE_V
+              ? instr->src1.value
+              : nullptr,
+          GET_OPCODE_SIG_TYPE_SRC2(info->signature) == OPCODE_SIG_TYPE_V
+              ? instr->src2.value
+              : nullptr,
+          GET_OPCODE_SIG_TYPE_SRC3(info->signature) == OPCODE_SIG_TYPE_V
+              ? instr->src3.value
+              : nullptr,
+      };
+      for (Value* v : sources) {
+        if (v && (v->IsConstant() || !v->def || v->def->block != block)) {
+          reserved_ordinals.set(v->ordinal);
+        }
+      }
+      instr = instr->next;
+    }
+    block = block->next;
+  }
+
+  // Lowest free ordinals are reused first.
+  std::priority_queue<uint32_t, std::vector<uint32_t>, std::greater<uint32_t>>
+      free_ordinals;
+  uint32_t next_ordinal = 0;
+  auto allocate_ordinal = [&]() {
+    if (!free_ordinals.empty()) {
+      uint32_t ordinal = free_ordinals.top();
+      free_ordinals.pop();
+      return ordinal;
+    }
+    while (next_ordinal < reserved_ordinals.size() &&
+           reserved_ordinals.test(next_ordinal)) {
+      ++next_ordinal;
+    }
+    return next_ordinal++;
+  };
+
+  block = builder->first_block();
   while (block) {
     // Reset used ordinals.
-    ordinals.reset();
+    free_ordinals = {};
+    next_ordinal = 0;
 
-    // Renumber all instructions to make liveness tracking easier.
+    // Renumber all instructions to make liveness tracking easier. Last uses
+    // may be stale if earlier passes moved them.
     uint32_t instr_ordinal = 0;
     auto instr = block->instr_head;
     while (instr) {
       instr->ordinal = instr_ordinal++;
+      if (GET_OPCODE_SIG_TYPE_DEST(instr->opcode->signature) ==
+          OPCODE_SIG_TYPE_V) {
+        instr->dest->last_use = nullptr;
+      }
       instr = instr->next;
     }
 
     instr = block->instr_head;
     while (instr) {
       const OpcodeInfo* info = instr->opcode;
-      auto dest_type = GET_OPCODE_SIG_TYPE_DEST(info->signature);
-      auto src1_type = GET_OPCODE_SIG_TYPE_SRC1(info->signature);
-      auto src2_type = GET_OPCODE_SIG_TYPE_SRC2(info->signature);
-      auto src3_type = GET_OPCODE_SIG_TYPE_SRC3(info->signature);
-      if (src1_type == OPCODE_SIG_TYPE_V) {
-        auto v = instr->src1.value;
-        if (!v->last_use) {
-          ComputeLastUse(v);
+      Value* sources[] = {
+          GET_OPCODE_SIG_TYPE_SRC1(info->signature) == OPCODE_SIG_TYPE_V
+              ? instr->src1.value
+              : nullptr,
+          GET_OPCODE_SIG_TYPE_SRC2(info->signature) == OPCODE_SIG_TYPE_V
+              ? instr->src2.value
+              : nullptr,
+          GET_OPCODE_SIG_TYPE_SRC3(info->signature) == OPCODE_SIG_TYPE_V
+              ? instr->src3.value
+              : nullptr,
+      };
+      for (size_t n = 0; n < xe::countof(sources); ++n) {
+        Value* v = sources[n];
+        if (!v || reserved_ordinals.test(v->ordinal)) {
+          continue;
         }
-        if (v->last_use == instr) {
-          // Available.
-          if (!instr->src1.value->IsConstant()) {
-            ordinals.reset(v->ordinal);
-          }
+        // The same value may be used by multiple operands.
+        if ((n > 0 && v == sources[0]) || (n > 1 && v == sources[1])) {
+          continue;
         }
-      }
-      if (src2_type == OPCODE_SIG_TYPE_V) {
-        auto v = instr->src2.value;
         if (!v->last_use) {
-          ComputeLastUse(v);
+          ComputeLastUse(v, block);
         }
         if (v->last_use == instr) {
           // Available.
-          if (!instr->src2.value->IsConstant()) {
-            ordinals.reset(v->ordinal);
-          }
-        }
-      }
-      if (src3_type == OPCODE_SIG_TYPE_V) {
-        auto v = instr->src3.value;
-        if (!v->last_use) {
-          ComputeLastUse(v);
-        }
-        if (v->last_use == instr) {
-          // Available.
-          if (!instr->src3.value->IsConstant()) {
-            ordinals.reset(v->ordinal);
-          }
+          free_ordinals.push(v->ordinal);
         }
       }
-      if (dest_type == OPCODE_SIG_TYPE_V) {
+      if (GET_OPCODE_SIG_TYPE_DEST(info->signature) == OPCODE_SIG_TYPE_V) {
         // Dest values are processed last, as they may be able to reuse a
         // source value ordinal.
         auto v = instr->dest;
-        // Find a lower ordinal.
-        for (auto n = 0u; n < ordinals.size(); n++) {
-          if (!ordinals.test(n)) {
-            ordinals.set(n);
-            v->ordinal = n;
-            break;
+        if (!reserved_ordinals.test(v->ordinal)) {
+          v->ordinal = allocate_ordinal();
+          if (!v->use_head) {
+            // Never used.
+            free_ordinals.push(v->ordinal);
           }
         }
       }
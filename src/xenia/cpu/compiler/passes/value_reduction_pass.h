@@ -22,10 +22,12 @@ class ValueReductionPass : public CompilerPass {
   ValueReductionPass();
   ~ValueReductionPass() override;
 
+  const char* name() const override { return "ValueReduction"; }
+
   bool Run(hir::HIRBuilder* builder) override;
 
  private:
-  void ComputeLastUse(hir::Value* value);
+  void ComputeLastUse(hir::Value* value, const hir::Block* block);
 };
 
 }  // namespace passes
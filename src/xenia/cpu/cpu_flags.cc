@@ -9,7 +9,7 @@
 
 #include "xenia/cpu/cpu_flags.h"
 
-DEFINE_string(cpu, "any", "CPU backend [any, x64].", "CPU");
+DEFINE_string(cpu, "any", "CPU backend [any, x64, interpreter].", "CPU");
 
 DEFINE_string(
     load_module_map, "",
@@ -37,6 +37,41 @@ DEFINE_bool(
 
 DEFINE_bool(validate_hir, false,
             "Perform validation checks on the HIR during compilation.", "CPU");
+DEFINE_bool(hoist_loop_invariants, true,
+            "Move computations that don't change between loop iterations out "
+            "of loops in optimized guest code.",
+            "CPU");
+DEFINE_bool(translation_statistics, false,
+            "Measure the time spent in each stage and compiler pass of guest "
+            "code translation, and the HIR instruction counts around the "
+            "passes.",
+            "CPU");
+DEFINE_int32(translation_statistics_log_interval, 60,
+             "Seconds between logging the statistics collected with "
+             "--translation_statistics, 0 to log them only on shutdown.",
+             "CPU");
+
+DEFINE_bool(
+    tiered_compilation, false,
+    "Translate functions quickly with few optimizations first, and retranslate "
+    "them with all optimizations in the background once they've been called "
+    "tier_up_call_count times.",
+    "CPU");
+DEFINE_int32(tier_up_call_count, 1000,
+             "Number of calls after which a function translated with few "
+             "optimizations is retranslated with all of them.",
+             "CPU");
+
+DEFINE_int32(interpreter_tier_call_count, 0,
+             "Run functions in the HIR interpreter first, and translate them "
+             "to native code once they've been called this many times. 0 to "
+             "disable.",
+             "CPU");
+
+DEFINE_bool(native_crt_routines, true,
+            "Replace guest C runtime routines (memcpy, strlen, etc) known from "
+            "the module map with host implementations.",
+            "CPU");
 
 DEFINE_uint64(
     pvr, 0x710700,
@@ -55,3 +90,8 @@ DEFINE_bool(break_condition_truncate, true, "truncate value to 32-bits", "CPU");
 
 DEFINE_bool(break_on_debugbreak, true, "int3 on JITed __debugbreak requests.",
             "CPU");
+
+DEFINE_bool(debugprint_trap_log, false,
+            "Log debugprint traps to the active debugger", "CPU");
+DEFINE_bool(ignore_undefined_externs, true,
+            "Don't exit when an undefined extern is called.", "CPU");
@@ -25,6 +25,15 @@ DECLARE_bool(trace_function_data);
 DECLARE_bool(disable_global_lock);
 
 DECLARE_bool(validate_hir);
+DECLARE_bool(hoist_loop_invariants);
+DECLARE_bool(translation_statistics);
+DECLARE_int32(translation_statistics_log_interval);
+
+DECLARE_bool(tiered_compilation);
+DECLARE_int32(tier_up_call_count);
+DECLARE_int32(interpreter_tier_call_count);
+
+DECLARE_bool(native_crt_routines);
 
 DECLARE_uint64(pvr);
 
@@ -37,4 +46,7 @@ DECLARE_bool(break_condition_truncate);
 
 DECLARE_bool(break_on_debugbreak);
 
+DECLARE_bool(debugprint_trap_log);
+DECLARE_bool(ignore_undefined_externs);
+
 #endif  // XENIA_CPU_CPU_FLAGS_H_
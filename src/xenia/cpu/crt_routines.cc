@@ -0,0 +1,219 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/crt_routines.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "xenia/cpu/ppc/ppc_context.h"
+#include "xenia/cpu/thread_state.h"
+#include "xenia/memory.h"
+
+namespace xe {
+namespace cpu {
+
+using ppc::PPCContext;
+
+// Guest memory is contiguous in the host address space within a heap, but
+// heaps may be mapped with different host address offsets. Returns the host
+// address of the guest address, and clamps the length to the end of its heap.
+// Returns null for addresses outside the heaps of RAM, such as MMIO ranges,
+// which only guest loads and stores can access.
+static uint8_t* TranslateSpan(Memory* memory, uint32_t address,
+                              uint32_t* length) {
+  const BaseHeap* heap = memory->LookupHeap(address);
+  if (!heap) {
+    return nullptr;
+  }
+  uint64_t heap_end = uint64_t(heap->heap_base()) + heap->heap_size();
+  *length = uint32_t(std::min(uint64_t(*length), heap_end - address));
+  return memory->TranslateVirtual(address);
+}
+
+static bool IsRamSpan(Memory* memory, uint32_t address, uint32_t length) {
+  while (length) {
+    uint32_t span_length = length;
+    if (!TranslateSpan(memory, address, &span_length)) {
+      return false;
+    }
+    address += span_length;
+    length -= span_length;
+  }
+  return true;
+}
+
+// Strings may only be read up to the end of the page containing their
+// terminator, nothing past it is known to be mapped.
+static uint32_t GetBytesToPageEnd(uint32_t address) {
+  return 4096 - (address & 4095);
+}
+
+static Memory* GetMemory(PPCContext* ppc_context) {
+  return ppc_context->thread_state->memory();
+}
+
+// Leaves the call to the guest routine.
+static void Decline(PPCContext* ppc_context) { ppc_context->scratch = 0; }
+
+static void Complete(PPCContext* ppc_context, uint64_t result) {
+  ppc_context->r[3] = result;
+  ppc_context->scratch = 1;
+}
+
+// void* memcpy(void* dest, const void* src, size_t count)
+// void* memmove(void* dest, const void* src, size_t count)
+// Bytes are copied as they are, so guest endianness doesn't matter. memcpy
+// with overlapping ranges is undefined, so it's safe to handle it like memmove.
+static void CrtMemmove(PPCContext* ppc_context, kernel::KernelState*) {
+  Memory* memory = GetMemory(ppc_context);
+  auto dest = uint32_t(ppc_context->r[3]);
+  auto src = uint32_t(ppc_context->r[4]);
+  auto count = uint32_t(ppc_context->r[5]);
+  if (!IsRamSpan(memory, dest, count) || !IsRamSpan(memory, src, count)) {
+    Decline(ppc_context);
+    return;
+  }
+  uint32_t dest_count = count;
+  uint32_t src_count = count;
+  uint8_t* dest_ptr = TranslateSpan(memory, dest, &dest_count);
+  uint8_t* src_ptr = TranslateSpan(memory, src, &src_count);
+  if (!count) {
+    // Nothing to copy, and the pointers may be anything.
+  } else if (dest_count == count && src_count == count) {
+    std::memmove(dest_ptr, src_ptr, count);
+  } else if (dest <= src) {
+    // Crossing a heap boundary.
+    for (uint32_t i = 0; i < count; ++i) {
+      *memory->TranslateVirtual(dest + i) = *memory->TranslateVirtual(src + i);
+    }
+  } else {
+    for (uint32_t i = count; i > 0; --i) {
+      *memory->TranslateVirtual(dest + i - 1) =
+          *memory->TranslateVirtual(src + i - 1);
+    }
+  }
+  Complete(ppc_context, dest);
+}
+
+// void* memset(void* dest, int c, size_t count)
+static void CrtMemset(PPCContext* ppc_context, kernel::KernelState*) {
+  Memory* memory = GetMemory(ppc_context);
+  auto dest = uint32_t(ppc_context->r[3]);
+  auto c = uint8_t(ppc_context->r[4]);
+  auto count = uint32_t(ppc_context->r[5]);
+  if (!IsRamSpan(memory, dest, count)) {
+    Decline(ppc_context);
+    return;
+  }
+  uint32_t address = dest;
+  while (count) {
+    uint32_t span_count = count;
+    uint8_t* span = TranslateSpan(memory, address, &span_count);
+    std::memset(span, c, span_count);
+    address += span_count;
+    count -= span_count;
+  }
+  Complete(ppc_context, dest);
+}
+
+// size_t strlen(const char* str)
+// Strings are only read, so the guest routine can take over at any point.
+static void CrtStrlen(PPCContext* ppc_context, kernel::KernelState*) {
+  Memory* memory = GetMemory(ppc_context);
+  auto str = uint32_t(ppc_context->r[3]);
+  uint32_t address = str;
+  while (true) {
+    uint32_t span_count = GetBytesToPageEnd(address);
+    auto span = TranslateSpan(memory, address, &span_count);
+    if (!span) {
+      Decline(ppc_context);
+      return;
+    }
+    auto terminator =
+        reinterpret_cast<const uint8_t*>(std::memchr(span, 0, span_count));
+    if (terminator) {
+      address += uint32_t(terminator - span);
+      break;
+    }
+    address += span_count;
+  }
+  Complete(ppc_context, address - str);
+}
+
+// int strcmp(const char* lhs, const char* rhs)
+static void CrtStrcmp(PPCContext* ppc_context, kernel::KernelState*) {
+  Memory* memory = GetMemory(ppc_context);
+  auto lhs = uint32_t(ppc_context->r[3]);
+  auto rhs = uint32_t(ppc_context->r[4]);
+  int32_t result = 0;
+  while (true) {
+    uint32_t lhs_count = GetBytesToPageEnd(lhs);
+    uint32_t rhs_count = GetBytesToPageEnd(rhs);
+    auto lhs_span = TranslateSpan(memory, lhs, &lhs_count);
+    auto rhs_span = TranslateSpan(memory, rhs, &rhs_count);
+    if (!lhs_span || !rhs_span) {
+      Decline(ppc_context);
+      return;
+    }
+    uint32_t span_count = std::min(lhs_count, rhs_count);
+    uint32_t i = 0;
+    for (; i < span_count; ++i) {
+      // Compared as unsigned char.
+      uint8_t l = lhs_span[i];
+      uint8_t r = rhs_span[i];
+      if (l != r) {
+        result = l < r ? -1 : 1;
+        break;
+      }
+      if (!l) {
+        break;
+      }
+    }
+    if (i < span_count) {
+      break;
+    }
+    lhs += span_count;
+    rhs += span_count;
+  }
+  Complete(ppc_context, uint64_t(int64_t(result)));
+}
+
+static const struct {
+  std::string_view name;
+  GuestFunction::ExternHandler handler;
+} crt_routines[] = {
+    {"memcpy", CrtMemmove}, {"memmove", CrtMemmove}, {"memset", CrtMemset},
+    {"strlen", CrtStrlen},  {"strcmp", CrtStrcmp},
+};
+
+GuestFunction::ExternHandler LookupCrtRoutine(std::string_view name) {
+  // Map files may have the C names decorated with an underscore.
+  if (name.size() > 1 && name[0] == '_' && name[1] != '_') {
+    name.remove_prefix(1);
+  }
+  for (const auto& crt_routine : crt_routines) {
+    if (crt_routine.name == name) {
+      return crt_routine.handler;
+    }
+  }
+  return nullptr;
+}
+
+bool IsCrtRoutine(GuestFunction::ExternHandler handler) {
+  for (const auto& crt_routine : crt_routines) {
+    if (crt_routine.handler == handler) {
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace cpu
+}  // namespace xe
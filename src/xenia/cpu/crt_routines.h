@@ -0,0 +1,36 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_CPU_CRT_ROUTINES_H_
+#define XENIA_CPU_CRT_ROUTINES_H_
+
+#include <string_view>
+
+#include "xenia/cpu/function.h"
+
+namespace xe {
+namespace cpu {
+
+// Host implementations of guest C runtime routines (memcpy, strlen, etc).
+// Returns the one for the symbol name, or null if there is none. Functions set
+// up as externs with them are called from guest code like imports instead of
+// running the translated guest loops.
+// The handlers set PPCContext::scratch to 1 if they performed the routine, or
+// to 0 without changing any guest state if the guest routine must be executed
+// instead, such as when an argument points to MMIO.
+GuestFunction::ExternHandler LookupCrtRoutine(std::string_view name);
+
+// Whether the extern handler is a C runtime routine implementation which may
+// leave the work to the guest routine.
+bool IsCrtRoutine(GuestFunction::ExternHandler handler);
+
+}  // namespace cpu
+}  // namespace xe
+
+#endif  // XENIA_CPU_CRT_ROUTINES_H_
@@ -2,36 +2,71 @@
  ******************************************************************************
  * Xenia : Xbox 360 Emulator Research Project                                 *
  ******************************************************************************
- * Copyright 2013 Ben Vanik. All rights reserved.                             *
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
  * Released under the BSD license - see LICENSE in the root for more details. *
  ******************************************************************************
  */
 
 #include "xenia/cpu/entry_table.h"
 
+#include <algorithm>
+
 #include "xenia/base/profiling.h"
 #include "xenia/base/threading.h"
 
 namespace xe {
 namespace cpu {
 
-EntryTable::EntryTable() = default;
+EntryTable::EntryTable() : pages_(new std::atomic<Slot*>[kPageCount]()) {}
 
 EntryTable::~EntryTable() {
-  auto global_lock = global_critical_region_.Acquire();
-  for (auto it : map_) {
-    Entry* entry = it.second;
+  for (uint32_t i = 0; i < kPageCount; ++i) {
+    Slot* page = pages_[i].load(std::memory_order_acquire);
+    if (!page) {
+      continue;
+    }
+    for (uint32_t j = 0; j < kPageSlotCount; ++j) {
+      delete page[j].load(std::memory_order_relaxed);
+    }
+    delete[] page;
+  }
+  for (Entry* entry : invalidated_entries_) {
     delete entry;
   }
 }
 
+EntryTable::Slot* EntryTable::GetSlot(uint32_t address) {
+  std::atomic<Slot*>& page_ptr = pages_[address >> kPageShift];
+  Slot* page = page_ptr.load(std::memory_order_acquire);
+  if (!page) {
+    Slot* new_page = new Slot[kPageSlotCount]();
+    if (page_ptr.compare_exchange_strong(page, new_page,
+                                         std::memory_order_acq_rel,
+                                         std::memory_order_acquire)) {
+      page = new_page;
+    } else {
+      // Another thread has allocated the page first.
+      delete[] new_page;
+    }
+  }
+  return &page[(address & ((uint32_t(1) << kPageShift) - 1)) >> 2];
+}
+
 Entry* EntryTable::Get(uint32_t address) {
-  auto global_lock = global_critical_region_.Acquire();
-  const auto& it = map_.find(address);
-  Entry* entry = it != map_.end() ? it->second : nullptr;
+  if (address & 3) {
+    return nullptr;
+  }
+  Slot* page = pages_[address >> kPageShift].load(std::memory_order_acquire);
+  if (!page) {
+    return nullptr;
+  }
+  Entry* entry =
+      page[(address & ((uint32_t(1) << kPageShift) - 1)) >> 2].load(
+          std::memory_order_acquire);
   if (entry) {
     // TODO(benvanik): wait if needed?
-    if (entry->status != Entry::STATUS_READY) {
+    if (entry->status.load(std::memory_order_acquire) !=
+        Entry::STATUS_READY) {
       entry = nullptr;
     }
   }
@@ -39,49 +74,130 @@ Entry* EntryTable::Get(uint32_t address) {
 }
 
 Entry::Status EntryTable::GetOrCreate(uint32_t address, Entry** out_entry) {
-  // TODO(benvanik): replace with a map with wait-free for find.
-  // https://github.com/facebook/folly/blob/master/folly/AtomicHashMap.h
+  if (address & 3) {
+    // Not a valid instruction address.
+    *out_entry = nullptr;
+    return Entry::STATUS_FAILED;
+  }
 
-  auto global_lock = global_critical_region_.Acquire();
-  const auto& it = map_.find(address);
-  Entry* entry = it != map_.end() ? it->second : nullptr;
-  Entry::Status status;
-  if (entry) {
-    // If we aren't ready yet spin and wait.
-    if (entry->status == Entry::STATUS_COMPILING) {
-      // Still compiling, so spin.
-      do {
-        global_lock.unlock();
-        // TODO(benvanik): sleep for less time?
-        xe::threading::Sleep(std::chrono::microseconds(10));
-        global_lock.lock();
-      } while (entry->status == Entry::STATUS_COMPILING);
+  Slot* slot = GetSlot(address);
+  Entry* entry = slot->load(std::memory_order_acquire);
+  if (!entry) {
+    // Create and try to claim for initialization.
+    Entry* new_entry = new Entry();
+    new_entry->address = address;
+    new_entry->end_address = 0;
+    new_entry->status.store(Entry::STATUS_COMPILING, std::memory_order_relaxed);
+    new_entry->function = nullptr;
+    if (slot->compare_exchange_strong(entry, new_entry,
+                                      std::memory_order_acq_rel,
+                                      std::memory_order_acquire)) {
+      *out_entry = new_entry;
+      return Entry::STATUS_NEW;
     }
-    status = entry->status;
-  } else {
-    // Create and return for initialization.
-    entry = new Entry();
-    entry->address = address;
-    entry->end_address = 0;
-    entry->status = Entry::STATUS_COMPILING;
-    entry->function = 0;
-    map_[address] = entry;
-    status = Entry::STATUS_NEW;
+    // Lost the race, wait for the winner instead.
+    delete new_entry;
+  }
+
+  // If we aren't ready yet spin and wait.
+  Entry::Status status = entry->status.load(std::memory_order_acquire);
+  while (status == Entry::STATUS_COMPILING) {
+    // TODO(benvanik): sleep for less time?
+    xe::threading::Sleep(std::chrono::microseconds(10));
+    status = entry->status.load(std::memory_order_acquire);
   }
-  global_lock.unlock();
   *out_entry = entry;
   return status;
 }
 
+void EntryTable::SetReady(Entry* entry, Function* function,
+                          uint32_t end_address) {
+  entry->function = function;
+  entry->end_address = end_address;
+  entry->status.store(Entry::STATUS_READY, std::memory_order_release);
+
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  // Not indexed if the module was unloaded while the function was compiled.
+  if (GetSlot(entry->address)->load(std::memory_order_relaxed) == entry) {
+    index_pending_.push_back(entry);
+  }
+}
+
+void EntryTable::Invalidate(uint32_t low_address, uint32_t high_address) {
+  std::lock_guard<std::mutex> lock(index_mutex_);
+  size_t old_invalidated_count = invalidated_entries_.size();
+  uint64_t address = (uint64_t(low_address) + 3) & ~uint64_t(3);
+  while (address < high_address) {
+    uint64_t page_end = ((address >> kPageShift) + 1) << kPageShift;
+    Slot* page = pages_[address >> kPageShift].load(std::memory_order_acquire);
+    if (!page) {
+      address = page_end;
+      continue;
+    }
+    for (; address < std::min(page_end, uint64_t(high_address));
+         address += 4) {
+      Entry* entry = page[(address & ((uint32_t(1) << kPageShift) - 1)) >> 2]
+                         .exchange(nullptr, std::memory_order_acq_rel);
+      if (entry) {
+        invalidated_entries_.push_back(entry);
+      }
+    }
+  }
+  if (invalidated_entries_.size() == old_invalidated_count) {
+    return;
+  }
+
+  auto is_invalidated = [low_address, high_address](const Entry* entry) {
+    return entry->address >= low_address && entry->address < high_address;
+  };
+  index_pending_.erase(std::remove_if(index_pending_.begin(),
+                                      index_pending_.end(), is_invalidated),
+                       index_pending_.end());
+  index_.erase(std::remove_if(index_.begin(), index_.end(), is_invalidated),
+               index_.end());
+  index_max_end_.resize(index_.size());
+  uint32_t max_end = 0;
+  for (size_t i = 0; i < index_.size(); ++i) {
+    max_end = std::max(max_end, index_[i]->end_address);
+    index_max_end_[i] = max_end;
+  }
+}
+
 std::vector<Function*> EntryTable::FindWithAddress(uint32_t address) {
-  auto global_lock = global_critical_region_.Acquire();
+  std::lock_guard<std::mutex> lock(index_mutex_);
+
+  if (!index_pending_.empty()) {
+    auto compare_address = [](const Entry* a, const Entry* b) {
+      return a->address < b->address;
+    };
+    std::sort(index_pending_.begin(), index_pending_.end(), compare_address);
+    size_t old_size = index_.size();
+    index_.insert(index_.end(), index_pending_.cbegin(),
+                  index_pending_.cend());
+    std::inplace_merge(index_.begin(), index_.begin() + old_size,
+                       index_.end(), compare_address);
+    index_pending_.clear();
+    index_max_end_.resize(index_.size());
+    uint32_t max_end = 0;
+    for (size_t i = 0; i < index_.size(); ++i) {
+      max_end = std::max(max_end, index_[i]->end_address);
+      index_max_end_[i] = max_end;
+    }
+  }
+
   std::vector<Function*> fns;
-  for (auto& it : map_) {
-    Entry* entry = it.second;
-    if (address >= entry->address && address <= entry->end_address) {
-      if (entry->status == Entry::STATUS_READY) {
-        fns.push_back(entry->function);
-      }
+  // Walk back from the last entry starting at or before the address until no
+  // earlier entry can reach it.
+  size_t i = std::upper_bound(index_.cbegin(), index_.cend(), address,
+                              [](uint32_t value, const Entry* entry) {
+                                return value < entry->address;
+                              }) -
+             index_.cbegin();
+  while (i && index_max_end_[i - 1] >= address) {
+    --i;
+    Entry* entry = index_[i];
+    if (address <= entry->end_address) {
+      fns.push_back(entry->function);
     }
   }
   return fns;
@@ -2,7 +2,7 @@
  ******************************************************************************
  * Xenia : Xbox 360 Emulator Research Project                                 *
  ******************************************************************************
- * Copyright 2013 Ben Vanik. All rights reserved.                             *
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
  * Released under the BSD license - see LICENSE in the root for more details. *
  ******************************************************************************
  */
@@ -10,11 +10,12 @@
 #ifndef XENIA_CPU_ENTRY_TABLE_H_
 #define XENIA_CPU_ENTRY_TABLE_H_
 
-#include <unordered_map>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <vector>
 
-#include "xenia/base/mutex.h"
-
 namespace xe {
 namespace cpu {
 
@@ -30,24 +31,59 @@ typedef struct Entry_t {
 
   uint32_t address;
   uint32_t end_address;
-  Status status;
+  // Written with release semantics after function and end_address, so they
+  // can be read without locking once STATUS_READY is observed.
+  std::atomic<Status> status;
   Function* function;
 } Entry;
 
+// Maps guest addresses to their resolved functions.
+//
+// Lookups and creation are lock-free: slots are stored in a two-level table
+// indexed by guest address (guest code is 4-byte aligned) with second-level
+// pages allocated on demand, and the thread that succeeds to claim an empty
+// slot with a CAS is the one that must compile the function. Invalidate
+// removes the entries of unloaded modules from the slots and the index, but
+// they are only freed with the table, as other threads may still be using or
+// compiling them.
 class EntryTable {
  public:
   EntryTable();
   ~EntryTable();
 
   Entry* Get(uint32_t address);
+  // Returns STATUS_NEW if the caller has created the entry and must compile
+  // it, then call SetReady or set the status to STATUS_FAILED. If another
+  // thread is compiling the entry, waits for it to finish.
   Entry::Status GetOrCreate(uint32_t address, Entry** out_entry);
+  void SetReady(Entry* entry, Function* function, uint32_t end_address);
 
   std::vector<Function*> FindWithAddress(uint32_t address);
+  // Removes the entries in [low_address, high_address), so that the functions
+  // at the addresses are resolved again.
+  void Invalidate(uint32_t low_address, uint32_t high_address);
 
  private:
-  xe::global_critical_region global_critical_region_;
-  // TODO(benvanik): replace with a better data structure.
-  std::unordered_map<uint32_t, Entry*> map_;
+  static constexpr uint32_t kPageShift = 16;
+  static constexpr uint32_t kPageCount = uint32_t(1) << (32 - kPageShift);
+  static constexpr uint32_t kPageSlotCount = uint32_t(1) << (kPageShift - 2);
+  typedef std::atomic<Entry*> Slot;
+
+  Slot* GetSlot(uint32_t address);
+
+  std::unique_ptr<std::atomic<Slot*>[]> pages_;
+
+  // Interval index of ready entries for FindWithAddress, which is only used
+  // off the hot path (debugging and exception handling), rebuilt lazily.
+  std::mutex index_mutex_;
+  // Entries made ready since the index was last rebuilt.
+  std::vector<Entry*> index_pending_;
+  // Sorted by start address.
+  std::vector<Entry*> index_;
+  // Maximum end address of index_[0...i], to stop the backwards scan early.
+  std::vector<uint32_t> index_max_end_;
+  // Removed by Invalidate, guarded by index_mutex_.
+  std::vector<Entry*> invalidated_entries_;
 };
 
 }  // namespace cpu
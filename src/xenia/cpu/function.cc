@@ -58,7 +58,9 @@ GuestFunction::GuestFunction(Module* module, uint32_t address)
   behavior_ = Behavior::kDefault;
 }
 
-GuestFunction::~GuestFunction() = default;
+GuestFunction::~GuestFunction() {
+  delete code_version_.load(std::memory_order_relaxed);
+}
 
 void GuestFunction::SetupExtern(ExternHandler handler, Export* export_data) {
   behavior_ = Behavior::kExtern;
@@ -66,11 +68,31 @@ void GuestFunction::SetupExtern(ExternHandler handler, Export* export_data) {
   export_data_ = export_data;
 }
 
+void GuestFunction::PublishCodeVersion(uint8_t* machine_code,
+                                       size_t machine_code_length,
+                                       std::vector<SourceMapEntry> source_map,
+                                       Tier tier) {
+  auto version = std::make_unique<CodeVersion>();
+  version->machine_code = machine_code;
+  version->machine_code_length = machine_code_length;
+  version->source_map = std::move(source_map);
+  version->previous.reset(code_version_.load(std::memory_order_relaxed));
+  code_version_.store(version.release(), std::memory_order_seq_cst);
+  set_tier(tier);
+}
+
+const std::vector<SourceMapEntry>& GuestFunction::source_map() const {
+  static const std::vector<SourceMapEntry> empty_source_map;
+  const CodeVersion* version = code_version();
+  return version ? version->source_map : empty_source_map;
+}
+
 const SourceMapEntry* GuestFunction::LookupGuestAddress(
     uint32_t guest_address) const {
+  const auto& source_map = this->source_map();
   // TODO(benvanik): binary search? We know the list is sorted by code order.
-  for (size_t i = 0; i < source_map_.size(); ++i) {
-    const auto& entry = source_map_[i];
+  for (size_t i = 0; i < source_map.size(); ++i) {
+    const auto& entry = source_map[i];
     if (entry.guest_address == guest_address) {
       return &entry;
     }
@@ -79,9 +101,10 @@ const SourceMapEntry* GuestFunction::LookupGuestAddress(
 }
 
 const SourceMapEntry* GuestFunction::LookupHIROffset(uint32_t offset) const {
+  const auto& source_map = this->source_map();
   // TODO(benvanik): binary search? We know the list is sorted by code order.
-  for (size_t i = 0; i < source_map_.size(); ++i) {
-    const auto& entry = source_map_[i];
+  for (size_t i = 0; i < source_map.size(); ++i) {
+    const auto& entry = source_map[i];
     if (entry.hir_offset >= offset) {
       return &entry;
     }
@@ -89,16 +112,21 @@ const SourceMapEntry* GuestFunction::LookupHIROffset(uint32_t offset) const {
   return nullptr;
 }
 
-const SourceMapEntry* GuestFunction::LookupMachineCodeOffset(
-    uint32_t offset) const {
+static const SourceMapEntry* LookupSourceMapCodeOffset(
+    const std::vector<SourceMapEntry>& source_map, uint32_t offset) {
   // TODO(benvanik): binary search? We know the list is sorted by code order.
-  for (int64_t i = source_map_.size() - 1; i >= 0; --i) {
-    const auto& entry = source_map_[i];
+  for (int64_t i = source_map.size() - 1; i >= 0; --i) {
+    const auto& entry = source_map[i];
     if (entry.code_offset <= offset) {
       return &entry;
     }
   }
-  return source_map_.empty() ? nullptr : &source_map_[0];
+  return source_map.empty() ? nullptr : &source_map[0];
+}
+
+const SourceMapEntry* GuestFunction::LookupMachineCodeOffset(
+    uint32_t offset) const {
+  return LookupSourceMapCodeOffset(source_map(), offset);
 }
 
 uint32_t GuestFunction::MapGuestAddressToMachineCodeOffset(
@@ -109,15 +137,39 @@ uint32_t GuestFunction::MapGuestAddressToMachineCodeOffset(
 
 uintptr_t GuestFunction::MapGuestAddressToMachineCode(
     uint32_t guest_address) const {
-  auto entry = LookupGuestAddress(guest_address);
-  return reinterpret_cast<uintptr_t>(machine_code()) +
-         (entry ? entry->code_offset : 0);
+  const CodeVersion* version = code_version();
+  if (!version) {
+    return 0;
+  }
+  uint32_t code_offset = 0;
+  for (const auto& entry : version->source_map) {
+    if (entry.guest_address == guest_address) {
+      code_offset = entry.code_offset;
+      break;
+    }
+  }
+  return reinterpret_cast<uintptr_t>(version->machine_code) + code_offset;
 }
 
 uint32_t GuestFunction::MapMachineCodeToGuestAddress(
     uintptr_t host_address) const {
-  auto entry = LookupMachineCodeOffset(static_cast<uint32_t>(
-      host_address - reinterpret_cast<uintptr_t>(machine_code())));
+  // The address may be in an older version still running on the thread.
+  const CodeVersion* version = code_version();
+  for (const CodeVersion* code = version; code; code = code->previous.get()) {
+    uintptr_t code_address = reinterpret_cast<uintptr_t>(code->machine_code);
+    if (host_address >= code_address &&
+        host_address < code_address + code->machine_code_length) {
+      version = code;
+      break;
+    }
+  }
+  if (!version) {
+    return address();
+  }
+  auto entry = LookupSourceMapCodeOffset(
+      version->source_map,
+      static_cast<uint32_t>(
+          host_address - reinterpret_cast<uintptr_t>(version->machine_code)));
   return entry ? entry->guest_address : address();
 }
 
@@ -10,6 +10,7 @@
 #ifndef XENIA_CPU_FUNCTION_H_
 #define XENIA_CPU_FUNCTION_H_
 
+#include <atomic>
 #include <memory>
 #include <vector>
 
@@ -46,19 +47,26 @@ class Function : public Symbol {
   ~Function() override;
 
   uint32_t address() const { return address_; }
-  bool has_end_address() const { return end_address_ > 0; }
-  uint32_t end_address() const { return end_address_; }
-  void set_end_address(uint32_t value) { end_address_ = value; }
+  bool has_end_address() const { return end_address() > 0; }
+  // Rescanning for retranslation updates the end address while other threads
+  // may be looking the function up.
+  uint32_t end_address() const {
+    return end_address_.load(std::memory_order_relaxed);
+  }
+  void set_end_address(uint32_t value) {
+    end_address_.store(value, std::memory_order_relaxed);
+  }
   Behavior behavior() const { return behavior_; }
   void set_behavior(Behavior value) { behavior_ = value; }
   bool is_guest() const { return behavior_ != Behavior::kBuiltin; }
 
   bool ContainsAddress(uint32_t address) const {
-    if (!address_ || !end_address_) {
+    uint32_t end_address = this->end_address();
+    if (!address_ || !end_address) {
       return false;
     }
 
-    if (address >= address_ && address < end_address_) {
+    if (address >= address_ && address < end_address) {
       return true;
     }
 
@@ -70,7 +78,7 @@ class Function : public Symbol {
  protected:
   Function(Module* module, uint32_t address);
 
-  uint32_t end_address_ = 0;
+  std::atomic<uint32_t> end_address_ = {0};
   Behavior behavior_ = Behavior::kDefault;
 };
 
@@ -100,23 +108,59 @@ class GuestFunction : public Function {
   typedef void (*ExternHandler)(ppc::PPCContext* ppc_context,
                                 kernel::KernelState* kernel_state);
 
+  enum class Tier {
+    // Translated with all optimizations.
+    kOptimized,
+    // Translated quickly with few optimizations. The code counts down
+    // tier_up_counter on entry and requests retranslation as kOptimized when
+    // it reaches zero.
+    kBaseline,
+    // Executed by the HIR interpreter without being translated to machine
+    // code. Counts down tier_up_counter like kBaseline.
+    kInterpreted,
+  };
+
+  // Machine code of one translation of the function and its source map.
+  // Retranslation publishes a new version rather than modifying the current
+  // one, as other threads may still be running, or mapping host addresses in,
+  // the code of an older version.
+  struct CodeVersion {
+    uint8_t* machine_code = nullptr;
+    size_t machine_code_length = 0;
+    std::vector<SourceMapEntry> source_map;
+    // Replaced version, kept until the function is destroyed.
+    std::unique_ptr<const CodeVersion> previous;
+  };
+
   GuestFunction(Module* module, uint32_t address);
   ~GuestFunction() override;
 
-  uint32_t address() const { return address_; }
-  bool has_end_address() const { return end_address_ > 0; }
-  uint32_t end_address() const { return end_address_; }
-  void set_end_address(uint32_t value) { end_address_ = value; }
-
-  virtual uint8_t* machine_code() const = 0;
-  virtual size_t machine_code_length() const = 0;
+  // Current version of the machine code, or null if not translated to machine
+  // code. Sequentially consistent with publishing, so a backend can check
+  // after publishing whether a caller that embeds the code read the old one.
+  const CodeVersion* code_version() const {
+    return code_version_.load(std::memory_order_seq_cst);
+  }
+  uint8_t* machine_code() const {
+    const CodeVersion* version = code_version();
+    return version ? version->machine_code : nullptr;
+  }
+  size_t machine_code_length() const {
+    const CodeVersion* version = code_version();
+    return version ? version->machine_code_length : 0;
+  }
 
   FunctionDebugInfo* debug_info() const { return debug_info_.get(); }
   void set_debug_info(std::unique_ptr<FunctionDebugInfo> debug_info) {
     debug_info_ = std::move(debug_info);
   }
   FunctionTraceData& trace_data() { return trace_data_; }
-  std::vector<SourceMapEntry>& source_map() { return source_map_; }
+  // Source map of the current version of the machine code.
+  const std::vector<SourceMapEntry>& source_map() const;
+
+  Tier tier() const { return tier_.load(std::memory_order_acquire); }
+  void set_tier(Tier value) { tier_.store(value, std::memory_order_release); }
+  int32_t* tier_up_counter() { return &tier_up_counter_; }
 
   ExternHandler extern_handler() const { return extern_handler_; }
   Export* export_data() const { return export_data_; }
@@ -135,12 +179,21 @@ class GuestFunction : public Function {
  protected:
   virtual bool CallImpl(ThreadState* thread_state, uint32_t return_address) = 0;
 
+  // Makes the machine code the current version, then sets the tier it was
+  // translated for. Must be done before the code is reachable through the
+  // indirection table.
+  void PublishCodeVersion(uint8_t* machine_code, size_t machine_code_length,
+                          std::vector<SourceMapEntry> source_map, Tier tier);
+
  protected:
   std::unique_ptr<FunctionDebugInfo> debug_info_;
   FunctionTraceData trace_data_;
-  std::vector<SourceMapEntry> source_map_;
+  // Versions are only added, by the thread translating the function.
+  std::atomic<CodeVersion*> code_version_ = {nullptr};
   ExternHandler extern_handler_ = nullptr;
   Export* export_data_ = nullptr;
+  std::atomic<Tier> tier_ = {Tier::kOptimized};
+  int32_t tier_up_counter_ = 0;
 };
 
 }  // namespace cpu
@@ -0,0 +1,206 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/guest_profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+#include "third_party/fmt/include/fmt/format.h"
+#include "xenia/base/assert.h"
+#include "xenia/base/filesystem.h"
+#include "xenia/base/host_thread_context.h"
+#include "xenia/base/logging.h"
+#include "xenia/cpu/backend/code_cache.h"
+#include "xenia/cpu/processor.h"
+#include "xenia/cpu/stack_walker.h"
+#include "xenia/cpu/thread.h"
+#include "xenia/cpu/thread_debug_info.h"
+
+namespace xe {
+namespace cpu {
+
+// Host frames are only named between the innermost guest frame and the
+// sampled PC (or the innermost frames of threads not in guest code), as
+// resolving host symbols is slow.
+static constexpr size_t kMaxHostFrames = 8;
+
+GuestProfiler::GuestProfiler(Processor* processor, StackWalker* stack_walker)
+    : processor_(processor), stack_walker_(stack_walker) {}
+
+GuestProfiler::~GuestProfiler() { Stop(); }
+
+bool GuestProfiler::Start(uint32_t samples_per_second) {
+  assert_null(thread_);
+  if (!stack_walker_ || !processor_->backend()->code_cache()) {
+    return false;
+  }
+  shutdown_ = false;
+  samples_per_second = std::max(samples_per_second, uint32_t(1));
+  // Samples should be taken at regular intervals even when the guest threads
+  // are busy.
+  xe::threading::Thread::CreationParameters params;
+  params.initial_priority = xe::threading::ThreadPriority::kAboveNormal;
+  thread_ = xe::threading::Thread::Create(
+      params, [this, samples_per_second]() {
+        SamplingThread(samples_per_second);
+      });
+  if (!thread_) {
+    return false;
+  }
+  thread_->set_name("CPU Guest Profiler");
+  return true;
+}
+
+void GuestProfiler::Stop() {
+  if (!thread_) {
+    return;
+  }
+  shutdown_ = true;
+  xe::threading::Wait(thread_.get(), false);
+  thread_.reset();
+}
+
+void GuestProfiler::SamplingThread(uint32_t samples_per_second) {
+  auto interval = std::chrono::microseconds(1000000 / samples_per_second);
+  auto next_sample_time = std::chrono::steady_clock::now();
+  while (!shutdown_) {
+    TakeSamples();
+    // Skip the samples that couldn't be taken in time instead of catching up.
+    next_sample_time += interval;
+    auto now = std::chrono::steady_clock::now();
+    if (next_sample_time > now) {
+      xe::threading::Sleep(next_sample_time - now);
+    } else {
+      next_sample_time = now;
+    }
+  }
+}
+
+void GuestProfiler::TakeSamples() {
+  auto code_cache = processor_->backend()->code_cache();
+  uint64_t code_low = code_cache->execute_base_address();
+  uint64_t code_high = code_low + code_cache->total_size();
+
+  uint64_t frame_host_pcs[kMaxFrames];
+  uint64_t resolve_host_pcs[kMaxFrames];
+  StackFrame frames[kMaxFrames];
+  for (ThreadDebugInfo* thread_info : processor_->QueryThreadDebugInfos()) {
+    std::string stack;
+    size_t frame_count = 0;
+    {
+      // Keeps the thread alive, and the debugger from suspending or resuming
+      // it concurrently.
+      auto global_lock = global_critical_region_.Acquire();
+      Thread* thread = thread_info->thread;
+      // Waiting threads aren't using the CPU.
+      if (!thread || thread_info->state != ThreadDebugInfo::State::kAlive ||
+          thread_info->suspended || !thread->can_debugger_suspend()) {
+        continue;
+      }
+      // The thread may be holding the heap lock while suspended, so nothing
+      // may be allocated until it's resumed.
+      stack = thread->thread_name();
+      if (stack.empty()) {
+        stack = fmt::format("Thread {:08X}", thread_info->thread_id);
+      }
+      stack.reserve(1024);
+      if (!thread->thread()->Suspend()) {
+        continue;
+      }
+      HostThreadContext host_context;
+      frame_count = stack_walker_->CaptureStackTrace(
+          thread->thread()->native_handle(), frame_host_pcs, 0, kMaxFrames,
+          nullptr, &host_context);
+      thread->thread()->Resume();
+    }
+    if (!frame_count) {
+      continue;
+    }
+
+    // Frames are captured from the innermost.
+    size_t innermost_guest_frame = frame_count;
+    for (size_t i = 0; i < frame_count; ++i) {
+      if (frame_host_pcs[i] >= code_low && frame_host_pcs[i] < code_high) {
+        innermost_guest_frame = i;
+        break;
+      }
+    }
+    size_t host_frame_count = std::min(innermost_guest_frame, kMaxHostFrames);
+    size_t resolve_count = 0;
+    for (size_t i = 0; i < frame_count; ++i) {
+      bool is_guest =
+          frame_host_pcs[i] >= code_low && frame_host_pcs[i] < code_high;
+      if (is_guest || i < host_frame_count) {
+        resolve_host_pcs[resolve_count++] = frame_host_pcs[i];
+      }
+    }
+    stack_walker_->ResolveStack(resolve_host_pcs, frames, resolve_count);
+
+    uint32_t innermost_guest_pc = 0;
+    for (size_t i = resolve_count; i-- > 0;) {
+      const StackFrame& frame = frames[i];
+      stack += ';';
+      if (frame.type == StackFrame::Type::kGuest) {
+        Function* function = frame.guest_symbol.function;
+        if (!function) {
+          stack += "[unknown guest code]";
+        } else if (!function->name().empty()) {
+          stack += function->name();
+        } else {
+          stack += fmt::format("sub_{:08X}", function->address());
+        }
+        innermost_guest_pc = frame.guest_pc;
+        if (i && frames[i - 1].type == StackFrame::Type::kHost) {
+          stack += fmt::format(";{:08X}", innermost_guest_pc);
+          innermost_guest_pc = 0;
+        }
+      } else if (frame.host_symbol.name[0]) {
+        stack += frame.host_symbol.name;
+      } else {
+        stack += fmt::format("{:016X}", frame.host_pc);
+      }
+    }
+    if (innermost_guest_pc) {
+      stack += fmt::format(";{:08X}", innermost_guest_pc);
+    }
+
+    std::lock_guard<std::mutex> lock(stacks_mutex_);
+    ++stacks_[stack];
+    ++sample_count_;
+  }
+}
+
+bool GuestProfiler::WriteCollapsedStacks(const std::filesystem::path& path) {
+  std::vector<std::pair<std::string, uint64_t>> stacks;
+  {
+    std::lock_guard<std::mutex> lock(stacks_mutex_);
+    stacks.assign(stacks_.cbegin(), stacks_.cend());
+  }
+  std::sort(stacks.begin(), stacks.end());
+
+  FILE* file = xe::filesystem::OpenFile(path, "w");
+  if (!file) {
+    XELOGE("Unable to write the guest profile to {}", xe::path_to_utf8(path));
+    return false;
+  }
+  for (const auto& stack : stacks) {
+    fmt::print(file, "{} {}\n", stack.first, stack.second);
+  }
+  fclose(file);
+  XELOGI("Wrote {} guest profile samples to {}", uint64_t(sample_count_),
+         xe::path_to_utf8(path));
+  return true;
+}
+
+}  // namespace cpu
+}  // namespace xe
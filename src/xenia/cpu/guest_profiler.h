@@ -0,0 +1,69 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#ifndef XENIA_CPU_GUEST_PROFILER_H_
+#define XENIA_CPU_GUEST_PROFILER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "xenia/base/mutex.h"
+#include "xenia/base/threading.h"
+
+namespace xe {
+namespace cpu {
+
+class Processor;
+class StackWalker;
+
+// Samples the call stacks of running guest threads at a fixed rate on a
+// background thread, and counts identical stacks.
+// Results are written as collapsed stacks, one line per unique stack with the
+// frames from the thread down to the sampled function separated by ';' and
+// the sample count, as consumed by flame graph tools. The innermost guest
+// frame is followed by the guest PC it was sampled at.
+class GuestProfiler {
+ public:
+  GuestProfiler(Processor* processor, StackWalker* stack_walker);
+  ~GuestProfiler();
+
+  uint64_t sample_count() const { return sample_count_; }
+
+  bool Start(uint32_t samples_per_second);
+  void Stop();
+
+  bool WriteCollapsedStacks(const std::filesystem::path& path);
+
+ private:
+  static constexpr size_t kMaxFrames = 64;
+
+  void SamplingThread(uint32_t samples_per_second);
+  void TakeSamples();
+
+  Processor* processor_;
+  StackWalker* stack_walker_;
+
+  std::unique_ptr<xe::threading::Thread> thread_;
+  std::atomic<bool> shutdown_ = {false};
+  xe::global_critical_region global_critical_region_;
+
+  std::mutex stacks_mutex_;
+  std::unordered_map<std::string, uint64_t> stacks_;
+  std::atomic<uint64_t> sample_count_ = {0};
+};
+
+}  // namespace cpu
+}  // namespace xe
+
+#endif  // XENIA_CPU_GUEST_PROFILER_H_
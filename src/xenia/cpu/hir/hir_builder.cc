@@ -534,6 +534,26 @@ void HIRBuilder::RemoveBlock(Block* block) {
   block->next = block->prev = nullptr;
 }
 
+Block* HIRBuilder::InsertBlock(Block* next_block) {
+  Block* block = arena_->Alloc<Block>();
+  block->ordinal = UINT16_MAX;
+  block->incoming_values = nullptr;
+  block->arena = arena_;
+  block->next = next_block;
+  block->prev = next_block->prev;
+  if (block->prev) {
+    block->prev->next = block;
+  } else {
+    block_head_ = block;
+  }
+  next_block->prev = block;
+  current_block_ = block;
+  block->label_head = block->label_tail = nullptr;
+  block->incoming_edge_head = block->outgoing_edge_head = nullptr;
+  block->instr_head = block->instr_tail = nullptr;
+  return block;
+}
+
 void HIRBuilder::MergeAdjacentBlocks(Block* left, Block* right) {
   assert_true(left->next == right && right->prev == left);
   assert_true(!right->incoming_edge_head ||
@@ -28,6 +28,8 @@ namespace hir {
 
 enum FunctionAttributes {
   FUNCTION_ATTRIB_INLINE = (1 << 1),
+  // Contains guest code from outside of the function's own range.
+  FUNCTION_ATTRIB_INLINED_CALLS = (1 << 2),
 };
 
 class HIRBuilder {
@@ -55,6 +57,9 @@ class HIRBuilder {
   Block* current_block() const;
   Instr* last_instr() const;
 
+  // True if control never continues past the instruction.
+  bool IsUnconditionalJump(Instr* instr);
+
   Label* NewLabel();
   void MarkLabel(Label* label, Block* block = 0);
   void InsertLabel(Label* label, Instr* prev_instr);
@@ -64,6 +69,8 @@ class HIRBuilder {
   void RemoveEdge(Block* src, Block* dest);
   void RemoveEdge(Edge* edge);
   void RemoveBlock(Block* block);
+  // Inserts an empty block before next_block and makes it the current block.
+  Block* InsertBlock(Block* next_block);
   void MergeAdjacentBlocks(Block* left, Block* right);
 
   // static allocations:
@@ -271,7 +278,6 @@ class HIRBuilder {
  private:
   Block* AppendBlock();
   void EndBlock();
-  bool IsUnconditionalJump(Instr* instr);
   Instr* AppendInstr(const OpcodeInfo& opcode, uint16_t flags, Value* dest = 0);
   void CommentBuffer(const char* p);
   Value* CompareXX(const OpcodeInfo& opcode, Value* value1, Value* value2);
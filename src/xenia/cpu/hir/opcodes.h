@@ -37,6 +37,9 @@ enum RoundMode {
 
 enum LoadStoreFlags {
   LOAD_STORE_BYTE_SWAP = 1 << 0,
+  // The address may be in an MMIO range, the access must go through its
+  // callbacks then.
+  LOAD_STORE_MMIO_CHECK = 1 << 1,
 };
 
 enum CacheControlType {
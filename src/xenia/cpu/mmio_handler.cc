@@ -94,6 +94,15 @@ MMIORange* MMIOHandler::LookupRange(uint32_t virtual_address) {
   return nullptr;
 }
 
+void MMIOHandler::SetAccessSiteCallback(AccessSiteCallback callback,
+                                        void* context) {
+  // The context is published first as the callback may be called by another
+  // thread as soon as it's set.
+  access_site_callback_ = nullptr;
+  access_site_callback_context_ = context;
+  access_site_callback_ = callback;
+}
+
 bool MMIOHandler::CheckLoad(uint32_t virtual_address, uint32_t* out_value) {
   for (const auto& range : mapped_ranges_) {
     if ((virtual_address & range.mask) == range.address) {
@@ -564,6 +573,12 @@ bool MMIOHandler::ExceptionCallback(Exception* ex) {
   // Advance RIP to the next instruction so that we resume properly.
   ex->set_resume_pc(rip + decoded_load_store.length);
 
+  AccessSiteCallback access_site_callback = access_site_callback_;
+  if (access_site_callback) {
+    access_site_callback(access_site_callback_context_,
+                         reinterpret_cast<void*>(rip));
+  }
+
   return true;
 }
 
@@ -10,6 +10,7 @@
 #ifndef XENIA_CPU_MMIO_HANDLER_H_
 #define XENIA_CPU_MMIO_HANDLER_H_
 
+#include <atomic>
 #include <memory>
 #include <mutex>
 #include <vector>
@@ -49,6 +50,9 @@ class MMIOHandler {
   typedef bool (*AccessViolationCallback)(
       std::unique_lock<std::recursive_mutex> global_lock_locked_once,
       void* context, void* host_address, bool is_write);
+  // Called with the address of the host load or store instruction after an
+  // access to a range through it has been emulated.
+  typedef void (*AccessSiteCallback)(void* context, void* host_pc);
 
   // access_violation_callback is called with global_critical_region locked once
   // on the thread, so if multiple threads trigger an access violation in the
@@ -66,6 +70,10 @@ class MMIOHandler {
                      MMIOWriteCallback write_callback);
   MMIORange* LookupRange(uint32_t virtual_address);
 
+  // Lets the code accessing ranges via faulting loads and stores be replaced
+  // with code calling the callbacks directly. Null to stop.
+  void SetAccessSiteCallback(AccessSiteCallback callback, void* context);
+
   bool CheckLoad(uint32_t virtual_address, uint32_t* out_value);
   bool CheckStore(uint32_t virtual_address, uint32_t value);
 
@@ -91,6 +99,9 @@ class MMIOHandler {
   AccessViolationCallback access_violation_callback_;
   void* access_violation_callback_context_;
 
+  std::atomic<AccessSiteCallback> access_site_callback_ = {nullptr};
+  std::atomic<void*> access_site_callback_context_ = {nullptr};
+
   static MMIOHandler* global_handler_;
 
   xe::global_critical_region global_critical_region_;
@@ -86,6 +86,9 @@ Symbol::Status Module::DeclareSymbol(Symbol::Type type, uint32_t address,
         symbol = new Symbol(Symbol::Type::kVariable, this, address);
         break;
     }
+    // Other threads looking the symbol up must wait until the caller has
+    // declared it.
+    symbol->set_status(Symbol::Status::kDeclaring);
     map_[address] = symbol;
     list_.emplace_back(symbol);
     status = Symbol::Status::kNew;
@@ -37,6 +37,12 @@ class Module {
   virtual bool is_executable() const = 0;
 
   virtual bool ContainsAddress(uint32_t address);
+  // Gets the [low, high) range ContainsAddress is true for if it's a single
+  // known range, so the processor can find the module with a binary search.
+  virtual bool GetAddressRange(uint32_t* out_low_address,
+                               uint32_t* out_high_address) const {
+    return false;
+  }
 
   Symbol* LookupSymbol(uint32_t address, bool wait = true);
   virtual Symbol::Status DeclareFunction(uint32_t address,
@@ -426,6 +426,18 @@ typedef struct PPCContext_s {
   // Value of last reserved load
   uint64_t reserved_val;
 
+  // Quiescent point tracking for freeing replaced generated code, see
+  // Processor::ReclaimRetiredCode. Host stack pointer in the guest to host
+  // thunk while guest code is calling host code, 0 otherwise.
+  volatile uint64_t host_call_stack_pointer;
+  // Incremented whenever the thread enters or leaves guest code.
+  volatile uint64_t host_call_count;
+  // Host stack address above the outermost guest frame, 0 if no guest code is
+  // on the stack.
+  volatile uint64_t guest_stack_top;
+
+  uint8_t padding[40];
+
   static std::string GetRegisterName(PPCRegister reg);
   std::string GetStringFromValue(PPCRegister reg) const;
   void SetValueFromString(PPCRegister reg, std::string value);
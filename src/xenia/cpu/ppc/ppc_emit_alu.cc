@@ -24,17 +24,6 @@ using xe::cpu::hir::Value;
 
 // Integer arithmetic (A-3)
 
-Value* AddDidCarry(PPCHIRBuilder& f, Value* v1, Value* v2) {
-  return f.CompareUGT(f.Truncate(v2, INT32_TYPE),
-                      f.Not(f.Truncate(v1, INT32_TYPE)));
-}
-
-Value* SubDidCarry(PPCHIRBuilder& f, Value* v1, Value* v2) {
-  return f.Or(f.CompareUGT(f.Truncate(v1, INT32_TYPE),
-                           f.Not(f.Neg(f.Truncate(v2, INT32_TYPE)))),
-              f.IsFalse(f.Truncate(v2, INT32_TYPE)));
-}
-
 // https://github.com/sebastianbiallas/pearpc/blob/0b3c823f61456faa677f6209545a7b906e797421/src/cpu/cpu_generic/ppc_tools.h#L26
 Value* AddWithCarryDidCarry(PPCHIRBuilder& f, Value* v1, Value* v2, Value* v3) {
   v1 = f.Truncate(v1, INT32_TYPE);
@@ -70,7 +59,7 @@ int InstrEmit_addcx(PPCHIRBuilder& f, const InstrData& i) {
     XEINSTRNOTIMPLEMENTED();
     // e.update_xer_with_overflow(EFLAGS OF?);
   } else {
-    f.StoreCA(AddDidCarry(f, ra, rb));
+    f.UpdateCAWithAdd(ra, rb);
   }
   if (i.XO.Rc) {
     f.UpdateCR(0, v);
@@ -117,7 +106,7 @@ int InstrEmit_addic(PPCHIRBuilder& f, const InstrData& i) {
   Value* ra = f.LoadGPR(i.D.RA);
   Value* v = f.Add(ra, f.LoadConstantInt64(XEEXTS16(i.D.DS)));
   f.StoreGPR(i.D.RT, v);
-  f.StoreCA(AddDidCarry(f, ra, f.LoadConstantInt64(XEEXTS16(i.D.DS))));
+  f.UpdateCAWithAdd(ra, f.LoadConstantInt64(XEEXTS16(i.D.DS)));
   return 0;
 }
 
@@ -127,7 +116,7 @@ int InstrEmit_addicx(PPCHIRBuilder& f, const InstrData& i) {
   Value* ra = f.LoadGPR(i.D.RA);
   Value* v = f.Add(f.LoadGPR(i.D.RA), f.LoadConstantInt64(XEEXTS16(i.D.DS)));
   f.StoreGPR(i.D.RT, v);
-  f.StoreCA(AddDidCarry(f, ra, f.LoadConstantInt64(XEEXTS16(i.D.DS))));
+  f.UpdateCAWithAdd(ra, f.LoadConstantInt64(XEEXTS16(i.D.DS)));
   f.UpdateCR(0, v);
   return 0;
 }
@@ -462,7 +451,7 @@ int InstrEmit_subfcx(PPCHIRBuilder& f, const InstrData& i) {
     return 1;
     // e.update_xer_with_overflow(EFLAGS??);
   } else {
-    f.StoreCA(SubDidCarry(f, rb, ra));
+    f.UpdateCAWithSub(rb, ra);
   }
   if (i.XO.Rc) {
     f.UpdateCR(0, v);
@@ -475,7 +464,7 @@ int InstrEmit_subficx(PPCHIRBuilder& f, const InstrData& i) {
   Value* ra = f.LoadGPR(i.D.RA);
   Value* v = f.Sub(f.LoadConstantInt64(XEEXTS16(i.D.DS)), ra);
   f.StoreGPR(i.D.RT, v);
-  f.StoreCA(SubDidCarry(f, f.LoadConstantInt64(XEEXTS16(i.D.DS)), ra));
+  f.UpdateCAWithSub(f.LoadConstantInt64(XEEXTS16(i.D.DS)), ra);
   return 0;
 }
 
@@ -81,7 +81,7 @@ int InstrEmit_branch(PPCHIRBuilder& f, const char* src, uint64_t cia,
           cond = f.IsFalse(cond);
         }
         f.CallTrue(cond, function, call_flags);
-      } else {
+      } else if (!f.InlineCall(function, call_flags)) {
         f.Call(function, call_flags);
       }
     }
@@ -330,15 +330,15 @@ int InstrEmit_fcmpx_(PPCHIRBuilder& f, const InstrData& i, bool ordered) {
   Value* rb = f.LoadFPR(i.X.RB);
 
   Value* nan = f.Or(f.IsNan(ra), f.IsNan(rb));
-  f.StoreContext(offsetof(PPCContext, cr0) + (4 * crf) + 3, nan);
+  f.StoreCRField(crf, 3, nan);
   Value* not_nan = f.Xor(nan, f.LoadConstantInt8(0x01));
 
   Value* lt = f.And(not_nan, f.CompareSLT(ra, rb));
-  f.StoreContext(offsetof(PPCContext, cr0) + (4 * crf) + 0, lt);
+  f.StoreCRField(crf, 0, lt);
   Value* gt = f.And(not_nan, f.CompareSGT(ra, rb));
-  f.StoreContext(offsetof(PPCContext, cr0) + (4 * crf) + 1, gt);
+  f.StoreCRField(crf, 1, gt);
   Value* eq = f.And(not_nan, f.CompareEQ(ra, rb));
-  f.StoreContext(offsetof(PPCContext, cr0) + (4 * crf) + 2, eq);
+  f.StoreCRField(crf, 2, eq);
   return 0;
 }
 int InstrEmit_fcmpo(PPCHIRBuilder& f, const InstrData& i) {
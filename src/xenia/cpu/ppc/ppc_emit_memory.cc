@@ -820,9 +820,9 @@ int InstrEmit_stdcx(PPCHIRBuilder& f, const InstrData& i) {
   Value* rt = f.ByteSwap(f.LoadGPR(i.X.RT));
   Value* res = f.ByteSwap(f.LoadReserved());
   Value* v = f.AtomicCompareExchange(ea, res, rt);
-  f.StoreContext(offsetof(PPCContext, cr0.cr0_eq), v);
-  f.StoreContext(offsetof(PPCContext, cr0.cr0_lt), f.LoadZeroInt8());
-  f.StoreContext(offsetof(PPCContext, cr0.cr0_gt), f.LoadZeroInt8());
+  f.StoreCRField(0, 2, v);
+  f.StoreCRField(0, 0, f.LoadZeroInt8());
+  f.StoreCRField(0, 1, f.LoadZeroInt8());
 
   // Issue memory barrier for when we go out of lock and want others to see our
   // updates.
@@ -853,9 +853,9 @@ int InstrEmit_stwcx(PPCHIRBuilder& f, const InstrData& i) {
   Value* rt = f.ByteSwap(f.Truncate(f.LoadGPR(i.X.RT), INT32_TYPE));
   Value* res = f.ByteSwap(f.Truncate(f.LoadReserved(), INT32_TYPE));
   Value* v = f.AtomicCompareExchange(ea, res, rt);
-  f.StoreContext(offsetof(PPCContext, cr0.cr0_eq), v);
-  f.StoreContext(offsetof(PPCContext, cr0.cr0_lt), f.LoadZeroInt8());
-  f.StoreContext(offsetof(PPCContext, cr0.cr0_gt), f.LoadZeroInt8());
+  f.StoreCRField(0, 2, v);
+  f.StoreCRField(0, 0, f.LoadZeroInt8());
+  f.StoreCRField(0, 1, f.LoadZeroInt8());
 
   // Issue memory barrier for when we go out of lock and want others to see our
   // updates.
@@ -9,14 +9,46 @@
 
 #include "xenia/cpu/ppc/ppc_frontend.h"
 
+#include <algorithm>
+
 #include "xenia/base/atomic.h"
+#include "xenia/base/clock.h"
+#include "xenia/base/cvar.h"
 #include "xenia/base/logging.h"
+#include "xenia/base/xxhash.h"
+#include "xenia/cpu/cpu_flags.h"
 #include "xenia/cpu/ppc/ppc_context.h"
 #include "xenia/cpu/ppc/ppc_emit.h"
 #include "xenia/cpu/ppc/ppc_opcode_info.h"
 #include "xenia/cpu/ppc/ppc_translator.h"
 #include "xenia/cpu/processor.h"
 
+DEFINE_int32(
+    precompile_threads, 0,
+    "Number of background threads translating guest functions before they "
+    "are first called (entry points, exports and call targets found during "
+    "translation). -1 to calculate automatically (half of logical CPU "
+    "cores), a positive number to specify the number of threads explicitly, "
+    "0 to translate functions only when they are first called.",
+    "CPU");
+
+DEFINE_bool(
+    precompile_all_functions, false,
+    "Translate all functions known when a module is loaded (from its runtime "
+    "function table) before it starts, on precompile_threads threads (or "
+    "automatically calculated if 0). For benchmarking the translated code "
+    "without translation on the fly.",
+    "CPU");
+
+DEFINE_bool(
+    patch_mmio_access_sites, true,
+    "Retranslate guest functions that have accessed MMIO through addresses "
+    "unknown at translation time, so the accesses call the MMIO handlers "
+    "directly instead of triggering an access violation every time.",
+    "CPU");
+
+DECLARE_int32(inline_max_instructions);
+
 namespace xe {
 namespace cpu {
 namespace ppc {
@@ -47,6 +79,13 @@ PPCFrontend::PPCFrontend(Processor* processor) : processor_(processor) {
 }
 
 PPCFrontend::~PPCFrontend() {
+  Shutdown();
+
+  auto translation_stats = QueryTranslationStatistics();
+  if (translation_stats.function_count) {
+    LogTranslationStatistics(translation_stats, 0, 0.0);
+  }
+
   // Force cleanup now before we deinit.
   translator_pool_.Reset();
 }
@@ -101,23 +140,478 @@ bool PPCFrontend::Initialize() {
       processor_->DefineBuiltin("LeaveGlobalLock", LeaveGlobalLock, arg0, arg1);
   builtins_.syscall_handler = processor_->DefineBuiltin(
       "SyscallHandler", SyscallHandler, nullptr, nullptr);
+
+  precompile_all_functions_ = cvars::precompile_all_functions;
+  precompile_declared_functions_ =
+      cvars::precompile_threads != 0 || precompile_all_functions_;
+  may_retranslate_functions_ = cvars::tiered_compilation ||
+                               cvars::interpreter_tier_call_count > 0 ||
+                               cvars::patch_mmio_access_sites ||
+                               cvars::inline_max_instructions > 0;
+  if (precompile_declared_functions_ || cvars::tiered_compilation ||
+      cvars::interpreter_tier_call_count > 0 ||
+      cvars::patch_mmio_access_sites) {
+    uint32_t logical_processor_count = xe::threading::logical_processor_count();
+    size_t precompile_thread_count;
+    if (cvars::precompile_threads < 0 ||
+        (!cvars::precompile_threads && precompile_all_functions_)) {
+      precompile_thread_count =
+          std::max(logical_processor_count / 2, uint32_t(1));
+    } else if (cvars::precompile_threads > 0) {
+      precompile_thread_count = std::min(uint32_t(cvars::precompile_threads),
+                                         logical_processor_count);
+    } else {
+      // Only retranslating hot functions and ones accessing MMIO.
+      precompile_thread_count = 1;
+    }
+    precompile_threads_shutdown_ = false;
+    precompile_threads_modules_.resize(precompile_thread_count, nullptr);
+    for (size_t i = 0; i < precompile_thread_count; ++i) {
+      // Guest threads must win over speculative work.
+      xe::threading::Thread::CreationParameters params;
+      params.initial_priority = xe::threading::ThreadPriority::kBelowNormal;
+      std::unique_ptr<xe::threading::Thread> precompile_thread =
+          xe::threading::Thread::Create(params,
+                                        [this, i]() { PrecompileThread(i); });
+      assert_not_null(precompile_thread);
+      precompile_thread->set_name("CPU Precompiler");
+      precompile_threads_.push_back(std::move(precompile_thread));
+    }
+    XELOGI("Translating guest functions in the background on {} threads",
+           precompile_thread_count);
+  }
+
   return true;
 }
 
+void PPCFrontend::Shutdown() {
+  if (precompile_threads_.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(precompile_request_lock_);
+    precompile_threads_shutdown_ = true;
+    precompile_queue_.clear();
+    tier_up_queue_.clear();
+    retranslate_queue_.clear();
+  }
+  precompile_request_cond_.notify_all();
+  for (size_t i = 0; i < precompile_threads_.size(); ++i) {
+    xe::threading::Wait(precompile_threads_[i].get(), false);
+  }
+  precompile_threads_.clear();
+  precompile_threads_modules_.clear();
+}
+
+void PPCFrontend::AddTranslationStatistics(
+    GuestFunction::Tier tier, const TranslationStatistics& stats,
+    const std::vector<compiler::Compiler::PassStatistics>& pass_stats) {
+  TranslationStatistics log_stats;
+  uint64_t log_function_count;
+  double log_interval_seconds;
+  {
+    std::lock_guard<std::mutex> lock(translation_stats_lock_);
+    uint64_t now_ticks = Clock::QueryHostTickCount();
+    if (!translation_stats_log_ticks_) {
+      translation_stats_log_ticks_ = now_ticks;
+    }
+
+    translation_stats_.function_count += stats.function_count;
+    translation_stats_.scan_time += stats.scan_time;
+    translation_stats_.hir_build_time += stats.hir_build_time;
+    translation_stats_.compile_time += stats.compile_time;
+    translation_stats_.assemble_time += stats.assemble_time;
+    translation_stats_.machine_code_size += stats.machine_code_size;
+    translation_stats_.optimized_function_count +=
+        stats.optimized_function_count;
+    translation_stats_.instr_count_before += stats.instr_count_before;
+    translation_stats_.instr_count_after += stats.instr_count_after;
+    translation_stats_.store_context_count_before +=
+        stats.store_context_count_before;
+    translation_stats_.store_context_count_after +=
+        stats.store_context_count_after;
+    translation_stats_.inlined_call_count += stats.inlined_call_count;
+    translation_stats_.loop_count += stats.loop_count;
+    translation_stats_.hoisted_loop_count += stats.hoisted_loop_count;
+    translation_stats_.hoisted_instr_count += stats.hoisted_instr_count;
+    // All translators set up the same passes.
+    auto& passes = tier == GuestFunction::Tier::kOptimized
+                       ? translation_stats_.optimized_passes
+                       : translation_stats_.baseline_passes;
+    if (passes.size() < pass_stats.size()) {
+      passes.resize(pass_stats.size());
+    }
+    for (size_t i = 0; i < pass_stats.size(); ++i) {
+      const auto& pass_stat = pass_stats[i];
+      PassStatistics& pass = passes[i];
+      if (pass.name.empty()) {
+        pass.name = pass_stat.name;
+      }
+      ++pass.run_count;
+      pass.time += pass_stat.ticks;
+      pass.instr_count_before += pass_stat.instr_count_before;
+      pass.instr_count_after += pass_stat.instr_count_after;
+    }
+
+    uint64_t interval_ticks =
+        uint64_t(std::max(cvars::translation_statistics_log_interval, 0)) *
+        Clock::QueryHostTickFrequency();
+    if (!interval_ticks ||
+        now_ticks - translation_stats_log_ticks_ < interval_ticks) {
+      return;
+    }
+    log_stats = translation_stats_;
+    log_function_count = translation_stats_.function_count -
+                         translation_stats_log_function_count_;
+    log_interval_seconds = double(now_ticks - translation_stats_log_ticks_) /
+                           double(Clock::QueryHostTickFrequency());
+    translation_stats_log_ticks_ = now_ticks;
+    translation_stats_log_function_count_ = translation_stats_.function_count;
+  }
+  LogTranslationStatistics(log_stats, log_function_count,
+                           log_interval_seconds);
+}
+
+PPCFrontend::TranslationStatistics PPCFrontend::QueryTranslationStatistics() {
+  std::lock_guard<std::mutex> lock(translation_stats_lock_);
+  return translation_stats_;
+}
+
+void PPCFrontend::LogTranslationStatistics(const TranslationStatistics& stats,
+                                           uint64_t interval_function_count,
+                                           double interval_seconds) {
+  double ms_per_tick = 1000.0 / double(Clock::QueryHostTickFrequency());
+  XELOGI(
+      "Translation: {} functions, {} bytes of machine code, {:.1f} ms "
+      "scanning, {:.1f} ms building HIR, {:.1f} ms compiling, {:.1f} ms "
+      "assembling",
+      stats.function_count, stats.machine_code_size,
+      stats.scan_time * ms_per_tick, stats.hir_build_time * ms_per_tick,
+      stats.compile_time * ms_per_tick, stats.assemble_time * ms_per_tick);
+  if (interval_seconds > 0.0) {
+    XELOGI("Translation: {:.1f} functions per second in the last {:.0f} s",
+           interval_function_count / interval_seconds, interval_seconds);
+  }
+  if (stats.optimized_function_count) {
+    XELOGI(
+        "HIR optimization: {} functions, {} -> {} instructions, {} -> {} "
+        "context stores",
+        stats.optimized_function_count, stats.instr_count_before,
+        stats.instr_count_after, stats.store_context_count_before,
+        stats.store_context_count_after);
+    XELOGI("Inlined {} guest calls", stats.inlined_call_count);
+    XELOGI("Found {} loops, hoisted {} instructions out of {} of them",
+           stats.loop_count, stats.hoisted_instr_count,
+           stats.hoisted_loop_count);
+  }
+  auto log_passes = [ms_per_tick](const char* compiler_name,
+                                  const std::vector<PassStatistics>& passes) {
+    for (size_t i = 0; i < passes.size(); ++i) {
+      const PassStatistics& pass = passes[i];
+      XELOGI(
+          "Translation: {} pass {} {}: {} runs, {:.1f} ms, {} -> {} "
+          "instructions",
+          compiler_name, i, pass.name, pass.run_count, pass.time * ms_per_tick,
+          pass.instr_count_before, pass.instr_count_after);
+    }
+  };
+  log_passes("optimized", stats.optimized_passes);
+  log_passes("baseline", stats.baseline_passes);
+}
+
 bool PPCFrontend::DeclareFunction(GuestFunction* function) {
   // Could scan or something here.
   // Could also check to see if it's a well-known function type and classify
   // for later.
-  // Could also kick off a precompiler, since we know it's likely the function
-  // will be demanded soon.
+  // It's likely the function will be demanded soon, so start translating it.
+  QueuePrecompile(function);
   return true;
 }
 
+void PPCFrontend::QueuePrecompile(GuestFunction* function) {
+  if (!precompile_declared_functions_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(precompile_request_lock_);
+    if (precompile_threads_shutdown_) {
+      return;
+    }
+    precompile_queue_.push_back(function);
+  }
+  precompile_request_cond_.notify_one();
+}
+
+void PPCFrontend::QueueTierUp(GuestFunction* function) {
+  if (precompile_threads_.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(precompile_request_lock_);
+    if (precompile_threads_shutdown_ ||
+        (function->tier() != GuestFunction::Tier::kBaseline &&
+         function->tier() != GuestFunction::Tier::kInterpreted)) {
+      return;
+    }
+    tier_up_queue_.push_back(function);
+  }
+  precompile_request_cond_.notify_one();
+}
+
+void PPCFrontend::CancelPrecompile(Module* module) {
+  auto in_module = [module](GuestFunction* function) {
+    return function->module() == module;
+  };
+  {
+    std::lock_guard<std::mutex> lock(inlined_calls_lock_);
+    inlined_calls_.erase(
+        std::remove_if(inlined_calls_.begin(), inlined_calls_.end(),
+                       [&in_module](const InlinedCall& call) {
+                         return in_module(call.caller) ||
+                                in_module(call.callee);
+                       }),
+        inlined_calls_.end());
+  }
+  {
+    std::lock_guard<std::mutex> lock(mmio_access_sites_lock_);
+    for (auto it = mmio_access_sites_.begin();
+         it != mmio_access_sites_.end();) {
+      if (module->ContainsAddress(*it)) {
+        it = mmio_access_sites_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+  if (precompile_threads_.empty()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(precompile_request_lock_);
+  precompile_queue_.erase(std::remove_if(precompile_queue_.begin(),
+                                         precompile_queue_.end(), in_module),
+                          precompile_queue_.end());
+  tier_up_queue_.erase(
+      std::remove_if(tier_up_queue_.begin(), tier_up_queue_.end(), in_module),
+      tier_up_queue_.end());
+  retranslate_queue_.erase(std::remove_if(retranslate_queue_.begin(),
+                                          retranslate_queue_.end(), in_module),
+                           retranslate_queue_.end());
+  precompile_completion_cond_.wait(lock, [this, module]() {
+    return std::find(precompile_threads_modules_.cbegin(),
+                     precompile_threads_modules_.cend(),
+                     module) == precompile_threads_modules_.cend();
+  });
+}
+
+void PPCFrontend::WaitForPrecompile(Module* module) {
+  if (precompile_threads_.empty()) {
+    return;
+  }
+  auto in_module = [module](GuestFunction* function) {
+    return function->module() == module;
+  };
+  std::unique_lock<std::mutex> lock(precompile_request_lock_);
+  precompile_completion_cond_.wait(lock, [this, module, &in_module]() {
+    return precompile_threads_shutdown_ ||
+           (std::none_of(precompile_queue_.cbegin(), precompile_queue_.cend(),
+                         in_module) &&
+            std::find(precompile_threads_modules_.cbegin(),
+                      precompile_threads_modules_.cend(),
+                      module) == precompile_threads_modules_.cend());
+  });
+}
+
+void PPCFrontend::SetInlinedCalls(GuestFunction* caller,
+                                  std::vector<InlinedCall> calls) {
+  std::lock_guard<std::mutex> lock(inlined_calls_lock_);
+  inlined_calls_.erase(
+      std::remove_if(inlined_calls_.begin(), inlined_calls_.end(),
+                     [caller](const InlinedCall& call) {
+                       return call.caller == caller;
+                     }),
+      inlined_calls_.end());
+  inlined_calls_.insert(inlined_calls_.end(), calls.cbegin(), calls.cend());
+}
+
+std::vector<GuestFunction*> PPCFrontend::FindInliningCallers(
+    uint32_t address) {
+  std::vector<GuestFunction*> callers;
+  std::lock_guard<std::mutex> lock(inlined_calls_lock_);
+  for (const InlinedCall& call : inlined_calls_) {
+    if (address >= call.callee->address() && address < call.end_address &&
+        std::find(callers.cbegin(), callers.cend(), call.caller) ==
+            callers.cend()) {
+      callers.push_back(call.caller);
+    }
+  }
+  return callers;
+}
+
+void PPCFrontend::RecordMmioAccessSite(GuestFunction* function,
+                                       uint32_t address) {
+  // Debug info must stay consistent for the lifetime of the function.
+  if (!cvars::patch_mmio_access_sites || function->debug_info()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mmio_access_sites_lock_);
+    if (!mmio_access_sites_.insert(address).second) {
+      // Already retranslated or queued, or the old code is still running.
+      return;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(precompile_request_lock_);
+    if (precompile_threads_shutdown_ || precompile_threads_.empty()) {
+      return;
+    }
+    if (std::find(retranslate_queue_.cbegin(), retranslate_queue_.cend(),
+                  function) == retranslate_queue_.cend()) {
+      retranslate_queue_.push_back(function);
+    }
+  }
+  precompile_request_cond_.notify_one();
+}
+
+std::vector<uint32_t> PPCFrontend::GetMmioAccessSites() {
+  std::vector<uint32_t> sites;
+  {
+    std::lock_guard<std::mutex> lock(mmio_access_sites_lock_);
+    sites.assign(mmio_access_sites_.cbegin(), mmio_access_sites_.cend());
+  }
+  std::sort(sites.begin(), sites.end());
+  return sites;
+}
+
+uint64_t PPCFrontend::HashInlinedCode(const InlinedCall& call) const {
+  uint32_t address = call.callee->address();
+  return XXH3_64bits(memory()->TranslateVirtual(address),
+                     call.end_address - address);
+}
+
+void PPCFrontend::RetranslateStaleInliningCallers(GuestFunction* function) {
+  std::vector<GuestFunction*> callers;
+  {
+    std::lock_guard<std::mutex> lock(inlined_calls_lock_);
+    for (const InlinedCall& call : inlined_calls_) {
+      if (call.callee == function && HashInlinedCode(call) != call.code_hash &&
+          std::find(callers.cbegin(), callers.cend(), call.caller) ==
+              callers.cend()) {
+        callers.push_back(call.caller);
+      }
+    }
+  }
+  // Published like tier-up code, through the indirection table, and the new
+  // translation records the new inlined calls.
+  for (GuestFunction* caller : callers) {
+    XELOGI("Retranslating {:08X} as the code of inlined {:08X} has changed",
+           caller->address(), function->address());
+    RetranslateFunction(caller);
+  }
+}
+
+bool PPCFrontend::RetranslateFunction(GuestFunction* function) {
+  auto translator = translator_pool_.Allocate(this);
+  bool result = translator->Translate(function, 0, function->tier());
+  translator_pool_.Release(translator);
+  if (!result) {
+    XELOGE("Failed to retranslate function {:08X}", function->address());
+  }
+  return result;
+}
+
+void PPCFrontend::PrecompileThread(size_t thread_index) {
+  while (true) {
+    GuestFunction* function;
+    bool tier_up = false;
+    bool retranslate = false;
+    {
+      std::unique_lock<std::mutex> lock(precompile_request_lock_);
+      precompile_request_cond_.wait(lock, [this]() {
+        return precompile_threads_shutdown_ || !tier_up_queue_.empty() ||
+               !retranslate_queue_.empty() || !precompile_queue_.empty();
+      });
+      if (precompile_threads_shutdown_) {
+        return;
+      }
+      if (!tier_up_queue_.empty()) {
+        tier_up = true;
+        function = tier_up_queue_.front();
+        tier_up_queue_.pop_front();
+      } else if (!retranslate_queue_.empty()) {
+        retranslate = true;
+        function = retranslate_queue_.front();
+        retranslate_queue_.pop_front();
+      } else {
+        function = precompile_queue_.back();
+        precompile_queue_.pop_back();
+      }
+      precompile_threads_modules_[thread_index] = function->module();
+    }
+
+    if (tier_up) {
+      if (function->tier() == GuestFunction::Tier::kBaseline ||
+          function->tier() == GuestFunction::Tier::kInterpreted) {
+        TierUpFunction(function);
+      }
+    } else if (retranslate) {
+      XELOGI("Retranslating {:08X} to access MMIO without access violations",
+             function->address());
+      RetranslateFunction(function);
+    } else {
+      // Goes through the same path as guest threads, so a guest thread calling
+      // the function while it's being translated here will wait for it, and
+      // functions that have already been translated are skipped.
+      processor_->ResolveFunction(function->address());
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(precompile_request_lock_);
+      precompile_threads_modules_[thread_index] = nullptr;
+    }
+    precompile_completion_cond_.notify_all();
+  }
+}
+
 bool PPCFrontend::DefineFunction(GuestFunction* function,
                                  uint32_t debug_info_flags) {
+  // Debug info must be consistent for the lifetime of the function, so only
+  // tier up when not debugging.
+  auto tier = GuestFunction::Tier::kOptimized;
+  if (!debug_info_flags) {
+    if (cvars::interpreter_tier_call_count > 0) {
+      tier = GuestFunction::Tier::kInterpreted;
+    } else if (cvars::tiered_compilation) {
+      tier = GuestFunction::Tier::kBaseline;
+    }
+  }
+  auto translator = translator_pool_.Allocate(this);
+  bool result = translator->Translate(function, debug_info_flags, tier);
+  translator_pool_.Release(translator);
+  if (result) {
+    RetranslateStaleInliningCallers(function);
+  }
+  return result;
+}
+
+bool PPCFrontend::TierUpFunction(GuestFunction* function) {
+  // The baseline code stays in the code cache as other threads may still be
+  // executing it, the new code is published through the indirection table
+  // by the assembler. Callers always go through the indirection table when
+  // tiered compilation is enabled. Interpreted functions go through baseline
+  // code first if it's enabled too.
+  auto tier = function->tier() == GuestFunction::Tier::kInterpreted &&
+                      cvars::tiered_compilation
+                  ? GuestFunction::Tier::kBaseline
+                  : GuestFunction::Tier::kOptimized;
   auto translator = translator_pool_.Allocate(this);
-  bool result = translator->Translate(function, debug_info_flags);
+  bool result = translator->Translate(function, 0, tier);
   translator_pool_.Release(translator);
+  if (!result) {
+    XELOGE("Failed to retranslate hot function {:08X}", function->address());
+  } else {
+    RetranslateStaleInliningCallers(function);
+  }
   return result;
 }
 
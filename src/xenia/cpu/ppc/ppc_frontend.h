@@ -10,14 +10,23 @@
 #ifndef XENIA_CPU_PPC_PPC_FRONTEND_H_
 #define XENIA_CPU_PPC_PPC_FRONTEND_H_
 
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_set>
+#include <vector>
 
+#include "xenia/base/threading.h"
 #include "xenia/base/type_pool.h"
+#include "xenia/cpu/compiler/compiler.h"
 #include "xenia/cpu/function.h"
 #include "xenia/memory.h"
 
 namespace xe {
 namespace cpu {
+class Module;
 class Processor;
 }  // namespace cpu
 }  // namespace xe
@@ -42,6 +51,9 @@ class PPCFrontend {
   ~PPCFrontend();
 
   bool Initialize();
+  // Stops the precompilation threads. Must be called before the modules are
+  // destroyed as the threads may be translating code from them.
+  void Shutdown();
 
   Processor* processor() const { return processor_; }
   Memory* memory() const;
@@ -50,10 +62,147 @@ class PPCFrontend {
   bool DeclareFunction(GuestFunction* function);
   bool DefineFunction(GuestFunction* function, uint32_t debug_info_flags);
 
+  bool is_precompiling() const { return precompile_declared_functions_; }
+  // Whether all functions of a module are translated before it starts.
+  bool is_precompiling_all() const { return precompile_all_functions_; }
+  // Whether functions may be translated again after being defined, for tier-up,
+  // changes of inlined code or MMIO access sites. Calls to them must then go
+  // through the indirection table or patched call sites, which are updated
+  // with the new code.
+  bool may_retranslate_functions() const { return may_retranslate_functions_; }
+  // Requests speculative translation of a function that is likely to be
+  // called soon on a background thread. No-op if precompilation is disabled.
+  void QueuePrecompile(GuestFunction* function);
+  // Requests retranslation of a hot GuestFunction::Tier::kBaseline or
+  // kInterpreted function to a higher tier on a background thread.
+  void QueueTierUp(GuestFunction* function);
+  // Drops pending requests and inlined calls for functions in the module and
+  // waits for the ones being translated to finish, before the module's code
+  // is unloaded.
+  void CancelPrecompile(Module* module);
+  // Waits until the requested functions in the module have been translated.
+  void WaitForPrecompile(Module* module);
+
+  // Code of a function inlined into another one by the translator.
+  struct InlinedCall {
+    GuestFunction* caller;
+    GuestFunction* callee;
+    // End of the inlined code (exclusive).
+    uint32_t end_address;
+    // Of the inlined guest code, to find callers made stale by a redefinition.
+    uint64_t code_hash;
+  };
+  uint64_t HashInlinedCode(const InlinedCall& call) const;
+  // Replaces the calls recorded when the caller was translated before.
+  void SetInlinedCalls(GuestFunction* caller, std::vector<InlinedCall> calls);
+  // Returns the functions containing an inlined copy of the guest address, so
+  // that the debugger can find all code for it.
+  std::vector<GuestFunction*> FindInliningCallers(uint32_t address);
+
+  // Records a guest load or store that has accessed MMIO through an access
+  // violation, and requests retranslation of the function so it calls the MMIO
+  // callbacks directly from now on.
+  void RecordMmioAccessSite(GuestFunction* function, uint32_t address);
+  // Returns the recorded sites, sorted, to look them up without locking while
+  // translating.
+  std::vector<uint32_t> GetMmioAccessSites();
+
+  // Where translation time goes and what the optimizing passes do, collected
+  // with --translation_statistics. Logged periodically and on shutdown. Times
+  // are in host ticks (see Clock::QueryHostTickFrequency).
+  struct PassStatistics {
+    std::string name;
+    uint64_t run_count;
+    uint64_t time;
+    uint64_t instr_count_before;
+    uint64_t instr_count_after;
+  };
+  struct TranslationStatistics {
+    uint64_t function_count;
+    uint64_t scan_time;
+    uint64_t hir_build_time;
+    uint64_t compile_time;
+    uint64_t assemble_time;
+    uint64_t machine_code_size;
+    // Totals of the functions translated by the optimizing compiler. HIR
+    // instructions are counted if they will be emitted.
+    uint64_t optimized_function_count;
+    uint64_t instr_count_before;
+    uint64_t instr_count_after;
+    uint64_t store_context_count_before;
+    uint64_t store_context_count_after;
+    uint64_t inlined_call_count;
+    uint64_t loop_count;
+    uint64_t hoisted_loop_count;
+    uint64_t hoisted_instr_count;
+    // Of the optimizing and the baseline compiler, in the order they run.
+    std::vector<PassStatistics> optimized_passes;
+    std::vector<PassStatistics> baseline_passes;
+  };
+  // stats contains the measurements of one function, without passes.
+  void AddTranslationStatistics(
+      GuestFunction::Tier tier, const TranslationStatistics& stats,
+      const std::vector<compiler::Compiler::PassStatistics>& pass_stats);
+  TranslationStatistics QueryTranslationStatistics();
+
  private:
+  void PrecompileThread(size_t thread_index);
+  bool TierUpFunction(GuestFunction* function);
+  // Translates the function again at the same tier, published like tier-up
+  // code.
+  bool RetranslateFunction(GuestFunction* function);
+  // Retranslates the functions the function has been inlined into if its code
+  // has changed since.
+  void RetranslateStaleInliningCallers(GuestFunction* function);
+  // interval_function_count functions have been translated in
+  // interval_seconds since the last time the statistics were logged.
+  static void LogTranslationStatistics(const TranslationStatistics& stats,
+                                       uint64_t interval_function_count,
+                                       double interval_seconds);
+
   Processor* processor_;
   PPCBuiltins builtins_ = {0};
   TypePool<PPCTranslator, PPCFrontend*> translator_pool_;
+
+  std::mutex precompile_request_lock_;
+  // Notify_one when a request is added, notify_all when shutting down.
+  std::condition_variable precompile_request_cond_;
+  // Notify_all when a thread finishes a request.
+  std::condition_variable precompile_completion_cond_;
+  // Protected with precompile_request_lock_. Most recent requests are taken
+  // first, as call targets discovered in code that has just been translated
+  // are the most likely to be executed next.
+  std::deque<GuestFunction*> precompile_queue_;
+  // Protected with precompile_request_lock_. Taken before precompile_queue_,
+  // as these functions are known to be hot.
+  std::deque<GuestFunction*> tier_up_queue_;
+  // Protected with precompile_request_lock_. Functions with new MMIO access
+  // sites, taken before precompile_queue_ as they're being executed.
+  std::deque<GuestFunction*> retranslate_queue_;
+  // Modules of the functions being translated, per thread. Protected with
+  // precompile_request_lock_.
+  std::vector<Module*> precompile_threads_modules_;
+  // Protected with precompile_request_lock_.
+  bool precompile_threads_shutdown_ = false;
+  std::vector<std::unique_ptr<xe::threading::Thread>> precompile_threads_;
+  // The threads may be created only for tiered compilation.
+  bool precompile_declared_functions_ = false;
+  bool precompile_all_functions_ = false;
+  bool may_retranslate_functions_ = false;
+
+  std::mutex translation_stats_lock_;
+  // Protected with translation_stats_lock_.
+  TranslationStatistics translation_stats_ = {};
+  uint64_t translation_stats_log_ticks_ = 0;
+  uint64_t translation_stats_log_function_count_ = 0;
+
+  std::mutex inlined_calls_lock_;
+  // Protected with inlined_calls_lock_.
+  std::vector<InlinedCall> inlined_calls_;
+
+  std::mutex mmio_access_sites_lock_;
+  // Protected with mmio_access_sites_lock_.
+  std::unordered_set<uint32_t> mmio_access_sites_;
 };
 
 }  // namespace ppc
@@ -10,10 +10,12 @@
 #include "xenia/cpu/ppc/ppc_hir_builder.h"
 
 #include <stddef.h>
+#include <algorithm>
 #include <cstring>
 
 #include "third_party/fmt/include/fmt/format.h"
 
+#include "xenia/base/assert.h"
 #include "xenia/base/byte_order.h"
 #include "xenia/base/cvar.h"
 #include "xenia/base/logging.h"
@@ -21,6 +23,7 @@
 #include "xenia/base/profiling.h"
 #include "xenia/base/string.h"
 #include "xenia/cpu/cpu_flags.h"
+#include "xenia/cpu/crt_routines.h"
 #include "xenia/cpu/hir/label.h"
 #include "xenia/cpu/ppc/ppc_context.h"
 #include "xenia/cpu/ppc/ppc_decode_data.h"
@@ -33,6 +36,18 @@ DEFINE_bool(
     "Break to the host debugger (or crash if no debugger attached) if an "
     "unimplemented PowerPC instruction is encountered.",
     "CPU");
+DEFINE_bool(
+    lazy_condition_flags, true,
+    "Record the operands of integer compares and carries instead of storing "
+    "CR fields and XER[CA] after every instruction, materializing them only "
+    "when branches, calls or CR/XER reads need them.",
+    "CPU");
+DEFINE_int32(
+    inline_max_instructions, 16,
+    "Maximum number of instructions in a leaf guest function for its body to "
+    "be emitted in place of calls to it in optimized code. 0 to disable "
+    "inlining.",
+    "CPU");
 
 namespace xe {
 namespace cpu {
@@ -78,15 +93,21 @@ void PPCHIRBuilder::Reset() {
   instr_count_ = 0;
   instr_offset_list_ = NULL;
   label_list_ = NULL;
+  branch_target_list_ = NULL;
   with_debug_info_ = false;
+  lazy_flags_ = false;
+  inline_calls_ = false;
+  inlined_functions_.clear();
+  mmio_access_sites_.clear();
+  flags_block_ = nullptr;
+  std::memset(pending_cr_, 0, sizeof(pending_cr_));
+  pending_ca_ = {};
   HIRBuilder::Reset();
 }
 
 bool PPCHIRBuilder::Emit(GuestFunction* function, uint32_t flags) {
   SCOPE_profile_cpu_f("cpu");
 
-  Memory* memory = frontend_->memory();
-
   function_ = function;
   start_address_ = function_->address();
   instr_count_ = (function_->end_address() - function_->address()) / 4 + 1;
@@ -98,23 +119,54 @@ bool PPCHIRBuilder::Emit(GuestFunction* function, uint32_t flags) {
                   function_->name().c_str());
   }
 
-  // Allocate offset list.
-  // This is used to quickly map labels to instructions.
-  // The list is built as the instructions are traversed, with the values
-  // being the previous HIR Instr before the given instruction. An
-  // instruction may have a label assigned to it if it hasn't been hit
-  // yet.
-  size_t list_size = instr_count_ * sizeof(void*);
-  instr_offset_list_ = (Instr**)arena_->Alloc(list_size, alignof(void*));
-  label_list_ = (Label**)arena_->Alloc(list_size, alignof(void*));
-  std::memset(instr_offset_list_, 0, list_size);
-  std::memset(label_list_, 0, list_size);
+  AllocateInstrLists();
+  FindBranchTargets();
+
+  // Pending flags would be invisible to the debugger between instructions.
+  lazy_flags_ = cvars::lazy_condition_flags && !cvars::debug;
+  // Keep guest calls precise when debugging.
+  inline_calls_ = (flags & EMIT_INLINE_CALLS) == EMIT_INLINE_CALLS &&
+                  !cvars::debug && cvars::inline_max_instructions > 0;
+
+  mmio_access_sites_ = frontend_->GetMmioAccessSites();
 
   // Always mark entry with label.
   label_list_[0] = NewLabel();
 
-  uint32_t start_address = function_->address();
-  uint32_t end_address = function_->end_address();
+  if (function_->behavior() == Function::Behavior::kExtern &&
+      function_->extern_handler()) {
+    if (!IsCrtRoutine(function_->extern_handler())) {
+      // Import thunk (sc 2; blr), only the handler is needed.
+      MarkLabel(label_list_[0]);
+      CallExtern(function_);
+      EmitReturnToLR();
+      return Finalize();
+    }
+    // Routine replaced with a host implementation. The guest code follows for
+    // when the handler leaves the work to it, outside the entry label, as the
+    // guest code may branch to its start.
+    CallExtern(function_);
+    BranchFalse(LoadContext(offsetof(PPCContext, scratch), INT8_TYPE),
+                label_list_[0]);
+    EmitReturnToLR();
+  }
+
+  EmitInstructions(function_->end_address(), false);
+
+  // In case the function falls through into the next one.
+  FlushFlags();
+
+  if (false) {
+    DumpAllOpcodeCounts();
+  }
+
+  return Finalize();
+}
+
+void PPCHIRBuilder::EmitInstructions(uint32_t end_address, bool is_inlined) {
+  Memory* memory = frontend_->memory();
+
+  uint32_t start_address = uint32_t(start_address_);
   for (uint32_t address = start_address, offset = 0; address <= end_address;
        address += 4, offset++) {
     trace_info_.dest_count = 0;
@@ -123,6 +175,19 @@ bool PPCHIRBuilder::Emit(GuestFunction* function, uint32_t flags) {
     auto opcode = LookupOpcode(code);
     auto& opcode_info = GetOpcodeInfo(opcode);
 
+    // Store pending flags before anything that may observe them, and don't
+    // carry them into a block that is also entered from elsewhere. This must
+    // come before the label and the instruction offset is stashed, so a label
+    // inserted later on still ends up after the stores.
+    bool is_branch_target = branch_target_list_[offset];
+    if (is_branch_target || !lazy_flags_ || !CanDeferFlagsAcross(opcode_info) ||
+        address == cvars::break_on_instruction) {
+      FlushFlags();
+    }
+    if (is_branch_target || !lazy_flags_) {
+      InvalidateFlags();
+    }
+
     // Mark label, if we were assigned one earlier on in the walk.
     // We may still get a label, but it'll be inserted by LookupLabel
     // as needed.
@@ -153,6 +218,11 @@ bool PPCHIRBuilder::Emit(GuestFunction* function, uint32_t flags) {
     // Stash instruction offset. It's either the SOURCE_OFFSET or the COMMENT.
     instr_offset_list_[offset] = first_instr;
 
+    if (is_inlined && address == end_address) {
+      // The return - continue with the code after the call.
+      break;
+    }
+
     if (opcode == PPCOpcode::kInvalid) {
       XELOGE("Invalid instruction {:08X} {:08X}", address, code);
       Comment("INVALID!");
@@ -175,6 +245,7 @@ bool PPCHIRBuilder::Emit(GuestFunction* function, uint32_t flags) {
     i.code = code;
     i.opcode = opcode;
     i.opcode_info = &opcode_info;
+    Instr* prev_instr = last_instr();
     if (!opcode_info.emit || opcode_info.emit(*this, i)) {
       auto& disasm_info = GetOpcodeDisasmInfo(opcode);
       XELOGE(
@@ -185,14 +256,52 @@ bool PPCHIRBuilder::Emit(GuestFunction* function, uint32_t flags) {
       if (cvars::break_on_unimplemented_instructions) {
         DebugBreak();
       }
+    } else if (IsMmioAccessOpcode(opcode) &&
+               std::binary_search(mmio_access_sites_.cbegin(),
+                                  mmio_access_sites_.cend(), address)) {
+      MarkMmioAccesses(prev_instr);
     }
   }
+}
 
-  if (false) {
-    DumpAllOpcodeCounts();
+bool PPCHIRBuilder::IsMmioAccessOpcode(PPCOpcode opcode) {
+  // MMIO is only accessed with 32-bit integer loads and stores.
+  switch (opcode) {
+    case PPCOpcode::lwz:
+    case PPCOpcode::lwzu:
+    case PPCOpcode::lwzux:
+    case PPCOpcode::lwzx:
+    case PPCOpcode::lwbrx:
+    case PPCOpcode::stw:
+    case PPCOpcode::stwu:
+    case PPCOpcode::stwux:
+    case PPCOpcode::stwx:
+    case PPCOpcode::stwbrx:
+      return true;
+    default:
+      return false;
   }
+}
 
-  return Finalize();
+void PPCHIRBuilder::MarkMmioAccesses(Instr* prev_instr) {
+  // The instruction has accessed MMIO through an access violation before,
+  // make its loads and stores check the address instead.
+  for (Instr* i = prev_instr->next; i; i = i->next) {
+    if (i->opcode == &OPCODE_LOAD_info ||
+        i->opcode == &OPCODE_LOAD_OFFSET_info) {
+      if (i->dest->type == INT32_TYPE) {
+        i->flags |= LOAD_STORE_MMIO_CHECK;
+      }
+    } else if (i->opcode == &OPCODE_STORE_info) {
+      if (i->src2.value->type == INT32_TYPE) {
+        i->flags |= LOAD_STORE_MMIO_CHECK;
+      }
+    } else if (i->opcode == &OPCODE_STORE_OFFSET_info) {
+      if (i->src3.value->type == INT32_TYPE) {
+        i->flags |= LOAD_STORE_MMIO_CHECK;
+      }
+    }
+  }
 }
 
 void PPCHIRBuilder::MaybeBreakOnInstruction(uint32_t address) {
@@ -249,6 +358,205 @@ void PPCHIRBuilder::AnnotateLabel(uint32_t address, Label* label) {
   memcpy(label->name, name_buffer, sizeof(name_buffer));
 }
 
+void PPCHIRBuilder::AllocateInstrLists() {
+  // Allocate offset list.
+  // This is used to quickly map labels to instructions.
+  // The list is built as the instructions are traversed, with the values
+  // being the previous HIR Instr before the given instruction. An
+  // instruction may have a label assigned to it if it hasn't been hit
+  // yet.
+  size_t list_size = instr_count_ * sizeof(void*);
+  instr_offset_list_ = (Instr**)arena_->Alloc(list_size, alignof(void*));
+  label_list_ = (Label**)arena_->Alloc(list_size, alignof(void*));
+  std::memset(instr_offset_list_, 0, list_size);
+  std::memset(label_list_, 0, list_size);
+  branch_target_list_ = (bool*)arena_->Alloc(instr_count_, alignof(bool));
+  std::memset(branch_target_list_, 0, instr_count_);
+}
+
+void PPCHIRBuilder::FindBranchTargets() {
+  // Must match the direct branches the emitters call LookupLabel for.
+  Memory* memory = frontend_->memory();
+  for (uint32_t offset = 0; offset < instr_count_; ++offset) {
+    uint32_t address = uint32_t(start_address_) + offset * 4;
+    uint32_t code =
+        xe::load_and_swap<uint32_t>(memory->TranslateVirtual(address));
+    PPCDecodeData d;
+    d.address = address;
+    d.code = code;
+    uint32_t target;
+    switch (LookupOpcode(code)) {
+      case PPCOpcode::bx:
+        target = d.I.ADDR();
+        break;
+      case PPCOpcode::bcx:
+        target = d.B.ADDR();
+        break;
+      default:
+        continue;
+    }
+    if (target < start_address_) {
+      continue;
+    }
+    uint64_t target_offset = (target - start_address_) / 4;
+    if (target_offset < instr_count_) {
+      branch_target_list_[target_offset] = true;
+    }
+  }
+}
+
+bool PPCHIRBuilder::InlineCall(Function* function, uint16_t call_flags) {
+  if (!function || !function->is_guest() || function == function_) {
+    return false;
+  }
+  auto guest_function = static_cast<GuestFunction*>(function);
+
+  if (function->behavior() == Function::Behavior::kExtern) {
+    // Routines with host implementations are only a call to the handler, which
+    // can be made from here directly. Kernel imports are still called through
+    // their thunks.
+    if (!cvars::native_crt_routines ||
+        !IsCrtRoutine(guest_function->extern_handler())) {
+      return false;
+    }
+    CallExtern(guest_function);
+    // The handler may leave the work to the guest code, which the function
+    // runs after calling the handler again.
+    Label* handled_label = NewLabel();
+    BranchTrue(LoadContext(offsetof(PPCContext, scratch), INT8_TYPE),
+               handled_label);
+    Call(guest_function, call_flags & ~CALL_TAIL);
+    MarkLabel(handled_label);
+    if (call_flags & CALL_TAIL) {
+      EmitReturnToLR();
+    }
+    return true;
+  }
+
+  if (!inline_calls_) {
+    return false;
+  }
+  uint32_t return_address;
+  switch (function->behavior()) {
+    case Function::Behavior::kDefault:
+      return_address =
+          FindInlinedReturn(guest_function, cvars::inline_max_instructions,
+                            false);
+      break;
+    case Function::Behavior::kProlog:
+    case Function::Behavior::kEpilog:
+    case Function::Behavior::kEpilogReturn:
+      // Register save/restore helpers - called in nearly every function, and
+      // the restore that returns from the caller is always a tail call.
+      return_address = FindInlinedReturn(guest_function, kMaxSaveRestInstrCount,
+                                         (call_flags & CALL_TAIL) != 0);
+      break;
+    default:
+      return false;
+  }
+  if (!return_address) {
+    return false;
+  }
+
+  if (with_debug_info_) {
+    CommentFormat("inlined {:08X}-{:08X} {}", guest_function->address(),
+                  return_address, guest_function->name().c_str());
+  }
+
+  // The body gets its own labels as it's emitted like a separate function,
+  // the caller's are restored afterwards.
+  auto start_address = start_address_;
+  auto instr_count = instr_count_;
+  auto instr_offset_list = instr_offset_list_;
+  auto label_list = label_list_;
+  auto branch_target_list = branch_target_list_;
+  start_address_ = guest_function->address();
+  instr_count_ = (return_address - guest_function->address()) / 4 + 1;
+  AllocateInstrLists();
+  FindBranchTargets();
+
+  EmitInstructions(return_address, true);
+
+  start_address_ = start_address;
+  instr_count_ = instr_count;
+  instr_offset_list_ = instr_offset_list;
+  label_list_ = label_list;
+  branch_target_list_ = branch_target_list;
+
+  if (call_flags & CALL_TAIL) {
+    // The blr returns from the caller.
+    EmitReturnToLR();
+  }
+
+  inlined_functions_.push_back({guest_function, return_address});
+  set_attributes(attributes() | FUNCTION_ATTRIB_INLINED_CALLS);
+  return true;
+}
+
+void PPCHIRBuilder::EmitReturnToLR() {
+  // Like bclrx, which also checks whether this is the return.
+  CallIndirect(LoadLR(), CALL_TAIL | CALL_POSSIBLE_RETURN);
+}
+
+uint32_t PPCHIRBuilder::FindInlinedReturn(GuestFunction* function,
+                                          int32_t max_instr_count,
+                                          bool allow_lr_write) {
+  // Only straight-line leaf code is accepted: the body must end with a blr,
+  // and branch only within itself, so it never needs LR or leaves the caller.
+  Memory* memory = frontend_->memory();
+  Module* module = function->module();
+  uint32_t start_address = function->address();
+  uint32_t max_target_address = start_address;
+  for (int32_t n = 0; n <= max_instr_count; ++n) {
+    uint32_t address = start_address + n * 4;
+    if (!module->ContainsAddress(address)) {
+      return 0;
+    }
+    uint32_t code =
+        xe::load_and_swap<uint32_t>(memory->TranslateVirtual(address));
+    if (code == 0x4E800020) {
+      // blr
+      return max_target_address <= address ? address : 0;
+    }
+    if (allow_lr_write && (code & 0xFC1FFFFF) == 0x7C0803A6) {
+      // mtlr, the blr will go to the new LR.
+      continue;
+    }
+    auto opcode = LookupOpcode(code);
+    auto& opcode_info = GetOpcodeInfo(opcode);
+    if (opcode == PPCOpcode::kInvalid || !opcode_info.emit ||
+        opcode_info.type != PPCOpcodeType::kGeneral) {
+      return 0;
+    }
+    switch (opcode_info.group) {
+      case PPCOpcodeGroup::kM:
+      case PPCOpcodeGroup::kI:
+      case PPCOpcodeGroup::kF:
+      case PPCOpcodeGroup::kV:
+        continue;
+      default:
+        break;
+    }
+    PPCDecodeData d;
+    d.address = address;
+    d.code = code;
+    uint32_t target;
+    if (opcode == PPCOpcode::bx && !d.I.LK()) {
+      target = d.I.ADDR();
+    } else if (opcode == PPCOpcode::bcx && !d.B.LK()) {
+      target = d.B.ADDR();
+    } else {
+      // Calls, traps, other returns, control registers, etc.
+      return 0;
+    }
+    if (target < start_address) {
+      return 0;
+    }
+    max_target_address = std::max(max_target_address, target);
+  }
+  return 0;
+}
+
 Function* PPCHIRBuilder::LookupFunction(uint32_t address) {
   return frontend_->processor()->LookupFunction(address);
 }
@@ -272,6 +580,8 @@ Label* PPCHIRBuilder::LookupLabel(uint32_t address) {
   label_list_[offset] = label;
   Instr* instr = instr_offset_list_[offset];
   if (instr) {
+    // Pending flags are only flushed before known branch targets.
+    assert_true(branch_target_list_[offset]);
     if (instr->prev) {
       // Insert label, breaking up existing instructions.
       InsertLabel(label, instr->prev);
@@ -331,6 +641,10 @@ Value* PPCHIRBuilder::LoadCR() {
 }
 
 Value* PPCHIRBuilder::LoadCR(uint32_t n) {
+  // The loads are forwarded from the stores by the optimizer.
+  SyncFlagState();
+  FlushCRField(n);
+
   // Construct the entire word of just the bits we care about.
   // This makes it easier for the optimizer to exclude things, though
   // we could be even more clever and watch sequences.
@@ -354,6 +668,13 @@ Value* PPCHIRBuilder::LoadCR(uint32_t n) {
 }
 
 Value* PPCHIRBuilder::LoadCRField(uint32_t n, uint32_t bit) {
+  SyncFlagState();
+  // Compares never update SO.
+  if (pending_cr_[n].lhs && bit < 3) {
+    // Redo the compare right here - when feeding a branch this lets the
+    // backend branch on the host flags.
+    return CompareCRField(n, bit);
+  }
   return LoadContext(offsetof(PPCContext, cr0) + (4 * n) + bit, INT8_TYPE);
 }
 
@@ -366,6 +687,8 @@ void PPCHIRBuilder::StoreCR(Value* value) {
 }
 
 void PPCHIRBuilder::StoreCR(uint32_t n, Value* value) {
+  DiscardCRField(n);
+
   // Pull out the bits we are interested in.
   // Optimization passes will kill any unneeded stores (mostly).
   StoreContext(offsetof(PPCContext, cr0) + (4 * n) + 0,
@@ -383,6 +706,10 @@ void PPCHIRBuilder::StoreCR(uint32_t n, Value* value) {
 }
 
 void PPCHIRBuilder::StoreCRField(uint32_t n, uint32_t bit, Value* value) {
+  // The other bits of the field must be kept.
+  SyncFlagState();
+  FlushCRField(n);
+  DiscardCRField(n);
   StoreContext(offsetof(PPCContext, cr0) + (4 * n) + bit, value);
 
   // TODO(benvanik): trace CR.
@@ -394,19 +721,13 @@ void PPCHIRBuilder::UpdateCR(uint32_t n, Value* lhs, bool is_signed) {
 
 void PPCHIRBuilder::UpdateCR(uint32_t n, Value* lhs, Value* rhs,
                              bool is_signed) {
-  if (is_signed) {
-    Value* lt = CompareSLT(lhs, rhs);
-    StoreContext(offsetof(PPCContext, cr0) + (4 * n) + 0, lt);
-    Value* gt = CompareSGT(lhs, rhs);
-    StoreContext(offsetof(PPCContext, cr0) + (4 * n) + 1, gt);
-  } else {
-    Value* lt = CompareULT(lhs, rhs);
-    StoreContext(offsetof(PPCContext, cr0) + (4 * n) + 0, lt);
-    Value* gt = CompareUGT(lhs, rhs);
-    StoreContext(offsetof(PPCContext, cr0) + (4 * n) + 1, gt);
-  }
-  Value* eq = CompareEQ(lhs, rhs);
-  StoreContext(offsetof(PPCContext, cr0) + (4 * n) + 2, eq);
+  SyncFlagState();
+  auto& field = pending_cr_[n];
+  field.lhs = lhs;
+  field.rhs = rhs;
+  field.is_signed = is_signed;
+  field.dirty = true;
+  TrackFlagUpdate();
 
   // Value* so = AllocValue(UINT8_TYPE);
   // StoreContext(offsetof(PPCContext, cr) + (4 * n) + 3, so);
@@ -414,7 +735,42 @@ void PPCHIRBuilder::UpdateCR(uint32_t n, Value* lhs, Value* rhs,
   // TOOD(benvanik): trace CR.
 }
 
+Value* PPCHIRBuilder::CompareCRField(uint32_t n, uint32_t bit) {
+  auto& field = pending_cr_[n];
+  switch (bit) {
+    case 0:
+      return field.is_signed ? CompareSLT(field.lhs, field.rhs)
+                             : CompareULT(field.lhs, field.rhs);
+    case 1:
+      return field.is_signed ? CompareSGT(field.lhs, field.rhs)
+                             : CompareUGT(field.lhs, field.rhs);
+    case 2:
+      return CompareEQ(field.lhs, field.rhs);
+    default:
+      assert_unhandled_case(bit);
+      return nullptr;
+  }
+}
+
+void PPCHIRBuilder::FlushCRField(uint32_t n) {
+  auto& field = pending_cr_[n];
+  if (!field.dirty) {
+    return;
+  }
+  for (uint32_t bit = 0; bit < 3; ++bit) {
+    StoreContext(offsetof(PPCContext, cr0) + (4 * n) + bit,
+                 CompareCRField(n, bit));
+  }
+  field.dirty = false;
+}
+
+void PPCHIRBuilder::DiscardCRField(uint32_t n) {
+  pending_cr_[n] = {};
+}
+
 void PPCHIRBuilder::UpdateCR6(Value* src_value) {
+  DiscardCRField(6);
+
   // Testing for all 1's and all 0's.
   // if (Rc) CR6 = all_equal | 0 | none_equal | 0
   // TODO(benvanik): efficient instruction?
@@ -441,6 +797,10 @@ void PPCHIRBuilder::StoreFPSCR(Value* value) {
 }
 
 void PPCHIRBuilder::UpdateFPSCR(Value* result, bool update_cr1) {
+  if (update_cr1) {
+    DiscardCRField(1);
+  }
+
   // TODO(benvanik): detect overflow and nan cases.
   // fx and vx are the most important.
   Value* fx = LoadConstantInt8(0);
@@ -471,6 +831,8 @@ void PPCHIRBuilder::UpdateFPSCR(Value* result, bool update_cr1) {
 }
 
 void PPCHIRBuilder::CopyFPSCRToCR1() {
+  DiscardCRField(1);
+
   // Pull out of FPSCR.
   Value* fpscr = LoadFPSCR();
   StoreContext(offsetof(PPCContext, cr1.cr1_fx),
@@ -495,18 +857,133 @@ void PPCHIRBuilder::StoreXER(Value* value) {
 }
 
 Value* PPCHIRBuilder::LoadCA() {
+  SyncFlagState();
+  if (pending_ca_.type != PendingCAType::kNone) {
+    return MaterializeCA();
+  }
   return LoadContext(offsetof(PPCContext, xer_ca), INT8_TYPE);
 }
 
 void PPCHIRBuilder::StoreCA(Value* value) {
   assert_true(value->type == INT8_TYPE);
-  StoreContext(offsetof(PPCContext, xer_ca), value);
+  SyncFlagState();
+  pending_ca_.type = PendingCAType::kValue;
+  pending_ca_.lhs = value;
+  pending_ca_.rhs = nullptr;
+  pending_ca_.dirty = true;
+  TrackFlagUpdate();
 
   auto& trace_reg = trace_info_.dests[trace_info_.dest_count++];
   trace_reg.reg = 66;
   trace_reg.value = value;
 }
 
+void PPCHIRBuilder::UpdateCAWithAdd(Value* lhs, Value* rhs) {
+  SyncFlagState();
+  pending_ca_.type = PendingCAType::kAdd;
+  pending_ca_.lhs = lhs;
+  pending_ca_.rhs = rhs;
+  pending_ca_.dirty = true;
+  TrackFlagUpdate();
+}
+
+void PPCHIRBuilder::UpdateCAWithSub(Value* lhs, Value* rhs) {
+  SyncFlagState();
+  pending_ca_.type = PendingCAType::kSub;
+  pending_ca_.lhs = lhs;
+  pending_ca_.rhs = rhs;
+  pending_ca_.dirty = true;
+  TrackFlagUpdate();
+}
+
+Value* PPCHIRBuilder::MaterializeCA() {
+  Value* lhs = pending_ca_.lhs;
+  Value* rhs = pending_ca_.rhs;
+  Value* ca;
+  switch (pending_ca_.type) {
+    case PendingCAType::kValue:
+      return lhs;
+    case PendingCAType::kAdd:
+      ca = CompareUGT(Truncate(rhs, INT32_TYPE), Not(Truncate(lhs, INT32_TYPE)));
+      break;
+    case PendingCAType::kSub:
+      ca = Or(CompareUGT(Truncate(lhs, INT32_TYPE),
+                         Not(Neg(Truncate(rhs, INT32_TYPE)))),
+              IsFalse(Truncate(rhs, INT32_TYPE)));
+      break;
+    default:
+      assert_unhandled_case(pending_ca_.type);
+      return nullptr;
+  }
+  // Only compute it once.
+  pending_ca_.type = PendingCAType::kValue;
+  pending_ca_.lhs = ca;
+  pending_ca_.rhs = nullptr;
+  return ca;
+}
+
+void PPCHIRBuilder::FlushCA() {
+  if (!pending_ca_.dirty) {
+    return;
+  }
+  StoreContext(offsetof(PPCContext, xer_ca), MaterializeCA());
+  pending_ca_.dirty = false;
+}
+
+bool PPCHIRBuilder::CanDeferFlagsAcross(const PPCOpcodeInfo& opcode_info) {
+  // Branches, control and floating-point/vector instructions may split
+  // blocks or read the CR bypassing the builder.
+  return (opcode_info.group == PPCOpcodeGroup::kI ||
+          opcode_info.group == PPCOpcodeGroup::kM) &&
+         opcode_info.type == PPCOpcodeType::kGeneral;
+}
+
+void PPCHIRBuilder::SyncFlagState() {
+  if (flags_block_ && flags_block_ == current_block_) {
+    return;
+  }
+  // The block ended - everything must have been stored before that.
+  for (auto& field : pending_cr_) {
+    assert_false(field.dirty);
+    field = {};
+  }
+  assert_false(pending_ca_.dirty);
+  pending_ca_ = {};
+  flags_block_ = nullptr;
+}
+
+void PPCHIRBuilder::TrackFlagUpdate() {
+  if (current_block_ && current_block_->instr_tail) {
+    flags_block_ = current_block_;
+    return;
+  }
+  // Nothing emitted in this block yet (constant operands), so a label may
+  // still end up ahead of the update. Store right away instead.
+  for (uint32_t n = 0; n < xe::countof(pending_cr_); ++n) {
+    FlushCRField(n);
+  }
+  FlushCA();
+  InvalidateFlags();
+}
+
+void PPCHIRBuilder::FlushFlags() {
+  SyncFlagState();
+  for (uint32_t n = 0; n < xe::countof(pending_cr_); ++n) {
+    FlushCRField(n);
+  }
+  FlushCA();
+}
+
+void PPCHIRBuilder::InvalidateFlags() {
+  for (auto& field : pending_cr_) {
+    assert_false(field.dirty);
+    field = {};
+  }
+  assert_false(pending_ca_.dirty);
+  pending_ca_ = {};
+  flags_block_ = nullptr;
+}
+
 Value* PPCHIRBuilder::LoadSAT() {
   return LoadContext(offsetof(PPCContext, vscr_sat), INT8_TYPE);
 }
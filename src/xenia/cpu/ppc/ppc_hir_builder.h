@@ -10,6 +10,8 @@
 #ifndef XENIA_CPU_PPC_PPC_HIR_BUILDER_H_
 #define XENIA_CPU_PPC_PPC_HIR_BUILDER_H_
 
+#include <vector>
+
 #include "xenia/base/string_buffer.h"
 #include "xenia/cpu/function.h"
 #include "xenia/cpu/hir/hir_builder.h"
@@ -20,6 +22,8 @@ namespace ppc {
 
 struct PPCBuiltins;
 class PPCFrontend;
+struct PPCOpcodeInfo;
+enum class PPCOpcode : uint32_t;
 
 class PPCHIRBuilder : public hir::HIRBuilder {
   using Instr = xe::cpu::hir::Instr;
@@ -37,6 +41,8 @@ class PPCHIRBuilder : public hir::HIRBuilder {
   enum EmitFlags {
     // Emit comment nodes.
     EMIT_DEBUG_COMMENTS = 1 << 0,
+    // Replace calls to small leaf functions with their bodies.
+    EMIT_INLINE_CALLS = 1 << 1,
   };
   bool Emit(GuestFunction* function, uint32_t flags);
 
@@ -44,6 +50,22 @@ class PPCHIRBuilder : public hir::HIRBuilder {
   Function* LookupFunction(uint32_t address);
   Label* LookupLabel(uint32_t address);
 
+  // Emits the body of the function in place of an unconditional call to it if
+  // it's a small leaf function (inline_max_instructions) or a register
+  // save/restore helper, or calls the host handler directly if it's a native
+  // CRT routine (native_crt_routines).
+  // Returns false if nothing has been emitted and the call must be made.
+  bool InlineCall(Function* function, uint16_t call_flags);
+  struct InlinedFunction {
+    GuestFunction* function;
+    // Address of the blr ending the inlined body.
+    uint32_t return_address;
+  };
+  // Functions inlined into the function emitted last, once per call site.
+  const std::vector<InlinedFunction>& inlined_functions() const {
+    return inlined_functions_;
+  }
+
   Value* LoadLR();
   void StoreLR(Value* value);
   Value* LoadCTR();
@@ -54,6 +76,11 @@ class PPCHIRBuilder : public hir::HIRBuilder {
   void StoreCR(Value* value);
   void StoreCR(uint32_t n, Value* value);
   void StoreCRField(uint32_t n, uint32_t bit, Value* value);
+  // CR field updates from integer compares are lazy: only the operands are
+  // recorded, and the bits are stored to the context when the instructions
+  // that follow may observe them (branches, calls, mfcr, etc). Reading a
+  // field in the meantime performs the compare in place so that it can feed
+  // a branch directly.
   void UpdateCR(uint32_t n, Value* lhs, bool is_signed = true);
   void UpdateCR(uint32_t n, Value* lhs, Value* rhs, bool is_signed = true);
   void UpdateCR6(Value* src_value);
@@ -68,6 +95,10 @@ class PPCHIRBuilder : public hir::HIRBuilder {
   // void StoreOV(Value* value);
   Value* LoadCA();
   void StoreCA(Value* value);
+  // Sets CA to the carry out of the 32-bit lhs + rhs, lazily like UpdateCR.
+  void UpdateCAWithAdd(Value* lhs, Value* rhs);
+  // Sets CA to the carry out of the 32-bit lhs - rhs, lazily like UpdateCR.
+  void UpdateCAWithSub(Value* lhs, Value* rhs);
   Value* LoadSAT();
   void StoreSAT(Value* value);
 
@@ -84,6 +115,43 @@ class PPCHIRBuilder : public hir::HIRBuilder {
  private:
   void MaybeBreakOnInstruction(uint32_t address);
   void AnnotateLabel(uint32_t address, Label* label);
+  void AllocateInstrLists();
+  void FindBranchTargets();
+  // Emits the instructions from start_address_ to end_address. The last
+  // instruction of an inlined body is its return, which only gets a label.
+  void EmitInstructions(uint32_t end_address, bool is_inlined);
+  // Returns from the function to the address in LR, like blr.
+  void EmitReturnToLR();
+  // Returns the address of the blr ending the function if it can be inlined,
+  // or 0 if it can't. mtlr is accepted if the blr returns from the caller.
+  uint32_t FindInlinedReturn(GuestFunction* function, int32_t max_instr_count,
+                             bool allow_lr_write);
+
+  // GPR/FPR/VMX 14-31 save/restore helpers, including mtlr and blr.
+  static constexpr int32_t kMaxSaveRestInstrCount = 40;
+
+  static bool IsMmioAccessOpcode(PPCOpcode opcode);
+  // Makes the memory accesses emitted after prev_instr check for MMIO.
+  void MarkMmioAccesses(Instr* prev_instr);
+
+  // True if the instruction can't end the block or read the flags outside of
+  // the builder, so lazy flag updates may be kept pending across it.
+  static bool CanDeferFlagsAcross(const PPCOpcodeInfo& opcode_info);
+  // Drops the pending flag state if the block it was recorded in has ended.
+  void SyncFlagState();
+  // Ties a flag update just recorded to the current block.
+  void TrackFlagUpdate();
+  Value* CompareCRField(uint32_t n, uint32_t bit);
+  Value* MaterializeCA();
+  // Stores the pending flag updates to the context. Their operands are kept
+  // so that later reads in the same block don't need to load them again.
+  void FlushFlags();
+  // As FlushFlags, for a single CR field or CA. The state must be synced.
+  void FlushCRField(uint32_t n);
+  void FlushCA();
+  // Forgets the pending flag state, which must have been flushed.
+  void InvalidateFlags();
+  void DiscardCRField(uint32_t n);
 
   PPCFrontend* frontend_;
 
@@ -97,6 +165,39 @@ class PPCHIRBuilder : public hir::HIRBuilder {
   uint64_t instr_count_;
   Instr** instr_offset_list_;
   Label** label_list_;
+  // Instructions that are targets of direct branches within the function, as
+  // labels may be inserted before them after they have been emitted.
+  bool* branch_target_list_;
+  bool lazy_flags_;
+  bool inline_calls_;
+  std::vector<InlinedFunction> inlined_functions_;
+  // Sorted snapshot of the frontend's MMIO access sites.
+  std::vector<uint32_t> mmio_access_sites_;
+
+  // Lazily updated flags, valid only within flags_block_ as values aren't
+  // carried across blocks.
+  hir::Block* flags_block_;
+  struct PendingCRField {
+    // Compare operands, or null if the field is only in the context.
+    Value* lhs;
+    Value* rhs;
+    bool is_signed;
+    // Not yet stored to the context.
+    bool dirty;
+  } pending_cr_[8];
+  enum class PendingCAType {
+    kNone,
+    kValue,
+    kAdd,
+    kSub,
+  };
+  struct {
+    PendingCAType type;
+    // The CA value itself for kValue.
+    Value* lhs;
+    Value* rhs;
+    bool dirty;
+  } pending_ca_;
 
   // Reset each instruction.
   struct {
@@ -59,6 +59,10 @@ bool PPCScanner::Scan(GuestFunction* function, FunctionDebugInfo* debug_info) {
 
   uint32_t start_address = static_cast<uint32_t>(function->address());
   uint32_t end_address = static_cast<uint32_t>(function->end_address());
+  // Functions declared with an end address (from the .pdata runtime function
+  // table, or known helpers) have exact extents, so the heuristics below only
+  // run up to it.
+  bool has_known_end = end_address != 0;
   uint32_t address = start_address;
   uint32_t furthest_target = start_address;
   size_t blocks_found = 0;
@@ -70,7 +74,7 @@ bool PPCScanner::Scan(GuestFunction* function, FunctionDebugInfo* debug_info) {
 
     // If we fetched 0 assume that we somehow hit one of the awesome
     // 'no really we meant to end after that bl' functions.
-    if (!code) {
+    if (!code && !has_known_end) {
       LOGPPC("function end {:08X} (0x00000000 read)", address);
       // Don't include the 0's.
       address -= 4;
@@ -252,6 +256,11 @@ bool PPCScanner::Scan(GuestFunction* function, FunctionDebugInfo* debug_info) {
     if (ends_block) {
       in_block = false;
     }
+    if (ends_fn && has_known_end && address < end_address) {
+      LOGPPC("ignoring function end {:08X} before known end {:08X}", address,
+             end_address);
+      ends_fn = false;
+    }
     if (ends_fn) {
       break;
     }
@@ -261,6 +270,8 @@ bool PPCScanner::Scan(GuestFunction* function, FunctionDebugInfo* debug_info) {
       // Hmm....
       LOGPPC("Ran over function bounds! {:08X}-{:08X}", start_address,
              end_address);
+      // The last instruction is the one at the end address.
+      address -= 4;
       break;
     }
   }
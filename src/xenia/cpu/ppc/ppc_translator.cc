@@ -9,8 +9,12 @@
 
 #include "xenia/cpu/ppc/ppc_translator.h"
 
+#include <algorithm>
+
 #include "xenia/base/assert.h"
 #include "xenia/base/byte_order.h"
+#include "xenia/base/clock.h"
+#include "xenia/base/logging.h"
 #include "xenia/base/memory.h"
 #include "xenia/base/profiling.h"
 #include "xenia/base/reset_scope.h"
@@ -70,17 +74,31 @@ PPCTranslator::PPCTranslator(PPCFrontend* frontend) : frontend_(frontend) {
     if (validate)
       compiler_->AddPass(std::make_unique<passes::ValidationPass>());
   }
+  // Hoisted values are simplified with the rest, and the loads they replace
+  // are removed as dead code.
+  if (cvars::hoist_loop_invariants) {
+    compiler_->AddPass(
+        std::make_unique<passes::LoopInvariantCodeMotionPass>());
+    if (validate)
+      compiler_->AddPass(std::make_unique<passes::ValidationPass>());
+  }
   compiler_->AddPass(std::make_unique<passes::SimplificationPass>());
   if (validate) compiler_->AddPass(std::make_unique<passes::ValidationPass>());
-  // compiler_->AddPass(std::make_unique<passes::DeadStoreEliminationPass>());
-  // if (validate)
-  // compiler_->AddPass(std::make_unique<passes::ValidationPass>());
+  // Simplification may have changed branches, refresh the CFG first.
+  compiler_->AddPass(std::make_unique<passes::ControlFlowAnalysisPass>());
+  compiler_->AddPass(std::make_unique<passes::DeadStoreEliminationPass>());
+  if (validate) compiler_->AddPass(std::make_unique<passes::ValidationPass>());
   compiler_->AddPass(std::make_unique<passes::DeadCodeEliminationPass>());
   if (validate) compiler_->AddPass(std::make_unique<passes::ValidationPass>());
 
-  //// Removes all unneeded variables. Try not to add new ones after this.
-  // compiler_->AddPass(new passes::ValueReductionPass());
-  // if (validate) compiler_->AddPass(new passes::ValidationPass());
+  // Removes all unneeded variables. Try not to add new ones after this.
+  // Only the interpreter indexes its registers by value ordinal, the x64
+  // backend allocates host registers instead and doesn't need the pass.
+  if (backend->machine_info()->uses_value_ordinals) {
+    compiler_->AddPass(std::make_unique<passes::ValueReductionPass>());
+    if (validate)
+      compiler_->AddPass(std::make_unique<passes::ValidationPass>());
+  }
 
   // Register allocation for the target backend.
   // Will modify the HIR to add loads/stores.
@@ -92,17 +110,32 @@ PPCTranslator::PPCTranslator(PPCFrontend* frontend) : frontend_(frontend) {
 
   // Must come last. The HIR is not really HIR after this.
   compiler_->AddPass(std::make_unique<passes::FinalizationPass>());
+
+  // Baseline tier - get code out as fast as possible, it will be replaced if
+  // it turns out to be hot.
+  baseline_compiler_.reset(new Compiler(frontend->processor()));
+  baseline_compiler_->AddPass(std::make_unique<passes::RegisterAllocationPass>(
+      backend->machine_info()));
+  if (validate) {
+    baseline_compiler_->AddPass(std::make_unique<passes::ValidationPass>());
+  }
+  baseline_compiler_->AddPass(std::make_unique<passes::FinalizationPass>());
 }
 
 PPCTranslator::~PPCTranslator() = default;
 
 bool PPCTranslator::Translate(GuestFunction* function,
-                              uint32_t debug_info_flags) {
+                              uint32_t debug_info_flags,
+                              GuestFunction::Tier tier) {
   SCOPE_profile_cpu_f("cpu");
 
+  Compiler* compiler = tier == GuestFunction::Tier::kOptimized
+                           ? compiler_.get()
+                           : baseline_compiler_.get();
+
   // Reset() all caching when we leave.
   xe::make_reset_scope(builder_);
-  xe::make_reset_scope(compiler_);
+  xe::make_reset_scope(compiler);
   xe::make_reset_scope(assembler_);
   xe::make_reset_scope(&string_buffer_);
 
@@ -127,10 +160,24 @@ bool PPCTranslator::Translate(GuestFunction* function,
     debug_info.reset(new FunctionDebugInfo());
   }
 
+  // Stages are measured including the dumping of debug info.
+  bool collect_statistics = cvars::translation_statistics;
+  PPCFrontend::TranslationStatistics translation_stats = {};
+  uint64_t stage_start_ticks =
+      collect_statistics ? Clock::QueryHostTickCount() : 0;
+  auto end_stage = [&](uint64_t* stage_time) {
+    if (collect_statistics) {
+      uint64_t ticks = Clock::QueryHostTickCount();
+      *stage_time = ticks - stage_start_ticks;
+      stage_start_ticks = ticks;
+    }
+  };
+
   // Scan the function to find its extents and gather debug data.
   if (!scanner_->Scan(function, debug_info.get())) {
     return false;
   }
+  end_stage(&translation_stats.scan_time);
 
   // Setup trace data, if needed.
   if (debug_info_flags & DebugInfoFlags::kDebugInfoTraceFunctions) {
@@ -164,10 +211,24 @@ bool PPCTranslator::Translate(GuestFunction* function,
   uint32_t emit_flags = 0;
   if (debug_info) {
     emit_flags |= PPCHIRBuilder::EMIT_DEBUG_COMMENTS;
+  } else if (tier == GuestFunction::Tier::kOptimized) {
+    emit_flags |= PPCHIRBuilder::EMIT_INLINE_CALLS;
   }
   if (!builder_->Emit(function, emit_flags)) {
     return false;
   }
+  // Hashed now, as the guest code may change while the HIR is compiled, and
+  // the hash must be of the code that has been translated.
+  std::vector<PPCFrontend::InlinedCall> inlined_calls;
+  for (const auto& inlined_function : builder_->inlined_functions()) {
+    PPCFrontend::InlinedCall call;
+    call.caller = function;
+    call.callee = inlined_function.function;
+    call.end_address = inlined_function.return_address + 4;
+    call.code_hash = frontend_->HashInlinedCode(call);
+    inlined_calls.push_back(call);
+  }
+  end_stage(&translation_stats.hir_build_time);
 
   // Stash raw HIR.
   if (debug_info_flags & DebugInfoFlags::kDebugInfoDisasmRawHir) {
@@ -177,9 +238,35 @@ bool PPCTranslator::Translate(GuestFunction* function,
   }
 
   // Compile/optimize/etc.
-  if (!compiler_->Compile(builder_.get())) {
+  if (!compiler->Compile(builder_.get())) {
     return false;
   }
+  // The compiler counts the instructions before and after each pass.
+  const auto& pass_stats = compiler->pass_statistics();
+  if (collect_statistics && tier == GuestFunction::Tier::kOptimized &&
+      !pass_stats.empty()) {
+    translation_stats.optimized_function_count = 1;
+    translation_stats.instr_count_before = pass_stats.front().instr_count_before;
+    translation_stats.instr_count_after = pass_stats.back().instr_count_after;
+    translation_stats.store_context_count_before =
+        pass_stats.front().store_context_count_before;
+    translation_stats.store_context_count_after =
+        pass_stats.back().store_context_count_after;
+    translation_stats.inlined_call_count =
+        builder_->inlined_functions().size();
+    const auto& loop_stats = compiler->loop_statistics();
+    translation_stats.loop_count = loop_stats.loop_count;
+    translation_stats.hoisted_loop_count = loop_stats.hoisted_loop_count;
+    translation_stats.hoisted_instr_count = loop_stats.hoisted_instr_count;
+    if (loop_stats.loop_count) {
+      XELOGD(
+          "{:08X}: {} loops nested up to {} deep, {} instructions hoisted out "
+          "of {} of them",
+          function->address(), loop_stats.loop_count,
+          loop_stats.max_loop_depth, loop_stats.hoisted_instr_count,
+          loop_stats.hoisted_loop_count);
+    }
+  }
 
   // Stash optimized HIR.
   if (debug_info_flags & DebugInfoFlags::kDebugInfoDisasmHir) {
@@ -187,12 +274,32 @@ bool PPCTranslator::Translate(GuestFunction* function,
     debug_info->set_hir_disasm(xe_strdup(string_buffer_.buffer()));
     string_buffer_.Reset();
   }
-
-  // Assemble to backend machine code.
-  if (!assembler_->Assemble(function, builder_.get(), debug_info_flags,
+  end_stage(&translation_stats.compile_time);
+
+  // Assemble to backend machine code. The emitter adds the call counter to
+  // baseline code, the interpreter counts calls itself. The assembler sets the
+  // tier once the code is published, as the current code of the function may
+  // be running on other threads.
+  if (tier == GuestFunction::Tier::kBaseline) {
+    *function->tier_up_counter() = std::max(cvars::tier_up_call_count, 1);
+  } else if (tier == GuestFunction::Tier::kInterpreted) {
+    *function->tier_up_counter() =
+        std::max(cvars::interpreter_tier_call_count, 1);
+  }
+  if (!assembler_->Assemble(function, tier, builder_.get(), debug_info_flags,
                             std::move(debug_info))) {
     return false;
   }
+  if (collect_statistics) {
+    end_stage(&translation_stats.assemble_time);
+    translation_stats.function_count = 1;
+    translation_stats.machine_code_size = function->machine_code_length();
+    frontend_->AddTranslationStatistics(tier, translation_stats, pass_stats);
+  }
+
+  // Recorded once the code is in place, as the debugger finds the inlined
+  // guest addresses through the source map of the new code.
+  frontend_->SetInlinedCalls(function, std::move(inlined_calls));
 
   return true;
 }
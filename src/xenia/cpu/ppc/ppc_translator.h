@@ -30,7 +30,8 @@ class PPCTranslator {
   explicit PPCTranslator(PPCFrontend* frontend);
   ~PPCTranslator();
 
-  bool Translate(GuestFunction* function, uint32_t debug_info_flags);
+  bool Translate(GuestFunction* function, uint32_t debug_info_flags,
+                 GuestFunction::Tier tier);
 
  private:
   void DumpSource(GuestFunction* function, StringBuffer* string_buffer);
@@ -39,6 +40,8 @@ class PPCTranslator {
   std::unique_ptr<PPCScanner> scanner_;
   std::unique_ptr<PPCHIRBuilder> builder_;
   std::unique_ptr<compiler::Compiler> compiler_;
+  // Only the passes required to generate code, for GuestFunction::kBaseline.
+  std::unique_ptr<compiler::Compiler> baseline_compiler_;
   std::unique_ptr<backend::Assembler> assembler_;
 
   StringBuffer string_buffer_;
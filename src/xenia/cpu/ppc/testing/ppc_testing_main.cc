@@ -15,6 +15,7 @@
 #include "xenia/base/math.h"
 #include "xenia/base/platform.h"
 #include "xenia/base/string_buffer.h"
+#include "xenia/cpu/backend/interpreter/interpreter_backend.h"
 #include "xenia/cpu/cpu_flags.h"
 #include "xenia/cpu/ppc/ppc_context.h"
 #include "xenia/cpu/ppc/ppc_frontend.h"
@@ -204,10 +205,16 @@ class TestRunner {
         backend.reset(new xe::cpu::backend::x64::X64Backend());
       }
 #endif  // XE_ARCH
+      if (cvars::cpu == "interpreter") {
+        backend.reset(new xe::cpu::backend::interpreter::InterpreterBackend());
+      }
       if (cvars::cpu == "any") {
         if (!backend) {
 #if XE_ARCH_AMD64
           backend.reset(new xe::cpu::backend::x64::X64Backend());
+#else
+          backend.reset(
+              new xe::cpu::backend::interpreter::InterpreterBackend());
 #endif  // XE_ARCH
         }
       }
@@ -9,10 +9,15 @@
 
 #include "xenia/cpu/processor.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
 #include "xenia/base/assert.h"
 #include "xenia/base/atomic.h"
 #include "xenia/base/byte_order.h"
 #include "xenia/base/byte_stream.h"
+#include "xenia/base/clock.h"
 #include "xenia/base/cvar.h"
 #include "xenia/base/debugging.h"
 #include "xenia/base/exception_handler.h"
@@ -22,9 +27,12 @@
 #include "xenia/base/platform.h"
 #include "xenia/base/profiling.h"
 #include "xenia/base/threading.h"
+#include "xenia/base/xxhash.h"
+#include "xenia/cpu/backend/code_cache.h"
 #include "xenia/cpu/breakpoint.h"
 #include "xenia/cpu/cpu_flags.h"
 #include "xenia/cpu/export_resolver.h"
+#include "xenia/cpu/guest_profiler.h"
 #include "xenia/cpu/module.h"
 #include "xenia/cpu/ppc/ppc_decode_data.h"
 #include "xenia/cpu/ppc/ppc_frontend.h"
@@ -48,6 +56,23 @@ DEFINE_path(trace_function_data_path, "", "File to write trace data to.",
             "CPU");
 DEFINE_bool(break_on_start, false, "Break into the debugger on startup.",
             "CPU");
+DEFINE_bool(store_translated_code, false,
+            "Store translated guest code in the cache directory and reuse it "
+            "on subsequent launches of the same modules to skip translation.",
+            "CPU");
+DEFINE_path(guest_profile_path, "",
+            "File to write samples of guest call stacks to on exit, as "
+            "collapsed stacks for flame graph tools.",
+            "CPU");
+DEFINE_int32(guest_profile_sample_rate, 200,
+             "Number of times per second to sample guest call stacks with "
+             "--guest_profile_path.",
+             "CPU");
+
+DECLARE_bool(break_on_unimplemented_instructions);
+DECLARE_bool(inline_mmio_access);
+DECLARE_bool(store_all_context_values);
+DECLARE_int32(inline_max_instructions);
 
 namespace xe {
 namespace kernel {
@@ -86,8 +111,32 @@ Processor::Processor(xe::Memory* memory, ExportResolver* export_resolver)
     : memory_(memory), export_resolver_(export_resolver) {}
 
 Processor::~Processor() {
+  if (guest_profiler_) {
+    guest_profiler_->Stop();
+    guest_profiler_->WriteCollapsedStacks(cvars::guest_profile_path);
+    guest_profiler_.reset();
+  }
+
+  // Precompilation threads may be translating code from the modules.
+  if (frontend_) {
+    memory_->SetVirtualMappedAccessSiteCallback(nullptr, nullptr);
+    frontend_->Shutdown();
+  }
+
+  if (code_reclamation_thread_) {
+    {
+      std::lock_guard<std::mutex> lock(code_reclamation_lock_);
+      code_reclamation_shutdown_ = true;
+    }
+    code_reclamation_cond_.notify_all();
+    xe::threading::Wait(code_reclamation_thread_.get(), false);
+    code_reclamation_thread_.reset();
+  }
+
   {
     auto global_lock = global_critical_region_.Acquire();
+    module_index_.store(nullptr, std::memory_order_release);
+    module_index_versions_.clear();
     modules_.clear();
   }
 
@@ -113,6 +162,7 @@ bool Processor::Setup(std::unique_ptr<backend::Backend> backend) {
   std::unique_ptr<Module> builtin_module(new BuiltinModule(this));
   builtin_module_ = builtin_module.get();
   modules_.push_back(std::move(builtin_module));
+  UpdateModuleIndex();
 
   if (frontend_ || backend_) {
     return false;
@@ -131,6 +181,13 @@ bool Processor::Setup(std::unique_ptr<backend::Backend> backend) {
   backend_ = std::move(backend);
   frontend_ = std::move(frontend);
 
+  // Guest code accessing MMIO through addresses unknown at translation time
+  // can be retranslated to call the MMIO callbacks instead of faulting.
+  if (backend_->code_cache()) {
+    memory_->SetVirtualMappedAccessSiteCallback(MmioAccessSiteCallbackThunk,
+                                                this);
+  }
+
   // Stack walker is used when profiling, debugging, and dumping.
   // Note that creation may fail, in which case we'll have to disable those
   // features.
@@ -147,6 +204,20 @@ bool Processor::Setup(std::unique_ptr<backend::Backend> backend) {
     }
   }
 
+  if (!cvars::guest_profile_path.empty()) {
+    if (stack_walker_) {
+      guest_profiler_ =
+          std::make_unique<GuestProfiler>(this, stack_walker_.get());
+      if (!guest_profiler_->Start(
+              uint32_t(std::max(cvars::guest_profile_sample_rate, 1)))) {
+        XELOGE("Unable to start the guest profiler");
+        guest_profiler_.reset();
+      }
+    } else {
+      XELOGW("Disabling --guest_profile_path due to lack of stack walker");
+    }
+  }
+
   // Open the trace data path, if requested.
   functions_trace_path_ = cvars::trace_function_data_path;
   if (!functions_trace_path_.empty()) {
@@ -157,6 +228,22 @@ bool Processor::Setup(std::unique_ptr<backend::Backend> backend) {
   return true;
 }
 
+void Processor::MmioAccessSiteCallbackThunk(void* context, void* host_pc) {
+  reinterpret_cast<Processor*>(context)->OnMmioAccessSite(host_pc);
+}
+
+void Processor::OnMmioAccessSite(void* host_pc) {
+  GuestFunction* function =
+      backend_->code_cache()->LookupFunction(uint64_t(host_pc));
+  if (!function) {
+    // Not guest code.
+    return;
+  }
+  frontend_->RecordMmioAccessSite(
+      function,
+      function->MapMachineCodeToGuestAddress(uintptr_t(host_pc)));
+}
+
 void Processor::PreLaunch() {
   if (cvars::break_on_start) {
     // Start paused.
@@ -172,9 +259,76 @@ void Processor::PreLaunch() {
 bool Processor::AddModule(std::unique_ptr<Module> module) {
   auto global_lock = global_critical_region_.Acquire();
   modules_.push_back(std::move(module));
+  UpdateModuleIndex();
   return true;
 }
 
+void Processor::UpdateModuleIndex() {
+  auto global_lock = global_critical_region_.Acquire();
+  auto index = std::make_unique<ModuleIndex>();
+  for (const auto& module : modules_) {
+    ModuleIndex::Range range;
+    if (module->GetAddressRange(&range.low_address, &range.high_address)) {
+      range.module = module.get();
+      index->ranges.push_back(range);
+    } else {
+      index->other_modules.push_back(module.get());
+    }
+  }
+  std::stable_sort(
+      index->ranges.begin(), index->ranges.end(),
+      [](const ModuleIndex::Range& a, const ModuleIndex::Range& b) {
+        return a.low_address < b.low_address;
+      });
+  module_index_.store(index.get(), std::memory_order_release);
+  module_index_versions_.push_back(std::move(index));
+}
+
+void Processor::InitializeModuleCodeStorage(Module* module,
+                                            uint64_t module_hash) {
+  if (!cvars::store_translated_code || code_storage_root_.empty()) {
+    return;
+  }
+  // Debug and tracing builds embed per-run host data in the code.
+  if (cvars::debug || debug_info_flags_ || cvars::disassemble_functions ||
+      cvars::trace_functions || cvars::trace_function_coverage ||
+      cvars::trace_function_references || cvars::trace_function_data) {
+    XELOGW("Not storing translated code as debugging or tracing is enabled");
+    return;
+  }
+
+  // Frontend and compiler settings that change the generated code.
+  struct {
+    uint64_t pvr;
+    uint8_t disable_global_lock;
+    uint8_t break_on_unimplemented_instructions;
+    uint8_t inline_mmio_access;
+    uint8_t store_all_context_values;
+    uint8_t native_crt_routines;
+    int32_t inline_max_instructions;
+  } frontend_key_data;
+  std::memset(&frontend_key_data, 0, sizeof(frontend_key_data));
+  frontend_key_data.pvr = cvars::pvr;
+  frontend_key_data.disable_global_lock = cvars::disable_global_lock;
+  frontend_key_data.break_on_unimplemented_instructions =
+      cvars::break_on_unimplemented_instructions;
+  frontend_key_data.inline_mmio_access = cvars::inline_mmio_access;
+  frontend_key_data.store_all_context_values = cvars::store_all_context_values;
+  frontend_key_data.inline_max_instructions = cvars::inline_max_instructions;
+  frontend_key_data.native_crt_routines = cvars::native_crt_routines;
+  uint64_t frontend_key =
+      XXH3_64bits(&frontend_key_data, sizeof(frontend_key_data));
+
+  backend_->InitializeCodeStorage(module, code_storage_root_, module_hash,
+                                  frontend_key);
+}
+
+void Processor::ShutdownModuleCodeStorage(Module* module) {
+  if (backend_) {
+    backend_->ShutdownCodeStorage(module);
+  }
+}
+
 Module* Processor::GetModule(const std::string_view name) {
   auto global_lock = global_critical_region_.Acquire();
   for (const auto& module : modules_) {
@@ -221,7 +375,15 @@ Function* Processor::QueryFunction(uint32_t address) {
 }
 
 std::vector<Function*> Processor::FindFunctionsWithAddress(uint32_t address) {
-  return entry_table_.FindWithAddress(address);
+  auto functions = entry_table_.FindWithAddress(address);
+  // Code inlined into other functions is mapped in their source maps.
+  for (GuestFunction* caller : frontend_->FindInliningCallers(address)) {
+    if (std::find(functions.cbegin(), functions.cend(), caller) ==
+        functions.cend()) {
+      functions.push_back(caller);
+    }
+  }
+  return functions;
 }
 
 Function* Processor::ResolveFunction(uint32_t address) {
@@ -241,9 +403,8 @@ Function* Processor::ResolveFunction(uint32_t address) {
       entry->status = Entry::STATUS_FAILED;
       return nullptr;
     }
-    entry->function = function;
-    entry->end_address = function->end_address();
-    status = entry->status = Entry::STATUS_READY;
+    entry_table_.SetReady(entry, function, function->end_address());
+    status = Entry::STATUS_READY;
   }
   if (status == Entry::STATUS_READY) {
     // Ready to use.
@@ -258,18 +419,7 @@ Function* Processor::LookupFunction(uint32_t address) {
   // TODO(benvanik): fast reject invalid addresses/log errors.
 
   // Find the module that contains the address.
-  Module* code_module = nullptr;
-  {
-    auto global_lock = global_critical_region_.Acquire();
-    // TODO(benvanik): sort by code address (if contiguous) so can bsearch.
-    // TODO(benvanik): cache last module low/high, as likely to be in there.
-    for (const auto& module : modules_) {
-      if (module->ContainsAddress(address)) {
-        code_module = module.get();
-        break;
-      }
-    }
-  }
+  Module* code_module = FindModuleForAddress(address);
   if (!code_module) {
     // No module found that could contain the address.
     return nullptr;
@@ -278,6 +428,46 @@ Function* Processor::LookupFunction(uint32_t address) {
   return LookupFunction(code_module, address);
 }
 
+Module* Processor::FindModuleForAddress(uint32_t address) {
+  // Lock-free - the index is immutable and never freed while the processor is
+  // alive.
+  const ModuleIndex* index = module_index_.load(std::memory_order_acquire);
+  if (!index) {
+    return nullptr;
+  }
+  const auto& ranges = index->ranges;
+
+  // Most lookups from a thread are in the module of the previous one.
+  thread_local const ModuleIndex* last_index = nullptr;
+  thread_local size_t last_range = 0;
+  if (last_index == index && last_range < ranges.size() &&
+      address >= ranges[last_range].low_address &&
+      address < ranges[last_range].high_address) {
+    return ranges[last_range].module;
+  }
+
+  auto it = std::upper_bound(
+      ranges.cbegin(), ranges.cend(), address,
+      [](uint32_t value, const ModuleIndex::Range& range) {
+        return value < range.low_address;
+      });
+  if (it != ranges.cbegin()) {
+    --it;
+    if (address < it->high_address) {
+      last_index = index;
+      last_range = size_t(it - ranges.cbegin());
+      return it->module;
+    }
+  }
+
+  for (Module* module : index->other_modules) {
+    if (module->ContainsAddress(address)) {
+      return module;
+    }
+  }
+  return nullptr;
+}
+
 Function* Processor::LookupFunction(Module* module, uint32_t address) {
   // Atomic create/lookup symbol in module.
   // If we get back the NEW flag we must declare it now.
@@ -295,6 +485,178 @@ Function* Processor::LookupFunction(Module* module, uint32_t address) {
   return function;
 }
 
+void Processor::PrecompileFunction(Module* module, uint32_t address) {
+  if (!frontend_->is_precompiling() || !module->ContainsAddress(address)) {
+    return;
+  }
+  // Newly declared functions are queued by the frontend.
+  LookupFunction(module, address);
+}
+
+void Processor::PrecompileAllFunctions(Module* module) {
+  if (!frontend_->is_precompiling_all()) {
+    return;
+  }
+  std::vector<GuestFunction*> functions;
+  module->ForEachFunction([&functions](Function* function) {
+    if (function->is_guest() &&
+        function->status() == Symbol::Status::kDeclared) {
+      functions.push_back(static_cast<GuestFunction*>(function));
+    }
+  });
+  XELOGI("Translating {} functions of {}...", functions.size(),
+         module->name());
+  uint64_t start_time = Clock::QueryHostUptimeMillis();
+  for (GuestFunction* function : functions) {
+    frontend_->QueuePrecompile(function);
+  }
+  frontend_->WaitForPrecompile(module);
+  XELOGI("Translated the functions of {} in {} ms", module->name(),
+         Clock::QueryHostUptimeMillis() - start_time);
+}
+
+void Processor::CancelPrecompile(Module* module) {
+  if (frontend_) {
+    frontend_->CancelPrecompile(module);
+  }
+}
+
+void Processor::ReleaseModuleCode(Module* module) {
+  if (!backend_) {
+    return;
+  }
+  uint32_t low_address, high_address;
+  if (module->GetAddressRange(&low_address, &high_address)) {
+    // A module loaded at the same addresses later must not get the released
+    // functions.
+    entry_table_.Invalidate(low_address, high_address);
+  }
+  backend_->ReleaseModuleCode(module);
+  RequestCodeReclamation();
+}
+
+bool Processor::has_retired_code() const {
+  cpu::backend::CodeCache* code_cache =
+      backend_ ? backend_->code_cache() : nullptr;
+  return code_cache && code_cache->has_retired_code();
+}
+
+void Processor::RequestCodeReclamation() {
+  if (!has_retired_code()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(code_reclamation_lock_);
+    if (code_reclamation_shutdown_) {
+      return;
+    }
+    code_reclamation_requested_ = true;
+    if (!code_reclamation_thread_) {
+      // Scanning is cheap, but guest threads must still win over it.
+      xe::threading::Thread::CreationParameters params;
+      params.initial_priority = xe::threading::ThreadPriority::kBelowNormal;
+      code_reclamation_thread_ = xe::threading::Thread::Create(
+          params, [this]() { CodeReclamationThread(); });
+      assert_not_null(code_reclamation_thread_);
+      code_reclamation_thread_->set_name("CPU Code Reclamation");
+    }
+  }
+  code_reclamation_cond_.notify_all();
+}
+
+void Processor::CodeReclamationThread() {
+  std::unique_lock<std::mutex> lock(code_reclamation_lock_);
+  while (true) {
+    code_reclamation_cond_.wait(lock, [this]() {
+      return code_reclamation_shutdown_ || code_reclamation_requested_;
+    });
+    if (code_reclamation_shutdown_) {
+      return;
+    }
+    code_reclamation_requested_ = false;
+    // Threads running guest code are only scanned once they call host code or
+    // return from guest code, so retry until everything has been freed.
+    while (has_retired_code()) {
+      lock.unlock();
+      ReclaimRetiredCode();
+      lock.lock();
+      if (code_reclamation_cond_.wait_for(
+              lock, std::chrono::milliseconds(100),
+              [this]() { return code_reclamation_shutdown_; })) {
+        return;
+      }
+    }
+  }
+}
+
+// Gathers the values in the guest frames of the thread pointing into
+// generated code, if the thread isn't running guest code. The thread keeps
+// running, so the stack is only known to have been read while it was calling
+// the same host code if the transition count is still the same afterwards.
+static bool ScanGuestFrames(const ppc::PPCContext* context, uint64_t code_low,
+                            uint64_t code_high,
+                            std::vector<uint64_t>* host_pcs) {
+  uint64_t host_call_count = context->host_call_count;
+  uint64_t stack_pointer = context->host_call_stack_pointer;
+  uint64_t stack_top = context->guest_stack_top;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (!stack_pointer) {
+    // Either no guest code is on the stack, or it's being run right now.
+    return !stack_top;
+  }
+  if (stack_top <= stack_pointer || stack_top - stack_pointer > 64_MiB) {
+    // Read while the thread was changing the state.
+    return false;
+  }
+  for (uint64_t address = stack_pointer; address < stack_top; address += 8) {
+    uint64_t value = *reinterpret_cast<const volatile uint64_t*>(address);
+    if (value >= code_low && value < code_high) {
+      host_pcs->push_back(value);
+    }
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (context->host_call_stack_pointer != stack_pointer ||
+      context->host_call_count != host_call_count) {
+    host_pcs->clear();
+    return false;
+  }
+  std::sort(host_pcs->begin(), host_pcs->end());
+  return true;
+}
+
+void Processor::ReclaimRetiredCode() {
+  if (!has_retired_code()) {
+    return;
+  }
+  cpu::backend::CodeCache* code_cache = backend_->code_cache();
+  uint64_t code_low = code_cache->execute_base_address();
+  uint64_t code_high = code_low + code_cache->total_size();
+
+  std::vector<cpu::backend::CodeCache::ThreadCodeReferences> threads;
+  // Threads exit under the global lock, so the stacks of the ones not marked
+  // as exited stay valid while it's held.
+  auto global_lock = global_critical_region_.Acquire();
+  // Pairs with the barrier guest threads do when they start running guest
+  // code: a thread seen outside guest code after the retired code has been
+  // replaced in the indirection table will only load the new code.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (auto& it : thread_debug_infos_) {
+    ThreadDebugInfo* thread_info = it.second.get();
+    Thread* thread = thread_info->thread;
+    if (!thread || thread_info->state == ThreadDebugInfo::State::kExited ||
+        thread_info->state == ThreadDebugInfo::State::kZombie) {
+      continue;
+    }
+    threads.emplace_back();
+    cpu::backend::CodeCache::ThreadCodeReferences& references = threads.back();
+    references.thread_id = thread_info->thread_id;
+    references.scanned =
+        ScanGuestFrames(thread->thread_state()->context(), code_low,
+                        code_high, &references.host_pcs);
+  }
+  code_cache->ReclaimRetiredCode(threads);
+}
+
 bool Processor::DemandFunction(Function* function) {
   // Lock function for generation. If it's already being generated
   // by another thread this will block and return DECLARED.
@@ -303,8 +665,13 @@ bool Processor::DemandFunction(Function* function) {
   if (symbol_status == Symbol::Status::kNew) {
     // Symbol is undefined, so define now.
     assert_true(function->is_guest());
-    if (!frontend_->DefineFunction(static_cast<GuestFunction*>(function),
-                                   debug_info_flags_)) {
+    auto guest_function = static_cast<GuestFunction*>(function);
+    // Reuse code stored by a previous launch if possible, otherwise
+    // translate.
+    bool restored =
+        !debug_info_flags_ && backend_->RestoreGuestFunction(guest_function);
+    if (!restored &&
+        !frontend_->DefineFunction(guest_function, debug_info_flags_)) {
       function->set_status(Symbol::Status::kFailed);
       return false;
     }
@@ -10,14 +10,18 @@
 #ifndef XENIA_CPU_PROCESSOR_H_
 #define XENIA_CPU_PROCESSOR_H_
 
+#include <atomic>
+#include <condition_variable>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 
 #include "xenia/base/cvar.h"
 #include "xenia/base/mapped_memory.h"
 #include "xenia/base/mutex.h"
+#include "xenia/base/threading.h"
 #include "xenia/cpu/backend/backend.h"
 #include "xenia/cpu/debug_listener.h"
 #include "xenia/cpu/entry_table.h"
@@ -37,6 +41,7 @@ namespace cpu {
 constexpr fourcc_t kProcessorSaveSignature = make_fourcc("PROC");
 
 class Breakpoint;
+class GuestProfiler;
 class StackWalker;
 class XexModule;
 
@@ -100,7 +105,20 @@ class Processor {
     debug_info_flags_ = debug_info_flags;
   }
 
+  // Sets the directory translated code is persisted to between launches.
+  // Must be set before modules are loaded for code storage to be used.
+  void set_code_storage_root(const std::filesystem::path& root) {
+    code_storage_root_ = root;
+  }
+  // Opens the persistent code storage for the module so that translations
+  // from previous launches can be reused, if enabled.
+  void InitializeModuleCodeStorage(Module* module, uint64_t module_hash);
+  void ShutdownModuleCodeStorage(Module* module);
+
   bool AddModule(std::unique_ptr<Module> module);
+  // Publishes a new index of module address ranges for LookupFunction. Must be
+  // called when a module's address range changes after it has been added.
+  void UpdateModuleIndex();
   Module* GetModule(const std::string_view name);
   std::vector<Module*> GetModules();
 
@@ -116,6 +134,32 @@ class Processor {
   Function* LookupFunction(Module* module, uint32_t address);
   Function* ResolveFunction(uint32_t address);
 
+  // Requests translation of a function known to be called at some point (an
+  // entry point or an export) in the background, if precompilation is
+  // enabled.
+  void PrecompileFunction(Module* module, uint32_t address);
+  // Translates all functions declared in the module in the background and
+  // waits for them, if requested with precompile_all_functions.
+  void PrecompileAllFunctions(Module* module);
+  // Stops background translation of the module's functions before its code is
+  // unloaded.
+  void CancelPrecompile(Module* module);
+  // Frees the code of the module's functions once no thread is running it,
+  // before the module is unloaded.
+  void ReleaseModuleCode(Module* module);
+  // Whether code replaced by retranslation or of unloaded modules is waiting
+  // for ReclaimRetiredCode.
+  bool has_retired_code() const;
+  // Wakes the code reclamation thread, starting it if needed, to free the
+  // retired code once no thread is running it.
+  void RequestCodeReclamation();
+  // Scans the guest frames of the threads that are calling host code from
+  // guest code or not running guest code at all, and frees the retired code
+  // that no thread that may still be running it has been scanned running. The
+  // threads aren't suspended, threads that are running guest code are skipped
+  // until a later call.
+  void ReclaimRetiredCode();
+
   bool Execute(ThreadState* thread_state, uint32_t address);
   bool ExecuteRaw(ThreadState* thread_state, uint32_t address);
   uint64_t Execute(ThreadState* thread_state, uint32_t address, uint64_t args[],
@@ -225,6 +269,9 @@ class Processor {
 
   void OnFunctionDefined(Function* function);
 
+  static void MmioAccessSiteCallbackThunk(void* context, void* host_pc);
+  void OnMmioAccessSite(void* host_pc);
+
   static bool ExceptionCallbackThunk(Exception* ex, void* data);
   bool ExceptionCallback(Exception* ex);
   void OnStepCompleted(ThreadDebugInfo* thread_info);
@@ -237,9 +284,26 @@ class Processor {
                                          uint32_t current_pc);
 
   bool DemandFunction(Function* function);
+  Module* FindModuleForAddress(uint32_t address);
+
+  void CodeReclamationThread();
+
+  // Immutable snapshot of the modules for lock-free address lookups.
+  struct ModuleIndex {
+    struct Range {
+      uint32_t low_address;
+      uint32_t high_address;
+      Module* module;
+    };
+    // Sorted by low_address.
+    std::vector<Range> ranges;
+    // Modules without a known address range, in the order they were added.
+    std::vector<Module*> other_modules;
+  };
 
   Memory* memory_ = nullptr;
   std::unique_ptr<StackWalker> stack_walker_;
+  std::unique_ptr<GuestProfiler> guest_profiler_;
 
   std::function<DebugListener*(Processor*)> debug_listener_handler_;
   DebugListener* debug_listener_ = nullptr;
@@ -249,6 +313,8 @@ class Processor {
   // If specified, the file trace data gets written to when running.
   std::filesystem::path functions_trace_path_;
   std::unique_ptr<ChunkedMappedMemoryWriter> functions_trace_file_;
+  // Directory persistent code storage files are kept in.
+  std::filesystem::path code_storage_root_;
 
   std::unique_ptr<ppc::PPCFrontend> frontend_;
   std::unique_ptr<backend::Backend> backend_;
@@ -258,6 +324,11 @@ class Processor {
   xe::global_critical_region global_critical_region_;
   ExecutionState execution_state_ = ExecutionState::kPaused;
   std::vector<std::unique_ptr<Module>> modules_;
+  // The current module index, replaced on updates. Readers may still be using
+  // the previous ones, so all versions are kept until the processor is
+  // destroyed (modules are added rarely). Guarded with the global lock.
+  std::atomic<const ModuleIndex*> module_index_ = {nullptr};
+  std::vector<std::unique_ptr<ModuleIndex>> module_index_versions_;
   Module* builtin_module_ = nullptr;
   uint32_t next_builtin_address_ = 0xFFFF0000u;
 
@@ -265,6 +336,14 @@ class Processor {
   // removed. Must be guarded with the global lock.
   std::map<uint32_t, std::unique_ptr<ThreadDebugInfo>> thread_debug_infos_;
 
+  // Frees retired code in the background while there is any, independently of
+  // the precompile threads, which may be disabled.
+  std::unique_ptr<xe::threading::Thread> code_reclamation_thread_;
+  std::mutex code_reclamation_lock_;
+  std::condition_variable code_reclamation_cond_;
+  bool code_reclamation_requested_ = false;
+  bool code_reclamation_shutdown_ = false;
+
   // TODO(benvanik): cleanup/change structures.
   std::vector<Breakpoint*> breakpoints_;
 
@@ -56,6 +56,7 @@ bool RawModule::LoadFile(uint32_t base_address,
 
   // Notify backend about executable code.
   processor_->backend()->CommitExecutableRange(low_address_, high_address_);
+  processor_->UpdateModuleIndex();
   return true;
 }
 
@@ -66,12 +67,23 @@ void RawModule::SetAddressRange(uint32_t base_address, uint32_t size) {
 
   // Notify backend about executable code.
   processor_->backend()->CommitExecutableRange(low_address_, high_address_);
+  processor_->UpdateModuleIndex();
 }
 
 bool RawModule::ContainsAddress(uint32_t address) {
   return address >= low_address_ && address < high_address_;
 }
 
+bool RawModule::GetAddressRange(uint32_t* out_low_address,
+                                uint32_t* out_high_address) const {
+  if (low_address_ >= high_address_) {
+    return false;
+  }
+  *out_low_address = low_address_;
+  *out_high_address = high_address_;
+  return true;
+}
+
 std::unique_ptr<Function> RawModule::CreateFunction(uint32_t address) {
   return std::unique_ptr<Function>(
       processor_->backend()->CreateGuestFunction(this, address));
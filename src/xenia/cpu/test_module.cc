@@ -48,11 +48,15 @@ TestModule::TestModule(Processor* processor, const std::string_view name,
   compiler_->AddPass(std::make_unique<passes::SimplificationPass>());
   compiler_->AddPass(std::make_unique<passes::ConstantPropagationPass>());
   compiler_->AddPass(std::make_unique<passes::SimplificationPass>());
-  // compiler_->AddPass(std::make_unique<passes::DeadStoreEliminationPass>());
+  // Simplification may have changed branches, refresh the CFG first.
+  compiler_->AddPass(std::make_unique<passes::ControlFlowAnalysisPass>());
+  compiler_->AddPass(std::make_unique<passes::DeadStoreEliminationPass>());
   compiler_->AddPass(std::make_unique<passes::DeadCodeEliminationPass>());
 
-  //// Removes all unneeded variables. Try not to add new ones after this.
-  // compiler_->AddPass(new passes::ValueReductionPass());
+  // Removes all unneeded variables. Try not to add new ones after this.
+  if (processor->backend()->machine_info()->uses_value_ordinals) {
+    compiler_->AddPass(std::make_unique<passes::ValueReductionPass>());
+  }
 
   // Register allocation for the target backend.
   // Will modify the HIR to add loads/stores.
@@ -95,7 +99,8 @@ Symbol::Status TestModule::DeclareFunction(uint32_t address,
     compiler_->Compile(builder_.get());
 
     // Assemble the function.
-    assembler_->Assemble(function, builder_.get(), 0, nullptr);
+    assembler_->Assemble(function, GuestFunction::Tier::kOptimized,
+                         builder_.get(), 0, nullptr);
 
     status = Symbol::Status::kDefined;
     function->set_status(status);
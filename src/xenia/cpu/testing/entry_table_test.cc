@@ -0,0 +1,251 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "xenia/base/mutex.h"
+#include "xenia/cpu/entry_table.h"
+
+#include "third_party/catch/include/catch.hpp"
+
+namespace xe {
+namespace cpu {
+namespace test {
+
+// The table never dereferences functions.
+static Function* FakeFunction(uint32_t address) {
+  return reinterpret_cast<Function*>(uintptr_t(address) | 1);
+}
+
+TEST_CASE("ENTRY_TABLE_CREATE", "[entry_table]") {
+  EntryTable table;
+  REQUIRE(table.Get(0x82000000) == nullptr);
+
+  Entry* entry;
+  REQUIRE(table.GetOrCreate(0x82000000, &entry) == Entry::STATUS_NEW);
+  REQUIRE(entry->address == 0x82000000);
+  // Not visible until ready.
+  REQUIRE(table.Get(0x82000000) == nullptr);
+  table.SetReady(entry, FakeFunction(0x82000000), 0x82000010);
+
+  Entry* ready_entry;
+  REQUIRE(table.GetOrCreate(0x82000000, &ready_entry) == Entry::STATUS_READY);
+  REQUIRE(ready_entry == entry);
+  REQUIRE(table.Get(0x82000000) == entry);
+  REQUIRE(entry->function == FakeFunction(0x82000000));
+
+  // Neighbors and other pages are independent.
+  REQUIRE(table.Get(0x82000004) == nullptr);
+  REQUIRE(table.GetOrCreate(0x82000004, &entry) == Entry::STATUS_NEW);
+  entry->status = Entry::STATUS_FAILED;
+  REQUIRE(table.GetOrCreate(0x82000004, &entry) == Entry::STATUS_FAILED);
+  REQUIRE(table.GetOrCreate(0xFFFFFFFC, &entry) == Entry::STATUS_NEW);
+  REQUIRE(table.GetOrCreate(0x00000000, &entry) == Entry::STATUS_NEW);
+
+  // Misaligned addresses can't be code.
+  REQUIRE(table.GetOrCreate(0x82000002, &entry) == Entry::STATUS_FAILED);
+  REQUIRE(entry == nullptr);
+}
+
+TEST_CASE("ENTRY_TABLE_FIND_WITH_ADDRESS", "[entry_table]") {
+  EntryTable table;
+  auto add = [&table](uint32_t address, uint32_t end_address) {
+    Entry* entry;
+    REQUIRE(table.GetOrCreate(address, &entry) == Entry::STATUS_NEW);
+    table.SetReady(entry, FakeFunction(address), end_address);
+  };
+  add(0x82000100, 0x82000200);
+  add(0x82000000, 0x82001000);
+  add(0x82000180, 0x82000190);
+  add(0x82002000, 0x82002000);
+
+  auto find = [&table](uint32_t address) {
+    auto fns = table.FindWithAddress(address);
+    std::sort(fns.begin(), fns.end());
+    return fns;
+  };
+  REQUIRE(find(0x81FFFFFC).empty());
+  REQUIRE(find(0x82000000) ==
+          std::vector<Function*>{FakeFunction(0x82000000)});
+  REQUIRE(find(0x82000184) ==
+          std::vector<Function*>{FakeFunction(0x82000000),
+                                 FakeFunction(0x82000100),
+                                 FakeFunction(0x82000180)});
+  REQUIRE(find(0x82000800) ==
+          std::vector<Function*>{FakeFunction(0x82000000)});
+  REQUIRE(find(0x82001004).empty());
+  REQUIRE(find(0x82002000) ==
+          std::vector<Function*>{FakeFunction(0x82002000)});
+
+  // Entries made ready after a query are picked up, entries still being
+  // compiled aren't.
+  add(0x82001004, 0x82001100);
+  Entry* compiling_entry;
+  table.GetOrCreate(0x82001200, &compiling_entry);
+  REQUIRE(find(0x82001008) ==
+          std::vector<Function*>{FakeFunction(0x82001004)});
+  REQUIRE(find(0x82001200).empty());
+}
+
+TEST_CASE("ENTRY_TABLE_INVALIDATE", "[entry_table]") {
+  EntryTable table;
+  auto add = [&table](uint32_t address, uint32_t end_address) {
+    Entry* entry;
+    REQUIRE(table.GetOrCreate(address, &entry) == Entry::STATUS_NEW);
+    table.SetReady(entry, FakeFunction(address), end_address);
+    return entry;
+  };
+  add(0x82000000, 0x82000100);
+  Entry* kept_entry = add(0x82010000, 0x82010100);
+  Entry* compiling_entry;
+  REQUIRE(table.GetOrCreate(0x82000200, &compiling_entry) ==
+          Entry::STATUS_NEW);
+  REQUIRE(table.FindWithAddress(0x82000010).size() == 1);
+
+  table.Invalidate(0x82000000, 0x82010000);
+  REQUIRE(table.Get(0x82000000) == nullptr);
+  REQUIRE(table.FindWithAddress(0x82000010).empty());
+  REQUIRE(table.Get(0x82010000) == kept_entry);
+  REQUIRE(table.FindWithAddress(0x82010010) ==
+          std::vector<Function*>{FakeFunction(0x82010000)});
+
+  // An entry invalidated while being compiled isn't indexed once ready.
+  table.SetReady(compiling_entry, FakeFunction(0x82000200), 0x82000300);
+  REQUIRE(table.Get(0x82000200) == nullptr);
+  REQUIRE(table.FindWithAddress(0x82000210).empty());
+
+  // The addresses resolve to new entries.
+  Entry* new_entry;
+  REQUIRE(table.GetOrCreate(0x82000000, &new_entry) == Entry::STATUS_NEW);
+  table.SetReady(new_entry, FakeFunction(0x82000004), 0x82000100);
+  REQUIRE(table.FindWithAddress(0x82000010) ==
+          std::vector<Function*>{FakeFunction(0x82000004)});
+}
+
+TEST_CASE("ENTRY_TABLE_CONCURRENT_CREATE", "[entry_table]") {
+  EntryTable table;
+  const uint32_t kAddressCount = 4096;
+  const size_t kThreadCount = 8;
+  std::atomic<uint32_t> created_count = {0};
+  std::atomic<uint32_t> ready_count = {0};
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < kThreadCount; ++i) {
+    threads.emplace_back([&]() {
+      for (uint32_t j = 0; j < kAddressCount; ++j) {
+        // Spread over multiple pages.
+        uint32_t address = 0x82000000 + j * 0x40;
+        Entry* entry;
+        Entry::Status status = table.GetOrCreate(address, &entry);
+        if (status == Entry::STATUS_NEW) {
+          ++created_count;
+          table.SetReady(entry, FakeFunction(address), address);
+        } else if (status == Entry::STATUS_READY &&
+                   entry->function == FakeFunction(address)) {
+          ++ready_count;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  REQUIRE(created_count == kAddressCount);
+  REQUIRE(ready_count == kAddressCount * (kThreadCount - 1));
+}
+
+// Measures how resolving already compiled functions scales with the number of
+// guest threads. Not run by default: xenia-cpu-tests "[benchmark]"
+TEST_CASE("ENTRY_TABLE_CONTENTION_BENCHMARK", "[.][benchmark][entry_table]") {
+  const uint32_t kAddressCount = 64 * 1024;
+  const uint32_t kResolvesPerThread = 4 * 1024 * 1024;
+
+  // The previous implementation, for comparison.
+  struct LockedTable {
+    xe::global_critical_region global_critical_region;
+    std::unordered_map<uint32_t, Entry*> map;
+    Entry* Get(uint32_t address) {
+      auto global_lock = global_critical_region.Acquire();
+      auto it = map.find(address);
+      return it != map.end() ? it->second : nullptr;
+    }
+  };
+
+  EntryTable table;
+  LockedTable locked_table;
+  for (uint32_t i = 0; i < kAddressCount; ++i) {
+    uint32_t address = 0x82000000 + i * 0x20;
+    Entry* entry;
+    table.GetOrCreate(address, &entry);
+    table.SetReady(entry, FakeFunction(address), address + 0x1C);
+    locked_table.map.emplace(address, entry);
+  }
+
+  auto run = [&](size_t thread_count, auto resolve) {
+    std::atomic<bool> start = {false};
+    std::atomic<uint64_t> checksum = {0};
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < thread_count; ++i) {
+      threads.emplace_back([&, i]() {
+        while (!start) {
+          std::this_thread::yield();
+        }
+        // Cheap LCG to get a call pattern the branch predictor can't learn.
+        uint32_t seed = uint32_t(i) * 2654435761u + 1;
+        uint64_t sum = 0;
+        for (uint32_t j = 0; j < kResolvesPerThread; ++j) {
+          seed = seed * 1664525u + 1013904223u;
+          uint32_t address = 0x82000000 + (seed >> 16) % kAddressCount * 0x20;
+          sum += uintptr_t(resolve(address)->function);
+        }
+        checksum += sum;
+      });
+    }
+    auto start_time = std::chrono::steady_clock::now();
+    start = true;
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start_time)
+                         .count();
+    REQUIRE(checksum != 0);
+    return double(kResolvesPerThread) * thread_count / seconds / 1000000.0;
+  };
+
+  size_t max_thread_count =
+      std::max(size_t(std::thread::hardware_concurrency()), size_t(1));
+  std::printf("threads | lock-free Mresolves/s | locked Mresolves/s\n");
+  // Powers of two, and the hardware thread count last even if it isn't one.
+  for (size_t thread_count = 1;;
+       thread_count = std::min(thread_count * 2, max_thread_count)) {
+    double lock_free_rate = run(thread_count, [&table](uint32_t address) {
+      Entry* entry;
+      table.GetOrCreate(address, &entry);
+      return entry;
+    });
+    double locked_rate = run(thread_count, [&locked_table](uint32_t address) {
+      return locked_table.Get(address);
+    });
+    std::printf("%7zu | %21.2f | %18.2f\n", thread_count, lock_free_rate,
+                locked_rate);
+    if (thread_count == max_thread_count) {
+      break;
+    }
+  }
+}
+
+}  // namespace test
+}  // namespace cpu
+}  // namespace xe
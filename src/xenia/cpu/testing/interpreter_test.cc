@@ -0,0 +1,74 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include "xenia/cpu/testing/util.h"
+
+using namespace xe::cpu::hir;
+using namespace xe::cpu;
+using namespace xe::cpu::testing;
+using xe::cpu::ppc::PPCContext;
+
+// Constants, locals and values used outside of the block defining them all
+// survive the optimizing passes (including ValueReductionPass on the
+// interpreter) with their own registers.
+TEST_CASE("PIPELINE_LOOP_LOCALS", "[pipeline]") {
+  TestFunction test([](HIRBuilder& b) {
+    auto loop = b.NewLabel();
+    auto done = b.NewLabel();
+    auto sum = b.AllocLocal(INT64_TYPE);
+    auto index = b.AllocLocal(INT64_TYPE);
+    auto count = LoadGPR(b, 4);
+    auto step = b.LoadConstantInt64(3);
+    b.StoreLocal(sum, b.LoadZeroInt64());
+    b.StoreLocal(index, b.LoadZeroInt64());
+    b.MarkLabel(loop);
+    auto index_value = b.LoadLocal(index);
+    b.BranchTrue(b.CompareUGE(index_value, count), done);
+    b.StoreLocal(sum, b.Add(b.LoadLocal(sum), b.Add(index_value, step)));
+    b.StoreLocal(index, b.Add(index_value, b.LoadConstantInt64(1)));
+    b.Branch(loop);
+    b.MarkLabel(done);
+    StoreGPR(b, 3, b.Add(b.LoadLocal(sum), count));
+    b.Return();
+  });
+  test.Run([](PPCContext* ctx) { ctx->r[4] = 0; },
+           [](PPCContext* ctx) { REQUIRE(ctx->r[3] == 0); });
+  test.Run([](PPCContext* ctx) { ctx->r[4] = 4; },
+           [](PPCContext* ctx) { REQUIRE(ctx->r[3] == 22); });
+  test.Run([](PPCContext* ctx) { ctx->r[4] = 10; },
+           [](PPCContext* ctx) { REQUIRE(ctx->r[3] == 85); });
+}
+
+TEST_CASE("PIPELINE_SELECT_ACROSS_BLOCKS", "[pipeline]") {
+  TestFunction test([](HIRBuilder& b) {
+    auto other = b.NewLabel();
+    auto a = LoadGPR(b, 4);
+    auto c = LoadGPR(b, 5);
+    auto difference = b.Sub(a, c);
+    auto bias = b.LoadConstantInt64(100);
+    b.BranchTrue(b.CompareSLT(a, c), other);
+    StoreGPR(b, 3, b.Add(difference, bias));
+    b.Return();
+    b.MarkLabel(other);
+    StoreGPR(b, 3, b.Sub(bias, difference));
+    b.Return();
+  });
+  test.Run(
+      [](PPCContext* ctx) {
+        ctx->r[4] = 7;
+        ctx->r[5] = 2;
+      },
+      [](PPCContext* ctx) { REQUIRE(ctx->r[3] == 105); });
+  test.Run(
+      [](PPCContext* ctx) {
+        ctx->r[4] = 2;
+        ctx->r[5] = 7;
+      },
+      [](PPCContext* ctx) { REQUIRE(ctx->r[3] == 105); });
+}
@@ -0,0 +1,238 @@
+/**
+ ******************************************************************************
+ * Xenia : Xbox 360 Emulator Research Project                                 *
+ ******************************************************************************
+ * Copyright 2022 Ben Vanik. All rights reserved.                             *
+ * Released under the BSD license - see LICENSE in the root for more details. *
+ ******************************************************************************
+ */
+
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "xenia/base/byte_stream.h"
+#include "xenia/base/memory.h"
+#include "xenia/memory.h"
+
+#include "third_party/catch/include/catch.hpp"
+
+namespace xe {
+namespace cpu {
+namespace test {
+
+// Many threads allocating, protecting and releasing in one heap while others
+// query it without taking the global critical region.
+TEST_CASE("HEAP_CONCURRENT_ALLOC_QUERY", "[memory]") {
+  Memory memory;
+  REQUIRE(memory.Initialize());
+  BaseHeap* heap = memory.LookupHeap(0x40000000);
+  REQUIRE(heap);
+  const uint32_t page_size = heap->page_size();
+  const uint32_t unreserved_page_count = heap->GetUnreservedPageCount();
+  const uint32_t allocating_thread_count = 16;
+  const uint32_t querying_thread_count = 4;
+
+  std::atomic<bool> done{false};
+  std::atomic<uint32_t> failures{0};
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < allocating_thread_count; ++i) {
+    threads.emplace_back([&, i]() {
+      uint8_t tag = uint8_t(i + 1);
+      for (uint32_t j = 0; j < 500; ++j) {
+        uint32_t size = (1 + (i + j) % 8) * page_size;
+        uint32_t address;
+        if (!heap->Alloc(size, 0,
+                         kMemoryAllocationReserve | kMemoryAllocationCommit,
+                         kMemoryProtectRead | kMemoryProtectWrite, (j & 1) != 0,
+                         &address)) {
+          ++failures;
+          continue;
+        }
+        auto host_address = memory.TranslateVirtual(address);
+        std::memset(host_address, tag, size);
+
+        uint32_t query_address = address + size / 2;
+        uint32_t query_size;
+        uint32_t protect;
+        if (!heap->QueryBaseAndSize(&query_address, &query_size) ||
+            query_address != address || query_size != size ||
+            !heap->QueryProtect(address, &protect) ||
+            protect != (kMemoryProtectRead | kMemoryProtectWrite)) {
+          ++failures;
+        }
+        if (!heap->Protect(address, size, kMemoryProtectRead) ||
+            !heap->QueryProtect(address + size - 1, &protect) ||
+            protect != kMemoryProtectRead) {
+          ++failures;
+        }
+        // No other thread may have been given any of the pages.
+        for (uint32_t k = 0; k < size; k += page_size / 4) {
+          if (host_address[k] != tag) {
+            ++failures;
+            break;
+          }
+        }
+        heap->Protect(address, size, kMemoryProtectRead | kMemoryProtectWrite);
+        if (!heap->Release(address)) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (uint32_t i = 0; i < querying_thread_count; ++i) {
+    threads.emplace_back([&, i]() {
+      uint32_t page = i;
+      while (!done) {
+        page = (page * 1103515245 + 12345) % 4096;
+        uint32_t address = heap->heap_base() + page * page_size;
+        uint32_t heap_relative_address = address - heap->heap_base();
+        HeapAllocationInfo info;
+        if (!heap->QueryRegionInfo(address, &info) || !info.region_size ||
+            (info.state && (info.allocation_base > heap_relative_address ||
+                            info.region_size > info.allocation_size))) {
+          ++failures;
+        }
+        uint32_t unreserved = heap->GetUnreservedPageCount();
+        if (unreserved > unreserved_page_count) {
+          ++failures;
+        }
+      }
+    });
+  }
+  for (uint32_t i = 0; i < allocating_thread_count; ++i) {
+    threads[i].join();
+  }
+  done = true;
+  for (uint32_t i = allocating_thread_count; i < threads.size(); ++i) {
+    threads[i].join();
+  }
+
+  REQUIRE(failures == 0);
+  REQUIRE(heap->GetUnreservedPageCount() == unreserved_page_count);
+}
+
+
+TEST_CASE("HEAP_SAVE_RESTORE", "[memory]") {
+  Memory memory;
+  REQUIRE(memory.Initialize());
+  BaseHeap* heap = memory.LookupHeap(0x40000000);
+  const uint32_t page_size = heap->page_size();
+  const uint32_t read_write = kMemoryProtectRead | kMemoryProtectWrite;
+  const uint32_t commit = kMemoryAllocationReserve | kMemoryAllocationCommit;
+
+  // Zero, compressible and incompressible pages, and pages the guest can't
+  // read or write.
+  uint32_t mixed_address, no_access_address, read_only_address;
+  REQUIRE(heap->Alloc(8 * page_size, 0, commit, read_write, false,
+                      &mixed_address));
+  REQUIRE(heap->Alloc(page_size, 0, commit, read_write, false,
+                      &no_access_address));
+  REQUIRE(heap->Alloc(2 * page_size, 0, commit, read_write, false,
+                      &read_only_address));
+  std::vector<uint8_t> expected(8 * page_size, 0);
+  uint32_t random = 1;
+  for (uint32_t i = 0; i < 8 * page_size; ++i) {
+    uint32_t page = i / page_size;
+    if (page == 1 || page == 5) {
+      expected[i] = uint8_t(i);
+    } else if (page == 2 || page == 3 || page == 7) {
+      random = random * 1103515245 + 12345;
+      expected[i] = uint8_t(random >> 16);
+    }
+  }
+  std::memcpy(memory.TranslateVirtual(mixed_address), expected.data(),
+              expected.size());
+  std::memset(memory.TranslateVirtual(no_access_address), 0x11, page_size);
+  std::memset(memory.TranslateVirtual(read_only_address), 0x22,
+              2 * page_size);
+  REQUIRE(heap->Protect(no_access_address, page_size, kMemoryProtectNoAccess));
+  REQUIRE(heap->Protect(read_only_address, 2 * page_size, kMemoryProtectRead));
+
+  std::vector<uint8_t> state(64 * 1024 * 1024);
+  ByteStream save_stream(state.data(), state.size());
+  REQUIRE(heap->Save(&save_stream));
+  // Compressed and without the zero pages.
+  REQUIRE(save_stream.offset() < 8 * page_size);
+
+  // Change everything saved.
+  std::memset(memory.TranslateVirtual(mixed_address), 0x33, 8 * page_size);
+  REQUIRE(heap->Protect(no_access_address, page_size, read_write));
+  std::memset(memory.TranslateVirtual(no_access_address), 0x44, page_size);
+  REQUIRE(heap->Release(read_only_address));
+
+  ByteStream restore_stream(state.data(), save_stream.offset());
+  REQUIRE(heap->Restore(&restore_stream));
+  REQUIRE(restore_stream.offset() == save_stream.offset());
+  REQUIRE(std::memcmp(memory.TranslateVirtual(mixed_address), expected.data(),
+                      expected.size()) == 0);
+  uint32_t protect;
+  REQUIRE(heap->QueryProtect(no_access_address, &protect));
+  REQUIRE(protect == kMemoryProtectNoAccess);
+  REQUIRE(heap->Protect(no_access_address, page_size, read_write));
+  REQUIRE(memory.TranslateVirtual(no_access_address)[page_size - 1] == 0x11);
+  uint32_t size;
+  REQUIRE(heap->QuerySize(read_only_address, &size));
+  REQUIRE(size == 2 * page_size);
+  REQUIRE(heap->QueryProtect(read_only_address, &protect));
+  REQUIRE(protect == kMemoryProtectRead);
+  REQUIRE(memory.TranslateVirtual(read_only_address)[2 * page_size - 1] ==
+          0x22);
+}
+
+TEST_CASE("MEMORY_INCREMENTAL_SAVE_RESTORE", "[memory]") {
+  if (!xe::memory::IsDirtyPageTrackingSupported()) {
+    WARN("Dirty page tracking isn't supported by the host");
+    return;
+  }
+  Memory memory;
+  REQUIRE(memory.Initialize());
+  BaseHeap* heap = memory.LookupHeap(0x40000000);
+  const uint32_t page_size = heap->page_size();
+  const uint32_t read_write = kMemoryProtectRead | kMemoryProtectWrite;
+  const uint32_t commit = kMemoryAllocationReserve | kMemoryAllocationCommit;
+
+  uint32_t written_address, unchanged_address, new_address;
+  REQUIRE(heap->Alloc(page_size, 0, commit, read_write, false,
+                      &written_address));
+  REQUIRE(heap->Alloc(page_size, 0, commit, read_write, false,
+                      &unchanged_address));
+  std::memset(memory.TranslateVirtual(written_address), 0x11, page_size);
+  std::memset(memory.TranslateVirtual(unchanged_address), 0x22, page_size);
+
+  std::vector<uint8_t> full_state(64 * 1024 * 1024);
+  ByteStream full_stream(full_state.data(), full_state.size());
+  REQUIRE(memory.Save(&full_stream));
+  REQUIRE(memory.CanSaveIncrementally());
+
+  std::memset(memory.TranslateVirtual(written_address), 0x33, page_size);
+  REQUIRE(heap->Alloc(page_size, 0, commit, read_write, false, &new_address));
+  std::memset(memory.TranslateVirtual(new_address), 0x44, page_size);
+
+  std::vector<uint8_t> incremental_state(64 * 1024 * 1024);
+  ByteStream incremental_stream(incremental_state.data(),
+                                incremental_state.size());
+  REQUIRE(memory.Save(&incremental_stream, true));
+  REQUIRE(incremental_stream.offset() < full_stream.offset());
+
+  std::memset(memory.TranslateVirtual(written_address), 0x55, page_size);
+  std::memset(memory.TranslateVirtual(unchanged_address), 0x66, page_size);
+  REQUIRE(heap->Release(new_address));
+
+  ByteStream full_restore_stream(full_state.data(), full_stream.offset());
+  REQUIRE(memory.Restore(&full_restore_stream));
+  ByteStream incremental_restore_stream(incremental_state.data(),
+                                        incremental_stream.offset());
+  REQUIRE(memory.Restore(&incremental_restore_stream));
+  REQUIRE(memory.TranslateVirtual(written_address)[page_size - 1] == 0x33);
+  REQUIRE(memory.TranslateVirtual(unchanged_address)[page_size - 1] == 0x22);
+  uint32_t size;
+  REQUIRE(heap->QuerySize(new_address, &size));
+  REQUIRE(size == page_size);
+  REQUIRE(memory.TranslateVirtual(new_address)[page_size - 1] == 0x44);
+}
+
+}  // namespace test
+}  // namespace cpu
+}  // namespace xe
@@ -17,7 +17,9 @@
 #include "xenia/base/logging.h"
 #include "xenia/base/math.h"
 #include "xenia/base/memory.h"
+#include "xenia/base/xxhash.h"
 #include "xenia/cpu/cpu_flags.h"
+#include "xenia/cpu/crt_routines.h"
 #include "xenia/cpu/export_resolver.h"
 #include "xenia/cpu/lzx.h"
 #include "xenia/cpu/processor.h"
@@ -860,6 +862,14 @@ int XexModule::ReadPEHeaders() {
     pe_sections_.push_back(section);
   }
 
+  const IMAGE_DATA_DIRECTORY& exception_directory =
+      opthdr->DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+  if (exception_directory.VirtualAddress && exception_directory.Size) {
+    runtime_function_table_address_ =
+        base_address_ + exception_directory.VirtualAddress;
+    runtime_function_table_size_ = exception_directory.Size;
+  }
+
   // DumpTLSDirectory(pImageBase, pNTHeader, (PIMAGE_TLS_DIRECTORY32)0);
   // DumpExportsSection(pImageBase, pNTHeader);
   return 0;
@@ -1003,6 +1013,7 @@ bool XexModule::LoadContinue() {
 
   // Notify backend that we have an executable range.
   processor_->backend()->CommitExecutableRange(low_address_, high_address_);
+  processor_->UpdateModuleIndex();
 
   // Add all imports (variables/functions).
   xex2_opt_import_libraries* opt_import_libraries = nullptr;
@@ -1054,6 +1065,9 @@ bool XexModule::LoadContinue() {
     return false;
   }
 
+  // Declare all functions with exception info with their exact extents.
+  FindRuntimeFunctions();
+
   // Load a specified module map and diff.
   if (cvars::load_module_map.size()) {
     if (!ReadMap(cvars::load_module_map.c_str())) {
@@ -1061,6 +1075,41 @@ bool XexModule::LoadContinue() {
     }
   }
 
+  // Replace the C runtime routines named in the map with host ones.
+  if (cvars::native_crt_routines) {
+    FindCrtRoutines();
+  }
+
+  // Reuse code translated during previous launches of this exact image.
+  if (high_address_ > low_address_) {
+    uint64_t image_hash =
+        XXH3_64bits(memory()->TranslateVirtual(low_address_),
+                    high_address_ - low_address_);
+    processor_->InitializeModuleCodeStorage(this, image_hash);
+  }
+
+  // Start translating the code known to be called before it's demanded.
+  uint32_t entry_point = 0;
+  if (GetOptHeader(XEX_HEADER_ENTRY_POINT, &entry_point)) {
+    processor_->PrecompileFunction(this, entry_point);
+  }
+  if (xex_security_info()->export_table) {
+    auto export_table = memory()->TranslateVirtual<const xex2_export_table*>(
+        xex_security_info()->export_table);
+    for (uint32_t i = 0; i < export_table->count; ++i) {
+      uint32_t export_address = export_table->ordOffset[i];
+      if (!export_address) {
+        continue;
+      }
+      export_address += export_table->imagebaseaddr << 16;
+      // Variables are exported too, and can't be translated.
+      if (IsInCodeSection(export_address)) {
+        processor_->PrecompileFunction(this, export_address);
+      }
+    }
+  }
+  processor_->PrecompileAllFunctions(this);
+
   // Setup memory protection.
   for (uint32_t i = 0, page = 0; i < sec_header->page_descriptor_count; i++) {
     // Byteswap the bitfield manually.
@@ -1091,6 +1140,10 @@ bool XexModule::Unload() {
   }
   loaded_ = false;
 
+  processor_->CancelPrecompile(this);
+  processor_->ReleaseModuleCode(this);
+  processor_->ShutdownModuleCodeStorage(this);
+
   // If this isn't a patch, just deallocate the memory occupied by the exe
   if (!is_patch()) {
     assert_not_zero(base_address_);
@@ -1286,11 +1339,97 @@ bool XexModule::ContainsAddress(uint32_t address) {
   return address >= low_address_ && address < high_address_;
 }
 
+bool XexModule::GetAddressRange(uint32_t* out_low_address,
+                                uint32_t* out_high_address) const {
+  if (low_address_ >= high_address_) {
+    return false;
+  }
+  *out_low_address = low_address_;
+  *out_high_address = high_address_;
+  return true;
+}
+
 std::unique_ptr<Function> XexModule::CreateFunction(uint32_t address) {
   return std::unique_ptr<Function>(
       processor_->backend()->CreateGuestFunction(this, address));
 }
 
+void XexModule::FindRuntimeFunctions() {
+  if (!runtime_function_table_size_) {
+    return;
+  }
+  // IMAGE_CE_RUNTIME_FUNCTION_ENTRY, big-endian unlike the PE headers.
+  struct RuntimeFunctionEntry {
+    xe::be<uint32_t> begin_address;
+    // PrologLength:8, FunctionLength:22 (in instructions), ThirtyTwoBit:1,
+    // ExceptionFlag:1 from the low bits.
+    xe::be<uint32_t> flags;
+  };
+  static_assert_size(RuntimeFunctionEntry, 8);
+  auto entries = memory()->TranslateVirtual<const RuntimeFunctionEntry*>(
+      runtime_function_table_address_);
+  uint32_t entry_count =
+      runtime_function_table_size_ / sizeof(RuntimeFunctionEntry);
+  uint32_t function_count = 0;
+  for (uint32_t i = 0; i < entry_count; ++i) {
+    uint32_t begin_address = entries[i].begin_address;
+    uint32_t length = (uint32_t(entries[i].flags) >> 8) & 0x3FFFFF;
+    if (!begin_address || !length || !ContainsAddress(begin_address) ||
+        !ContainsAddress(begin_address + (length - 1) * 4)) {
+      continue;
+    }
+    Function* function;
+    if (DeclareFunction(begin_address, &function) != Symbol::Status::kNew) {
+      // Save/restore helpers and the like have already been set up.
+      continue;
+    }
+    function->set_end_address(begin_address + (length - 1) * 4);
+    function->set_status(Symbol::Status::kDeclared);
+    ++function_count;
+  }
+  XELOGI("Declared {} functions from the runtime function table",
+         function_count);
+}
+
+void XexModule::FindCrtRoutines() {
+  uint32_t crt_routine_count = 0;
+  ForEachFunction([&](Function* function) {
+    if (!function->is_guest() ||
+        function->behavior() != Function::Behavior::kDefault ||
+        function->name().empty()) {
+      return;
+    }
+    auto handler = LookupCrtRoutine(function->name());
+    if (handler) {
+      static_cast<GuestFunction*>(function)->SetupExtern(handler);
+      ++crt_routine_count;
+    }
+  });
+  if (crt_routine_count) {
+    XELOGI("Replaced {} C runtime routines with host implementations",
+           crt_routine_count);
+  }
+}
+
+bool XexModule::IsInCodeSection(uint32_t address) const {
+  auto page_size = memory()->LookupHeap(base_address_)->page_size();
+  auto sec_header = xex_security_info();
+  for (uint32_t i = 0, page = 0; i < sec_header->page_descriptor_count; i++) {
+    // Byteswap the bitfield manually.
+    xex2_page_descriptor desc;
+    desc.value = xe::byte_swap(sec_header->page_descriptors[i].value);
+
+    const auto start_address = base_address_ + (page * page_size);
+    const auto end_address = start_address + (desc.page_count * page_size);
+    if (address >= start_address && address < end_address) {
+      return desc.info == XEX_SECTION_CODE;
+    }
+
+    page += desc.page_count;
+  }
+  return false;
+}
+
 bool XexModule::FindSaveRest() {
   // Special stack save/restore functions.
   // http://research.microsoft.com/en-us/um/redmond/projects/invisible/src/crt/md/ppc/xxx.s.htm
@@ -149,6 +149,8 @@ class XexModule : public xe::cpu::Module {
   bool Unload();
 
   bool ContainsAddress(uint32_t address) override;
+  bool GetAddressRange(uint32_t* out_low_address,
+                       uint32_t* out_high_address) const override;
 
   const std::string& name() const override { return name_; }
   bool is_executable() const override {
@@ -190,6 +192,10 @@ class XexModule : public xe::cpu::Module {
   bool SetupLibraryImports(const std::string_view name,
                            const xex2_import_library* library);
   bool FindSaveRest();
+  void FindRuntimeFunctions();
+  void FindCrtRoutines();
+  // Whether the address is in a section containing code rather than data.
+  bool IsInCodeSection(uint32_t address) const;
 
   Processor* processor_ = nullptr;
   kernel::KernelState* kernel_state_ = nullptr;
@@ -201,6 +207,9 @@ class XexModule : public xe::cpu::Module {
   std::vector<ImportLibrary>
       import_libs_;  // pre-loaded import libraries for ease of use
   std::vector<PESection> pe_sections_;
+  // .pdata runtime function table from the PE exception directory.
+  uint32_t runtime_function_table_address_ = 0;
+  uint32_t runtime_function_table_size_ = 0;
 
   // XEX_HEADER_ALTERNATE_TITLE_IDS loaded into a safe std::vector
   std::vector<uint32_t> opt_alternate_title_ids_;
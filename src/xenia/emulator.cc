@@ -10,6 +10,7 @@
 #include "xenia/emulator.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cinttypes>
 
 #include "config.h"
@@ -24,9 +25,11 @@
 #include "xenia/base/literals.h"
 #include "xenia/base/logging.h"
 #include "xenia/base/mapped_memory.h"
+#include "xenia/base/memory.h"
 #include "xenia/base/platform.h"
 #include "xenia/base/string.h"
 #include "xenia/cpu/backend/code_cache.h"
+#include "xenia/cpu/backend/interpreter/interpreter_backend.h"
 #include "xenia/cpu/backend/null_backend.h"
 #include "xenia/cpu/cpu_flags.h"
 #include "xenia/cpu/thread_state.h"
@@ -66,6 +69,19 @@ DEFINE_string(
     "or the module specified by the game. Leave blank to launch the default "
     "module.",
     "General");
+DEFINE_uint32(snapshot_interval, 0,
+              "Interval in milliseconds of taking snapshots of the running "
+              "title in host memory for rewinding. 0 to disable.",
+              "General");
+DEFINE_uint32(snapshot_count, 16,
+              "Number of the latest snapshots to keep for rewinding.",
+              "General");
+DEFINE_uint32(snapshot_full_interval, 8,
+              "Number of snapshots between the snapshots storing all the "
+              "memory rather than only the memory written since the previous "
+              "snapshot, at most snapshot_count. Incremental snapshots are "
+              "only taken where the host can track the written pages.",
+              "General");
 
 namespace xe {
 
@@ -108,6 +124,12 @@ Emulator::Emulator(const std::filesystem::path& command_line,
       restore_fence_() {}
 
 Emulator::~Emulator() {
+  StopSnapshotThread();
+  if (snapshot_scratch_) {
+    xe::memory::DeallocFixed(snapshot_scratch_, 0,
+                             xe::memory::DeallocationType::kRelease);
+  }
+
   // Note that we delete things in the reverse order they were initialized.
 
   // Give the systems time to shutdown before we delete them.
@@ -173,10 +195,15 @@ X_STATUS Emulator::Setup(
     backend.reset(new xe::cpu::backend::x64::X64Backend());
   }
 #endif  // XE_ARCH
+  if (cvars::cpu == "interpreter") {
+    backend.reset(new xe::cpu::backend::interpreter::InterpreterBackend());
+  }
   if (cvars::cpu == "any") {
     if (!backend) {
 #if XE_ARCH_AMD64
       backend.reset(new xe::cpu::backend::x64::X64Backend());
+#else
+      backend.reset(new xe::cpu::backend::interpreter::InterpreterBackend());
 #endif  // XE_ARCH
     }
   }
@@ -190,6 +217,9 @@ X_STATUS Emulator::Setup(
   if (!processor_->Setup(std::move(backend))) {
     return X_STATUS_UNSUCCESSFUL;
   }
+  if (!cache_root_.empty()) {
+    processor_->set_code_storage_root(cache_root_ / "jit");
+  }
 
   // Initialize the APU.
   if (audio_system_factory) {
@@ -266,6 +296,13 @@ X_STATUS Emulator::TerminateTitle() {
     return X_STATUS_UNSUCCESSFUL;
   }
 
+  StopSnapshotThread();
+  {
+    std::lock_guard<std::mutex> lock(snapshots_mutex_);
+    snapshots_.clear();
+    snapshot_memory_current_ = false;
+  }
+
   kernel_state_->TerminateTitle();
   title_id_ = std::nullopt;
   title_name_ = "";
@@ -439,19 +476,13 @@ bool Emulator::SaveToFile(const std::filesystem::path& path) {
 
   // Save the emulator state to a file
   ByteStream stream(map->data(), map->size());
-  stream.Write(kEmulatorSaveSignature);
-  stream.Write(title_id_.has_value());
-  if (title_id_.has_value()) {
-    stream.Write(title_id_.value());
+  SaveState(&stream);
+  {
+    // The following snapshot can't be relative to the previous one anymore.
+    std::lock_guard<std::mutex> lock(snapshots_mutex_);
+    snapshot_memory_current_ = false;
+    memory_->Save(&stream);
   }
-
-  // It's important we don't hold the global lock here! XThreads need to step
-  // forward (possibly through guarded regions) without worry!
-  processor_->Save(&stream);
-  graphics_system_->Save(&stream);
-  audio_system_->Save(&stream);
-  kernel_state_->Save(&stream);
-  memory_->Save(&stream);
   map->Close(stream.offset());
 
   Resume();
@@ -465,6 +496,10 @@ bool Emulator::RestoreFromFile(const std::filesystem::path& path) {
     return false;
   }
 
+  std::lock_guard<std::mutex> snapshots_lock(snapshots_mutex_);
+  snapshots_.clear();
+  snapshot_memory_current_ = false;
+
   restoring_ = true;
 
   // Terminate any loaded titles.
@@ -473,16 +508,45 @@ bool Emulator::RestoreFromFile(const std::filesystem::path& path) {
 
   auto lock = global_critical_region::AcquireDirect();
   ByteStream stream(map->data(), map->size());
-  if (stream.Read<uint32_t>() != kEmulatorSaveSignature) {
+  if (!RestoreState(&stream)) {
+    return false;
+  }
+  if (!memory_->Restore(&stream)) {
+    XELOGE("Could not restore memory!");
     return false;
   }
 
-  auto has_title_id = stream.Read<bool>();
+  CompleteRestore();
+  return true;
+}
+
+bool Emulator::SaveState(ByteStream* stream) {
+  stream->Write(kEmulatorSaveSignature);
+  stream->Write(title_id_.has_value());
+  if (title_id_.has_value()) {
+    stream->Write(title_id_.value());
+  }
+
+  // It's important we don't hold the global lock here! XThreads need to step
+  // forward (possibly through guarded regions) without worry!
+  processor_->Save(stream);
+  graphics_system_->Save(stream);
+  audio_system_->Save(stream);
+  kernel_state_->Save(stream);
+  return true;
+}
+
+bool Emulator::RestoreState(ByteStream* stream) {
+  if (stream->Read<uint32_t>() != kEmulatorSaveSignature) {
+    return false;
+  }
+
+  auto has_title_id = stream->Read<bool>();
   std::optional<uint32_t> title_id;
   if (!has_title_id) {
     title_id = {};
   } else {
-    title_id = stream.Read<uint32_t>();
+    title_id = stream->Read<uint32_t>();
   }
   if (title_id_.has_value() != title_id.has_value() ||
       title_id_.value() != title_id.value()) {
@@ -491,27 +555,26 @@ bool Emulator::RestoreFromFile(const std::filesystem::path& path) {
     return false;
   }
 
-  if (!processor_->Restore(&stream)) {
+  if (!processor_->Restore(stream)) {
     XELOGE("Could not restore processor!");
     return false;
   }
-  if (!graphics_system_->Restore(&stream)) {
+  if (!graphics_system_->Restore(stream)) {
     XELOGE("Could not restore graphics system!");
     return false;
   }
-  if (!audio_system_->Restore(&stream)) {
+  if (!audio_system_->Restore(stream)) {
     XELOGE("Could not restore audio system!");
     return false;
   }
-  if (!kernel_state_->Restore(&stream)) {
+  if (!kernel_state_->Restore(stream)) {
     XELOGE("Could not restore kernel state!");
     return false;
   }
-  if (!memory_->Restore(&stream)) {
-    XELOGE("Could not restore memory!");
-    return false;
-  }
+  return true;
+}
 
+void Emulator::CompleteRestore() {
   // Update the main thread.
   auto threads =
       kernel_state_->object_table()->GetObjectsByType<kernel::XThread>();
@@ -526,10 +589,177 @@ bool Emulator::RestoreFromFile(const std::filesystem::path& path) {
 
   restore_fence_.Signal();
   restoring_ = false;
+}
+
+bool Emulator::TakeSnapshot() {
+  if (!is_title_open()) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(snapshots_mutex_);
+  if (!snapshot_scratch_) {
+    snapshot_scratch_ = reinterpret_cast<uint8_t*>(xe::memory::AllocFixed(
+        nullptr, 2_GiB, xe::memory::AllocationType::kReserveCommit,
+        xe::memory::PageAccess::kReadWrite));
+    if (!snapshot_scratch_) {
+      XELOGE("Unable to allocate the snapshot buffer");
+      return false;
+    }
+  }
+
+  // Nothing is allocated while the guest threads are suspended, the state is
+  // saved to the scratch buffer and copied once they have been resumed.
+  memory_->ReserveSaveBuffers();
+  bool was_paused = is_paused();
+  Pause();
 
+  // Every snapshot_full_interval-th snapshot stores all the memory, so the
+  // incremental ones don't need to be kept for long. The interval is clamped to
+  // the size of the ring so the ring always has a full snapshot to apply the
+  // incremental ones to.
+  uint32_t max_snapshot_count = std::max(cvars::snapshot_count, 1u);
+  uint32_t full_interval =
+      std::min(std::max(cvars::snapshot_full_interval, 1u), max_snapshot_count);
+  size_t incremental_count = 0;
+  for (auto it = snapshots_.crbegin();
+       it != snapshots_.crend() && it->memory_incremental; ++it) {
+    ++incremental_count;
+  }
+  Snapshot snapshot;
+  snapshot.memory_incremental =
+      snapshot_memory_current_ && !snapshots_.empty() &&
+      incremental_count + 1 < full_interval && memory_->CanSaveIncrementally();
+
+  auto start_time = std::chrono::steady_clock::now();
+  ByteStream stream(snapshot_scratch_, 2_GiB);
+  bool saved = SaveState(&stream);
+  size_t state_length = stream.offset();
+  saved = saved && memory_->Save(&stream, snapshot.memory_incremental);
+  snapshot_memory_current_ = saved;
+
+  if (!was_paused) {
+    Resume();
+  }
+  if (!saved) {
+    XELOGE("Unable to take a snapshot");
+    return false;
+  }
+  snapshot.state.assign(stream.data(), stream.data() + state_length);
+  snapshot.memory.assign(stream.data() + state_length,
+                         stream.data() + stream.offset());
+
+  snapshots_.push_back(std::move(snapshot));
+  // Keep the oldest snapshot full. The latest full snapshot is at most
+  // full_interval - 1 snapshots before the newest, so this never drops the
+  // newest.
+  while (snapshots_.size() > 1 &&
+         (snapshots_.size() > max_snapshot_count ||
+          snapshots_.front().memory_incremental)) {
+    snapshots_.pop_front();
+  }
+  XELOGI("Took {} snapshot of {} KB in {} ms",
+         snapshots_.back().memory_incremental ? "an incremental" : "a full",
+         (snapshots_.back().state.size() + snapshots_.back().memory.size()) /
+             1024,
+         std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now() - start_time)
+             .count());
   return true;
 }
 
+bool Emulator::RestoreSnapshot(size_t snapshots_back) {
+  std::unique_lock<std::mutex> snapshots_lock(snapshots_mutex_);
+  if (snapshots_back >= snapshots_.size()) {
+    return false;
+  }
+  size_t target_index = snapshots_.size() - 1 - snapshots_back;
+  // The memory is restored from the latest full snapshot, with the changes
+  // from the incremental ones up to the target applied on top of it.
+  size_t full_index = target_index;
+  while (snapshots_[full_index].memory_incremental) {
+    --full_index;
+  }
+
+  restoring_ = true;
+
+  // Terminate any loaded titles.
+  Pause();
+  kernel_state_->TerminateTitle();
+
+  {
+    auto lock = global_critical_region::AcquireDirect();
+    const Snapshot& target = snapshots_[target_index];
+    ByteStream state_stream(const_cast<uint8_t*>(target.state.data()),
+                            target.state.size());
+    bool restored = RestoreState(&state_stream);
+    for (size_t i = full_index; restored && i <= target_index; ++i) {
+      ByteStream memory_stream(
+          const_cast<uint8_t*>(snapshots_[i].memory.data()),
+          snapshots_[i].memory.size());
+      if (!memory_->Restore(&memory_stream)) {
+        XELOGE("Could not restore memory!");
+        restored = false;
+      }
+    }
+    if (restored) {
+      snapshots_.erase(snapshots_.begin() + target_index + 1,
+                       snapshots_.end());
+      snapshot_memory_current_ = true;
+      CompleteRestore();
+      return true;
+    }
+  }
+
+  // The title has already been terminated, and may have been partially
+  // restored, so it can't continue. Close it rather than leaving it paused,
+  // and let WaitUntilExit return.
+  XELOGE("Unable to restore the snapshot, closing the title");
+  snapshots_.clear();
+  snapshot_memory_current_ = false;
+  snapshots_lock.unlock();
+  title_id_ = std::nullopt;
+  title_name_ = "";
+  title_version_ = "";
+  Resume();
+  restore_fence_.Signal();
+  restoring_ = false;
+  on_terminate();
+  return false;
+}
+
+size_t Emulator::snapshot_count() {
+  std::lock_guard<std::mutex> lock(snapshots_mutex_);
+  return snapshots_.size();
+}
+
+void Emulator::StartSnapshotThread() {
+  if (!cvars::snapshot_interval || snapshot_thread_) {
+    return;
+  }
+  snapshot_thread_shutdown_ = threading::Event::CreateManualResetEvent(false);
+  auto interval = std::chrono::milliseconds(cvars::snapshot_interval);
+  snapshot_thread_ = threading::Thread::Create({}, [this, interval]() {
+    while (threading::Wait(snapshot_thread_shutdown_.get(), false, interval) ==
+           threading::WaitResult::kTimeout) {
+      if (!is_paused()) {
+        TakeSnapshot();
+      }
+    }
+  });
+  if (snapshot_thread_) {
+    snapshot_thread_->set_name("Snapshots");
+  }
+}
+
+void Emulator::StopSnapshotThread() {
+  if (!snapshot_thread_) {
+    return;
+  }
+  snapshot_thread_shutdown_->Set();
+  threading::Wait(snapshot_thread_.get(), false);
+  snapshot_thread_.reset();
+  snapshot_thread_shutdown_.reset();
+}
+
 bool Emulator::TitleRequested() {
   auto xam = kernel_state()->GetKernelModule<kernel::xam::XamModule>("xam.xex");
   return xam->loader_data().launch_data_present;
@@ -549,6 +779,10 @@ bool Emulator::ExceptionCallbackThunk(Exception* ex, void* data) {
 bool Emulator::ExceptionCallback(Exception* ex) {
   // Check to see if the exception occurred in guest code.
   auto code_cache = processor()->backend()->code_cache();
+  if (!code_cache) {
+    // Guest code isn't executed as host code.
+    return false;
+  }
   auto code_base = code_cache->execute_base_address();
   auto code_end = code_base + code_cache->total_size();
 
@@ -839,6 +1073,8 @@ X_STATUS Emulator::CompleteLaunch(const std::filesystem::path& path,
   main_thread_ = main_thread;
   on_launch(title_id_.value(), title_name_);
 
+  StartSnapshotThread();
+
   return X_STATUS_SUCCESS;
 }
 
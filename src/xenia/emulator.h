@@ -12,13 +12,18 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
 #include <vector>
 
+#include "xenia/base/byte_stream.h"
 #include "xenia/base/delegate.h"
 #include "xenia/base/exception_handler.h"
+#include "xenia/base/threading.h"
 #include "xenia/kernel/kernel_state.h"
 #include "xenia/memory.h"
 #include "xenia/vfs/virtual_file_system.h"
@@ -194,6 +199,15 @@ class Emulator {
   bool SaveToFile(const std::filesystem::path& path);
   bool RestoreFromFile(const std::filesystem::path& path);
 
+  // Adds a snapshot of the running title to the ring of the latest ones in
+  // host memory, for rewinding. Where supported, most snapshots only store the
+  // memory written since the previous one.
+  bool TakeSnapshot();
+  // Rewinds to the snapshot taken snapshots_back snapshots before the latest
+  // one, dropping the snapshots taken after it.
+  bool RestoreSnapshot(size_t snapshots_back = 0);
+  size_t snapshot_count();
+
   // The game can request another title to be loaded.
   bool TitleRequested();
   void LaunchNextTitle();
@@ -218,6 +232,15 @@ class Emulator {
   X_STATUS CompleteLaunch(const std::filesystem::path& path,
                           const std::string_view module_path);
 
+  // Saves or restores the state other than the memory.
+  bool SaveState(ByteStream* stream);
+  bool RestoreState(ByteStream* stream);
+  // Updates the main thread and resumes the restored title.
+  void CompleteRestore();
+
+  void StartSnapshotThread();
+  void StopSnapshotThread();
+
   std::filesystem::path command_line_;
   std::filesystem::path storage_root_;
   std::filesystem::path content_root_;
@@ -256,6 +279,24 @@ class Emulator {
   bool paused_;
   bool restoring_;
   threading::Fence restore_fence_;  // Fired on restore finish.
+
+  struct Snapshot {
+    std::vector<uint8_t> state;
+    std::vector<uint8_t> memory;
+    // Whether memory only has the changes since the previous snapshot.
+    bool memory_incremental;
+  };
+  std::mutex snapshots_mutex_;
+  // Oldest first, and the oldest is always full.
+  std::deque<Snapshot> snapshots_;
+  // Whether the memory was last saved or restored for the latest snapshot, so
+  // the next one can be incremental.
+  bool snapshot_memory_current_ = false;
+  // Serialization buffer, reserved once as the size of a state isn't known
+  // in advance.
+  uint8_t* snapshot_scratch_ = nullptr;
+  std::unique_ptr<threading::Thread> snapshot_thread_;
+  std::unique_ptr<threading::Event> snapshot_thread_shutdown_;
 };
 
 }  // namespace xe
@@ -10,10 +10,12 @@
 #include "xenia/memory.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <utility>
 
 #include "third_party/fmt/include/fmt/format.h"
+#include "third_party/snappy/snappy.h"
 #include "xenia/base/assert.h"
 #include "xenia/base/byte_stream.h"
 #include "xenia/base/clock.h"
@@ -32,6 +34,13 @@ DEFINE_bool(protect_on_release, false,
             "Protect released memory to prevent accesses.", "Memory");
 DEFINE_bool(scribble_heap, false,
             "Scribble 0xCD into all allocated heap memory.", "Memory");
+DEFINE_bool(huge_pages, false,
+            "Back the guest virtual memory with host huge pages where "
+            "supported (transparent huge pages on Linux) to reduce TLB misses, "
+            "at the cost of more host memory usage. The guest physical memory "
+            "keeps normal pages as it's watched for writes with page "
+            "protection.",
+            "Memory");
 
 namespace xe {
 uint32_t get_page_count(uint32_t value, uint32_t page_size) {
@@ -95,6 +104,11 @@ Memory::~Memory() {
   assert_true(active_memory_ == this);
   active_memory_ = nullptr;
 
+  if (heaps_.v00000000.huge_pages()) {
+    XELOGI("{} MB of the guest virtual memory was backed by huge pages",
+           GetHugePageBackedSize() / (1024 * 1024));
+  }
+
   // Uninstall the MMIO handler, as we won't be able to service more
   // requests.
   mmio_handler_.reset();
@@ -179,6 +193,19 @@ bool Memory::Initialize() {
   heaps_.vE0000000.Initialize(this, virtual_membase_, HeapType::kGuestPhysical,
                               0xE0000000, 0x1FD00000, 4096, &heaps_.physical);
 
+  // Huge pages can't be partially protected, so watching physical memory for
+  // writes would keep splitting them.
+  if (cvars::huge_pages) {
+    if (xe::memory::IsHugePageAdviceSupported()) {
+      heaps_.v00000000.set_huge_pages(true);
+      heaps_.v40000000.set_huge_pages(true);
+      heaps_.v80000000.set_huge_pages(true);
+      heaps_.v90000000.set_huge_pages(true);
+    } else {
+      XELOGW("Huge pages are not supported by the host");
+    }
+  }
+
   // Protect the first and last 64kb of memory.
   heaps_.v00000000.AllocFixed(
       0x00000000, 0x10000, 0x10000,
@@ -395,6 +422,12 @@ void Memory::Copy(uint32_t dest, uint32_t src, uint32_t size) {
   std::memcpy(pdest, psrc, size);
 }
 
+size_t Memory::GetHugePageBackedSize() const {
+  // The views of the virtual heaps (and of the 0x7F000000 range) below
+  // 0xA0000000 are contiguous.
+  return xe::memory::QueryHugePageBackedSize(virtual_membase_, 0xA0000000);
+}
+
 uint32_t Memory::SearchAligned(uint32_t start, uint32_t end,
                                const uint32_t* values, size_t value_count) {
   assert_true(start <= end);
@@ -437,6 +470,11 @@ cpu::MMIORange* Memory::LookupVirtualMappedRange(uint32_t virtual_address) {
   return mmio_handler_->LookupRange(virtual_address);
 }
 
+void Memory::SetVirtualMappedAccessSiteCallback(
+    cpu::MMIOHandler::AccessSiteCallback callback, void* context) {
+  mmio_handler_->SetAccessSiteCallback(callback, context);
+}
+
 bool Memory::AccessViolationCallback(
     std::unique_lock<std::recursive_mutex> global_lock_locked_once,
     void* host_address, bool is_write) {
@@ -580,26 +618,126 @@ void Memory::DumpMap() {
   XELOGE("");
 }
 
-bool Memory::Save(ByteStream* stream) {
-  XELOGD("Serializing memory...");
-  heaps_.v00000000.Save(stream);
-  heaps_.v40000000.Save(stream);
-  heaps_.v80000000.Save(stream);
-  heaps_.v90000000.Save(stream);
-  heaps_.physical.Save(stream);
+std::array<BaseHeap*, Memory::kSavedHeapCount> Memory::GetSavedHeaps() {
+  return {&heaps_.v00000000, &heaps_.v40000000, &heaps_.v80000000,
+          &heaps_.v90000000, &heaps_.physical};
+}
 
+bool Memory::GetWrittenPages(const BaseHeap& heap,
+                             std::vector<uint64_t>* written_pages) {
+  const uint8_t* heap_host_address = heap.TranslateRelative<const uint8_t*>(0);
+  uint64_t granularity_mask = ~uint64_t(system_allocation_granularity_ - 1);
+  // Find the range of the mapping backing the heap.
+  uint64_t file_begin = UINT64_MAX;
+  for (size_t n = 0; n < xe::countof(map_info); n++) {
+    const uint8_t* view = views_.all_views[n];
+    size_t view_length =
+        map_info[n].virtual_address_end - map_info[n].virtual_address_start + 1;
+    if (heap_host_address >= view && heap_host_address < view + view_length) {
+      file_begin = (map_info[n].target_address & granularity_mask) +
+                   uint64_t(heap_host_address - view);
+      break;
+    }
+  }
+  if (file_begin == UINT64_MAX) {
+    return false;
+  }
+  uint64_t file_end = file_begin + heap.heap_size();
+
+  // The memory may have been written through any view of the same range.
+  size_t host_page_size = xe::memory::page_size();
+  uint32_t heap_page_size = heap.page_size();
+  written_pages->assign((heap.heap_size() / heap_page_size + 63) / 64, 0);
+  std::vector<uint64_t>& dirty_bits = save_dirty_bits_;
+  for (size_t n = 0; n < xe::countof(map_info); n++) {
+    uint64_t view_file_begin = map_info[n].target_address & granularity_mask;
+    uint64_t view_file_end = view_file_begin + map_info[n].virtual_address_end -
+                             map_info[n].virtual_address_start + 1;
+    uint64_t overlap_begin = std::max(file_begin, view_file_begin);
+    uint64_t overlap_end = std::min(file_end, view_file_end);
+    if (overlap_begin >= overlap_end) {
+      continue;
+    }
+    size_t overlap_length = size_t(overlap_end - overlap_begin);
+    size_t host_page_count =
+        (overlap_length + host_page_size - 1) / host_page_size;
+    dirty_bits.assign((host_page_count + 63) / 64, 0);
+    if (!xe::memory::QueryDirtyPages(
+            views_.all_views[n] + (overlap_begin - view_file_begin),
+            overlap_length, dirty_bits.data())) {
+      return false;
+    }
+    // Mark every heap page overlapping a dirty host page.
+    for (size_t i = 0; i < dirty_bits.size(); ++i) {
+      uint64_t bits = dirty_bits[i];
+      while (bits) {
+        size_t host_page = i * 64 + xe::tzcnt(bits);
+        bits &= bits - 1;
+        uint64_t heap_offset =
+            overlap_begin - file_begin + host_page * host_page_size;
+        uint64_t heap_offset_end = std::min(
+            heap_offset + host_page_size, uint64_t(heap.heap_size()));
+        for (uint64_t page = heap_offset / heap_page_size;
+             page * heap_page_size < heap_offset_end; ++page) {
+          (*written_pages)[page >> 6] |= uint64_t(1) << (page & 63);
+        }
+      }
+    }
+  }
   return true;
 }
 
+bool Memory::Save(ByteStream* stream, bool incremental) {
+  XELOGD("Serializing memory...");
+  auto heaps = GetSavedHeaps();
+  // Collect the written pages before resetting the tracking for the next
+  // save, as the heaps are saved after that.
+  std::vector<uint64_t>* written_pages = save_written_pages_;
+  incremental = incremental && CanSaveIncrementally();
+  for (size_t i = 0; incremental && i < heaps.size(); ++i) {
+    if (!GetWrittenPages(*heaps[i], &written_pages[i])) {
+      XELOGE("Memory::Save: unable to get the written pages");
+      return false;
+    }
+  }
+  dirty_page_tracking_valid_ = xe::memory::IsDirtyPageTrackingSupported() &&
+                               xe::memory::ResetDirtyPageTracking();
+  bool saved = true;
+  for (size_t i = 0; saved && i < heaps.size(); ++i) {
+    saved = heaps[i]->Save(stream, incremental ? &written_pages[i] : nullptr);
+  }
+  return saved;
+}
+
+void Memory::ReserveSaveBuffers() {
+  if (!CanSaveIncrementally()) {
+    return;
+  }
+  // A view overlapping a heap covers at most the whole heap.
+  auto heaps = GetSavedHeaps();
+  size_t host_page_size = xe::memory::page_size();
+  size_t max_host_page_count = 0;
+  for (size_t i = 0; i < heaps.size(); ++i) {
+    save_written_pages_[i].reserve(
+        (heaps[i]->heap_size() / heaps[i]->page_size() + 63) / 64);
+    max_host_page_count =
+        std::max(max_host_page_count,
+                 (heaps[i]->heap_size() + host_page_size - 1) / host_page_size);
+  }
+  save_dirty_bits_.reserve((max_host_page_count + 63) / 64);
+}
+
 bool Memory::Restore(ByteStream* stream) {
   XELOGD("Restoring memory...");
-  heaps_.v00000000.Restore(stream);
-  heaps_.v40000000.Restore(stream);
-  heaps_.v80000000.Restore(stream);
-  heaps_.v90000000.Restore(stream);
-  heaps_.physical.Restore(stream);
-
-  return true;
+  bool restored =
+      heaps_.v00000000.Restore(stream) && heaps_.v40000000.Restore(stream) &&
+      heaps_.v80000000.Restore(stream) && heaps_.v90000000.Restore(stream) &&
+      heaps_.physical.Restore(stream);
+  // The following incremental saves are relative to the restored state.
+  dirty_page_tracking_valid_ = restored &&
+                               xe::memory::IsDirtyPageTrackingSupported() &&
+                               xe::memory::ResetDirtyPageTracking();
+  return restored;
 }
 
 xe::memory::PageAccess ToPageAccess(uint32_t protect) {
@@ -650,6 +788,7 @@ void BaseHeap::Initialize(Memory* memory, uint8_t* membase, HeapType heap_type,
   page_size_ = page_size;
   host_address_offset_ = host_address_offset;
   page_table_.resize(heap_size / page_size);
+  free_pages_.Resize(uint32_t(page_table_.size()));
 }
 
 void BaseHeap::Dispose() {
@@ -719,107 +858,405 @@ void BaseHeap::DumpMap() {
 uint32_t BaseHeap::GetTotalPageCount() { return uint32_t(page_table_.size()); }
 
 uint32_t BaseHeap::GetUnreservedPageCount() {
-  auto global_lock = global_critical_region_.Acquire();
-  uint32_t count = 0;
-  bool is_empty_span = false;
-  uint32_t empty_span_start = 0;
-  uint32_t size = uint32_t(page_table_.size());
-  for (uint32_t i = 0; i < size; ++i) {
-    auto& page = page_table_[i];
-    if (!page.state) {
-      if (!is_empty_span) {
-        is_empty_span = true;
-        empty_span_start = i;
-      }
-      continue;
-    }
-    if (is_empty_span) {
-      is_empty_span = false;
-      count += i - empty_span_start;
-    }
-    i += page.region_page_count - 1;
-  }
-  if (is_empty_span) {
-    count += size - empty_span_start;
-  }
+  uint32_t count;
+  ReadPageTable([&]() { count = free_pages_.free_page_count(); });
   return count;
 }
 
-bool BaseHeap::Save(ByteStream* stream) {
-  XELOGD("Heap {:08X}-{:08X}", heap_base_, heap_base_ + (heap_size_ - 1));
-
-  for (size_t i = 0; i < page_table_.size(); i++) {
-    auto& page = page_table_[i];
-    stream->Write(page.qword);
-    if (!page.state) {
-      // Unallocated.
-      continue;
-    }
-
-    // TODO(DrChat): write compressed with snappy.
-    if (page.state & kMemoryAllocationCommit) {
-      void* addr = TranslateRelative(i * page_size_);
+// Savestate heap layout:
+// - kHeapSaveSignature.
+// - Whether the state is incremental, as a bool.
+// - The page table.
+// - Blocks of contiguous committed pages that aren't all zero, each being a
+//   HeapSaveBlockHeader followed by the encoded data, in ascending order.
+//   In a full state, committed pages not in any block are zero. In an
+//   incremental state, the blocks are only of the pages written since the
+//   previous state, including zero blocks, and other pages are unchanged.
+// - A HeapSaveBlockHeader with a page_count of 0.
+enum class HeapSaveEncoding : uint32_t {
+  kNone,
+  kSnappy,
+  // All zero, no data.
+  kZero,
+};
 
-      memory::PageAccess old_access;
-      memory::Protect(addr, page_size_, memory::PageAccess::kReadWrite,
-                      &old_access);
+struct HeapSaveBlockHeader {
+  // Heap-relative page numbers.
+  uint32_t first_page;
+  uint32_t page_count;
+  HeapSaveEncoding encoding;
+  uint32_t encoded_length;
+};
 
-      stream->Write(addr, page_size_);
+// Blocks are large enough for the header to be negligible and small enough to
+// stay in the cache while being compressed.
+constexpr uint32_t kHeapSaveMaxBlockSize = 1024 * 1024;
 
-      memory::Protect(addr, page_size_, old_access, nullptr);
+static bool IsZeroPage(const uint8_t* page, uint32_t page_size) {
+  auto words = reinterpret_cast<const uint64_t*>(page);
+  for (uint32_t i = 0; i < page_size / sizeof(uint64_t); i += 8) {
+    if (words[i] | words[i + 1] | words[i + 2] | words[i + 3] | words[i + 4] |
+        words[i + 5] | words[i + 6] | words[i + 7]) {
+      return false;
     }
   }
+  return true;
+}
 
+// Writes a zero block if data is null.
+static bool WriteHeapSaveBlock(ByteStream* stream, uint32_t first_page,
+                               uint32_t page_count, const uint8_t* data,
+                               size_t length) {
+  HeapSaveBlockHeader header;
+  header.first_page = first_page;
+  header.page_count = page_count;
+  header.encoding = HeapSaveEncoding::kNone;
+  if (!data) {
+    if (stream->data_length() - stream->offset() < sizeof(header)) {
+      return false;
+    }
+    header.encoding = HeapSaveEncoding::kZero;
+    header.encoded_length = 0;
+    stream->Write(header);
+    return true;
+  }
+  size_t available = stream->data_length() - stream->offset();
+  if (available < sizeof(header)) {
+    return false;
+  }
+  available -= sizeof(header);
+  // Encode right into the stream after the header.
+  auto encoded = reinterpret_cast<char*>(stream->data() + stream->offset() +
+                                         sizeof(header));
+  size_t encoded_length = length;
+  if (available >= snappy::MaxCompressedLength(length)) {
+    snappy::RawCompress(reinterpret_cast<const char*>(data), length, encoded,
+                        &encoded_length);
+    if (encoded_length < length) {
+      header.encoding = HeapSaveEncoding::kSnappy;
+    }
+  }
+  if (header.encoding == HeapSaveEncoding::kNone) {
+    if (available < length) {
+      return false;
+    }
+    std::memcpy(encoded, data, length);
+    encoded_length = length;
+  }
+  header.encoded_length = uint32_t(encoded_length);
+  stream->Write(header);
+  stream->Advance(encoded_length);
   return true;
 }
 
-bool BaseHeap::Restore(ByteStream* stream) {
-  XELOGD("Heap {:08X}-{:08X}", heap_base_, heap_base_ + (heap_size_ - 1));
+// Returns the end of the run of pages starting at first_page for which key
+// returns the same value.
+template <typename Key>
+static uint32_t FindPageRunEnd(const std::vector<PageEntry>& page_table,
+                               uint32_t first_page, Key key) {
+  auto first_key = key(page_table[first_page]);
+  uint32_t page_number = first_page + 1;
+  while (page_number < page_table.size() &&
+         key(page_table[page_number]) == first_key) {
+    ++page_number;
+  }
+  return page_number;
+}
 
-  for (size_t i = 0; i < page_table_.size(); i++) {
-    auto& page = page_table_[i];
-    page.qword = stream->Read<uint64_t>();
-    if (!page.state) {
-      // Unallocated.
+static bool IsPageCommitted(PageEntry page) {
+  return (page.state & kMemoryAllocationCommit) != 0;
+}
+
+bool BaseHeap::Save(ByteStream* stream,
+                    const std::vector<uint64_t>* written_pages) {
+  XELOGD("Heap {:08X}-{:08X}", heap_base_, heap_base_ + (heap_size_ - 1));
+  auto start_time = std::chrono::steady_clock::now();
+  size_t start_offset = stream->offset();
+
+  stream->Write(kHeapSaveSignature);
+  stream->Write(written_pages != nullptr);
+  stream->Write(page_table_.data(), sizeof(PageEntry) * page_table_.size());
+  auto is_saved = [written_pages](uint32_t page_number) {
+    return !written_pages ||
+           ((*written_pages)[page_number >> 6] >> (page_number & 63)) & 1;
+  };
+
+  uint32_t page_count = uint32_t(page_table_.size());
+  uint32_t max_block_page_count =
+      std::max(kHeapSaveMaxBlockSize / page_size_, uint32_t(1));
+  uint32_t committed_page_count = 0;
+  uint32_t saved_page_count = 0;
+  uint32_t zero_page_count = 0;
+  // Only pages inaccessible to the guest need their host protection changed to
+  // be read, once for each run of them.
+  auto readability = [](PageEntry page) {
+    if (!IsPageCommitted(page)) {
+      return -1;
+    }
+    return (page.current_protect & kMemoryProtectRead) ? 1 : 0;
+  };
+  for (uint32_t page_number = 0; page_number < page_count;) {
+    if (!IsPageCommitted(page_table_[page_number])) {
+      ++page_number;
       continue;
     }
+    bool readable = readability(page_table_[page_number]) != 0;
+    uint32_t run_end = FindPageRunEnd(page_table_, page_number, readability);
+    void* run_host_address = TranslateRelative(page_number * page_size_);
+    size_t run_length = size_t(run_end - page_number) * page_size_;
+    if (!readable) {
+      xe::memory::Protect(run_host_address, run_length,
+                          xe::memory::PageAccess::kReadOnly, nullptr);
+    }
+    committed_page_count += run_end - page_number;
 
-    memory::PageAccess page_access = memory::PageAccess::kNoAccess;
-    if ((page.current_protect & kMemoryProtectRead) &&
-        (page.current_protect & kMemoryProtectWrite)) {
-      page_access = memory::PageAccess::kReadWrite;
-    } else if (page.current_protect & kMemoryProtectRead) {
-      page_access = memory::PageAccess::kReadOnly;
+    bool block_written = true;
+    while (page_number < run_end) {
+      if (!is_saved(page_number)) {
+        ++page_number;
+        continue;
+      }
+      const uint8_t* page_host_address =
+          TranslateRelative(page_number * page_size_);
+      bool zero = IsZeroPage(page_host_address, page_size_);
+      if (zero && !written_pages) {
+        // Implied by a full state.
+        ++zero_page_count;
+        ++page_number;
+        continue;
+      }
+      // A block of either all zero or all non-zero pages.
+      uint32_t block_end = page_number + 1;
+      while (block_end < run_end &&
+             block_end - page_number < max_block_page_count &&
+             is_saved(block_end) &&
+             IsZeroPage(TranslateRelative(block_end * page_size_),
+                        page_size_) == zero) {
+        ++block_end;
+      }
+      saved_page_count += block_end - page_number;
+      if (zero) {
+        zero_page_count += block_end - page_number;
+      }
+      block_written = WriteHeapSaveBlock(
+          stream, page_number, block_end - page_number,
+          zero ? nullptr : page_host_address,
+          size_t(block_end - page_number) * page_size_);
+      if (!block_written) {
+        break;
+      }
+      page_number = block_end;
     }
 
-    // Commit the memory if it isn't already. We do not need to reserve any
-    // memory, as the mapping has already taken care of that.
-    if (page.state & kMemoryAllocationCommit) {
-      xe::memory::AllocFixed(TranslateRelative(i * page_size_), page_size_,
-                             memory::AllocationType::kCommit,
-                             memory::PageAccess::kReadWrite);
+    if (!readable) {
+      xe::memory::Protect(run_host_address, run_length,
+                          xe::memory::PageAccess::kNoAccess, nullptr);
     }
+    if (!block_written) {
+      XELOGE("BaseHeap::Save ran out of space in the stream");
+      return false;
+    }
+    page_number = run_end;
+  }
+  HeapSaveBlockHeader end_header = {};
+  stream->Write(end_header);
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start_time)
+                       .count();
+  if (!written_pages) {
+    saved_page_count += zero_page_count;
+  }
+  double committed_mb = double(committed_page_count) * page_size_ / 1048576.0;
+  double saved_mb = double(saved_page_count) * page_size_ / 1048576.0;
+  double encoded_mb = double(stream->offset() - start_offset) / 1048576.0;
+  XELOGI(
+      "Heap {:08X}-{:08X}: saved {:.1f} MB of {:.1f} MB committed{} ({} zero "
+      "pages) as {:.1f} MB, compression ratio {:.2f}, {:.0f} MB/s",
+      heap_base_, heap_base_ + (heap_size_ - 1), saved_mb, committed_mb,
+      written_pages ? " written since the previous save" : "", zero_page_count,
+      encoded_mb, saved_mb / encoded_mb,
+      seconds > 0.0 ? saved_mb / seconds : 0.0);
+  return true;
+}
 
-    // Now read into memory. We'll set R/W protection first, then set the
-    // protection back to its previous state.
-    // TODO(DrChat): read compressed with snappy.
-    if (page.state & kMemoryAllocationCommit) {
-      void* addr = TranslateRelative(i * page_size_);
-      xe::memory::Protect(addr, page_size_, memory::PageAccess::kReadWrite,
-                          nullptr);
+bool BaseHeap::Restore(ByteStream* stream) {
+  XELOGD("Heap {:08X}-{:08X}", heap_base_, heap_base_ + (heap_size_ - 1));
+  auto start_time = std::chrono::steady_clock::now();
+  size_t start_offset = stream->offset();
 
-      stream->Read(addr, page_size_);
+  if (stream->Read<uint32_t>() != kHeapSaveSignature) {
+    XELOGE("BaseHeap::Restore: invalid heap signature");
+    return false;
+  }
+  bool incremental = stream->Read<bool>();
 
-      xe::memory::Protect(addr, page_size_, page_access, nullptr);
+  uint32_t page_count = uint32_t(page_table_.size());
+  // Committing the memory again may clear it, so in an incremental state only
+  // the pages that weren't committed in the previous state are committed.
+  std::vector<PageEntry> previous_page_table;
+  {
+    auto global_lock = global_critical_region_.Acquire();
+    if (incremental) {
+      previous_page_table = page_table_;
+    }
+    BeginPageTableWrite();
+    stream->Read(page_table_.data(), sizeof(PageEntry) * page_table_.size());
+    free_pages_.Reset();
+    for (uint32_t page_number = 0; page_number < page_count;) {
+      uint32_t run_end =
+          FindPageRunEnd(page_table_, page_number,
+                         [](PageEntry page) { return page.state != 0; });
+      if (page_table_[page_number].state) {
+        free_pages_.MarkUsed(page_number, run_end - page_number);
+      }
+      page_number = run_end;
+    }
+    EndPageTableWrite();
+  }
+
+  // Commit the memory if it isn't already and make it writable, once for each
+  // run of committed pages. We do not need to reserve any memory, as the
+  // mapping has already taken care of that.
+  uint32_t committed_page_count = 0;
+  for (uint32_t page_number = 0; page_number < page_count;) {
+    uint32_t run_end =
+        FindPageRunEnd(page_table_, page_number, IsPageCommitted);
+    if (IsPageCommitted(page_table_[page_number])) {
+      void* run_host_address = TranslateRelative(page_number * page_size_);
+      size_t run_length = size_t(run_end - page_number) * page_size_;
+      if (!incremental) {
+        xe::memory::AllocFixed(run_host_address, run_length,
+                               xe::memory::AllocationType::kCommit,
+                               xe::memory::PageAccess::kReadWrite);
+      } else {
+        for (uint32_t new_page_number = page_number;
+             new_page_number < run_end;) {
+          uint32_t new_run_end =
+              std::min(FindPageRunEnd(previous_page_table, new_page_number,
+                                      IsPageCommitted),
+                       run_end);
+          if (!IsPageCommitted(previous_page_table[new_page_number])) {
+            xe::memory::AllocFixed(
+                TranslateRelative(new_page_number * page_size_),
+                size_t(new_run_end - new_page_number) * page_size_,
+                xe::memory::AllocationType::kCommit,
+                xe::memory::PageAccess::kReadWrite);
+          }
+          new_page_number = new_run_end;
+        }
+      }
+      if (huge_pages_) {
+        xe::memory::AdviseHugePages(run_host_address, run_length);
+      }
+      xe::memory::Protect(run_host_address, run_length,
+                          xe::memory::PageAccess::kReadWrite, nullptr);
+      committed_page_count += run_end - page_number;
     }
+    page_number = run_end;
   }
 
+  // Decompress the blocks straight into the memory, and clear the committed
+  // pages between them in a full state.
+  auto zero_committed_pages = [this, incremental](uint32_t begin,
+                                                  uint32_t end) {
+    if (incremental) {
+      return;
+    }
+    for (uint32_t page_number = begin; page_number < end;) {
+      uint32_t run_end = std::min(
+          FindPageRunEnd(page_table_, page_number, IsPageCommitted), end);
+      if (IsPageCommitted(page_table_[page_number])) {
+        std::memset(TranslateRelative(page_number * page_size_), 0,
+                    size_t(run_end - page_number) * page_size_);
+      }
+      page_number = run_end;
+    }
+  };
+  uint32_t restored_page_count = 0;
+  while (true) {
+    auto header = stream->Read<HeapSaveBlockHeader>();
+    if (!header.page_count) {
+      break;
+    }
+    size_t length = size_t(header.page_count) * page_size_;
+    // Only committed pages have been made writable above.
+    if (header.first_page < restored_page_count ||
+        header.first_page >= page_count ||
+        header.page_count > page_count - header.first_page ||
+        header.encoded_length > stream->data_length() - stream->offset() ||
+        !IsPageCommitted(page_table_[header.first_page]) ||
+        FindPageRunEnd(page_table_, header.first_page, IsPageCommitted) <
+            header.first_page + header.page_count) {
+      XELOGE("BaseHeap::Restore: invalid block");
+      return false;
+    }
+    zero_committed_pages(restored_page_count, header.first_page);
+    auto encoded =
+        reinterpret_cast<const char*>(stream->data() + stream->offset());
+    auto decoded = TranslateRelative<char*>(header.first_page * page_size_);
+    bool decoded_block = false;
+    if (header.encoding == HeapSaveEncoding::kZero) {
+      std::memset(decoded, 0, length);
+      decoded_block = header.encoded_length == 0;
+    } else if (header.encoding == HeapSaveEncoding::kSnappy) {
+      size_t decoded_length;
+      decoded_block =
+          snappy::GetUncompressedLength(encoded, header.encoded_length,
+                                        &decoded_length) &&
+          decoded_length == length &&
+          snappy::RawUncompress(encoded, header.encoded_length, decoded);
+    } else if (header.encoding == HeapSaveEncoding::kNone &&
+               header.encoded_length == length) {
+      std::memcpy(decoded, encoded, length);
+      decoded_block = true;
+    }
+    if (!decoded_block) {
+      XELOGE("BaseHeap::Restore: unable to decode block");
+      return false;
+    }
+    stream->Advance(header.encoded_length);
+    restored_page_count = header.first_page + header.page_count;
+  }
+  zero_committed_pages(restored_page_count, page_count);
+
+  // Set the protection back, once for each run of pages with the same
+  // protection.
+  for (uint32_t page_number = 0; page_number < page_count;) {
+    uint32_t run_end =
+        FindPageRunEnd(page_table_, page_number, [](PageEntry page) {
+          return IsPageCommitted(page) ? int32_t(page.current_protect) : -1;
+        });
+    if (IsPageCommitted(page_table_[page_number])) {
+      xe::memory::Protect(
+          TranslateRelative(page_number * page_size_),
+          size_t(run_end - page_number) * page_size_,
+          ToPageAccess(page_table_[page_number].current_protect), nullptr);
+    }
+    page_number = run_end;
+  }
+
+  double seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start_time)
+                       .count();
+  double committed_mb = double(committed_page_count) * page_size_ / 1048576.0;
+  double restored_mb = double(stream->offset() - start_offset) / 1048576.0;
+  XELOGI(
+      "Heap {:08X}-{:08X}: restored {}{:.1f} MB committed from {:.1f} MB, "
+      "{:.0f} MB/s",
+      heap_base_, heap_base_ + (heap_size_ - 1),
+      incremental ? "changes to " : "", committed_mb, restored_mb,
+      seconds > 0.0 ? committed_mb / seconds : 0.0);
   return true;
 }
 
 void BaseHeap::Reset() {
   // TODO(DrChat): protect pages.
+  auto global_lock = global_critical_region_.Acquire();
+  BeginPageTableWrite();
   std::memset(page_table_.data(), 0, sizeof(PageEntry) * page_table_.size());
+  free_pages_.Reset();
+  EndPageTableWrite();
   // TODO(Triang3l): Remove access callbacks from pages if this is a physical
   // memory heap.
 }
@@ -891,6 +1328,9 @@ bool BaseHeap::AllocFixed(uint32_t base_address, uint32_t size,
       XELOGE("BaseHeap::AllocFixed failed to alloc range from host");
       return false;
     }
+    if (huge_pages_) {
+      xe::memory::AdviseHugePages(result, page_count * page_size_);
+    }
 
     if (cvars::scribble_heap && protect & kMemoryProtectWrite) {
       std::memset(result, 0xCD, page_count * page_size_);
@@ -898,6 +1338,7 @@ bool BaseHeap::AllocFixed(uint32_t base_address, uint32_t size,
   }
 
   // Set page state.
+  BeginPageTableWrite();
   for (uint32_t page_number = start_page_number; page_number <= end_page_number;
        ++page_number) {
     auto& page_entry = page_table_[page_number];
@@ -910,6 +1351,8 @@ bool BaseHeap::AllocFixed(uint32_t base_address, uint32_t size,
     page_entry.current_protect = protect;
     page_entry.state = kMemoryAllocationReserve | allocation_type;
   }
+  free_pages_.MarkUsed(start_page_number, page_count);
+  EndPageTableWrite();
 
   return true;
 }
@@ -938,92 +1381,19 @@ bool BaseHeap::AllocRange(uint32_t low_address, uint32_t high_address,
 
   auto global_lock = global_critical_region_.Acquire();
 
-  // Find a free page range.
-  // The base page must match the requested alignment, so we first scan for
-  // a free aligned page and only then check for continuous free pages.
-  // TODO(benvanik): optimized searching (free list buckets, bitmap, etc).
-  uint32_t start_page_number = UINT_MAX;
-  uint32_t end_page_number = UINT_MAX;
+  // Find a free page range with a base page matching the requested alignment.
   uint32_t page_scan_stride = alignment / page_size_;
   high_page_number = high_page_number - (high_page_number % page_scan_stride);
-  if (top_down) {
-    for (int64_t base_page_number =
-             high_page_number - xe::round_up(page_count, page_scan_stride);
-         base_page_number >= low_page_number;
-         base_page_number -= page_scan_stride) {
-      if (page_table_[base_page_number].state != 0) {
-        // Base page not free, skip to next usable page.
-        continue;
-      }
-      // Check requested range to ensure free.
-      start_page_number = uint32_t(base_page_number);
-      end_page_number = uint32_t(base_page_number) + page_count - 1;
-      assert_true(end_page_number < page_table_.size());
-      bool any_taken = false;
-      for (uint32_t page_number = uint32_t(base_page_number);
-           !any_taken && page_number <= end_page_number; ++page_number) {
-        bool is_free = page_table_[page_number].state == 0;
-        if (!is_free) {
-          // At least one page in the range is used, skip to next.
-          // We know we'll be starting at least before this page.
-          any_taken = true;
-          if (page_count > page_number) {
-            // Not enough space left to fit entire page range. Breaks outer
-            // loop.
-            base_page_number = -1;
-          } else {
-            base_page_number = page_number - page_count;
-            base_page_number -= base_page_number % page_scan_stride;
-            base_page_number += page_scan_stride;  // cancel out loop logic
-          }
-          break;
-        }
-      }
-      if (!any_taken) {
-        // Found our place.
-        break;
-      }
-      // Retry.
-      start_page_number = end_page_number = UINT_MAX;
-    }
-  } else {
-    for (uint32_t base_page_number = low_page_number;
-         base_page_number <= high_page_number - page_count;
-         base_page_number += page_scan_stride) {
-      if (page_table_[base_page_number].state != 0) {
-        // Base page not free, skip to next usable page.
-        continue;
-      }
-      // Check requested range to ensure free.
-      start_page_number = base_page_number;
-      end_page_number = base_page_number + page_count - 1;
-      bool any_taken = false;
-      for (uint32_t page_number = base_page_number;
-           !any_taken && page_number <= end_page_number; ++page_number) {
-        bool is_free = page_table_[page_number].state == 0;
-        if (!is_free) {
-          // At least one page in the range is used, skip to next.
-          // We know we'll be starting at least after this page.
-          any_taken = true;
-          base_page_number = xe::round_up(page_number + 1, page_scan_stride);
-          base_page_number -= page_scan_stride;  // cancel out loop logic
-          break;
-        }
-      }
-      if (!any_taken) {
-        // Found our place.
-        break;
-      }
-      // Retry.
-      start_page_number = end_page_number = UINT_MAX;
-    }
-  }
-  if (start_page_number == UINT_MAX || end_page_number == UINT_MAX) {
+  uint32_t start_page_number = free_pages_.FindFreeRange(
+      low_page_number, high_page_number, page_count, page_scan_stride,
+      top_down);
+  if (start_page_number == FreePageMap::kInvalidPage) {
     // Out of memory.
     XELOGE("BaseHeap::Alloc failed to find contiguous range");
     assert_always("Heap exhausted!");
     return false;
   }
+  uint32_t end_page_number = start_page_number + page_count - 1;
 
   // Allocate from host.
   if (allocation_type == kMemoryAllocationReserve) {
@@ -1039,6 +1409,9 @@ bool BaseHeap::AllocRange(uint32_t low_address, uint32_t high_address,
       XELOGE("BaseHeap::Alloc failed to alloc range from host");
       return false;
     }
+    if (huge_pages_) {
+      xe::memory::AdviseHugePages(result, page_count * page_size_);
+    }
 
     if (cvars::scribble_heap && (protect & kMemoryProtectWrite)) {
       std::memset(result, 0xCD, page_count * page_size_);
@@ -1046,6 +1419,7 @@ bool BaseHeap::AllocRange(uint32_t low_address, uint32_t high_address,
   }
 
   // Set page state.
+  BeginPageTableWrite();
   for (uint32_t page_number = start_page_number; page_number <= end_page_number;
        ++page_number) {
     auto& page_entry = page_table_[page_number];
@@ -1055,6 +1429,8 @@ bool BaseHeap::AllocRange(uint32_t low_address, uint32_t high_address,
     page_entry.current_protect = protect;
     page_entry.state = kMemoryAllocationReserve | allocation_type;
   }
+  free_pages_.MarkUsed(start_page_number, page_count);
+  EndPageTableWrite();
 
   *out_address = heap_base_ + (start_page_number * page_size_);
   return true;
@@ -1082,11 +1458,13 @@ bool BaseHeap::Decommit(uint32_t address, uint32_t size) {
   }*/
 
   // Perform table change.
+  BeginPageTableWrite();
   for (uint32_t page_number = start_page_number; page_number <= end_page_number;
        ++page_number) {
     auto& page_entry = page_table_[page_number];
     page_entry.state &= ~kMemoryAllocationCommit;
   }
+  EndPageTableWrite();
 
   return true;
 }
@@ -1140,11 +1518,14 @@ bool BaseHeap::Release(uint32_t base_address, uint32_t* out_region_size) {
   // Perform table change.
   uint32_t end_page_number =
       base_page_number + base_page_entry.region_page_count - 1;
+  BeginPageTableWrite();
   for (uint32_t page_number = base_page_number; page_number <= end_page_number;
        ++page_number) {
     auto& page_entry = page_table_[page_number];
     page_entry.qword = 0;
   }
+  free_pages_.MarkFree(base_page_number, base_page_entry.region_page_count);
+  EndPageTableWrite();
 
   return true;
 }
@@ -1226,11 +1607,13 @@ bool BaseHeap::Protect(uint32_t address, uint32_t size, uint32_t protect,
   }
 
   // Perform table change.
+  BeginPageTableWrite();
   for (uint32_t page_number = start_page_number; page_number <= end_page_number;
        ++page_number) {
     auto& page_entry = page_table_[page_number];
     page_entry.current_protect = protect;
   }
+  EndPageTableWrite();
 
   return true;
 }
@@ -1238,80 +1621,84 @@ bool BaseHeap::Protect(uint32_t address, uint32_t size, uint32_t protect,
 bool BaseHeap::QueryRegionInfo(uint32_t base_address,
                                HeapAllocationInfo* out_info) {
   uint32_t start_page_number = (base_address - heap_base_) / page_size_;
-  if (start_page_number > page_table_.size()) {
+  if (start_page_number >= page_table_.size()) {
     XELOGE("BaseHeap::QueryRegionInfo base page out of range");
     return false;
   }
 
-  auto global_lock = global_critical_region_.Acquire();
-
-  auto start_page_entry = page_table_[start_page_number];
-  out_info->base_address = base_address;
-  out_info->allocation_base = 0;
-  out_info->allocation_protect = 0;
-  out_info->region_size = 0;
-  out_info->state = 0;
-  out_info->protect = 0;
-  if (start_page_entry.state) {
-    // Committed/reserved region.
-    out_info->allocation_base = start_page_entry.base_address * page_size_;
-    out_info->allocation_protect = start_page_entry.allocation_protect;
-    out_info->allocation_size = start_page_entry.region_page_count * page_size_;
-    out_info->state = start_page_entry.state;
-    out_info->protect = start_page_entry.current_protect;
-
-    // Scan forward and report the size of the region matching the initial
-    // base address's attributes.
-    for (uint32_t page_number = start_page_number;
-         page_number <
-         start_page_entry.base_address + start_page_entry.region_page_count;
-         ++page_number) {
-      auto page_entry = page_table_[page_number];
-      if (page_entry.base_address != start_page_entry.base_address ||
-          page_entry.state != start_page_entry.state ||
-          page_entry.current_protect != start_page_entry.current_protect) {
-        // Different region or different properties within the region; done.
-        break;
+  ReadPageTable([&]() {
+    auto start_page_entry = page_table_[start_page_number];
+    out_info->base_address = base_address;
+    out_info->allocation_base = 0;
+    out_info->allocation_protect = 0;
+    out_info->region_size = 0;
+    out_info->state = 0;
+    out_info->protect = 0;
+    if (start_page_entry.state) {
+      // Committed/reserved region.
+      out_info->allocation_base = start_page_entry.base_address * page_size_;
+      out_info->allocation_protect = start_page_entry.allocation_protect;
+      out_info->allocation_size =
+          start_page_entry.region_page_count * page_size_;
+      out_info->state = start_page_entry.state;
+      out_info->protect = start_page_entry.current_protect;
+
+      // Scan forward and report the size of the region matching the initial
+      // base address's attributes. The region end is clamped in case the
+      // entry is being modified concurrently.
+      uint32_t region_end_page_number =
+          std::min(uint32_t(page_table_.size()),
+                   uint32_t(start_page_entry.base_address +
+                            start_page_entry.region_page_count));
+      for (uint32_t page_number = start_page_number;
+           page_number < region_end_page_number; ++page_number) {
+        auto page_entry = page_table_[page_number];
+        if (page_entry.base_address != start_page_entry.base_address ||
+            page_entry.state != start_page_entry.state ||
+            page_entry.current_protect != start_page_entry.current_protect) {
+          // Different region or different properties within the region; done.
+          break;
+        }
+        out_info->region_size += page_size_;
       }
-      out_info->region_size += page_size_;
-    }
-  } else {
-    // Free region.
-    for (uint32_t page_number = start_page_number;
-         page_number < page_table_.size(); ++page_number) {
-      auto page_entry = page_table_[page_number];
-      if (page_entry.state) {
-        // First non-free page; done with region.
-        break;
+    } else {
+      // Free region.
+      for (uint32_t page_number = start_page_number;
+           page_number < page_table_.size(); ++page_number) {
+        auto page_entry = page_table_[page_number];
+        if (page_entry.state) {
+          // First non-free page; done with region.
+          break;
+        }
+        out_info->region_size += page_size_;
       }
-      out_info->region_size += page_size_;
     }
-  }
+  });
   return true;
 }
 
 bool BaseHeap::QuerySize(uint32_t address, uint32_t* out_size) {
   uint32_t page_number = (address - heap_base_) / page_size_;
-  if (page_number > page_table_.size()) {
+  if (page_number >= page_table_.size()) {
     XELOGE("BaseHeap::QuerySize base page out of range");
     *out_size = 0;
     return false;
   }
-  auto global_lock = global_critical_region_.Acquire();
-  auto page_entry = page_table_[page_number];
+  PageEntry page_entry;
+  ReadPageTable([&]() { page_entry = page_table_[page_number]; });
   *out_size = (page_entry.region_page_count * page_size_);
   return true;
 }
 
 bool BaseHeap::QueryBaseAndSize(uint32_t* in_out_address, uint32_t* out_size) {
   uint32_t page_number = (*in_out_address - heap_base_) / page_size_;
-  if (page_number > page_table_.size()) {
+  if (page_number >= page_table_.size()) {
     XELOGE("BaseHeap::QuerySize base page out of range");
     *out_size = 0;
     return false;
   }
-  auto global_lock = global_critical_region_.Acquire();
-  auto page_entry = page_table_[page_number];
+  PageEntry page_entry;
+  ReadPageTable([&]() { page_entry = page_table_[page_number]; });
   *in_out_address = (page_entry.base_address * page_size_);
   *out_size = (page_entry.region_page_count * page_size_);
   return true;
@@ -1319,13 +1706,13 @@ bool BaseHeap::QueryBaseAndSize(uint32_t* in_out_address, uint32_t* out_size) {
 
 bool BaseHeap::QueryProtect(uint32_t address, uint32_t* out_protect) {
   uint32_t page_number = (address - heap_base_) / page_size_;
-  if (page_number > page_table_.size()) {
+  if (page_number >= page_table_.size()) {
     XELOGE("BaseHeap::QueryProtect base page out of range");
     *out_protect = 0;
     return false;
   }
-  auto global_lock = global_critical_region_.Acquire();
-  auto page_entry = page_table_[page_number];
+  PageEntry page_entry;
+  ReadPageTable([&]() { page_entry = page_table_[page_number]; });
   *out_protect = page_entry.current_protect;
   return true;
 }
@@ -1338,13 +1725,13 @@ xe::memory::PageAccess BaseHeap::QueryRangeAccess(uint32_t low_address,
   }
   uint32_t low_page_number = (low_address - heap_base_) / page_size_;
   uint32_t high_page_number = (high_address - heap_base_) / page_size_;
-  uint32_t protect = kMemoryProtectRead | kMemoryProtectWrite;
-  {
-    auto global_lock = global_critical_region_.Acquire();
+  uint32_t protect;
+  ReadPageTable([&]() {
+    protect = kMemoryProtectRead | kMemoryProtectWrite;
     for (uint32_t i = low_page_number; protect && i <= high_page_number; ++i) {
       protect &= page_table_[i].current_protect;
     }
-  }
+  });
   return ToPageAccess(protect);
 }
 
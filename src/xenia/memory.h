@@ -10,6 +10,8 @@
 #ifndef XENIA_MEMORY_H_
 #define XENIA_MEMORY_H_
 
+#include <array>
+#include <atomic>
 #include <cstdint>
 #include <memory>
 #include <mutex>
@@ -17,8 +19,10 @@
 #include <utility>
 #include <vector>
 
+#include "xenia/base/free_page_map.h"
 #include "xenia/base/memory.h"
 #include "xenia/base/mutex.h"
+#include "xenia/base/threading.h"
 #include "xenia/cpu/mmio_handler.h"
 
 namespace xe {
@@ -29,6 +33,8 @@ namespace xe {
 
 class Memory;
 
+constexpr fourcc_t kHeapSaveSignature = make_fourcc("XHEP");
+
 enum SystemHeapFlag : uint32_t {
   kSystemHeapVirtual = 1 << 0,
   kSystemHeapPhysical = 1 << 1,
@@ -120,6 +126,10 @@ class BaseHeap {
   // (not including membase).
   uint32_t host_address_offset() const { return host_address_offset_; }
 
+  // Whether the committed memory is advised to be backed by host huge pages.
+  bool huge_pages() const { return huge_pages_; }
+  void set_huge_pages(bool huge_pages) { huge_pages_ = huge_pages; }
+
   template <typename T = uint8_t*>
   inline T TranslateRelative(size_t relative_address) const {
     return reinterpret_cast<T>(membase_ + heap_base_ + host_address_offset_ +
@@ -187,7 +197,11 @@ class BaseHeap {
   xe::memory::PageAccess QueryRangeAccess(uint32_t low_address,
                                           uint32_t high_address);
 
-  bool Save(ByteStream* stream);
+  // Saves the page table and the contents of the committed pages, or, if
+  // written_pages is provided, only of the pages with a set bit in it, for
+  // restoring on top of the previous state.
+  bool Save(ByteStream* stream,
+            const std::vector<uint64_t>* written_pages = nullptr);
   bool Restore(ByteStream* stream);
 
   void Reset();
@@ -199,6 +213,34 @@ class BaseHeap {
                   uint32_t heap_base, uint32_t heap_size, uint32_t page_size,
                   uint32_t host_address_offset = 0);
 
+  // Modifications of page_table_ and free_pages_ must be made between these,
+  // in the global critical region.
+  void BeginPageTableWrite() {
+    page_table_sequence_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+  void EndPageTableWrite() {
+    page_table_sequence_.fetch_add(1, std::memory_order_release);
+  }
+  // Calls read until page_table_ and free_pages_ weren't modified while it
+  // was running, so it may see torn or inconsistent entries that are then
+  // discarded - it must only write its results and stay within the tables.
+  template <typename F>
+  void ReadPageTable(F&& read) const {
+    while (true) {
+      uint32_t sequence = page_table_sequence_.load(std::memory_order_acquire);
+      if (sequence & 1) {
+        xe::threading::MaybeYield();
+        continue;
+      }
+      read();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (page_table_sequence_.load(std::memory_order_relaxed) == sequence) {
+        return;
+      }
+    }
+  }
+
   Memory* memory_;
   uint8_t* membase_;
   HeapType heap_type_;
@@ -206,8 +248,27 @@ class BaseHeap {
   uint32_t heap_size_;
   uint32_t page_size_;
   uint32_t host_address_offset_;
+  bool huge_pages_ = false;
+  // Lock hierarchy for the page tables:
+  // - Modifications are made in the global critical region, which serializes
+  //   them and keeps the modifying thread from being suspended midway, so
+  //   Save and the debugger (which suspend threads in the region) never see a
+  //   half-done allocation. A PhysicalHeap modifies its parent heap while
+  //   staying in the region, and the physical write-watch path
+  //   (EnableAccessCallbacks, TriggerCallbacks and the invalidation
+  //   callbacks) reads the page table in the region too.
+  // - Queries take no lock and instead retry if the tables were modified
+  //   concurrently (a seqlock on page_table_sequence_), so frequent kernel
+  //   queries don't wait for the JIT, the object table or GPU write-watch
+  //   callbacks holding the global critical region. They may be called from
+  //   anywhere, including from the region, but not between
+  //   BeginPageTableWrite and EndPageTableWrite.
   xe::global_critical_region global_critical_region_;
+  // Odd while the tables are being modified.
+  std::atomic<uint32_t> page_table_sequence_{0};
   std::vector<PageEntry> page_table_;
+  // Pages with a zero state in page_table_, for finding free ranges quickly.
+  FreePageMap free_pages_;
 };
 
 // Normal heap allowing allocations from guest virtual address ranges.
@@ -371,6 +432,11 @@ class Memory {
   // Gets the defined MMIO range for the given virtual address, if any.
   cpu::MMIORange* LookupVirtualMappedRange(uint32_t virtual_address);
 
+  // Sets the callback receiving the host instructions that have accessed MMIO
+  // ranges by triggering an access violation.
+  void SetVirtualMappedAccessSiteCallback(
+      cpu::MMIOHandler::AccessSiteCallback callback, void* context);
+
   // Physical memory access callbacks, two types of them.
   //
   // This is simple per-system-page protection without reference counting or
@@ -475,13 +541,36 @@ class Memory {
   // Dumps a map of all allocated memory to the log.
   void DumpMap();
 
-  bool Save(ByteStream* stream);
+  // Whether Save can store only the memory written since the previous Save or
+  // Restore, which requires host dirty page tracking.
+  bool CanSaveIncrementally() const { return dirty_page_tracking_valid_; }
+
+  // If incremental, and CanSaveIncrementally, only the memory written since
+  // the previous Save or Restore is stored, and restoring it is only valid on
+  // top of that state. Guest threads must not be running.
+  bool Save(ByteStream* stream, bool incremental = false);
   bool Restore(ByteStream* stream);
+  // Allocates the buffers used by Save to find the written memory, so it
+  // doesn't need to allocate while guest threads are suspended.
+  void ReserveSaveBuffers();
+
+  // Returns the number of bytes of the guest virtual memory currently backed
+  // by host huge pages.
+  size_t GetHugePageBackedSize() const;
 
  private:
   int MapViews(uint8_t* mapping_base);
   void UnmapViews();
 
+  // Heaps stored by Save, in order.
+  static constexpr size_t kSavedHeapCount = 5;
+  std::array<BaseHeap*, kSavedHeapCount> GetSavedHeaps();
+
+  // Gets a bit for each page of the heap written since the last
+  // ResetDirtyPageTracking through any view aliasing it.
+  bool GetWrittenPages(const BaseHeap& heap,
+                       std::vector<uint64_t>* written_pages);
+
   static uint32_t HostToGuestVirtualThunk(const void* context,
                                           const void* host_address);
 
@@ -516,6 +605,13 @@ class Memory {
     uint8_t* all_views[9];
   } views_ = {{0}};
 
+  // Whether the dirty page tracking has been reset by a Save or a Restore, so
+  // incremental saves are relative to it.
+  bool dirty_page_tracking_valid_ = false;
+  // Reused by Save, for each saved heap, and for the dirty host pages.
+  std::vector<uint64_t> save_written_pages_[kSavedHeapCount];
+  std::vector<uint64_t> save_dirty_bits_;
+
   std::unique_ptr<cpu::MMIOHandler> mmio_handler_;
 
   struct {